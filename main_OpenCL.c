@@ -1,4 +1,12 @@
+#ifdef __linux__
+#define _GNU_SOURCE // sched_setaffinity
+#endif
 #include "clFFT.h"
+#ifdef __APPLE__
+#include <OpenCL/cl_ext.h>
+#else
+#include <CL/cl_ext.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,12 +16,365 @@
 #include <png.h>
 #include <inttypes.h>
 #include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 #define MAX_SOURCE_SIZE (0x100000)
 FILE *last_run_log_file;
 FILE *list_of_runs_log_file;
 const float zero = 0;
 
+// Комплексная матрица ( или пачка матриц ) из N чисел на устройстве лежит либо
+// как две раздельные float матрицы ( re, im - CLFFT_COMPLEX_PLANAR ), либо как одна
+// матрица пар (re, im) в buffers[0] ( CLFFT_COMPLEX_INTERLEAVED, buffers[1] == 0 )
+enum Data_layout {
+    LAYOUT_PLANAR,
+    LAYOUT_INTERLEAVED
+};
+
+const char *data_layout_name(enum Data_layout layout)
+{
+    return layout == LAYOUT_INTERLEAVED ? "interleaved" : "planar";
+}
+
+// В какой точности хранятся спектры картинок и h_rash. В PRECISION_HALF каждый срез
+// хранится как cl_half, делённый на свой масштаб, и переводится во float в multiply
+enum Spectrum_precision {
+    PRECISION_FLOAT,
+    PRECISION_HALF
+};
+
+const char *spectrum_precision_name(enum Spectrum_precision precision)
+{
+    return precision == PRECISION_HALF ? "half" : "float";
+}
+
+// Кто считает ПФ в FFT_2D_OpenCL: clFFT или встроенные kernel'ы из rash_kernel.cl ( fft_lines_kernel )
+enum Fft_engine {
+    FFT_ENGINE_CLFFT,
+    FFT_ENGINE_BUILTIN
+};
+
+const char *fft_engine_name(enum Fft_engine engine)
+{
+    return engine == FFT_ENGINE_BUILTIN ? "builtin" : "clFFT";
+}
+
+// Параметры запуска из командной строки ( всё остальное спрашивается интерактивно )
+struct Run_options {
+    // каталог для кэша спектров входных картинок, NULL - кэш выключен
+    const char *spectra_cache_dir;
+    // каталог для кэша скомпилированных программ, NULL - всегда собираем из исходника
+    const char *kernel_cache_dir;
+    // каталог, куда clFFT сохраняет сгенерированные kernel'ы, NULL - не сохранять
+    const char *fft_kernel_dump_dir;
+    // собирать kernel'ы без подстановки размеров ( -D ) - как было изначально
+    int generic_kernels;
+    // замерить время kernel'ов в обычной и специализированной сборке
+    int jit_compare;
+    // параметры оптики, подставляются в rash_kernel.cl при сборке
+    float defocus_coef;
+    float pupil_radius;
+    float pupil_phase_coef;
+    // раскладка комплексных данных: planar ( по умолчанию ), interleaved или выбор по замеру ( auto )
+    int layout_auto;
+    enum Data_layout layout;
+    // файл базы подобранных размеров рабочих групп, NULL - не подбирать
+    const char *tune_file;
+    // собирать kernel'ы с быстрой математикой
+    int fast_math;
+    // сравнить 8-битные результаты быстрой и точной сборки
+    int validate_fast_math;
+    // точность хранения спектров
+    enum Spectrum_precision spectrum_precision;
+    // сравнить 8-битный результат с эталонным расчётом в double на CPU
+    int validate_precision;
+    // сравнить пути расчёта ( встроенное ПФ, запись пар и т.д. ) с базовым расчётом через clFFT
+    int validate_paths;
+    // всегда удвоенные размеры ПФ и вся h ( без измерения опоры PSF )
+    int double_padding;
+    // доля энергии PSF, которую можно отбросить за пределами опоры
+    float psf_tail;
+    // потайловая свёртка ( overlap-save ) с фиксированным расходом памяти
+    int tiled;
+    // размер ПФ тайла, 0 - по опоре PSF
+    int tile_fft_size;
+    // движок ПФ
+    enum Fft_engine fft_engine;
+    // сравнить время clFFT и встроенного ПФ с прореживанием
+    int benchmark_fft;
+    // пары с компактной PSF считать прямой свёрткой
+    int hybrid;
+    // доля энергии спектра h, которую можно отбросить, считая пару в пониженном разрешении; 0 - выключено
+    float reduce_far_layers;
+    // порог ( доля max|h| ), ниже которого спектр h не хранится и не умножается; 0 - выключено
+    float compact_otf;
+    // допуск ( относительная ошибка ) разделимого приближения PSF; 0 - выключено
+    float separable;
+    // бюджет кеша h в мегабайтах ( h генерируются по требованию ); 0 - все h сразу
+    float h_cache_mb;
+    // передачи напрямую, без кольца закреплённых буферов
+    int no_pinned_staging;
+    // кольцо закреплённых буферов на больших страницах
+    int staging_huge_pages;
+    // обычные буферы и копирование даже на CPU / устройстве с общей памятью
+    int no_zero_copy;
+    // все передачи и kernel'ы в одной очереди
+    int single_queue;
+    // пары ставятся в очередь по одной команде, без записи в command buffer
+    int no_command_buffers;
+    // выходных слоёв в блоке: -1 - по памяти и загрузке устройства, 0 - по одному
+    int batch_outputs;
+    // потоков пула стадий: -1 - по числу процессоров, 0 - всё в основном потоке
+    int stage_threads;
+    // потоков CPU для эталонного расчёта: -1 - по числу процессоров
+    int cpu_threads;
+    // замерить ускорение эталонного расчёта от 1 потока до всех процессоров
+    int cpu_scaling;
+};
+
+struct Run_options options;
+
+void print_usage(const char *program_name)
+{
+    printf("Usage: %s [options]\n", program_name);
+    printf("  --spectra-cache DIR   keep forward spectra of input pics in DIR and reuse them on later runs\n");
+    printf("  --kernel-cache DIR    keep compiled rash_kernel.cl binaries in DIR and reuse them on later runs\n");
+    printf("  --fft-kernel-dump DIR save kernels generated by clFFT to DIR\n");
+    printf("  --generic-kernels     build kernels without compile-time sizes\n");
+    printf("  --jit-compare         measure kernel time for generic versus size-specialized builds\n");
+    printf("  --defocus-coef F      defocus phase coefficient (default 0.375)\n");
+    printf("  --pupil-radius F      pupil radius (default pi/2)\n");
+    printf("  --pupil-phase F       pupil phase coefficient (default pi/2)\n");
+    printf("  --layout MODE         complex data layout: planar (default), interleaved or auto (picked by benchmark)\n");
+    printf("  --tune-file PATH      autotune work-group sizes on first use and keep them in PATH\n");
+    printf("  --fast-math           build kernels with -cl-fast-relaxed-math and native sin/cos/sqrt\n");
+    printf("  --validate-fast-math  compare 8-bit results of the fast-math and precise builds\n");
+    printf("  --spectrum-precision P store spectra of pics and h as float (default) or half\n");
+    printf("  --validate-precision  compare 8-bit results with a float64 reference computed on the host\n");
+    printf("  --validate-paths      compare optional computation paths with the plain clFFT result on the same pics\n");
+    printf("  --padding MODE        FFT size: auto (default, from measured PSF support) or double (2x image size)\n");
+    printf("  --psf-tail F          fraction of PSF energy allowed outside the support (default 1e-4)\n");
+    printf("  --tiled               convolve tile by tile (overlap-save), device memory does not depend on image size\n");
+    printf("  --tile-fft-size P     FFT size of a tile (implies --tiled, default picked from PSF support)\n");
+    printf("  --fft-engine E        FFT engine: clfft (default) or builtin (pruned Stockham kernels from rash_kernel.cl)\n");
+    printf("  --benchmark-fft       time clFFT against the pruned built-in FFT for 512..4096 pics\n");
+    printf("  --hybrid              convolve pairs with a compact PSF directly, the crossover is benchmarked\n");
+    printf("  --reduce-far-layers F process pairs with a narrow-band h at reduced resolution, F - allowed fraction\n");
+    printf("                        of h spectrum energy outside the kept band (e.g. 1e-4)\n");
+    printf("  --separable TOL       convolve pairs with a low-rank separable PSF approximation (relative error TOL,\n");
+    printf("                        e.g. 1e-3) when it is faster than the FFT pair, the crossover is benchmarked\n");
+    printf("  --h-cache-mb M        generate h spectra on demand and keep at most M MB of them (LRU)\n");
+    printf("  --compact-otf T       store each h spectrum only where |h| > T * max|h| (e.g. 1e-5) and skip the rest in multiply\n");
+    printf("  --no-pinned-staging   transfer directly instead of through a ring of pinned staging buffers\n");
+    printf("  --staging-huge-pages  back the staging buffers with huge pages (CL_MEM_USE_HOST_PTR)\n");
+    printf("  --no-zero-copy        copy to and from buffers even when the device shares memory with the host\n");
+    printf("  --single-queue        issue transfers in the compute queue instead of a separate transfer queue\n");
+    printf("  --no-command-buffers  enqueue every pair instead of replaying a recorded cl_khr_command_buffer\n");
+    printf("  --batch-outputs B     compute B output layers per launch (auto - from device memory and occupancy)\n");
+    printf("  --stage-threads T     pool threads for decode/crop/encode stages (default: cores - 1, 0 - main thread only)\n");
+    printf("  --cpu-threads T       threads of the work-stealing pool for the float64 host reference (default: all cores)\n");
+    printf("  --cpu-scaling         time the float64 host reference on 1, 2, 4, ... and all cores\n");
+    printf("  --help                show this message\n");
+}
+
+int parse_run_options(int argc, char **argv, struct Run_options *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->defocus_coef = 0.375f;
+    opts->pupil_radius = M_PI * 0.5f;
+    opts->pupil_phase_coef = M_PI * 0.5f;
+    opts->psf_tail = 1e-4f;
+    opts->stage_threads = -1;
+    opts->cpu_threads = -1;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--spectra-cache") == 0 && i + 1 < argc)
+            opts->spectra_cache_dir = argv[++i];
+        else if (strcmp(argv[i], "--kernel-cache") == 0 && i + 1 < argc)
+            opts->kernel_cache_dir = argv[++i];
+        else if (strcmp(argv[i], "--fft-kernel-dump") == 0 && i + 1 < argc)
+            opts->fft_kernel_dump_dir = argv[++i];
+        else if (strcmp(argv[i], "--generic-kernels") == 0)
+            opts->generic_kernels = 1;
+        else if (strcmp(argv[i], "--jit-compare") == 0)
+            opts->jit_compare = 1;
+        else if (strcmp(argv[i], "--defocus-coef") == 0 && i + 1 < argc)
+            opts->defocus_coef = atof(argv[++i]);
+        else if (strcmp(argv[i], "--pupil-radius") == 0 && i + 1 < argc)
+            opts->pupil_radius = atof(argv[++i]);
+        else if (strcmp(argv[i], "--pupil-phase") == 0 && i + 1 < argc)
+            opts->pupil_phase_coef = atof(argv[++i]);
+        else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc)
+        {
+            i++;
+            opts->layout_auto = strcmp(argv[i], "auto") == 0;
+            if (strcmp(argv[i], "planar") == 0)
+                opts->layout = LAYOUT_PLANAR;
+            else if (strcmp(argv[i], "interleaved") == 0)
+                opts->layout = LAYOUT_INTERLEAVED;
+            else if (!opts->layout_auto)
+            {
+                printf("Unknown layout: %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--tune-file") == 0 && i + 1 < argc)
+            opts->tune_file = argv[++i];
+        else if (strcmp(argv[i], "--fast-math") == 0)
+            opts->fast_math = 1;
+        else if (strcmp(argv[i], "--validate-fast-math") == 0)
+            opts->validate_fast_math = 1;
+        else if (strcmp(argv[i], "--spectrum-precision") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "float") == 0)
+                opts->spectrum_precision = PRECISION_FLOAT;
+            else if (strcmp(argv[i], "half") == 0)
+                opts->spectrum_precision = PRECISION_HALF;
+            else
+            {
+                printf("Unknown spectrum precision: %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--validate-precision") == 0)
+            opts->validate_precision = 1;
+        else if (strcmp(argv[i], "--validate-paths") == 0)
+            opts->validate_paths = 1;
+        else if (strcmp(argv[i], "--padding") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "auto") == 0)
+                opts->double_padding = 0;
+            else if (strcmp(argv[i], "double") == 0)
+                opts->double_padding = 1;
+            else
+            {
+                printf("Unknown padding mode: %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--psf-tail") == 0 && i + 1 < argc)
+            opts->psf_tail = atof(argv[++i]);
+        else if (strcmp(argv[i], "--tiled") == 0)
+            opts->tiled = 1;
+        else if (strcmp(argv[i], "--tile-fft-size") == 0 && i + 1 < argc)
+        {
+            opts->tiled = 1;
+            opts->tile_fft_size = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--fft-engine") == 0 && i + 1 < argc)
+        {
+            i++;
+            if (strcmp(argv[i], "clfft") == 0)
+                opts->fft_engine = FFT_ENGINE_CLFFT;
+            else if (strcmp(argv[i], "builtin") == 0)
+                opts->fft_engine = FFT_ENGINE_BUILTIN;
+            else
+            {
+                printf("Unknown FFT engine: %s\n", argv[i]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--benchmark-fft") == 0)
+            opts->benchmark_fft = 1;
+        else if (strcmp(argv[i], "--hybrid") == 0)
+            opts->hybrid = 1;
+        else if (strcmp(argv[i], "--reduce-far-layers") == 0 && i + 1 < argc)
+            opts->reduce_far_layers = atof(argv[++i]);
+        else if (strcmp(argv[i], "--separable") == 0 && i + 1 < argc)
+            opts->separable = atof(argv[++i]);
+        else if (strcmp(argv[i], "--h-cache-mb") == 0 && i + 1 < argc)
+            opts->h_cache_mb = atof(argv[++i]);
+        else if (strcmp(argv[i], "--compact-otf") == 0 && i + 1 < argc)
+            opts->compact_otf = atof(argv[++i]);
+        else if (strcmp(argv[i], "--no-pinned-staging") == 0)
+            opts->no_pinned_staging = 1;
+        else if (strcmp(argv[i], "--staging-huge-pages") == 0)
+            opts->staging_huge_pages = 1;
+        else if (strcmp(argv[i], "--no-zero-copy") == 0)
+            opts->no_zero_copy = 1;
+        else if (strcmp(argv[i], "--single-queue") == 0)
+            opts->single_queue = 1;
+        else if (strcmp(argv[i], "--no-command-buffers") == 0)
+            opts->no_command_buffers = 1;
+        else if (strcmp(argv[i], "--batch-outputs") == 0 && i + 1 < argc)
+        {
+            i++;
+            opts->batch_outputs = strcmp(argv[i], "auto") == 0 ? -1 : atoi(argv[i]);
+        }
+        else if (strcmp(argv[i], "--stage-threads") == 0 && i + 1 < argc)
+            opts->stage_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--cpu-threads") == 0 && i + 1 < argc)
+            opts->cpu_threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--cpu-scaling") == 0)
+            opts->cpu_scaling = 1;
+        else if (strcmp(argv[i], "--help") == 0)
+        {
+            print_usage(argv[0]);
+            return 1;
+        }
+        else
+        {
+            printf("Unknown option: %s\n", argv[i]);
+            print_usage(argv[0]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// 64-битный FNV-1a, используется для ключей кэшей
+#define FNV1A_OFFSET_BASIS 0xcbf29ce484222325ULL
+
+uint64_t fnv1a_update(uint64_t hash, const void *data, size_t size)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// хэш содержимого файла; возвращает 0, если файл не удалось прочитать
+int fnv1a_update_file(const char *file_name, uint64_t *hash)
+{
+    unsigned char chunk[65536];
+    size_t read_bytes;
+
+    FILE *fp = fopen(file_name, "rb");
+    if (!fp)
+        return 0;
+
+    while ((read_bytes = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+        *hash = fnv1a_update(*hash, chunk, read_bytes);
+
+    fclose(fp);
+    return 1;
+}
+
+// настенное время в секундах ( clock() считает процессорное время и не видит ожидания устройства )
+double get_wall_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Строку пишут и задачи пула стадий ( encode_layer_job ): вывод одной строки не должен перемешиваться
+pthread_mutex_t status_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void show_status_string(const char *format, ...)
 {
     char str[256]={'\0'};
@@ -25,6 +386,7 @@ void show_status_string(const char *format, ...)
 
     va_end(args);
 
+    pthread_mutex_lock(&status_lock);
     // console
     printf( "### "); 
     puts(str);
@@ -32,6 +394,611 @@ void show_status_string(const char *format, ...)
     // log file
     fputs(str, last_run_log_file); 
     fputc('\n', last_run_log_file);
+    pthread_mutex_unlock(&status_lock);
+}
+
+/// ПУЛ ПОТОКОВ CPU С ПЕРЕХВАТОМ ЗАДАЧ ( work stealing )
+// У каждого потока свой дек задач: владелец берёт задачи с конца, свободный поток перехватывает
+// у соседей с начала. Задача кладётся в дек потока, который первым будет читать её данные ( home ):
+// эталонный расчёт раскладывает задачи заранее, чтобы поток чаще читал то, что сам недавно записал и что
+// ещё в его кеше; в графе стадий задача, ставшая готовой после задачи потока, идёт в его же дек
+// ( кодирование png сразу за обрезкой того же слоя ). Это только предпочтение: задачу может перехватить
+// любой поток, так что на каком узле NUMA машины окажутся страницы, не гарантируется.
+// Потоки пула привязаны к процессорам. Вызывающий поток ( workers[0] ) не привязывается: он работает
+// только внутри cpu_pool_run.
+// Задачи крупные ( ПФ целого слоя, png ), поэтому деки под мьютексами.
+
+#define MAX_CPU_WORKERS 256
+
+struct Cpu_pool;
+
+struct Cpu_worker {
+    struct Cpu_pool *pool;
+    int index;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // дек: задачи tasks[head..tail)
+    int *tasks;
+    int head;
+    int tail;
+    // статистика за всё время пула
+    int executed;
+    int stolen;
+    double busy;
+};
+
+struct Cpu_pool {
+    int amount_of_workers;
+    // workers[0] - вызывающий поток, он работает наравне с остальными в cpu_pool_run
+    struct Cpu_worker workers[MAX_CPU_WORKERS];
+    // место в деке потока: задач между cpu_pool_run ( для графа стадий - за всё время пула )
+    int capacity;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    // задач в деках и поставленных, но ещё не выполненных
+    int queued;
+    int unfinished;
+    int stop;
+    // был ли cpu_pool_run: иначе workers[0] задач не получает и в сводку не входит
+    int caller_works;
+    void (*run)(void *arg, int task, int worker);
+    void *arg;
+#ifdef __linux__
+    int pinned;
+    int amount_of_cpus;
+    int cpus[MAX_CPU_WORKERS];
+#endif
+};
+
+void pin_cpu_worker(struct Cpu_pool *pool, int index)
+{
+#ifdef __linux__
+    if (!pool->pinned)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(pool->cpus[index % pool->amount_of_cpus], &set);
+    sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
+// Задача task в дек потока worker. Пул должен быть настроен ( run, arg ) до первой задачи
+void cpu_pool_push(struct Cpu_pool *pool, int worker, int task)
+{
+    struct Cpu_worker *home = &pool->workers[worker];
+    pthread_mutex_lock(&pool->lock);
+    pthread_mutex_lock(&home->lock);
+    home->tasks[home->tail++] = task;
+    pthread_mutex_unlock(&home->lock);
+    pool->queued++;
+    pool->unfinished++;
+    pthread_cond_signal(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int cpu_worker_pop(struct Cpu_worker *worker)
+{
+    int task = -1;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail > worker->head)
+        task = worker->tasks[--worker->tail];
+    pthread_mutex_unlock(&worker->lock);
+    return task;
+}
+
+int cpu_worker_steal(struct Cpu_worker *victim)
+{
+    int task = -1;
+    pthread_mutex_lock(&victim->lock);
+    if (victim->tail > victim->head)
+        task = victim->tasks[victim->head++];
+    pthread_mutex_unlock(&victim->lock);
+    return task;
+}
+
+// Выполняет задачи, пока они есть в своём деке или у соседей
+void cpu_worker_loop(struct Cpu_worker *worker)
+{
+    struct Cpu_pool *pool = worker->pool;
+    for (;;)
+    {
+        int task = cpu_worker_pop(worker);
+        int stolen = 0;
+        for (int i = 1; i < pool->amount_of_workers && task < 0; i++)
+        {
+            task = cpu_worker_steal(&pool->workers[(worker->index + i) % pool->amount_of_workers]);
+            stolen = task >= 0;
+        }
+        if (task < 0)
+            break;
+        pthread_mutex_lock(&pool->lock);
+        pool->queued--;
+        pthread_mutex_unlock(&pool->lock);
+
+        double start = get_wall_time();
+        pool->run(pool->arg, task, worker->index);
+        double busy = get_wall_time() - start;
+
+        // статистику читает report_cpu_pool под тем же lock
+        pthread_mutex_lock(&pool->lock);
+        worker->busy += busy;
+        worker->executed++;
+        worker->stolen += stolen;
+        if (--pool->unfinished == 0)
+            pthread_cond_broadcast(&pool->done_cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+void *cpu_worker_thread(void *arg)
+{
+    struct Cpu_worker *worker = (struct Cpu_worker *)arg;
+    struct Cpu_pool *pool = worker->pool;
+    pin_cpu_worker(pool, worker->index);
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop)
+    {
+        if (pool->queued == 0)
+        {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        cpu_worker_loop(worker);
+        pthread_mutex_lock(&pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Потоков в пуле при запросе workers ( <= 0 - по числу процессоров )
+int cpu_pool_size(int workers)
+{
+    if (workers <= 0)
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers < 1)
+        workers = 1;
+    return workers > MAX_CPU_WORKERS ? MAX_CPU_WORKERS : workers;
+}
+
+// capacity - место в деке каждого потока. Возвращает число потоков вместе с вызывающим
+int InitCpu_pool(struct Cpu_pool *pool, int workers, int capacity)
+{
+    memset(pool, 0, sizeof(*pool));
+    workers = cpu_pool_size(workers);
+    pool->capacity = capacity;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+#ifdef __linux__
+    // процессоры, на которых разрешено работать; потоки раскладываются по ним по порядку
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE && pool->amount_of_cpus < MAX_CPU_WORKERS; cpu++)
+            if (CPU_ISSET(cpu, &allowed))
+                pool->cpus[pool->amount_of_cpus++] = cpu;
+        pool->pinned = pool->amount_of_cpus > 0;
+    }
+#endif
+
+    for (int i = 0; i < workers; i++)
+    {
+        struct Cpu_worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        worker->tasks = (int *) malloc(capacity * sizeof(int));
+        if (worker->tasks == NULL)
+            break;
+        pthread_mutex_init(&worker->lock, NULL);
+        if (i > 0 && pthread_create(&worker->thread, NULL, cpu_worker_thread, worker) != 0)
+        {
+            pthread_mutex_destroy(&worker->lock);
+            free(worker->tasks);
+            worker->tasks = NULL;
+            break;
+        }
+        pool->amount_of_workers++;
+    }
+    return pool->amount_of_workers;
+}
+
+// Выполняет задачи 0..amount_of_tasks-1 ( run(arg, task, worker) ), задача task сначала кладётся
+// в дек потока home[task] ( home == NULL - по кругу ). Возвращается, когда выполнены все.
+// Пул должен быть свободен: между вызовами деки начинаются заново, и если задач больше capacity,
+// деки увеличиваются. 0 - задачи выполнены, -1 - не хватило памяти на деки ( не выполнена ни одна )
+int cpu_pool_run(struct Cpu_pool *pool, int amount_of_tasks, const int *home, void (*run)(void *, int, int), void *arg)
+{
+    int capacity = amount_of_tasks > pool->capacity ? amount_of_tasks : pool->capacity;
+    int grown = 1;
+    for (int i = 0; i < pool->amount_of_workers; i++)
+    {
+        struct Cpu_worker *worker = &pool->workers[i];
+        pthread_mutex_lock(&worker->lock);
+        worker->head = worker->tail = 0;
+        int *tasks = capacity > pool->capacity ? (int *) realloc(worker->tasks, capacity * sizeof(int)) : worker->tasks;
+        if (tasks != NULL)
+            worker->tasks = tasks;
+        else
+            grown = 0;
+        pthread_mutex_unlock(&worker->lock);
+    }
+    if (!grown)
+    {
+        printf("cpu_pool_run: not enough memory for %d tasks\n", amount_of_tasks);
+        return -1;
+    }
+    pool->capacity = capacity;
+    pool->run = run;
+    pool->arg = arg;
+    pool->caller_works = 1;
+    for (int task = 0; task < amount_of_tasks; task++)
+        cpu_pool_push(pool, (home ? home[task] : task) % pool->amount_of_workers, task);
+
+    cpu_worker_loop(&pool->workers[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->unfinished > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+// Перехваченные задачи и баланс: средняя занятость потока к наибольшей ( 1 - идеально )
+void report_cpu_pool(struct Cpu_pool *pool, const char *name)
+{
+    int first = pool->caller_works ? 0 : 1;
+    int executed = 0, stolen = 0;
+    double busy = 0, max_busy = 0;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->unfinished > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    for (int i = first; i < pool->amount_of_workers; i++)
+    {
+        executed += pool->workers[i].executed;
+        stolen += pool->workers[i].stolen;
+        busy += pool->workers[i].busy;
+        if (pool->workers[i].busy > max_busy)
+            max_busy = pool->workers[i].busy;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    int threads = pool->amount_of_workers - first;
+    show_status_string("%s: %d threads, %d tasks, %d stolen, load balance %.2f", name, threads,
+                       executed, stolen, max_busy > 0 ? busy / threads / max_busy : 1.0);
+}
+
+// Все поставленные задачи должны быть выполнены
+void DeInitCpu_pool(struct Cpu_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = 1;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    // пока жив хоть один поток, он может заглядывать в чужие деки
+    for (int i = 1; i < pool->amount_of_workers; i++)
+        pthread_join(pool->workers[i].thread, NULL);
+    for (int i = 0; i < pool->amount_of_workers; i++)
+    {
+        pthread_mutex_destroy(&pool->workers[i].lock);
+        free(pool->workers[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    memset(pool, 0, sizeof(*pool));
+}
+
+/// ПЛАНИРОВЩИК СТАДИЙ
+// Конвейер разбит на стадии ( декодирование png, загрузка, прямое ПФ, генерация h, слой результата, обрезка,
+// кодирование и запись png ). Независимая работа хоста - задачи графа: задача ставится с зависимостями от
+// ранее поставленных задач и, при необходимости, от события устройства ( clSetEventCallback ), и выполняется
+// пулом потоков, как только все зависимости выполнены. Стадии, которые идут в основном потоке, отмечаются
+// stage_record как уже выполненные задачи - так в сводке видны все стадии и критический путь.
+// Пул - Cpu_pool: готовая задача попадает в дек потока, снявшего её последнюю зависимость.
+
+struct Stage_graph;
+
+enum Pipeline_stage {
+    STAGE_DECODE,
+    STAGE_UPLOAD,
+    STAGE_FORWARD_FFT,
+    STAGE_H_GENERATION,
+    STAGE_LAYER,
+    STAGE_CROP,
+    STAGE_ENCODE,
+    AMOUNT_OF_STAGES
+};
+
+const char *stage_names[AMOUNT_OF_STAGES] = {"decode", "upload", "forward FFT", "h generation", "multiply/IFFT/accumulate",
+                                             "crop", "encode+write"};
+
+#define MAX_STAGE_LINKS 4
+
+struct Stage_task {
+    struct Stage_graph *graph;
+    int stage;
+    void (*run)(void *arg);
+    void *arg;
+    // невыполненных зависимостей ( пока задача ставится - ещё одна, своя )
+    int pending;
+    int done;
+    int amount_of_dependents;
+    int dependents[MAX_STAGE_LINKS];
+    int amount_of_predecessors;
+    int predecessors[MAX_STAGE_LINKS];
+    double start;
+    double end;
+};
+
+struct Stage_graph {
+    // потоки пула без основного: готовые задачи кладутся в деки workers[1..amount_of_workers]
+    int amount_of_workers;
+    struct Cpu_pool pool;
+    pthread_mutex_t lock;
+    pthread_cond_t done_cond;
+    // задачи не перемещаются ( на них ссылаются обратные вызовы событий ), поэтому ёмкость задаётся сразу
+    struct Stage_task *tasks;
+    int capacity;
+    int amount;
+    // поток для задач, ставших готовыми не в пуле ( по кругу )
+    int next_worker;
+    // последняя задача основного потока ( stage_record ): следующие записи идут после неё
+    int last_record;
+    double created;
+};
+
+// Один граф на программу, как кольцо передач; amount_of_workers == 0 - задачи выполняются сразу при постановке
+struct Stage_graph stages;
+
+// Вызывается под lock. worker - поток пула, выполнивший последнюю зависимость: задача идёт в его дек,
+// её данные ещё в его кэше; 0 - зависимость снята основным потоком или событием, потоки по кругу
+void stage_make_ready(struct Stage_graph *graph, int id, int worker)
+{
+    if (worker == 0)
+        worker = 1 + graph->next_worker++ % graph->amount_of_workers;
+    cpu_pool_push(&graph->pool, worker, id);
+}
+
+// Вызывается под lock
+void stage_release(struct Stage_graph *graph, int id, int worker)
+{
+    if (--graph->tasks[id].pending == 0)
+        stage_make_ready(graph, id, worker);
+}
+
+// Задача пула ( cpu_pool_push ): id задачи графа
+void stage_execute(void *arg, int id, int worker)
+{
+    struct Stage_graph *graph = (struct Stage_graph *)arg;
+    struct Stage_task *task = &graph->tasks[id];
+    task->start = get_wall_time();
+    task->run(task->arg);
+    task->end = get_wall_time();
+
+    pthread_mutex_lock(&graph->lock);
+    task->done = 1;
+    for (int i = 0; i < task->amount_of_dependents; i++)
+        stage_release(graph, task->dependents[i], worker);
+    pthread_cond_broadcast(&graph->done_cond);
+    pthread_mutex_unlock(&graph->lock);
+}
+
+void CL_CALLBACK stage_event_complete(cl_event event, cl_int status, void *user_data)
+{
+    struct Stage_task *task = (struct Stage_task *)user_data;
+    struct Stage_graph *graph = task->graph;
+    pthread_mutex_lock(&graph->lock);
+    stage_release(graph, (int)(task - graph->tasks), 0);
+    pthread_mutex_unlock(&graph->lock);
+}
+
+// workers <= 0 - по числу процессоров без основного потока
+int InitStage_graph(struct Stage_graph *graph, int workers, int capacity)
+{
+    memset(graph, 0, sizeof(*graph));
+    graph->created = get_wall_time();
+    graph->last_record = -1;
+    if (workers <= 0)
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+    if (workers < 1)
+        workers = 1;
+    if (workers > MAX_CPU_WORKERS - 1)
+        workers = MAX_CPU_WORKERS - 1;
+    graph->capacity = capacity;
+    graph->tasks = (struct Stage_task *) calloc(capacity, sizeof(struct Stage_task));
+    if (graph->tasks == NULL)
+        return 0;
+    // основной поток занят устройством и в пул не входит: он только ставит задачи
+    graph->amount_of_workers = InitCpu_pool(&graph->pool, workers + 1, capacity) - 1;
+    if (graph->amount_of_workers <= 0)
+    {
+        DeInitCpu_pool(&graph->pool);
+        free(graph->tasks);
+        memset(graph, 0, sizeof(*graph));
+        return 0;
+    }
+    graph->pool.run = stage_execute;
+    graph->pool.arg = graph;
+    pthread_mutex_init(&graph->lock, NULL);
+    pthread_cond_init(&graph->done_cond, NULL);
+    return graph->amount_of_workers;
+}
+
+void stage_wait(struct Stage_graph *graph, int id)
+{
+    if (id < 0)
+        return;
+    pthread_mutex_lock(&graph->lock);
+    while (!graph->tasks[id].done)
+        pthread_cond_wait(&graph->done_cond, &graph->lock);
+    pthread_mutex_unlock(&graph->lock);
+}
+
+// Задача стадии stage после задач deps ( id, -1 пропускается ) и события event ( 0 - без него ).
+// Возвращает id; без пула или без места задача выполняется сразу в вызывающем потоке после своих
+// зависимостей ( они могут ещё стоять в очереди или выполняться в пуле ) и возвращается -1
+int stage_add(struct Stage_graph *graph, int stage, void (*run)(void *), void *arg, int amount_of_deps,
+              const int *deps, cl_event event)
+{
+    if (graph->amount_of_workers == 0 || graph->amount == graph->capacity)
+    {
+        for (int i = 0; i < amount_of_deps; i++)
+            stage_wait(graph, deps[i]);
+        if (event)
+            clWaitForEvents(1, &event);
+        run(arg);
+        return -1;
+    }
+
+    pthread_mutex_lock(&graph->lock);
+    int id = graph->amount++;
+    struct Stage_task *task = &graph->tasks[id];
+    memset(task, 0, sizeof(*task));
+    task->graph = graph;
+    task->stage = stage;
+    task->run = run;
+    task->arg = arg;
+    task->pending = 1;
+    for (int i = 0; i < amount_of_deps; i++)
+    {
+        int dep = deps[i];
+        if (dep < 0)
+            continue;
+        if (task->amount_of_predecessors < MAX_STAGE_LINKS)
+            task->predecessors[task->amount_of_predecessors++] = dep;
+        if (!graph->tasks[dep].done)
+        {
+            // у задачи-предшественника нет места - ждём её здесь
+            while (graph->tasks[dep].amount_of_dependents == MAX_STAGE_LINKS && !graph->tasks[dep].done)
+                pthread_cond_wait(&graph->done_cond, &graph->lock);
+            if (!graph->tasks[dep].done)
+            {
+                graph->tasks[dep].dependents[graph->tasks[dep].amount_of_dependents++] = id;
+                task->pending++;
+            }
+        }
+    }
+    if (event)
+        task->pending++;
+    pthread_mutex_unlock(&graph->lock);
+
+    if (event && clSetEventCallback(event, CL_COMPLETE, stage_event_complete, task) != CL_SUCCESS)
+    {
+        clWaitForEvents(1, &event);
+        pthread_mutex_lock(&graph->lock);
+        task->pending--;
+        pthread_mutex_unlock(&graph->lock);
+    }
+
+    pthread_mutex_lock(&graph->lock);
+    stage_release(graph, id, 0);
+    pthread_mutex_unlock(&graph->lock);
+    return id;
+}
+
+void stage_wait_all(struct Stage_graph *graph)
+{
+    for (int id = 0; id < graph->amount; id++)
+        stage_wait(graph, id);
+}
+
+// Стадия, выполненная в основном потоке с start по end ( get_wall_time ), после задач deps.
+// Возвращает её id, чтобы от неё могли зависеть задачи пула
+int stage_record(struct Stage_graph *graph, int stage, double start, int amount_of_deps, const int *deps)
+{
+    double end = get_wall_time();
+    if (graph->amount_of_workers == 0 || graph->amount == graph->capacity)
+        return -1;
+    pthread_mutex_lock(&graph->lock);
+    int id = graph->amount++;
+    struct Stage_task *task = &graph->tasks[id];
+    memset(task, 0, sizeof(*task));
+    task->stage = stage;
+    task->done = 1;
+    task->start = start;
+    task->end = end;
+    if (graph->last_record >= 0)
+        task->predecessors[task->amount_of_predecessors++] = graph->last_record;
+    for (int i = 0; i < amount_of_deps && task->amount_of_predecessors < MAX_STAGE_LINKS; i++)
+        if (deps[i] >= 0)
+            task->predecessors[task->amount_of_predecessors++] = deps[i];
+    graph->last_record = id;
+    pthread_mutex_unlock(&graph->lock);
+    return id;
+}
+
+// Загрузка стадий: время работы, доля от всего конвейера, средний параллелизм; критический путь - самая
+// длинная по времени цепочка зависимостей ( задачи добавляются после своих предшественников )
+void report_stage_graph(struct Stage_graph *graph)
+{
+    if (graph->amount == 0)
+        return;
+    stage_wait_all(graph);
+    double wall = 0;
+    double busy[AMOUNT_OF_STAGES] = {0};
+    double first[AMOUNT_OF_STAGES], last[AMOUNT_OF_STAGES];
+    int tasks[AMOUNT_OF_STAGES] = {0};
+    double *path = (double *) calloc(graph->amount, sizeof(double));
+    int *path_from = (int *) calloc(graph->amount, sizeof(int));
+    int critical = 0;
+    for (int id = 0; id < graph->amount; id++)
+    {
+        struct Stage_task *task = &graph->tasks[id];
+        double duration = task->end - task->start;
+        int s = task->stage;
+        if (tasks[s] == 0 || task->start < first[s])
+            first[s] = task->start;
+        if (tasks[s] == 0 || task->end > last[s])
+            last[s] = task->end;
+        tasks[s]++;
+        busy[s] += duration;
+        if (task->end - graph->created > wall)
+            wall = task->end - graph->created;
+
+        path_from[id] = -1;
+        for (int i = 0; i < task->amount_of_predecessors; i++)
+            if (path[task->predecessors[i]] > path[id])
+            {
+                path[id] = path[task->predecessors[i]];
+                path_from[id] = task->predecessors[i];
+            }
+        path[id] += duration;
+        if (path[id] > path[critical])
+            critical = id;
+    }
+
+    show_status_string("Pipeline stages ( %d pool threads, %.3f s wall ):", graph->amount_of_workers, wall);
+    for (int s = 0; s < AMOUNT_OF_STAGES; s++)
+        if (tasks[s] > 0)
+            show_status_string("  %-26s %4d tasks, busy %8.3f s ( %5.1f%% of wall ), parallelism %.2f", stage_names[s],
+                               tasks[s], busy[s], wall > 0 ? 100.0 * busy[s] / wall : 0.0,
+                               last[s] > first[s] ? busy[s] / (last[s] - first[s]) : 1.0);
+
+    double on_path[AMOUNT_OF_STAGES] = {0};
+    for (int id = critical; id >= 0; id = path_from[id])
+        on_path[graph->tasks[id].stage] += graph->tasks[id].end - graph->tasks[id].start;
+    show_status_string("Critical path: %.3f s", path[critical]);
+    for (int s = 0; s < AMOUNT_OF_STAGES; s++)
+        if (on_path[s] > 0)
+            show_status_string("  %-26s %8.3f s", stage_names[s], on_path[s]);
+    if (graph->amount_of_workers > 0)
+        report_cpu_pool(&graph->pool, "Stage pool");
+    free(path);
+    free(path_from);
+}
+
+void DeInitStage_graph(struct Stage_graph *graph)
+{
+    if (graph->amount_of_workers > 0)
+    {
+        DeInitCpu_pool(&graph->pool);
+        pthread_mutex_destroy(&graph->lock);
+        pthread_cond_destroy(&graph->done_cond);
+    }
+    free(graph->tasks);
+    memset(graph, 0, sizeof(*graph));
 }
 
 
@@ -40,6 +1007,48 @@ struct Cl_Buffer_pair
     cl_mem buffers[2];
 };
 
+/// БУФЕРЫ БЕЗ КОПИРОВАНИЯ ( zero-copy )
+// На CPU и устройствах с общей с хостом памятью ( CL_DEVICE_HOST_UNIFIED_MEMORY ) буферы создаются с
+// CL_MEM_USE_HOST_PTR поверх выровненной по странице памяти хоста: картинки декодируются прямо в буфер,
+// результат читается через map, вторых копий на хосте нет. Память освобождается вместе с буфером.
+
+// Включается в main после выбора устройства ( --no-zero-copy - выключить )
+int zero_copy_buffers = 0;
+
+int device_has_host_memory(cl_device_id device)
+{
+    cl_device_type type = 0;
+    cl_bool unified = CL_FALSE;
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, NULL);
+    return (type & CL_DEVICE_TYPE_CPU) || unified == CL_TRUE;
+}
+
+void CL_CALLBACK free_host_pages(cl_mem memobj, void *host)
+{
+    free(host);
+}
+
+// clCreateBuffer без host_ptr; в режиме zero-copy - поверх своей памяти хоста
+cl_mem create_buffer(cl_context ctx, cl_bitfield mode, size_t size, cl_int *err)
+{
+    if (!zero_copy_buffers)
+        return clCreateBuffer(ctx, mode, size, NULL, err);
+
+    void *host = NULL;
+    if (posix_memalign(&host, 4096, (size + 4095) / 4096 * 4096) != 0)
+    {
+        *err = CL_OUT_OF_HOST_MEMORY;
+        return 0;
+    }
+    cl_mem buffer = clCreateBuffer(ctx, mode | CL_MEM_USE_HOST_PTR, size, host, err);
+    if (*err == CL_SUCCESS)
+        *err = clSetMemObjectDestructorCallback(buffer, free_host_pages, host);
+    else
+        free(host);
+    return buffer;
+}
+
 cl_int  InitCl_Buffer_pair(cl_context ctx, cl_command_queue queue, cl_bitfield mode, size_t N, struct  Cl_Buffer_pair *pair)
 {
     cl_int err = CL_SUCCESS;
@@ -47,455 +1056,6378 @@ cl_int  InitCl_Buffer_pair(cl_context ctx, cl_command_queue queue, cl_bitfield m
 
     for (int i = 0; i < 2; i++)
     {
-        pair->buffers[i] = clCreateBuffer(ctx, mode, N * sizeof(cl_float), NULL, &err);
+        pair->buffers[i] = create_buffer(ctx, mode, N * sizeof(cl_float), &err);
         if (err != CL_SUCCESS) {
             printf("InitCl_Buffer_pair: Error with buffers[%d] clCreateBuffer\n", i);
             return err;
         }
-        err = clEnqueueFillBuffer(queue, pair->buffers[i], &zero, sizeof(zero), 0, N * sizeof(float), 0, NULL, NULL);
-        if (err != CL_SUCCESS) {
-            printf("InitCl_Buffer_pair: Error with buffers[%d] clEnqueueFillBuffer\n", i);
-            return err;
+        err = clEnqueueFillBuffer(queue, pair->buffers[i], &zero, sizeof(zero), 0, N * sizeof(float), 0, NULL, NULL);
+        if (err != CL_SUCCESS) {
+            printf("InitCl_Buffer_pair: Error with buffers[%d] clEnqueueFillBuffer\n", i);
+            return err;
+        }
+
+    }
+    err = clFinish(queue);
+    if (err != CL_SUCCESS) {
+        printf("InitCl_Buffer_pair: Error with clFinish\n");
+        return err;
+    }
+    return  err;
+}
+
+cl_int InitCl_Buffer_interleaved(cl_context ctx, cl_command_queue queue, cl_bitfield mode, size_t N, struct Cl_Buffer_pair *pair)
+{
+    cl_int err = CL_SUCCESS;
+    memset(pair, 0, sizeof(*pair)); // побайтовое обнуление всей структуры pair
+
+    pair->buffers[0] = create_buffer(ctx, mode, 2 * N * sizeof(cl_float), &err);
+    if (err != CL_SUCCESS) {
+        printf("InitCl_Buffer_interleaved: Error with clCreateBuffer\n");
+        return err;
+    }
+    err = clEnqueueFillBuffer(queue, pair->buffers[0], &zero, sizeof(zero), 0, 2 * N * sizeof(float), 0, NULL, NULL);
+    if (err != CL_SUCCESS) {
+        printf("InitCl_Buffer_interleaved: Error with clEnqueueFillBuffer\n");
+        return err;
+    }
+    err = clFinish(queue);
+    if (err != CL_SUCCESS) {
+        printf("InitCl_Buffer_interleaved: Error with clFinish\n");
+        return err;
+    }
+    return err;
+}
+
+cl_int InitCl_Buffer_complex(cl_context ctx, cl_command_queue queue, cl_bitfield mode, size_t N, enum Data_layout layout,
+                             struct Cl_Buffer_pair *pair)
+{
+    if (layout == LAYOUT_INTERLEAVED)
+        return InitCl_Buffer_interleaved(ctx, queue, mode, N, pair);
+    return InitCl_Buffer_pair(ctx, queue, mode, N, pair);
+}
+
+void DeInItCl_Buffer_pair(struct Cl_Buffer_pair *pair)
+{
+    // Release OpenCL memory objects
+    if (pair->buffers[0])
+        clReleaseMemObject(pair->buffers[0]);
+    if (pair->buffers[1])
+        clReleaseMemObject(pair->buffers[1]);
+    memset(pair, 0, sizeof(*pair)); // побайтовое обнуление всей структуры pair
+}
+
+/// АРЕНА УСТРОЙСТВА
+// Несколько больших буферов ( блоков ), из которых нарезаются выровненные по CL_DEVICE_MEM_BASE_ADDR_ALIGN
+// sub-buffer'ы. Обнуление отложенное: области только запоминаются, а arena_zero_fill ставит в очередь по одному
+// clEnqueueFillBuffer на каждый непрерывный кусок без clFinish. Каждый выданный буфер у арены и у вызывающего
+// со своей ссылкой: вызывающий освобождает его как обычный ( DeInItCl_Buffer_pair ), память блока
+// возвращается только в DeInitDevice_arena.
+
+#define MAX_ARENA_BLOCKS 16
+#define MAX_ARENA_BUFFERS 256
+
+struct Device_arena {
+    cl_context ctx;
+    size_t alignment;
+    // размер нового общего блока ( больший запрос получает свой блок )
+    size_t block_size;
+    int amount_of_blocks;
+    cl_mem blocks[MAX_ARENA_BLOCKS];
+    size_t block_sizes[MAX_ARENA_BLOCKS];
+    size_t block_used[MAX_ARENA_BLOCKS];
+    int amount_of_buffers;
+    cl_mem buffers[MAX_ARENA_BUFFERS];
+    // ещё не обнулённые области ( блок, начало, размер в байтах ) в порядке выдачи
+    int amount_of_zero;
+    int zero_block[MAX_ARENA_BUFFERS];
+    size_t zero_origin[MAX_ARENA_BUFFERS];
+    size_t zero_size[MAX_ARENA_BUFFERS];
+};
+
+cl_int InitDevice_arena(cl_context ctx, cl_device_id device, size_t block_size, struct Device_arena *arena)
+{
+    memset(arena, 0, sizeof(*arena));
+    arena->ctx = ctx;
+    arena->block_size = block_size;
+
+    cl_uint align_bits = 0;
+    cl_int err = clGetDeviceInfo(device, CL_DEVICE_MEM_BASE_ADDR_ALIGN, sizeof(align_bits), &align_bits, NULL);
+    // не меньше float4, чтобы смещения interleaved таблицы h делились на два комплексных числа
+    arena->alignment = align_bits / 8 > 16 ? align_bits / 8 : 16;
+    return err;
+}
+
+void DeInitDevice_arena(struct Device_arena *arena)
+{
+    for (int i = 0; i < arena->amount_of_buffers; i++)
+        clReleaseMemObject(arena->buffers[i]);
+    for (int i = 0; i < arena->amount_of_blocks; i++)
+        clReleaseMemObject(arena->blocks[i]);
+    memset(arena, 0, sizeof(*arena));
+}
+
+size_t arena_align(const struct Device_arena *arena, size_t bytes)
+{
+    return (bytes + arena->alignment - 1) / arena->alignment * arena->alignment;
+}
+
+// Отдельный блок целиком ( из него потом нарезаются окна arena_view )
+cl_mem arena_block(struct Device_arena *arena, size_t bytes, int zero, cl_int *err)
+{
+    if (arena->amount_of_blocks == MAX_ARENA_BLOCKS || (zero && arena->amount_of_zero == MAX_ARENA_BUFFERS))
+    {
+        *err = CL_OUT_OF_RESOURCES;
+        return 0;
+    }
+    cl_mem block = create_buffer(arena->ctx, CL_MEM_READ_WRITE, bytes, err);
+    if (*err != CL_SUCCESS)
+        return 0;
+
+    int b = arena->amount_of_blocks++;
+    arena->blocks[b] = block;
+    arena->block_sizes[b] = bytes;
+    arena->block_used[b] = bytes;
+    if (zero)
+    {
+        arena->zero_block[arena->amount_of_zero] = b;
+        arena->zero_origin[arena->amount_of_zero] = 0;
+        arena->zero_size[arena->amount_of_zero++] = bytes;
+    }
+    clRetainMemObject(block);
+    return block;
+}
+
+// Окно [origin, origin + bytes) блока block ( origin выровнен )
+cl_mem arena_view(struct Device_arena *arena, cl_mem block, size_t origin, size_t bytes, cl_int *err)
+{
+    if (arena->amount_of_buffers == MAX_ARENA_BUFFERS)
+    {
+        *err = CL_OUT_OF_RESOURCES;
+        return 0;
+    }
+    cl_buffer_region region = {origin, bytes};
+    cl_mem view = clCreateSubBuffer(block, CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region, err);
+    if (*err != CL_SUCCESS)
+        return 0;
+    arena->buffers[arena->amount_of_buffers++] = view;
+    clRetainMemObject(view);
+    return view;
+}
+
+// Выровненный кусок общего блока; zero - обнулить при следующем arena_zero_fill
+cl_mem arena_buffer(struct Device_arena *arena, size_t bytes, int zero, cl_int *err)
+{
+    size_t aligned = arena_align(arena, bytes);
+    int b = 0;
+    while (b < arena->amount_of_blocks && arena->block_used[b] + aligned > arena->block_sizes[b])
+        b++;
+    if (b == arena->amount_of_blocks)
+    {
+        size_t block_size = aligned > arena->block_size ? aligned : arena->block_size;
+        cl_mem block = arena_block(arena, block_size, 0, err);
+        if (*err != CL_SUCCESS)
+            return 0;
+        // arena_block отдаёт блок целиком, здесь он общий
+        clReleaseMemObject(block);
+        arena->block_used[b] = 0;
+    }
+    if (zero && arena->amount_of_zero == MAX_ARENA_BUFFERS)
+    {
+        *err = CL_OUT_OF_RESOURCES;
+        return 0;
+    }
+
+    size_t origin = arena->block_used[b];
+    cl_mem buffer = arena_view(arena, arena->blocks[b], origin, bytes, err);
+    if (*err != CL_SUCCESS)
+        return 0;
+    arena->block_used[b] += aligned;
+    if (zero)
+    {
+        arena->zero_block[arena->amount_of_zero] = b;
+        arena->zero_origin[arena->amount_of_zero] = origin;
+        arena->zero_size[arena->amount_of_zero++] = aligned;
+    }
+    return buffer;
+}
+
+// Комплексная матрица из N чисел в нужной раскладке, нарезанная из арены
+cl_int arena_buffer_complex(struct Device_arena *arena, size_t N, enum Data_layout layout, int zero, struct Cl_Buffer_pair *pair)
+{
+    cl_int err = CL_SUCCESS;
+    memset(pair, 0, sizeof(*pair));
+    if (layout == LAYOUT_INTERLEAVED)
+        pair->buffers[0] = arena_buffer(arena, 2 * N * sizeof(cl_float), zero, &err);
+    else for (int i = 0; i < 2 && err == CL_SUCCESS; i++)
+        pair->buffers[i] = arena_buffer(arena, N * sizeof(cl_float), zero, &err);
+    if (err != CL_SUCCESS)
+        printf("arena_buffer_complex: Error %d\n", err);
+    return err;
+}
+
+// Обнуление всех запомненных областей: соседние области одного блока сливаются в один fill
+cl_int arena_zero_fill(struct Device_arena *arena, cl_command_queue queue)
+{
+    cl_int err = CL_SUCCESS;
+    for (int i = 0; i < arena->amount_of_zero && err == CL_SUCCESS; )
+    {
+        int b = arena->zero_block[i];
+        size_t origin = arena->zero_origin[i];
+        size_t end = origin + arena->zero_size[i];
+        for (i++; i < arena->amount_of_zero && arena->zero_block[i] == b && arena->zero_origin[i] == end; i++)
+            end += arena->zero_size[i];
+        err = clEnqueueFillBuffer(queue, arena->blocks[b], &zero, sizeof(zero), origin, end - origin, 0, NULL, NULL);
+    }
+    if (err != CL_SUCCESS)
+        printf("arena_zero_fill: Error %d\n", err);
+    arena->amount_of_zero = 0;
+    return err;
+}
+
+/// ТАБЛИЦА h
+// Все h_k в одном блоке ( на плоскость ) с шагом stride комплексных чисел ( N, выровненное по арене );
+// h_rash_CL[k] - окна в ней. Kernel'ы multiply привязывают таблицу один раз ( bind_h_table ),
+// а на каждую пару меняют только смещение k * stride, как image_start_offset у картинок.
+struct H_table {
+    struct Device_arena *arena;
+    struct Cl_Buffer_pair table;
+    enum Data_layout layout;
+    size_t N;
+    cl_ulong stride;
+    int amount_of_h;
+};
+
+cl_int InitH_table(struct Device_arena *arena, size_t N, int amount_of_h, enum Data_layout layout, struct H_table *table)
+{
+    cl_int err = CL_SUCCESS;
+    memset(table, 0, sizeof(*table));
+    table->arena = arena;
+    table->layout = layout;
+    table->N = N;
+    table->amount_of_h = amount_of_h;
+
+    // байт на комплексное число в одном буфере таблицы
+    size_t complex_bytes = layout == LAYOUT_INTERLEAVED ? 2 * sizeof(cl_float) : sizeof(cl_float);
+    table->stride = arena_align(arena, N * complex_bytes) / complex_bytes;
+    int amount_of_planes = layout == LAYOUT_INTERLEAVED ? 1 : 2;
+    for (int i = 0; i < amount_of_planes && err == CL_SUCCESS; i++)
+        table->table.buffers[i] = arena_block(arena, table->stride * amount_of_h * complex_bytes, 1, &err);
+    if (err != CL_SUCCESS)
+    {
+        printf("InitH_table: Error %d\n", err);
+        DeInItCl_Buffer_pair(&table->table);
+    }
+    return err;
+}
+
+void DeInitH_table(struct H_table *table)
+{
+    DeInItCl_Buffer_pair(&table->table);
+    memset(table, 0, sizeof(*table));
+}
+
+// Окно h_k в таблице ( как буфер из InitCl_Buffer_complex, но без обнуления - таблица обнуляется целиком )
+cl_int h_table_view(struct H_table *table, int k, struct Cl_Buffer_pair *view)
+{
+    cl_int err = CL_SUCCESS;
+    memset(view, 0, sizeof(*view));
+    size_t complex_bytes = table->layout == LAYOUT_INTERLEAVED ? 2 * sizeof(cl_float) : sizeof(cl_float);
+    int amount_of_planes = table->layout == LAYOUT_INTERLEAVED ? 1 : 2;
+    for (int i = 0; i < amount_of_planes && err == CL_SUCCESS; i++)
+        view->buffers[i] = arena_view(table->arena, table->table.buffers[i], k * table->stride * complex_bytes,
+                                      table->N * complex_bytes, &err);
+    if (err != CL_SUCCESS)
+        DeInItCl_Buffer_pair(view);
+    return err;
+}
+
+/// ПРОМЕЖУТОЧНЫЕ БУФЕРЫ ПЕРЕДАЧ ( pinned staging ring )
+// Загрузки на устройство и чтения результата идут через STAGING_RING_SIZE закреплённых ( pinned ) буферов:
+// CL_MEM_ALLOC_HOST_PTR, отображённых один раз на всё время работы, или ( --staging-huge-pages )
+// CL_MEM_USE_HOST_PTR поверх памяти на больших страницах. Передачи неблокирующие, у слота событие последней
+// передачи, и слот берётся снова только после её завершения - подготовка следующих данных на хосте идёт
+// параллельно с копированием. Время передач - по профилированию событий ( если очередь его поддерживает ).
+
+#define STAGING_RING_SIZE 3
+
+struct Staging_ring {
+    cl_context ctx;
+    cl_command_queue queue;
+    int use_huge_pages;
+    // размер слота растёт под самую большую передачу ( staging_acquire )
+    size_t slot_size;
+    cl_mem pinned[STAGING_RING_SIZE];
+    void *host[STAGING_RING_SIZE];
+    // память на больших страницах под все слоты ( USE_HOST_PTR ), иначе NULL
+    void *huge_pages;
+    size_t huge_pages_size;
+    cl_event busy[STAGING_RING_SIZE];
+    int busy_upload[STAGING_RING_SIZE];
+    size_t busy_bytes[STAGING_RING_SIZE];
+    int next;
+    double upload_bytes;
+    double upload_seconds;
+    double download_bytes;
+    double download_seconds;
+};
+
+// Один на программу, как реестр планов ПФ; queue == 0 - передачи идут напрямую
+struct Staging_ring staging;
+
+// Анонимная память на больших страницах: hugetlbfs, если есть зарезервированные, иначе прозрачные
+void *alloc_huge_pages(size_t size)
+{
+    void *memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (memory == MAP_FAILED)
+    {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        madvise(memory, size, MADV_HUGEPAGE);
+#endif
+    }
+    return memory;
+}
+
+// Ждёт последнюю передачу слота и добавляет её в статистику
+cl_int staging_wait(struct Staging_ring *ring, int slot)
+{
+    if (ring->busy[slot] == 0)
+        return CL_SUCCESS;
+    cl_int err = clWaitForEvents(1, &ring->busy[slot]);
+    cl_ulong start = 0, end = 0;
+    if (err == CL_SUCCESS &&
+        clGetEventProfilingInfo(ring->busy[slot], CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) == CL_SUCCESS &&
+        clGetEventProfilingInfo(ring->busy[slot], CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) == CL_SUCCESS)
+    {
+        if (ring->busy_upload[slot])
+        {
+            ring->upload_bytes += ring->busy_bytes[slot];
+            ring->upload_seconds += (end - start) * 1e-9;
+        }
+        else
+        {
+            ring->download_bytes += ring->busy_bytes[slot];
+            ring->download_seconds += (end - start) * 1e-9;
+        }
+    }
+    clReleaseEvent(ring->busy[slot]);
+    ring->busy[slot] = 0;
+    return err;
+}
+
+cl_int staging_finish(struct Staging_ring *ring)
+{
+    cl_int err = CL_SUCCESS;
+    for (int i = 0; i < STAGING_RING_SIZE; i++)
+        err |= staging_wait(ring, i);
+    return err;
+}
+
+// Освобождает слоты ( статистика и очередь остаются )
+void release_staging_slots(struct Staging_ring *ring)
+{
+    staging_finish(ring);
+    for (int i = 0; i < STAGING_RING_SIZE; i++)
+        if (ring->pinned[i])
+        {
+            if (ring->host[i])
+                clEnqueueUnmapMemObject(ring->queue, ring->pinned[i], ring->host[i], 0, NULL, NULL);
+            clFinish(ring->queue);
+            clReleaseMemObject(ring->pinned[i]);
+            ring->pinned[i] = 0;
+            ring->host[i] = NULL;
+        }
+    if (ring->huge_pages)
+        munmap(ring->huge_pages, ring->huge_pages_size);
+    ring->huge_pages = NULL;
+    ring->huge_pages_size = 0;
+    ring->slot_size = 0;
+}
+
+// Слоты по slot_size байт ( округляется до страницы ), отображённые на хост и обнулённые
+cl_int alloc_staging_slots(struct Staging_ring *ring, size_t slot_size)
+{
+    cl_int err = CL_SUCCESS;
+    slot_size = (slot_size + 4095) / 4096 * 4096;
+    if (ring->use_huge_pages)
+    {
+        // 2 МБ - обычный размер большой страницы
+        ring->huge_pages_size = (STAGING_RING_SIZE * slot_size + (2 << 20) - 1) / (2 << 20) * (2 << 20);
+        ring->huge_pages = alloc_huge_pages(ring->huge_pages_size);
+        if (ring->huge_pages == NULL)
+            return CL_OUT_OF_HOST_MEMORY;
+    }
+    for (int i = 0; i < STAGING_RING_SIZE && err == CL_SUCCESS; i++)
+    {
+        if (ring->huge_pages)
+            ring->pinned[i] = clCreateBuffer(ring->ctx, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, slot_size,
+                                             (char *)ring->huge_pages + i * slot_size, &err);
+        else
+            ring->pinned[i] = clCreateBuffer(ring->ctx, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, slot_size, NULL, &err);
+        if (err == CL_SUCCESS)
+            ring->host[i] = clEnqueueMapBuffer(ring->queue, ring->pinned[i], CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0,
+                                               slot_size, 0, NULL, NULL, &err);
+        if (err == CL_SUCCESS)
+            memset(ring->host[i], 0, slot_size);
+    }
+    ring->slot_size = slot_size;
+    if (err != CL_SUCCESS)
+    {
+        printf("alloc_staging_slots: Error %d\n", err);
+        release_staging_slots(ring);
+    }
+    return err;
+}
+
+void InitStaging_ring(cl_context ctx, cl_command_queue queue, int use_huge_pages, struct Staging_ring *ring)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->ctx = ctx;
+    ring->queue = queue;
+    ring->use_huge_pages = use_huge_pages;
+}
+
+void DeInitStaging_ring(struct Staging_ring *ring)
+{
+    if (ring->queue)
+        release_staging_slots(ring);
+    memset(ring, 0, sizeof(*ring));
+}
+
+// Свободный слот под передачу bytes байт ( его host память можно заполнять ); -1 - кольца нет,
+// передача идёт напрямую. Содержимое слота - от прошлой передачи
+int staging_acquire(struct Staging_ring *ring, size_t bytes)
+{
+    if (ring->queue == 0)
+        return -1;
+    if (bytes > ring->slot_size)
+    {
+        release_staging_slots(ring);
+        if (alloc_staging_slots(ring, bytes) != CL_SUCCESS)
+            return -1;
+    }
+    int slot = ring->next;
+    ring->next = (ring->next + 1) % STAGING_RING_SIZE;
+    if (staging_wait(ring, slot) != CL_SUCCESS)
+        return -1;
+    return slot;
+}
+
+// Неблокирующая загрузка bytes байт слота в dst со смещения offset
+cl_int staging_upload(struct Staging_ring *ring, int slot, cl_mem dst, size_t offset, size_t bytes)
+{
+    ring->busy_upload[slot] = 1;
+    ring->busy_bytes[slot] = bytes;
+    return clEnqueueWriteBuffer(ring->queue, dst, CL_FALSE, offset, bytes, ring->host[slot], 0, NULL, &ring->busy[slot]);
+}
+
+// Неблокирующее чтение bytes байт src со смещения offset в слот ( готово после staging_wait ),
+// после события after ( 0 - сразу )
+cl_int staging_download(struct Staging_ring *ring, int slot, cl_mem src, size_t offset, size_t bytes, cl_event after)
+{
+    ring->busy_upload[slot] = 0;
+    ring->busy_bytes[slot] = bytes;
+    return clEnqueueReadBuffer(ring->queue, src, CL_FALSE, offset, bytes, ring->host[slot], after ? 1 : 0,
+                               after ? &after : NULL, &ring->busy[slot]);
+}
+
+// Передача данных в queue: команды, поставленные в неё дальше, ждут все передачи кольца ( без ожидания на хосте )
+cl_int staging_hand_off(struct Staging_ring *ring, cl_command_queue queue)
+{
+    cl_event pending[STAGING_RING_SIZE];
+    cl_uint amount = 0;
+    for (int i = 0; i < STAGING_RING_SIZE; i++)
+        if (ring->busy[i])
+            pending[amount++] = ring->busy[i];
+    if (amount == 0 || ring->queue == queue)
+        return CL_SUCCESS;
+    return clEnqueueBarrierWithWaitList(queue, amount, pending, NULL);
+}
+
+void report_staging(const struct Staging_ring *ring)
+{
+    if (ring->upload_seconds > 0)
+        show_status_string("Host->device transfers: %.1f MB, %.2f GB/s", ring->upload_bytes / 1048576.0,
+                           ring->upload_bytes / ring->upload_seconds / 1e9);
+    if (ring->download_seconds > 0)
+        show_status_string("Device->host transfers: %.1f MB, %.2f GB/s", ring->download_bytes / 1048576.0,
+                           ring->download_bytes / ring->download_seconds / 1e9);
+}
+
+void release_event(cl_event *event)
+{
+    if (*event)
+        clReleaseEvent(*event);
+    *event = 0;
+}
+
+// Слой результата ( N float ) на хост: zero-copy - отображение самого result_CL, через кольцо - указатель
+// на слот ( действителен до следующего staging_acquire ), иначе блокирующее чтение в result.
+// После использования - release_result_layer
+const float *read_result_layer(cl_command_queue queue, cl_mem result_CL, size_t N, float *result, cl_int *err)
+{
+    if (zero_copy_buffers)
+        return (const float *)clEnqueueMapBuffer(queue, result_CL, CL_TRUE, CL_MAP_READ, 0, N * sizeof(float),
+                                                 0, NULL, NULL, err);
+    int slot = staging_acquire(&staging, N * sizeof(float));
+    if (slot < 0)
+    {
+        *err = clEnqueueReadBuffer(queue, result_CL, CL_TRUE, 0, N * sizeof(float), result, 0, NULL, NULL);
+        return result;
+    }
+    // кольцо может работать в очереди передач: чтение ждёт все команды расчёта, поставленные до него
+    cl_event computed = 0;
+    *err = clEnqueueMarkerWithWaitList(queue, 0, NULL, &computed);
+    if (*err == CL_SUCCESS)
+    {
+        clFlush(queue);
+        *err = staging_download(&staging, slot, result_CL, 0, N * sizeof(float), computed);
+    }
+    release_event(&computed);
+    if (*err == CL_SUCCESS)
+        *err = staging_wait(&staging, slot);
+    return (const float *)staging.host[slot];
+}
+
+cl_int release_result_layer(cl_command_queue queue, cl_mem result_CL, const float *layer)
+{
+    if (!zero_copy_buffers || layer == NULL)
+        return CL_SUCCESS;
+    return clEnqueueUnmapMemObject(queue, result_CL, (void *)layer, 0, NULL, NULL);
+}
+
+/// ЧТЕНИЕ СЛОЯ ПАРАЛЛЕЛЬНО СО СЛЕДУЮЩИМ
+// Готовый result_CL копируется на устройстве в copy_CL ( очередь расчёта ), а copy_CL читается в очереди
+// передач по событию копирования, пока очередь расчёта считает следующий слой. Перекрытие - по меткам
+// времени: интервал чтения против интервала расчёта следующего слоя ( маркеры в очереди расчёта ).
+
+struct Layer_readback {
+    cl_command_queue transfer_queue;
+    cl_mem copy_CL;
+    size_t N;
+    // слот кольца, -1 - чтение прямо в host
+    int slot;
+    float *host;
+    cl_event copied;
+    cl_event done;
+    cl_event compute_start;
+    cl_event compute_end;
+    int layers;
+    double transfer_seconds;
+    double overlapped_seconds;
+};
+
+cl_int InitLayer_readback(cl_context ctx, cl_command_queue transfer_queue, size_t N, float *host, struct Layer_readback *readback)
+{
+    cl_int err = CL_SUCCESS;
+    memset(readback, 0, sizeof(*readback));
+    readback->transfer_queue = transfer_queue;
+    readback->N = N;
+    readback->slot = -1;
+    readback->host = host;
+    readback->copy_CL = create_buffer(ctx, CL_MEM_READ_WRITE, N * sizeof(cl_float), &err);
+    if (err != CL_SUCCESS)
+        printf("InitLayer_readback: Error %d\n", err);
+    return err;
+}
+
+void DeInitLayer_readback(struct Layer_readback *readback)
+{
+    release_event(&readback->copied);
+    release_event(&readback->done);
+    release_event(&readback->compute_start);
+    release_event(&readback->compute_end);
+    if (readback->copy_CL)
+        clReleaseMemObject(readback->copy_CL);
+    memset(readback, 0, sizeof(*readback));
+}
+
+// Маркеры вокруг расчёта слоя в очереди расчёта
+cl_int layer_compute_mark(struct Layer_readback *readback, cl_command_queue queue, int end)
+{
+    cl_event *mark = end ? &readback->compute_end : &readback->compute_start;
+    release_event(mark);
+    return clEnqueueMarkerWithWaitList(queue, 0, NULL, mark);
+}
+
+// Копия готового слоя и неблокирующее чтение её в очереди передач
+cl_int start_layer_readback(struct Layer_readback *readback, cl_command_queue queue, cl_mem result_CL)
+{
+    const size_t bytes = readback->N * sizeof(float);
+    release_event(&readback->copied);
+    release_event(&readback->done);
+    cl_int err = clEnqueueCopyBuffer(queue, result_CL, readback->copy_CL, 0, 0, bytes, 0, NULL, &readback->copied);
+    if (err != CL_SUCCESS)
+        return err;
+    clFlush(queue);
+
+    readback->slot = staging_acquire(&staging, bytes);
+    if (readback->slot < 0)
+        return clEnqueueReadBuffer(readback->transfer_queue, readback->copy_CL, CL_FALSE, 0, bytes, readback->host,
+                                   1, &readback->copied, &readback->done);
+    err = staging_download(&staging, readback->slot, readback->copy_CL, 0, bytes, readback->copied);
+    if (err == CL_SUCCESS)
+    {
+        readback->done = staging.busy[readback->slot];
+        clRetainEvent(readback->done);
+    }
+    clFlush(readback->transfer_queue);
+    return err;
+}
+
+// Куда придут данные слоя ( готовы по событию readback->done )
+const float *layer_readback_data(const struct Layer_readback *readback)
+{
+    return readback->slot < 0 ? readback->host : (const float *)staging.host[readback->slot];
+}
+
+// Ждёт чтение и учитывает его перекрытие с последним расчётом ( слот кольца освобождается при следующем
+// staging_acquire )
+cl_int account_layer_readback(struct Layer_readback *readback)
+{
+    cl_int err = clWaitForEvents(1, &readback->done);
+    if (err != CL_SUCCESS)
+        return err;
+
+    cl_ulong start = 0, end = 0, compute_start = 0, compute_end = 0;
+    if (readback->compute_start && readback->compute_end && clWaitForEvents(1, &readback->compute_end) == CL_SUCCESS &&
+        clGetEventProfilingInfo(readback->done, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL) == CL_SUCCESS &&
+        clGetEventProfilingInfo(readback->done, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL) == CL_SUCCESS &&
+        clGetEventProfilingInfo(readback->compute_start, CL_PROFILING_COMMAND_END, sizeof(compute_start), &compute_start, NULL) == CL_SUCCESS &&
+        clGetEventProfilingInfo(readback->compute_end, CL_PROFILING_COMMAND_END, sizeof(compute_end), &compute_end, NULL) == CL_SUCCESS)
+    {
+        cl_ulong from = start > compute_start ? start : compute_start;
+        cl_ulong to = end < compute_end ? end : compute_end;
+        readback->transfer_seconds += (end - start) * 1e-9;
+        if (to > from)
+            readback->overlapped_seconds += (to - from) * 1e-9;
+    }
+    readback->layers++;
+    return CL_SUCCESS;
+}
+
+void report_layer_readback(const struct Layer_readback *readback)
+{
+    if (readback->transfer_seconds > 0)
+        show_status_string("Result readback: %d layers, %.3f s, %.1f%% overlapped with computing the next layer",
+                           readback->layers, readback->transfer_seconds,
+                           100.0 * readback->overlapped_seconds / readback->transfer_seconds);
+}
+
+struct FFT_OpenCL_data {
+    int sizex;
+    int sizey;
+
+    // Temporary buffer
+    cl_mem tmpBuffer;
+
+    // FFT library realted declarations
+    clfftPlanHandle planHandle;
+
+    // встроенное ПФ: если lines_kernel != 0, clFFT не используется
+    cl_kernel lines_kernel;
+    size_t row_local_size;
+    size_t col_local_size;
+    int batch;
+    enum Data_layout layout;
+    float forward_scale;
+    float backward_scale;
+    // прореживание встроенного ПФ: прямое читает только прямоугольник input_width x input_height
+    // в левом верхнем углу ( остальное - нули ), обратное считает только прямоугольник output_*
+    // ( остальные элементы буфера после него не определены )
+    int input_width;
+    int input_height;
+    int output_x0;
+    int output_y0;
+    int output_width;
+    int output_height;
+};
+
+/// ЗАПИСЬ КОМАНД ( cl_khr_command_buffer )
+// Повторяющаяся последовательность kernel'ов записывается один раз в command buffer и потом ставится в очередь
+// одной командой; аргументы, которые меняются между повторами ( смещения ), обновляются через
+// cl_khr_command_buffer_mutable_dispatch. Пока recording != NULL, enqueue_kernel не ставит kernel в очередь,
+// а записывает. clFFT записать нельзя, поэтому записываются только пары со встроенным ПФ. Без расширения
+// ( или с заголовками старше mutable dispatch 0.9.2 ) всё идёт обычным путём.
+
+#if defined(CL_KHR_COMMAND_BUFFER_MUTABLE_DISPATCH_EXTENSION_VERSION) && \
+    CL_KHR_COMMAND_BUFFER_MUTABLE_DISPATCH_EXTENSION_VERSION >= CL_MAKE_VERSION(0, 9, 2)
+#define HAVE_COMMAND_BUFFERS 1
+#endif
+
+#define MAX_RECORDED_COMMANDS 16
+#define MAX_RECORDED_ARGS 4
+
+struct Command_recorder {
+#ifdef HAVE_COMMAND_BUFFERS
+    cl_command_buffer_khr buffer;
+    cl_mutable_command_khr commands[MAX_RECORDED_COMMANDS];
+    // точка синхронизации последней записанной команды: следующая ждёт её, как в очереди по порядку
+    cl_sync_point_khr last_sync_point;
+#endif
+    cl_command_queue queue;
+    int amount_of_commands;
+    // записан и готов к повтору
+    int ready;
+};
+
+// Изменённый аргумент записанного kernel'а
+struct Recorded_arg {
+    cl_uint index;
+    size_t size;
+    const void *value;
+};
+
+struct Command_recorder *recording = NULL;
+int command_buffers_available = 0;
+
+#ifdef HAVE_COMMAND_BUFFERS
+// Функции расширения ( адреса берутся у платформы )
+struct {
+    cl_command_buffer_khr (CL_API_CALL *create)(cl_uint, const cl_command_queue *, const cl_properties *, cl_int *);
+    cl_int (CL_API_CALL *finalize)(cl_command_buffer_khr);
+    cl_int (CL_API_CALL *release)(cl_command_buffer_khr);
+    cl_int (CL_API_CALL *ndrange)(cl_command_buffer_khr, cl_command_queue, const cl_properties *, cl_kernel, cl_uint,
+                                  const size_t *, const size_t *, const size_t *, cl_uint, const cl_sync_point_khr *,
+                                  cl_sync_point_khr *, cl_mutable_command_khr *);
+    cl_int (CL_API_CALL *enqueue)(cl_uint, cl_command_queue *, cl_command_buffer_khr, cl_uint, const cl_event *, cl_event *);
+    cl_int (CL_API_CALL *update)(cl_command_buffer_khr, cl_uint, const cl_command_buffer_update_type_khr *, const void **);
+} command_buffer_api;
+#endif
+
+// Есть ли у устройства command buffer с изменяемыми аргументами; заполняет command_buffers_available
+int InitCommand_buffers(cl_device_id device)
+{
+    command_buffers_available = 0;
+#ifdef HAVE_COMMAND_BUFFERS
+    size_t extensions_size = 0;
+    if (clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, 0, NULL, &extensions_size) != CL_SUCCESS)
+        return 0;
+    char *extensions = (char *) calloc(extensions_size + 1, 1);
+    cl_platform_id platform = 0;
+    int supported = clGetDeviceInfo(device, CL_DEVICE_EXTENSIONS, extensions_size, extensions, NULL) == CL_SUCCESS &&
+                    strstr(extensions, "cl_khr_command_buffer_mutable_dispatch") != NULL &&
+                    clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL) == CL_SUCCESS;
+    free(extensions);
+    if (!supported)
+        return 0;
+
+    *(void **)&command_buffer_api.create = clGetExtensionFunctionAddressForPlatform(platform, "clCreateCommandBufferKHR");
+    *(void **)&command_buffer_api.finalize = clGetExtensionFunctionAddressForPlatform(platform, "clFinalizeCommandBufferKHR");
+    *(void **)&command_buffer_api.release = clGetExtensionFunctionAddressForPlatform(platform, "clReleaseCommandBufferKHR");
+    *(void **)&command_buffer_api.ndrange = clGetExtensionFunctionAddressForPlatform(platform, "clCommandNDRangeKernelKHR");
+    *(void **)&command_buffer_api.enqueue = clGetExtensionFunctionAddressForPlatform(platform, "clEnqueueCommandBufferKHR");
+    *(void **)&command_buffer_api.update = clGetExtensionFunctionAddressForPlatform(platform, "clUpdateMutableCommandsKHR");
+    command_buffers_available = command_buffer_api.create && command_buffer_api.finalize && command_buffer_api.release &&
+                                command_buffer_api.ndrange && command_buffer_api.enqueue && command_buffer_api.update;
+#endif
+    return command_buffers_available;
+}
+
+// Запуск kernel'а: в очередь или, во время записи, в command buffer ( аргументы - как сейчас выставлены )
+cl_int enqueue_kernel(cl_command_queue queue, cl_kernel kernel, cl_uint work_dim, const size_t *global_size,
+                      const size_t *local_size)
+{
+#ifdef HAVE_COMMAND_BUFFERS
+    if (recording != NULL)
+    {
+        if (recording->amount_of_commands == MAX_RECORDED_COMMANDS)
+            return CL_OUT_OF_RESOURCES;
+        const cl_properties mutable_args[] = {CL_MUTABLE_DISPATCH_UPDATABLE_FIELDS_KHR, CL_MUTABLE_DISPATCH_ARGUMENTS_KHR, 0};
+        // команды буфера сами по себе не упорядочены: умножение -> ПФ строк -> ПФ столбцов -> модуль
+        cl_uint amount_of_waits = recording->amount_of_commands > 0 ? 1 : 0;
+        cl_sync_point_khr previous = recording->last_sync_point;
+        return command_buffer_api.ndrange(recording->buffer, NULL, mutable_args, kernel, work_dim, NULL, global_size,
+                                          local_size, amount_of_waits, amount_of_waits ? &previous : NULL,
+                                          &recording->last_sync_point,
+                                          &recording->commands[recording->amount_of_commands++]);
+    }
+#endif
+    return clEnqueueNDRangeKernel(queue, kernel, work_dim, NULL, global_size, local_size, 0, NULL, NULL);
+}
+
+cl_int begin_recording(struct Command_recorder *recorder, cl_command_queue queue)
+{
+    memset(recorder, 0, sizeof(*recorder));
+    recorder->queue = queue;
+    if (!command_buffers_available)
+        return CL_INVALID_OPERATION;
+#ifdef HAVE_COMMAND_BUFFERS
+    cl_int err = CL_SUCCESS;
+    const cl_properties properties[] = {CL_COMMAND_BUFFER_FLAGS_KHR, CL_COMMAND_BUFFER_MUTABLE_KHR, 0};
+    recorder->buffer = command_buffer_api.create(1, &queue, properties, &err);
+    if (err == CL_SUCCESS)
+        recording = recorder;
+    return err;
+#else
+    return CL_INVALID_OPERATION;
+#endif
+}
+
+cl_int end_recording(struct Command_recorder *recorder)
+{
+    recording = NULL;
+#ifdef HAVE_COMMAND_BUFFERS
+    cl_int err = command_buffer_api.finalize(recorder->buffer);
+    recorder->ready = err == CL_SUCCESS;
+    return err;
+#else
+    return CL_INVALID_OPERATION;
+#endif
+}
+
+void DeInitCommand_recorder(struct Command_recorder *recorder)
+{
+    if (recording == recorder)
+        recording = NULL;
+#ifdef HAVE_COMMAND_BUFFERS
+    if (recorder->buffer)
+        command_buffer_api.release(recorder->buffer);
+#endif
+    memset(recorder, 0, sizeof(*recorder));
+}
+
+// Новые значения аргументов записанной команды command ( номер в порядке записи ) и повтор всей записи
+cl_int replay_recording(struct Command_recorder *recorder, int command, int amount_of_args, const struct Recorded_arg *args)
+{
+#ifdef HAVE_COMMAND_BUFFERS
+    cl_mutable_dispatch_arg_khr arg_list[MAX_RECORDED_ARGS];
+    for (int i = 0; i < amount_of_args && i < MAX_RECORDED_ARGS; i++)
+    {
+        arg_list[i].arg_index = args[i].index;
+        arg_list[i].arg_size = args[i].size;
+        arg_list[i].arg_value = args[i].value;
+    }
+    cl_mutable_dispatch_config_khr config;
+    memset(&config, 0, sizeof(config));
+    config.command = recorder->commands[command];
+    config.num_args = amount_of_args < MAX_RECORDED_ARGS ? amount_of_args : MAX_RECORDED_ARGS;
+    config.arg_list = arg_list;
+    const cl_command_buffer_update_type_khr type = CL_STRUCTURE_TYPE_MUTABLE_DISPATCH_CONFIG_KHR;
+    const void *configs[] = {&config};
+    cl_int err = amount_of_args > 0 ? command_buffer_api.update(recorder->buffer, 1, &type, configs) : CL_SUCCESS;
+    if (err == CL_SUCCESS)
+        err = command_buffer_api.enqueue(1, &recorder->queue, recorder->buffer, 0, NULL, NULL);
+    return err;
+#else
+    return CL_INVALID_OPERATION;
+#endif
+}
+
+/// ВСТРОЕННОЕ ПФ
+// Программа, из которой InitFFT_OpenCL_data берёт fft_lines_kernel; 0 - все ПФ считает clFFT.
+// Держит свою ссылку на программу.
+cl_program builtin_fft_program = 0;
+
+void set_builtin_fft_program(cl_program program)
+{
+    if (program)
+        clRetainProgram(program);
+    if (builtin_fft_program)
+        clReleaseProgram(builtin_fft_program);
+    builtin_fft_program = program;
+}
+
+// Длины линий, которые раскладывает fft_radix() в rash_kernel.cl
+int builtin_fft_length_supported(int n)
+{
+    if (n < 2)
+        return 0;
+    for (int p = 2; p <= 7; p++)
+        while (n % p == 0)
+            n /= p;
+    return n == 1;
+}
+
+// Рабочая группа на линию длины n: каждый work-item держит в регистрах не больше
+// FFT_MAX_PER_ITEM ( 32 ) значений этапа, для этого нужно хотя бы n / 16 work-item'ов
+size_t builtin_fft_local_size(int n, size_t max_work_group_size)
+{
+    size_t local_size = 64;
+    while (local_size * 16 < (size_t)n)
+        local_size *= 2;
+    return local_size <= max_work_group_size ? local_size : 0;
+}
+
+// Берёт встроенное ПФ, если линии обоих измерений помещаются в local память и рабочую группу
+cl_int init_builtin_fft(cl_command_queue queue, struct FFT_OpenCL_data *data)
+{
+    cl_int err;
+    cl_device_id device = 0;
+    cl_ulong local_mem_size = 0;
+    size_t max_work_group_size = 0;
+
+    if (builtin_fft_program == 0)
+        return CL_INVALID_PROGRAM;
+
+    err = clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(device), &device, NULL);
+    if (err != CL_SUCCESS)
+        return err;
+
+    data->lines_kernel = clCreateKernel(builtin_fft_program, "fft_lines_kernel", &err);
+    if (err != CL_SUCCESS)
+    {
+        printf("Problems w/ creating fft_lines_kernel: %d\n", err);
+        data->lines_kernel = 0;
+        return err;
+    }
+    err = clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem_size), &local_mem_size, NULL);
+    if (err == CL_SUCCESS)
+        err = clGetKernelWorkGroupInfo(data->lines_kernel, device, CL_KERNEL_WORK_GROUP_SIZE,
+                                       sizeof(max_work_group_size), &max_work_group_size, NULL);
+
+    int longest = data->sizex > data->sizey ? data->sizex : data->sizey;
+    data->row_local_size = builtin_fft_local_size(data->sizex, max_work_group_size);
+    data->col_local_size = builtin_fft_local_size(data->sizey, max_work_group_size);
+    if (err == CL_SUCCESS && (!builtin_fft_length_supported(data->sizex) || !builtin_fft_length_supported(data->sizey) ||
+                              data->row_local_size == 0 || data->col_local_size == 0 ||
+                              longest * sizeof(cl_float2) > local_mem_size))
+    {
+        show_status_string("Built-in FFT does not support %dx%d on this device, using clFFT", data->sizex, data->sizey);
+        err = CL_INVALID_WORK_GROUP_SIZE;
+    }
+
+    if (err != CL_SUCCESS)
+    {
+        clReleaseKernel(data->lines_kernel);
+        data->lines_kernel = 0;
+    }
+    return err;
+}
+
+// Один проход fft_lines_kernel: lines линий, начиная с first_line, во всех матрицах пакета
+cl_int enqueue_fft_lines(cl_command_queue queue, struct FFT_OpenCL_data *data, struct Cl_Buffer_pair *buffer,
+                         int n, size_t local_size, int first_line, int lines, int line_pitch, int element_pitch,
+                         int in_count, int out_start, int out_count, float sign, float scale)
+{
+    cl_int ret = CL_SUCCESS;
+    cl_kernel kernel = data->lines_kernel;
+    int interleaved = data->layout == LAYOUT_INTERLEAVED;
+    cl_mem imag = interleaved ? buffer->buffers[0] : buffer->buffers[1];
+    int complex_pitch = interleaved ? 2 : 1;
+    int imag_offset = interleaved ? 1 : 0;
+    cl_ulong batch_pitch = (cl_ulong)data->sizex * data->sizey;
+
+    ret |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &buffer->buffers[0]);
+    ret |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &imag);
+    ret |= clSetKernelArg(kernel, 2, sizeof(complex_pitch), &complex_pitch);
+    ret |= clSetKernelArg(kernel, 3, sizeof(imag_offset), &imag_offset);
+    ret |= clSetKernelArg(kernel, 4, sizeof(n), &n);
+    ret |= clSetKernelArg(kernel, 5, sizeof(first_line), &first_line);
+    ret |= clSetKernelArg(kernel, 6, sizeof(line_pitch), &line_pitch);
+    ret |= clSetKernelArg(kernel, 7, sizeof(element_pitch), &element_pitch);
+    ret |= clSetKernelArg(kernel, 8, sizeof(batch_pitch), &batch_pitch);
+    ret |= clSetKernelArg(kernel, 9, sizeof(in_count), &in_count);
+    ret |= clSetKernelArg(kernel, 10, sizeof(out_start), &out_start);
+    ret |= clSetKernelArg(kernel, 11, sizeof(out_count), &out_count);
+    ret |= clSetKernelArg(kernel, 12, sizeof(sign), &sign);
+    ret |= clSetKernelArg(kernel, 13, sizeof(scale), &scale);
+    ret |= clSetKernelArg(kernel, 14, n * sizeof(cl_float2), NULL);
+    if (ret != CL_SUCCESS)
+    {
+        printf("Problems w/ setting KernelArgs for fft_lines_kernel\n");
+        return ret;
+    }
+
+    size_t global_size[] = {lines * local_size, data->batch};
+    size_t work_group_size[] = {local_size, 1};
+    return enqueue_kernel(queue, kernel, 2, global_size, work_group_size);
+}
+
+// Прямое ПФ: строки только с данными ( нулевые строки дают нулевой спектр ), затем столбцы, в которых
+// ненулевые только первые input_height элементов. Обратное: столбцы целиком, но сохраняются только
+// строки выхода, затем только строки выхода и в них только столбцы выхода
+cl_int builtin_fft_2d(struct Cl_Buffer_pair *input_output, clfftDirection direction, cl_command_queue queue,
+                      struct FFT_OpenCL_data *data)
+{
+    cl_int err;
+    int sizex = data->sizex;
+    int sizey = data->sizey;
+
+    if (direction == CLFFT_FORWARD)
+    {
+        err = enqueue_fft_lines(queue, data, input_output, sizex, data->row_local_size, 0, data->input_height, sizex, 1,
+                                data->input_width, 0, sizex, -1.0f, 1.0f);
+        if (err == CL_SUCCESS)
+            err = enqueue_fft_lines(queue, data, input_output, sizey, data->col_local_size, 0, sizex, 1, sizex,
+                                    data->input_height, 0, sizey, -1.0f, data->forward_scale);
+    }
+    else
+    {
+        err = enqueue_fft_lines(queue, data, input_output, sizey, data->col_local_size, 0, sizex, 1, sizex,
+                                sizey, data->output_y0, data->output_height, 1.0f, 1.0f);
+        if (err == CL_SUCCESS)
+            err = enqueue_fft_lines(queue, data, input_output, sizex, data->row_local_size, data->output_y0,
+                                    data->output_height, sizex, 1, sizex, data->output_x0, data->output_width,
+                                    1.0f, data->backward_scale);
+    }
+    return err;
+}
+
+// Прореживание встроенного ПФ ( clFFT всегда считает матрицу целиком )
+void prune_fft_input(struct FFT_OpenCL_data *data, int width, int height)
+{
+    data->input_width = width;
+    data->input_height = height;
+}
+
+void prune_fft_output(struct FFT_OpenCL_data *data, int x0, int y0, int width, int height)
+{
+    data->output_x0 = x0;
+    data->output_y0 = y0;
+    data->output_width = width;
+    data->output_height = height;
+}
+
+/// РЕЕСТР ПЛАНОВ clFFT
+// clfftBakePlan генерирует и компилирует kernel'ы, поэтому каждый план с уже
+// встречавшейся геометрией берём из реестра, а не печём заново. Планы живут до
+// release_fft_plans(), временный буфер у всех планов общий ( самый большой из нужных ).
+
+#define MAX_FFT_PLANS 32
+
+struct Fft_plan_key {
+    size_t lengths[2];
+    clfftLayout layout_in;
+    clfftLayout layout_out;
+    size_t batch;
+    clfftDirection direction_normalize;
+    cl_float scale;
+    clfftPrecision precision;
+};
+
+struct Fft_plan_entry {
+    struct Fft_plan_key key;
+    clfftPlanHandle planHandle;
+    size_t tmpBufferSize;
+    float bake_time;
+    int uses;
+};
+
+struct Fft_plan_registry {
+    struct Fft_plan_entry entries[MAX_FFT_PLANS];
+    int count;
+
+    cl_mem tmpBuffer;
+    size_t tmpBufferSize;
+
+    int hits;
+    int misses;
+    float bake_time_total;
+};
+
+struct Fft_plan_registry fft_plans;
+
+int fft_plan_key_equal(const struct Fft_plan_key *a, const struct Fft_plan_key *b)
+{
+    return a->lengths[0] == b->lengths[0] && a->lengths[1] == b->lengths[1] &&
+           a->layout_in == b->layout_in && a->layout_out == b->layout_out &&
+           a->batch == b->batch && a->direction_normalize == b->direction_normalize &&
+           a->scale == b->scale && a->precision == b->precision;
+}
+
+// clFFT пишет сгенерированные kernel'ы ( CLFFT_DUMP_PROGRAMS ) только в текущий каталог. Менять его
+// нельзя - задачи пула стадий открывают картинки по относительным путям, поэтому после сборки плана
+// его файлы clfft.*.cl переносятся в каталог для дампа
+void move_fft_kernel_dump(void)
+{
+    DIR *dir = opendir(".");
+    if (dir == NULL)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        size_t length = strlen(entry->d_name);
+        if (strncmp(entry->d_name, "clfft.", 6) != 0 || length < 3 || strcmp(entry->d_name + length - 3, ".cl") != 0)
+            continue;
+        char path[4096];
+        if (snprintf(path, sizeof(path), "%s/%s", options.fft_kernel_dump_dir, entry->d_name) >= (int)sizeof(path) ||
+            rename(entry->d_name, path) != 0)
+            printf("bake_fft_plan: could not move %s to %s\n", entry->d_name, options.fft_kernel_dump_dir);
+    }
+    closedir(dir);
+}
+
+cl_int bake_fft_plan(clfftPlanHandle planHandle, cl_command_queue queue)
+{
+    cl_int err = clfftBakePlan(planHandle, 1, &queue, NULL, NULL);
+    if (options.fft_kernel_dump_dir != NULL)
+        move_fft_kernel_dump();
+    return err;
+}
+
+cl_int acquire_fft_plan(const struct Fft_plan_key *key, cl_context ctx, cl_command_queue queue, clfftPlanHandle *planHandle)
+{
+    cl_int err = CL_SUCCESS;
+
+    for (int i = 0; i < fft_plans.count; i++)
+    {
+        if (fft_plan_key_equal(&fft_plans.entries[i].key, key))
+        {
+            fft_plans.entries[i].uses++;
+            fft_plans.hits++;
+            *planHandle = fft_plans.entries[i].planHandle;
+            return CL_SUCCESS;
+        }
+    }
+
+    if (fft_plans.count == MAX_FFT_PLANS)
+    {
+        printf("acquire_fft_plan: registry is full\n");
+        return CL_OUT_OF_RESOURCES;
+    }
+
+    struct Fft_plan_entry *entry = &fft_plans.entries[fft_plans.count];
+    memset(entry, 0, sizeof(*entry));
+    entry->key = *key;
+    size_t N = key->lengths[0] * key->lengths[1];
+
+    // Create a default plan for a complex FFT
+    err = clfftCreateDefaultPlan(&entry->planHandle, ctx, CLFFT_2D, entry->key.lengths);
+    if (err != CL_SUCCESS)
+        return err;
+
+    // Set plan parameters
+    err = clfftSetPlanPrecision(entry->planHandle, key->precision);
+    if (err == CL_SUCCESS)
+        err = clfftSetLayout(entry->planHandle, key->layout_in, key->layout_out);
+    if (err == CL_SUCCESS)
+        err = clfftSetResultLocation(entry->planHandle, CLFFT_INPLACE);
+    if (err == CL_SUCCESS)
+        err = clfftSetPlanBatchSize(entry->planHandle, key->batch);
+    if (err == CL_SUCCESS)
+        err = clfftSetPlanDistance(entry->planHandle, N, N);
+    if (err == CL_SUCCESS)
+        err = clfftSetPlanScale(entry->planHandle, key->direction_normalize, key->scale);
+
+    // Bake the plan
+    clock_t bake_start = clock();
+    if (err == CL_SUCCESS)
+        err = bake_fft_plan(entry->planHandle, queue);
+    entry->bake_time = (float)(clock() - bake_start)/CLOCKS_PER_SEC;
+
+    if (err == CL_SUCCESS)
+        err = clfftGetTmpBufSize(entry->planHandle, &entry->tmpBufferSize);
+
+    if (err != CL_SUCCESS)
+    {
+        clfftDestroyPlan(&entry->planHandle);
+        return err;
+    }
+
+    show_status_string("Baked FFT plan %zux%zu (batch %zu): %f", key->lengths[0], key->lengths[1], key->batch, entry->bake_time);
+    fft_plans.bake_time_total += entry->bake_time;
+    fft_plans.misses++;
+    fft_plans.count++;
+    entry->uses = 1;
+
+    // общий временный буфер растёт до самого большого запроса; планы,
+    // получившие старый буфер, держат на него свою ссылку
+    if (entry->tmpBufferSize > fft_plans.tmpBufferSize)
+    {
+        cl_mem tmpBuffer = clCreateBuffer(ctx, CL_MEM_READ_WRITE, entry->tmpBufferSize, NULL, &err);
+        if (err != CL_SUCCESS) {
+            printf("Error with tmpBuffer clCreateBuffer\n");
+            return err;
+        }
+        if (fft_plans.tmpBuffer)
+            clReleaseMemObject(fft_plans.tmpBuffer);
+        fft_plans.tmpBuffer = tmpBuffer;
+        fft_plans.tmpBufferSize = entry->tmpBufferSize;
+    }
+
+    *planHandle = entry->planHandle;
+    return CL_SUCCESS;
+}
+
+void release_fft_plans(void)
+{
+    show_status_string("FFT plans: %d baked, %d reused, total bake time: %f", fft_plans.misses, fft_plans.hits, fft_plans.bake_time_total);
+
+    for (int i = 0; i < fft_plans.count; i++)
+        clfftDestroyPlan(&fft_plans.entries[i].planHandle);
+    if (fft_plans.tmpBuffer)
+        clReleaseMemObject(fft_plans.tmpBuffer);
+    memset(&fft_plans, 0, sizeof(fft_plans));
+}
+
+cl_int InitFFT_OpenCL_data(int sizex, int sizey, cl_context ctx, cl_command_queue queue, int amount_of_buffers_to_transform, clfftDirection direction_normalize, enum Data_layout layout, struct FFT_OpenCL_data *data) {
+    cl_int err = CL_SUCCESS;
+    memset(data, 0, sizeof(*data)); // побайтовое обнуление всей структуры data
+    data->sizex = sizex;
+    data->sizey = sizey;
+    int N = sizex * sizey;
+
+    data->batch = amount_of_buffers_to_transform;
+    data->layout = layout;
+    // как у плана clFFT: в направлении direction_normalize 1/sqrt(N), иначе прямое 1, обратное 1/N
+    data->forward_scale = direction_normalize == CLFFT_FORWARD ? 1.0f / sqrtf(N) : 1.0f;
+    data->backward_scale = direction_normalize == CLFFT_BACKWARD ? 1.0f / sqrtf(N) : 1.0f / N;
+    prune_fft_input(data, sizex, sizey);
+    prune_fft_output(data, 0, 0, sizex, sizey);
+    if (init_builtin_fft(queue, data) == CL_SUCCESS)
+        return CL_SUCCESS;
+
+    struct Fft_plan_key key;
+    memset(&key, 0, sizeof(key));
+    key.lengths[0] = sizex;
+    key.lengths[1] = sizey;
+    key.layout_in = layout == LAYOUT_INTERLEAVED ? CLFFT_COMPLEX_INTERLEAVED : CLFFT_COMPLEX_PLANAR;
+    key.layout_out = key.layout_in;
+    key.batch = amount_of_buffers_to_transform;
+    key.direction_normalize = direction_normalize;
+    key.scale = 1.0f / sqrtf(N);
+    key.precision = CLFFT_SINGLE;
+
+    err = acquire_fft_plan(&key, ctx, queue, &data->planHandle);
+    if (err != CL_SUCCESS)
+        return err;
+
+    if (fft_plans.tmpBuffer)
+    {
+        data->tmpBuffer = fft_plans.tmpBuffer;
+        clRetainMemObject(data->tmpBuffer);
+    }
+
+    return err;
+}
+
+void DeInItFFT_OpenCL_data(struct FFT_OpenCL_data *data)
+{
+    // Release OpenCL memory objects ( сам план остаётся в реестре )
+    if (data->tmpBuffer)
+        clReleaseMemObject(data->tmpBuffer);
+    if (data->lines_kernel)
+        clReleaseKernel(data->lines_kernel);
+    memset(data, 0, sizeof(*data)); // побайтовое обнуление всей структуры data
+}
+
+///////// OpenCL FFT 2D function ///////////
+int FFT_2D_OpenCL(struct Cl_Buffer_pair *input_output, clfftDirection direction, cl_command_queue queue, cl_int finishFlag,
+                  struct FFT_OpenCL_data *data){
+    cl_int err;
+    if (data->lines_kernel)
+        err = builtin_fft_2d(input_output, direction, queue, data);
+    else
+    {
+        // заполнение буферов на GPU нулями
+        err = clfftEnqueueTransform(data->planHandle, direction, 1, &queue, 0, NULL, NULL,
+                                    input_output->buffers, input_output->buffers, data->tmpBuffer);
+    }
+
+    // Wait for calculations to be finished
+    if (finishFlag == CL_TRUE)
+        err = clFinish(queue);
+
+    return err;
+}
+
+struct Image{
+    int width;
+    int height;
+
+    png_bytep* row_pointers;
+};
+
+struct Image read_png_file(char* file_name)
+{
+    png_byte color_type;
+    png_byte bit_depth;
+
+    png_structp png_ptr;
+    png_infop info_ptr;
+    int number_of_passes;
+
+    struct Image image;
+    memset(&image, 0, sizeof(image));
+
+    png_byte header[8];    // 8 is the maximum size that can be checked
+
+    /* open file and test for it being a png */
+    FILE *fp = fopen(file_name, "rb");
+    if (!fp)
+    {
+        printf("[read_png_file] File %s could not be opened for reading\n", file_name);
+        return image;
+    }
+
+    fread(header, 1, 8, fp);
+    if (png_sig_cmp(header, 0, 8))
+    {
+        printf("[read_png_file] File %s is not recognized as a PNG file\n", file_name);
+        return image;
+    }
+
+
+    /* initialize stuff */
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+
+    if (!png_ptr)
+    {
+        printf("[read_png_file] png_create_read_struct failed\n");
+        return  image;
+    }
+
+
+    info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr)
+    {
+        printf("[read_png_file] png_create_info_struct failed\n");
+        return image;
+    }
+
+
+    if (setjmp(png_jmpbuf(png_ptr)))
+    {
+        printf("[read_png_file] Error during init_io\n");
+        return image;
+    }
+
+
+    png_init_io(png_ptr, fp);
+    png_set_sig_bytes(png_ptr, 8);
+
+    png_read_info(png_ptr, info_ptr);
+
+    image.width = png_get_image_width(png_ptr, info_ptr);
+    image.height = png_get_image_height(png_ptr, info_ptr);
+    color_type = png_get_color_type(png_ptr, info_ptr);
+    bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+
+    number_of_passes = png_set_interlace_handling(png_ptr);
+//    png_read_update_info(png_ptr, info_ptr);
+
+
+    /* read file */
+    if (setjmp(png_jmpbuf(png_ptr)))
+    {
+        printf("[read_png_file] Error during read_image\n");
+        return  image;
+    }
+
+    if ((color_type & PNG_COLOR_MASK_COLOR)!= PNG_COLOR_TYPE_GRAY )
+        png_set_rgb_to_gray(png_ptr, 1, 0, 0);
+    png_read_update_info(png_ptr, info_ptr);
+
+    image.row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * image.height);
+    for (int y = 0; y < image.height; y++)
+        image.row_pointers[y] = (png_byte*) malloc(png_get_rowbytes(png_ptr,info_ptr));
+
+    png_read_image(png_ptr, image.row_pointers);
+
+    fclose(fp);
+    return image;
+}
+
+void write_png_file(struct Image image, const char* file_name)
+{
+    png_byte color_type = PNG_COLOR_TYPE_GRAY;
+    png_byte bit_depth = 8;
+
+    png_structp png_ptr;
+    png_infop info_ptr;
+
+
+    /* create file */
+    FILE *fp = fopen(file_name, "wb");
+    if (!fp)
+    {
+        printf("[write_png_file] File %s could not be opened for writing", file_name);
+        return;
+    }
+
+    /* initialize stuff */
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+
+    if (!png_ptr)
+    {
+        printf("[write_png_file] png_create_write_struct failed");
+        return;
+    }
+
+
+    info_ptr = png_create_info_struct(png_ptr);
+    if (!info_ptr)
+    {
+        printf("[write_png_file] png_create_info_struct failed");
+        return;
+    }
+
+
+    if (setjmp(png_jmpbuf(png_ptr)))
+    {
+        printf("[write_png_file] Error during init_io");
+        return;
+    }
+
+
+    png_init_io(png_ptr, fp);
+
+
+    /* write header */
+    if (setjmp(png_jmpbuf(png_ptr)))
+    {
+        printf("[write_png_file] Error during writing header");
+        return;
+    }
+
+
+    png_set_IHDR(png_ptr, info_ptr, image.width, image.height,
+                 bit_depth, color_type, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+
+    png_write_info(png_ptr, info_ptr);
+
+
+    /* write bytes */
+    if (setjmp(png_jmpbuf(png_ptr)))
+    {
+        printf("[write_png_file] Error during writing bytes");
+        return;
+    }
+
+
+    png_write_image(png_ptr, image.row_pointers);
+
+
+    /* end write */
+    if (setjmp(png_jmpbuf(png_ptr)))
+    {
+        printf("[write_png_file] Error during end of write");
+        return;
+    }
+
+    png_write_end(png_ptr, NULL);
+
+    fclose(fp);
+}
+
+void make_pic_filename(char *filename, int image_width, int image_height, int index)
+{
+    sprintf(filename, "%dx%d/image%02d.png", image_width, image_height, index+1);
+}
+
+/// ГЕОМЕТРИЯ СВЁРТКИ
+// Картинка кладётся в левый верхний угол расширенной матрицы, опора PSF ( прямоугольник |h|^2,
+// вне которого остаётся пренебрежимо мало энергии ) - тоже. Циклическая свёртка размера sizex
+// совпадает с линейной на месте картинки ( crop_x .. crop_x + image_width ), если
+//     sizex >= crop_x + image_width  и  sizex >= image_width + psf_width - 1 - crop_x,
+// где crop_x - положение центра PSF в опоре. Исходный вариант - sizex = 2 * image_width, вся h.
+
+struct Conv_geometry {
+    // исходная картинка ( и h до обрезки - того же размера )
+    int image_width;
+    int image_height;
+    // опора PSF: [psf_x0, psf_x0 + psf_width) x [psf_y0, psf_y0 + psf_height) в матрице |h|^2
+    int psf_x0;
+    int psf_y0;
+    int psf_width;
+    int psf_height;
+    // расширенные матрицы ( размер ПФ )
+    int sizex;
+    int sizey;
+    // где в расширенном результате начинается картинка
+    int crop_x;
+    int crop_y;
+};
+
+// Длины, которые clFFT раскладывает на свои основания ( 2, 3, 5, 7 )
+int is_fft_friendly_size(int n)
+{
+    const int radices[] = {2, 3, 5, 7};
+    for (int i = 0; i < 4; i++)
+        while (n % radices[i] == 0)
+            n /= radices[i];
+    return n == 1;
+}
+
+// Наименьшая чётная длина >= n, удобная для clFFT ( чётность нужна interleaved kernel'ам с float4 )
+int next_fft_size(int n)
+{
+    if (n < 2)
+        n = 2;
+    while (n % 2 != 0 || !is_fft_friendly_size(n))
+        n++;
+    return n;
+}
+
+// Исходная геометрия: вся h и удвоенные размеры
+void init_double_padding_geometry(int image_width, int image_height, struct Conv_geometry *geometry)
+{
+    memset(geometry, 0, sizeof(*geometry));
+    geometry->image_width = image_width;
+    geometry->image_height = image_height;
+    geometry->psf_width = image_width;
+    geometry->psf_height = image_height;
+    geometry->sizex = 2 * image_width;
+    geometry->sizey = 2 * image_height;
+    geometry->crop_x = image_width / 2;
+    geometry->crop_y = image_height / 2;
+}
+
+// По опоре PSF ( psf_* уже заданы ) - положение картинки в результате и минимальные размеры ПФ
+void fit_geometry_to_psf_support(struct Conv_geometry *geometry)
+{
+    // центр PSF после fftshift - ( image_width/2, image_height/2 )
+    geometry->crop_x = geometry->image_width / 2 - geometry->psf_x0;
+    geometry->crop_y = geometry->image_height / 2 - geometry->psf_y0;
+
+    int required_x = geometry->crop_x + geometry->image_width;
+    int tail_x = geometry->image_width + geometry->psf_width - 1 - geometry->crop_x;
+    int required_y = geometry->crop_y + geometry->image_height;
+    int tail_y = geometry->image_height + geometry->psf_height - 1 - geometry->crop_y;
+
+    geometry->sizex = next_fft_size(required_x > tail_x ? required_x : tail_x);
+    geometry->sizey = next_fft_size(required_y > tail_y ? required_y : tail_y);
+}
+
+// Нормировка модуля: яркость результата не зависит от размера ПФ ( обратное ПФ делит на sqrt(N) );
+// при удвоенных размерах это исходное 1 / (width^3 * amount_of_pics)
+float result_scaling(const struct Conv_geometry *geometry, int amount_of_pics)
+{
+    double N = (double)geometry->sizex * geometry->sizey;
+    return (float)(2.0 / (sqrt(N) * geometry->image_width * geometry->image_height * amount_of_pics));
+}
+
+/// КЭШ СПЕКТРОВ ВХОДНЫХ КАРТИНОК
+// Файл кэша: заголовок, затем действительные части всех спектров, затем мнимые
+// ( ровно в том виде, в каком они лежат в all_pics_buffer ).
+// Ключ - хэш содержимого всех входных png вместе с размером преобразования,
+// поэтому замена любой картинки или другой размер дают другой файл.
+
+#define SPECTRA_CACHE_MAGIC 0x43505352u // "RSPC"
+#define SPECTRA_CACHE_VERSION 2u
+
+struct Spectra_cache_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t sizex;
+    int32_t sizey;
+    int32_t amount_of_pics;
+    int32_t layout;
+    uint64_t key;
+};
+
+int spectra_cache_key(int amount_of_pics, const struct Conv_geometry *geometry, enum Data_layout layout, uint64_t *key)
+{
+    int32_t layout_id = layout;
+    uint64_t hash = FNV1A_OFFSET_BASIS;
+    hash = fnv1a_update(hash, &geometry->image_width, sizeof(geometry->image_width));
+    hash = fnv1a_update(hash, &geometry->image_height, sizeof(geometry->image_height));
+    hash = fnv1a_update(hash, &geometry->sizex, sizeof(geometry->sizex));
+    hash = fnv1a_update(hash, &geometry->sizey, sizeof(geometry->sizey));
+    hash = fnv1a_update(hash, &layout_id, sizeof(layout_id));
+
+    for (int i = 0; i < amount_of_pics; i++)
+    {
+        char filename[64] = {'\0'};
+        make_pic_filename(filename, geometry->image_width, geometry->image_height, i);
+        if (!fnv1a_update_file(filename, &hash))
+            return 0;
+    }
+
+    *key = hash;
+    return 1;
+}
+
+void spectra_cache_path(char *path, size_t path_size, const char *dir, int sizex, int sizey, int amount_of_pics, uint64_t key)
+{
+    snprintf(path, path_size, "%s/spectra_%dx%d_%d_%016"PRIx64".bin", dir, sizex, sizey, amount_of_pics, key);
+}
+
+// CL_SUCCESS - спектры загружены из кэша в all_pics_buffer, иначе кэша нет ( или он испорчен )
+cl_int load_spectra_from_cache(const char *path, cl_command_queue queue, int sizex, int sizey, int amount_of_pics,
+                               enum Data_layout layout, uint64_t key, struct Cl_Buffer_pair *all_pics_buffer)
+{
+    // planar - две плоскости ( re, im ), interleaved - одна плоскость вдвое больше
+    const int amount_of_planes = layout == LAYOUT_INTERLEAVED ? 1 : 2;
+    const size_t plane_size_in_bytes = (size_t)sizex * sizey * amount_of_pics * sizeof(cl_float) * (3 - amount_of_planes);
+    const size_t file_size = sizeof(struct Spectra_cache_header) + 2 * (size_t)sizex * sizey * amount_of_pics * sizeof(cl_float);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return CL_INVALID_VALUE;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != file_size)
+    {
+        close(fd);
+        return CL_INVALID_VALUE;
+    }
+
+    void *mapped = mmap(NULL, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return CL_INVALID_VALUE;
+
+    const struct Spectra_cache_header *header = (const struct Spectra_cache_header *)mapped;
+    const char *planes = (const char *)mapped + sizeof(*header);
+    cl_int err = CL_INVALID_VALUE;
+
+    if (header->magic == SPECTRA_CACHE_MAGIC && header->version == SPECTRA_CACHE_VERSION && header->key == key &&
+        header->sizex == sizex && header->sizey == sizey && header->amount_of_pics == amount_of_pics &&
+        header->layout == layout)
+    {
+        err = clEnqueueWriteBuffer(queue, all_pics_buffer->buffers[0], CL_FALSE, 0, plane_size_in_bytes, planes, 0, NULL, NULL);
+        if (err == CL_SUCCESS && amount_of_planes == 2)
+            err = clEnqueueWriteBuffer(queue, all_pics_buffer->buffers[1], CL_FALSE, 0, plane_size_in_bytes,
+                                       planes + plane_size_in_bytes, 0, NULL, NULL);
+
+        // отображение должно жить, пока не закончатся копирования
+        cl_int finish_err = clFinish(queue);
+        if (err == CL_SUCCESS)
+            err = finish_err;
+    }
+
+    munmap(mapped, file_size);
+    return err;
+}
+
+cl_int store_spectra_to_cache(const char *path, cl_command_queue queue, int sizex, int sizey, int amount_of_pics,
+                              enum Data_layout layout, uint64_t key, struct Cl_Buffer_pair *all_pics_buffer)
+{
+    const int amount_of_planes = layout == LAYOUT_INTERLEAVED ? 1 : 2;
+    const size_t plane_size_in_bytes = (size_t)sizex * sizey * amount_of_pics * sizeof(cl_float) * (3 - amount_of_planes);
+    const size_t file_size = sizeof(struct Spectra_cache_header) + 2 * (size_t)sizex * sizey * amount_of_pics * sizeof(cl_float);
+
+    // пишем во временный файл и переименовываем, чтобы прерванный запуск не оставил битый кэш
+    char tmp_path[1024] = {'\0'};
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("store_spectra_to_cache: could not create %s\n", tmp_path);
+        return CL_INVALID_VALUE;
+    }
+    if (ftruncate(fd, file_size) != 0)
+    {
+        printf("store_spectra_to_cache: could not resize %s\n", tmp_path);
+        close(fd);
+        unlink(tmp_path);
+        return CL_INVALID_VALUE;
+    }
+
+    void *mapped = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        unlink(tmp_path);
+        return CL_INVALID_VALUE;
+    }
+
+    struct Spectra_cache_header *header = (struct Spectra_cache_header *)mapped;
+    char *planes = (char *)mapped + sizeof(*header);
+
+    cl_int err = clEnqueueReadBuffer(queue, all_pics_buffer->buffers[0], CL_TRUE, 0, plane_size_in_bytes, planes, 0, NULL, NULL);
+    if (err == CL_SUCCESS && amount_of_planes == 2)
+        err = clEnqueueReadBuffer(queue, all_pics_buffer->buffers[1], CL_TRUE, 0, plane_size_in_bytes,
+                                  planes + plane_size_in_bytes, 0, NULL, NULL);
+
+    if (err == CL_SUCCESS)
+    {
+        memset(header, 0, sizeof(*header));
+        header->magic = SPECTRA_CACHE_MAGIC;
+        header->version = SPECTRA_CACHE_VERSION;
+        header->sizex = sizex;
+        header->sizey = sizey;
+        header->amount_of_pics = amount_of_pics;
+        header->layout = layout;
+        header->key = key;
+        msync(mapped, file_size, MS_SYNC);
+    }
+    munmap(mapped, file_size);
+
+    if (err != CL_SUCCESS || rename(tmp_path, path) != 0)
+    {
+        printf("store_spectra_to_cache: could not write %s\n", path);
+        unlink(tmp_path);
+        return err != CL_SUCCESS ? err : CL_INVALID_VALUE;
+    }
+    return CL_SUCCESS;
+}
+
+/// ДЕКОДИРОВАНИЕ КАРТИНОК В ПУЛЕ
+// Картинки декодируются задачами STAGE_DECODE, как только известны их размеры, параллельно со сборкой
+// программы, планами ПФ и подбором размеров; read_and_fft_pics забирает их по одной по мере готовности.
+// С кэшем спектров декодирование запускает сама read_and_fft_pics и только при промахе кэша.
+
+struct Pic_decode_job {
+    int index;
+    int width;
+    int height;
+    struct Image image;
+};
+
+struct Pic_decoding {
+    int amount_of_pics;
+    struct Pic_decode_job *jobs;
+    int *tasks;
+};
+
+void decode_pic(void *arg)
+{
+    struct Pic_decode_job *job = (struct Pic_decode_job *)arg;
+    char filename[64] = {'\0'};
+    make_pic_filename(filename, job->width, job->height, job->index);
+    job->image = read_png_file(filename);
+}
+
+void start_pic_decoding(struct Stage_graph *graph, int amount_of_pics, int width, int height, struct Pic_decoding *decoding)
+{
+    decoding->amount_of_pics = amount_of_pics;
+    decoding->jobs = (struct Pic_decode_job *) calloc(amount_of_pics, sizeof(struct Pic_decode_job));
+    decoding->tasks = (int *) calloc(amount_of_pics, sizeof(int));
+    for (int i = 0; i < amount_of_pics; i++)
+    {
+        decoding->jobs[i].index = i;
+        decoding->jobs[i].width = width;
+        decoding->jobs[i].height = height;
+        decoding->tasks[i] = stage_add(graph, STAGE_DECODE, decode_pic, &decoding->jobs[i], 0, NULL, 0);
+    }
+}
+
+// Картинка i ( ждёт её декодирования ); освобождает её вызывающий
+struct Image take_decoded_pic(struct Stage_graph *graph, struct Pic_decoding *decoding, int i)
+{
+    stage_wait(graph, decoding->tasks[i]);
+    struct Image image = decoding->jobs[i].image;
+    memset(&decoding->jobs[i].image, 0, sizeof(image));
+    return image;
+}
+
+void DeInitPic_decoding(struct Stage_graph *graph, struct Pic_decoding *decoding)
+{
+    for (int i = 0; i < decoding->amount_of_pics; i++)
+    {
+        struct Image image = take_decoded_pic(graph, decoding, i);
+        if (image.row_pointers != NULL)
+        {
+            for (int l = 0; l < image.height; l++)
+                free(image.row_pointers[l]);
+            free(image.row_pointers);
+        }
+    }
+    free(decoding->jobs);
+    free(decoding->tasks);
+    memset(decoding, 0, sizeof(*decoding));
+}
+
+// decoding - картинки, декодируемые в пуле ( start_pic_decoding; ещё не запущено - запускается после
+// промаха кэша спектров ), NULL - декодировать здесь
+struct Cl_Buffer_pair read_and_fft_pics(cl_context ctx, cl_command_queue queue, int amount_of_pics,
+                                        const struct Conv_geometry *geometry, enum Data_layout layout,
+                                        struct Pic_decoding *decoding) {
+    cl_int err;
+    struct Cl_Buffer_pair all_pics_buffer;
+    struct FFT_OpenCL_data fft_rash_size;
+    int sizex = geometry->sizex;
+    int sizey = geometry->sizey;
+    size_t N = (size_t)sizex * sizey;
+    // промежуточная картинка на хосте - только для загрузки без zero-copy и без кольца
+    float *Array = NULL;
+
+    clock_t creation_of_helpers_time_start = clock();
+    InitCl_Buffer_complex(ctx, queue, CL_MEM_READ_WRITE, N*amount_of_pics, layout, &all_pics_buffer);
+    // interleaved: каждый пиксель - пара (re, 0)
+    const int floats_per_pixel = layout == LAYOUT_INTERLEAVED ? 2 : 1;
+
+    /// Если спектры этих картинок уже посчитаны - берём их из кэша, без декодирования png и прямого ПФ
+    int use_spectra_cache = 0;
+    uint64_t spectra_key = 0;
+    char spectra_cache_file[1024] = {'\0'};
+    if (options.spectra_cache_dir != NULL)
+    {
+        use_spectra_cache = spectra_cache_key(amount_of_pics, geometry, layout, &spectra_key);
+        if (use_spectra_cache)
+        {
+            spectra_cache_path(spectra_cache_file, sizeof(spectra_cache_file), options.spectra_cache_dir,
+                               sizex, sizey, amount_of_pics, spectra_key);
+            clock_t cache_start = clock();
+            if (load_spectra_from_cache(spectra_cache_file, queue, sizex, sizey, amount_of_pics, layout, spectra_key, &all_pics_buffer) == CL_SUCCESS)
+            {
+                show_status_string("Spectra of input pics loaded from cache %s: %f", spectra_cache_file,
+                                   (float)(clock() - cache_start)/CLOCKS_PER_SEC);
+                return all_pics_buffer;
+            }
+            show_status_string("No spectra cache for these pics yet: %s", spectra_cache_file);
+        }
+    }
+    if (decoding != NULL && decoding->jobs == NULL)
+        start_pic_decoding(&stages, amount_of_pics, geometry->image_width, geometry->image_height, decoding);
+
+    InitFFT_OpenCL_data(sizex, sizey, ctx, queue, amount_of_pics, CLFFT_BACKWARD, layout, &fft_rash_size);
+    prune_fft_input(&fft_rash_size, geometry->image_width, geometry->image_height);
+    clock_t creation_of_helpers_time_end = clock();
+    show_status_string("Time for initiating buffer(helpers) for pics: %f", (float)(creation_of_helpers_time_end-creation_of_helpers_time_start)/CLOCKS_PER_SEC);
+
+    clock_t  sumtime = 0;
+
+    const size_t pic_size_in_bytes = N * floats_per_pixel * sizeof(cl_float);
+
+    for (int i = 0; i < amount_of_pics; i++)
+    {
+        clock_t start_time_load_pic = clock();
+        char filename[64] = {'\0'};
+        make_pic_filename(filename, geometry->image_width, geometry->image_height, i);
+        printf("### filename: %s\n", filename);
+
+        struct Image image;
+        if (decoding != NULL)
+            image = take_decoded_pic(&stages, decoding, i);
+        else
+            image = read_png_file(filename);
+        double upload_start = get_wall_time();
+
+        if (image.row_pointers == NULL || image.width != geometry->image_width || image.height != geometry->image_height)
+        {
+            DeInItCl_Buffer_pair(&all_pics_buffer);
+            if (image.row_pointers != NULL)
+            {
+                for(int l = 0; l < image.height; l++)
+                    free(image.row_pointers[l]);
+                free(image.row_pointers);
+            }
+            free(Array);
+            return all_pics_buffer;
+        }
+
+        // zero-copy: пишем прямо в буфер ( он уже обнулён ), без копии на хосте; через кольцо: декодирование
+        // следующей картинки идёт, пока копируется эта
+        int slot = -1;
+        float *pic = NULL;
+        err = CL_SUCCESS;
+        if (zero_copy_buffers)
+            pic = (float *)clEnqueueMapBuffer(queue, all_pics_buffer.buffers[0], CL_TRUE, CL_MAP_WRITE, pic_size_in_bytes*i,
+                                              pic_size_in_bytes, 0, NULL, NULL, &err);
+        else if ((slot = staging_acquire(&staging, pic_size_in_bytes)) >= 0)
+        {
+            pic = (float *)staging.host[slot];
+            memset(pic, 0, pic_size_in_bytes);
+        }
+        else
+        {
+            // нули за картинкой остаются от calloc: все картинки пишутся в одни и те же точки
+            if (Array == NULL)
+                Array = (float *) calloc(N * floats_per_pixel, sizeof(float));
+            pic = Array;
+            if (Array == NULL)
+                err = CL_OUT_OF_HOST_MEMORY;
+        }
+        if (err != CL_SUCCESS)
+        {
+            printf("Error %d preparing pics[%d] for upload\n", err, i);
+            for(int l = 0; l < image.height; l++)
+                free(image.row_pointers[l]);
+            free(image.row_pointers);
+            DeInItCl_Buffer_pair(&all_pics_buffer);
+            free(Array);
+            return all_pics_buffer;
+        }
+        for (int l = 0; l < image.height; l++)
+        {
+            for (int p = 0; p < image.width; p++)
+                pic[(l*fft_rash_size.sizex+p)*floats_per_pixel] = image.row_pointers[l][p];
+        }
+
+        cl_event write_future = 0;
+        if (zero_copy_buffers)
+            err = clEnqueueUnmapMemObject(queue, all_pics_buffer.buffers[0], pic, 0, NULL, &write_future);
+        else if (slot >= 0)
+            err = staging_upload(&staging, slot, all_pics_buffer.buffers[0], pic_size_in_bytes*i, pic_size_in_bytes);
+        else
+            err = clEnqueueWriteBuffer(queue, all_pics_buffer.buffers[0], CL_FALSE, pic_size_in_bytes*i,
+                                       pic_size_in_bytes, Array, 0, NULL, &write_future);
+
+
+        for(int l = 0; l < image.height; l++)
+            free(image.row_pointers[l]);
+        free(image.row_pointers);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error with pics[%d].buffers[0] clEnqueueWriteBuffer\n", i);
+            if (write_future)
+                clReleaseEvent(write_future);
+            DeInItCl_Buffer_pair(&all_pics_buffer);
+            free(Array);
+            return all_pics_buffer;
+        }
+        // прямая загрузка из Array - ждём её, Array нужен для следующей картинки
+        cl_int err1 = CL_SUCCESS;
+        if (write_future)
+        {
+            err = clWaitForEvents(1, &write_future);
+            err1 = clReleaseEvent(write_future);
+        }
+        if (err != CL_SUCCESS || err1 != CL_SUCCESS)
+        {
+            printf("ERROR with events\n");
+            DeInItCl_Buffer_pair(&all_pics_buffer);
+            free(Array);
+            return all_pics_buffer;
+        }
+
+        stage_record(&stages, STAGE_UPLOAD, upload_start, decoding != NULL ? 1 : 0, decoding != NULL ? &decoding->tasks[i] : NULL);
+        clock_t tmpTime = clock() - start_time_load_pic;
+        sumtime += tmpTime;
+        printf("### %d loaded pic: %f seconds", i+1, (float)tmpTime/CLOCKS_PER_SEC);
+        printf("\n");
+    }
+
+    /// Прямое ПФ для КАРТИНК
+    // загрузки через кольцо идут в очереди передач: ПФ в очереди расчёта ждёт их по событиям
+    staging_hand_off(&staging, queue);
+
+    clock_t fft_start = clock();
+    double fft_wall_start = get_wall_time();
+    if (FFT_2D_OpenCL(&all_pics_buffer, CLFFT_FORWARD, queue, CL_TRUE , &fft_rash_size) == 0)
+    {
+
+        clock_t fft_end = clock();
+        stage_record(&stages, STAGE_FORWARD_FFT, fft_wall_start, 0, NULL);
+        printf("### all pics fft: %f seconds\n", (float)(fft_end - fft_start)/CLOCKS_PER_SEC);
+
+        if (use_spectra_cache &&
+            store_spectra_to_cache(spectra_cache_file, queue, sizex, sizey, amount_of_pics, layout, spectra_key, &all_pics_buffer) == CL_SUCCESS)
+            show_status_string("Spectra of input pics saved to cache %s", spectra_cache_file);
+    }
+    else
+    {
+        printf("Problems w/ FFT\n");
+        DeInItCl_Buffer_pair(&all_pics_buffer);
+    }
+
+    printf("\n");
+    DeInItFFT_OpenCL_data(&fft_rash_size);
+    free(Array);
+    return all_pics_buffer;
+}
+
+#ifdef EMBED_KERNEL_SOURCE
+// генерируется из rash_kernel.cl командой xxd -i ( см. Makefile )
+#include "rash_kernel_embedded.h"
+#endif
+
+// Исходник kernel'ов: либо встроенный в исполняемый файл, либо rash_kernel.cl из текущего каталога
+char *load_kernel_source(size_t *source_size)
+{
+    char *source_str;
+
+#ifdef EMBED_KERNEL_SOURCE
+    source_str = (char*)malloc(rash_kernel_cl_len + 1);
+    memcpy(source_str, rash_kernel_cl, rash_kernel_cl_len);
+    *source_size = rash_kernel_cl_len;
+#else
+    FILE *rash_kernel;
+
+    /// Открываем файл с kernel на чтение
+    rash_kernel = fopen("rash_kernel.cl", "r");
+    if (!rash_kernel)
+    {
+        fprintf(stderr, "Failed to load kernel.\n");
+        return NULL;
+    }
+    source_str = (char*)malloc(MAX_SOURCE_SIZE + 1);
+    *source_size = fread( source_str, 1, MAX_SOURCE_SIZE, rash_kernel);
+    fclose(rash_kernel);
+#endif
+
+    source_str[*source_size] = '\0';
+    return source_str;
+}
+
+void print_program_build_log(cl_program program, cl_device_id device)
+{
+    size_t source_size_log;
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0 , NULL, &source_size_log);
+    char *log= malloc(sizeof(char) * source_size_log);
+    clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, source_size_log, log, &source_size_log);
+    printf("%s\n", log);
+    free(log);
+}
+
+/// КЭШ СКОМПИЛИРОВАННЫХ ПРОГРАММ
+// Бинарник действителен только для того же устройства, той же версии драйвера,
+// тех же опций сборки и того же исходника - всё это входит в ключ ( и в имя файла ).
+
+uint64_t program_cache_key(cl_device_id device, const char *build_options, const char *source_str, size_t source_size)
+{
+    char device_name[128] = {'\0'};
+    char driver_version[128] = {'\0'};
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver_version), driver_version, NULL);
+
+    if (build_options == NULL)
+        build_options = "";
+
+    uint64_t hash = FNV1A_OFFSET_BASIS;
+    hash = fnv1a_update(hash, device_name, strlen(device_name) + 1);
+    hash = fnv1a_update(hash, driver_version, strlen(driver_version) + 1);
+    hash = fnv1a_update(hash, build_options, strlen(build_options) + 1);
+    hash = fnv1a_update(hash, source_str, source_size);
+    return hash;
+}
+
+cl_program load_program_from_cache(const char *path, cl_context ctx, cl_device_id device, const char *build_options)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return 0;
+
+    fseek(fp, 0, SEEK_END);
+    long binary_size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (binary_size <= 0)
+    {
+        fclose(fp);
+        return 0;
+    }
+
+    unsigned char *binary = (unsigned char *)malloc(binary_size);
+    size_t read_bytes = fread(binary, 1, binary_size, fp);
+    fclose(fp);
+    if (read_bytes != (size_t)binary_size)
+    {
+        free(binary);
+        return 0;
+    }
+
+    cl_int ret, binary_status;
+    size_t binary_length = binary_size;
+    cl_program program = clCreateProgramWithBinary(ctx, 1, &device, &binary_length, (const unsigned char **)&binary,
+                                                   &binary_status, &ret);
+    free(binary);
+    if (ret != CL_SUCCESS || binary_status != CL_SUCCESS)
+    {
+        if (program)
+            clReleaseProgram(program);
+        return 0;
+    }
+
+    // даже для бинарника нужен clBuildProgram, но он почти ничего не стоит
+    ret = clBuildProgram(program, 1, &device, build_options, NULL, NULL);
+    if (ret != CL_SUCCESS)
+    {
+        clReleaseProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+cl_int store_program_to_cache(const char *path, cl_program program)
+{
+    size_t binary_size = 0;
+    cl_int ret = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binary_size), &binary_size, NULL);
+    if (ret != CL_SUCCESS || binary_size == 0)
+        return ret != CL_SUCCESS ? ret : CL_INVALID_BINARY;
+
+    unsigned char *binary = (unsigned char *)malloc(binary_size);
+    ret = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL);
+    if (ret != CL_SUCCESS)
+    {
+        free(binary);
+        return ret;
+    }
+
+    char tmp_path[1024] = {'\0'};
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp)
+    {
+        printf("store_program_to_cache: could not create %s\n", tmp_path);
+        free(binary);
+        return CL_INVALID_VALUE;
+    }
+    size_t written = fwrite(binary, 1, binary_size, fp);
+    fclose(fp);
+    free(binary);
+
+    if (written != binary_size || rename(tmp_path, path) != 0)
+    {
+        printf("store_program_to_cache: could not write %s\n", path);
+        unlink(tmp_path);
+        return CL_INVALID_VALUE;
+    }
+    return CL_SUCCESS;
+}
+
+cl_program init_kernel_program(cl_context ctx, cl_device_id device, const char *build_options)
+{
+    // Execute the OpenCL kernel on the list
+    cl_int ret;
+    char *source_str;
+    size_t source_size = 0;
+    char program_cache_file[1024] = {'\0'};
+
+    source_str = load_kernel_source(&source_size);
+    if (source_str == NULL)
+        return 0;
+
+    clock_t build_start = clock();
+
+    /// Сначала пробуем взять уже скомпилированную программу из кэша
+    if (options.kernel_cache_dir != NULL)
+    {
+        uint64_t key = program_cache_key(device, build_options, source_str, source_size);
+        snprintf(program_cache_file, sizeof(program_cache_file), "%s/rash_kernel_%016"PRIx64".bin", options.kernel_cache_dir, key);
+
+        cl_program cached_program = load_program_from_cache(program_cache_file, ctx, device, build_options);
+        if (cached_program != 0)
+        {
+            show_status_string("Kernel program loaded from cache %s: %f", program_cache_file, (float)(clock() - build_start)/CLOCKS_PER_SEC);
+            free(source_str);
+            return cached_program;
+        }
+    }
+
+    // Create program
+    cl_program program = clCreateProgramWithSource(ctx, 1, (const char **)&source_str, &source_size, &ret);
+    free(source_str);
+    source_str = NULL;
+    if (ret != CL_SUCCESS)
+    {
+        printf("Problems w/ creating program\n");
+        return 0;
+    }
+
+    // Build the program
+    ret = clBuildProgram(program, 1, &device, build_options, NULL, NULL);
+
+    /// в случае ошибок выводим log
+    if(ret != CL_SUCCESS)
+    {
+        printf("Problems w/ building program\n");
+        print_program_build_log(program, device);
+        clReleaseProgram(program);
+        return 0;
+    }
+    show_status_string("Kernel program built from source: %f", (float)(clock() - build_start)/CLOCKS_PER_SEC);
+
+    if (options.kernel_cache_dir != NULL && store_program_to_cache(program_cache_file, program) == CL_SUCCESS)
+        show_status_string("Kernel program saved to cache %s", program_cache_file);
+
+    return program;
+}
+
+
+
+/// ВАРИАНТЫ ПРОГРАММЫ
+// rash_kernel.cl собирается под конкретную задачу: размеры, нормировка и оптика
+// подставляются через -D, и компилятор сворачивает индексную арифметику и константы.
+// Каждый набор опций собирается один раз за запуск ( и один раз вообще при --kernel-cache ).
+
+struct Kernel_config {
+    // размер h ( исходной картинки )
+    int h_sizex;
+    int h_sizey;
+    // нормировка модуля в add_normalized_abs_part_kernel
+    float scaling;
+    // 0 - размеры и нормировка передаются только аргументами kernel'ов
+    int specialized;
+    // -cl-fast-relaxed-math и native_* функции
+    int fast_math;
+    // размер ПФ для встроенных kernel'ов пары, 0 - передаётся аргументом
+    int fft_sizex;
+    int fft_sizey;
+};
+
+int is_power_of_two(int value)
+{
+    return value > 0 && (value & (value - 1)) == 0;
+}
+
+int int_log2(int value)
+{
+    int log2 = 0;
+    while ((1 << (log2 + 1)) <= value)
+        log2++;
+    return log2;
+}
+
+void make_build_options(char *build_options, size_t size, const struct Kernel_config *config)
+{
+    int length = snprintf(build_options, size, "-D DEFOCUS_COEF=%.9ef -D PUPIL_RADIUS=%.9ef -D PUPIL_PHASE_COEF=%.9ef",
+                          options.defocus_coef, options.pupil_radius, options.pupil_phase_coef);
+
+    if (config->fast_math)
+        length += snprintf(build_options + length, size - length, " -cl-fast-relaxed-math -D USE_NATIVE_MATH");
+
+    if (config->specialized)
+    {
+        length += snprintf(build_options + length, size - length, " -D H_SIZEX=%d -D H_SIZEY=%d -D ABS_SCALING=%.9ef",
+                           config->h_sizex, config->h_sizey, config->scaling);
+        if (is_power_of_two(config->h_sizex))
+            length += snprintf(build_options + length, size - length, " -D H_SIZEX_LOG2=%d", int_log2(config->h_sizex));
+        if (config->fft_sizex > 0)
+            snprintf(build_options + length, size - length, " -D FFT_SIZEX=%d -D FFT_SIZEY=%d", config->fft_sizex, config->fft_sizey);
+    }
+}
+
+#define MAX_PROGRAM_VARIANTS 16
+
+struct Program_variant {
+    char build_options[512];
+    struct Kernel_config config;
+    cl_program program;
+};
+
+struct Program_variant program_variants[MAX_PROGRAM_VARIANTS];
+int amount_of_program_variants = 0;
+
+// возвращает программу, собранную с данными опциями; вызывающий владеет своей ссылкой ( clReleaseProgram )
+cl_program get_program_variant(cl_context ctx, cl_device_id device, const struct Kernel_config *config)
+{
+    char build_options[512] = {'\0'};
+    make_build_options(build_options, sizeof(build_options), config);
+
+    for (int i = 0; i < amount_of_program_variants; i++)
+    {
+        if (strcmp(program_variants[i].build_options, build_options) == 0)
+        {
+            clRetainProgram(program_variants[i].program);
+            return program_variants[i].program;
+        }
+    }
+
+    show_status_string("Building kernels with: %s", build_options);
+    cl_program program = init_kernel_program(ctx, device, build_options);
+    if (program == 0 || amount_of_program_variants == MAX_PROGRAM_VARIANTS)
+        return program;
+
+    strcpy(program_variants[amount_of_program_variants].build_options, build_options);
+    program_variants[amount_of_program_variants].config = *config;
+    program_variants[amount_of_program_variants].program = program;
+    amount_of_program_variants++;
+    clRetainProgram(program);
+    return program;
+}
+
+void release_program_variants(void)
+{
+    set_builtin_fft_program(0);
+    for (int i = 0; i < amount_of_program_variants; i++)
+        clReleaseProgram(program_variants[i].program);
+    memset(program_variants, 0, sizeof(program_variants));
+    amount_of_program_variants = 0;
+}
+
+/// БАЗА ПОДОБРАННЫХ РАЗМЕРОВ РАБОЧЕЙ ГРУППЫ
+// Для каждого ( устройство, kernel, сборка, глобальный размер ) хранится лучший локальный размер,
+// найденный перебором; local[0] == 0 значит, что выбор драйвера ( NULL ) оказался лучше.
+// Сборка - вариант программы ( specialized / generic, fast-math, размеры встроенного ПФ ): другой
+// код kernel'а может требовать другого размера группы.
+// Файл текстовый: device|kernel|build|gx|gy|lx|ly|tuned_time|default_time
+
+#define MAX_TUNING_ENTRIES 256
+
+struct Tuning_entry {
+    char device_name[128];
+    char kernel_name[64];
+    char build[64];
+    size_t global_size[2];
+    size_t local_size[2];
+    float tuned_time;
+    float default_time;
+};
+
+struct Tuning_db {
+    struct Tuning_entry entries[MAX_TUNING_ENTRIES];
+    int count;
+    char device_name[128];
+};
+
+struct Tuning_db tuning_db;
+
+void load_tuning_db(const char *path, cl_device_id device)
+{
+    memset(&tuning_db, 0, sizeof(tuning_db));
+    clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(tuning_db.device_name), tuning_db.device_name, NULL);
+
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return;
+
+    char line[512];
+    while (fgets(line, sizeof(line), fp) && tuning_db.count < MAX_TUNING_ENTRIES)
+    {
+        struct Tuning_entry *entry = &tuning_db.entries[tuning_db.count];
+        if (sscanf(line, "%127[^|]|%63[^|]|%63[^|]|%zu|%zu|%zu|%zu|%f|%f", entry->device_name, entry->kernel_name,
+                   entry->build, &entry->global_size[0], &entry->global_size[1], &entry->local_size[0],
+                   &entry->local_size[1], &entry->tuned_time, &entry->default_time) == 9)
+            tuning_db.count++;
+    }
+    fclose(fp);
+}
+
+void save_tuning_db(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+    {
+        printf("save_tuning_db: could not write %s\n", path);
+        return;
+    }
+    for (int i = 0; i < tuning_db.count; i++)
+    {
+        struct Tuning_entry *entry = &tuning_db.entries[i];
+        fprintf(fp, "%s|%s|%s|%zu|%zu|%zu|%zu|%g|%g\n", entry->device_name, entry->kernel_name, entry->build,
+                entry->global_size[0], entry->global_size[1], entry->local_size[0], entry->local_size[1],
+                entry->tuned_time, entry->default_time);
+    }
+    fclose(fp);
+}
+
+// Сборка, из которой взят kernel ( по варианту его программы ), "other" - программа не из вариантов
+void tuning_build_key(cl_kernel kernel, char *build, size_t size)
+{
+    cl_program program = 0;
+    snprintf(build, size, "other");
+    if (clGetKernelInfo(kernel, CL_KERNEL_PROGRAM, sizeof(program), &program, NULL) != CL_SUCCESS)
+        return;
+    for (int i = 0; i < amount_of_program_variants; i++)
+        if (program_variants[i].program == program)
+        {
+            const struct Kernel_config *config = &program_variants[i].config;
+            int length = snprintf(build, size, "%s%s", config->specialized ? "specialized" : "generic",
+                                  config->fast_math ? ",fast-math" : "");
+            if (config->specialized && config->fft_sizex > 0)
+                snprintf(build + length, size - length, ",fft%dx%d", config->fft_sizex, config->fft_sizey);
+            return;
+        }
+}
+
+struct Tuning_entry *find_tuning_entry(cl_kernel kernel, const char *kernel_name, cl_uint work_dim, const size_t *global_size)
+{
+    if (tuning_db.count == 0)
+        return NULL;
+    char build[64];
+    tuning_build_key(kernel, build, sizeof(build));
+    size_t global_y = work_dim > 1 ? global_size[1] : 1;
+    for (int i = 0; i < tuning_db.count; i++)
+    {
+        struct Tuning_entry *entry = &tuning_db.entries[i];
+        if (entry->global_size[0] == global_size[0] && entry->global_size[1] == global_y &&
+            strcmp(entry->kernel_name, kernel_name) == 0 && strcmp(entry->build, build) == 0 &&
+            strcmp(entry->device_name, tuning_db.device_name) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+// локальный размер для clEnqueueNDRangeKernel: подобранный, либо NULL ( решает драйвер )
+const size_t *tuned_local_size(cl_kernel kernel, const char *kernel_name, cl_uint work_dim, const size_t *global_size)
+{
+    struct Tuning_entry *entry = find_tuning_entry(kernel, kernel_name, work_dim, global_size);
+    if (entry == NULL || entry->local_size[0] == 0)
+        return NULL;
+    return entry->local_size;
+}
+
+/// KERNEL'Ы ДЛЯ ОДНОЙ ПАРЫ ( картинка n, h_|n-m| )
+// multiply -> обратное ПФ -> модуль с накоплением в result_CL, в нужной раскладке
+
+struct Pair_kernels {
+    enum Data_layout layout;
+    enum Spectrum_precision precision;
+    // масштабы срезов картинок и h для PRECISION_HALF ( NULL - множитель 1 )
+    const float *image_scales;
+    const float *h_scales;
+    cl_kernel multiply_kernel;
+    cl_kernel add_abs_kernel;
+    const char *multiply_kernel_name;
+    const char *add_abs_kernel_name;
+    // сколько work-item'ов на матрицу: N для planar, N/2 для interleaved ( по два числа на float4 )
+    size_t global_size;
+    // встроенное ПФ слито с парой ( fuse_pair_kernels ): multiply_kernel - multiply_fft_cols_kernel,
+    // add_abs_kernel - fft_abs_rows_kernel, отдельного обратного ПФ нет
+    int fused;
+    size_t cols_global_size;
+    size_t cols_local_size;
+    size_t rows_global_size;
+    size_t rows_local_size;
+    // h хранятся компактно ( compact_h_rash ): multiply_kernel - multiply_sparse_kernel по сетке sizex x sizey
+    int sparse;
+    size_t sparse_global_size[2];
+    // привязанная таблица h ( bind_h_table ): на пару меняется только смещение k * h_stride
+    int h_table_bound;
+    cl_ulong h_stride;
+    // записанная пара ( record_pair ), replay.ready - пары идут повтором записи
+    struct Command_recorder replay;
+};
+
+cl_int InitPair_kernels(cl_program program, enum Data_layout layout, enum Spectrum_precision precision, size_t N,
+                        struct Cl_Buffer_pair *images, struct Cl_Buffer_pair *result_part, float scaling, cl_mem result_CL,
+                        struct Pair_kernels *kernels)
+{
+    cl_int ret = CL_SUCCESS;
+    memset(kernels, 0, sizeof(*kernels));
+    kernels->layout = layout;
+    kernels->precision = precision;
+    // у half варианта multiply перед результатом стоит ещё один аргумент - масштаб
+    cl_uint result_arg_shift = precision == PRECISION_HALF ? 1 : 0;
+    // пока таблица h не привязана, каждый h - отдельный буфер
+    cl_ulong h_offset = 0;
+
+    if (layout == LAYOUT_INTERLEAVED)
+    {
+        kernels->global_size = N / 2;
+        kernels->multiply_kernel_name = precision == PRECISION_HALF ? "multiply_half_interleaved_kernel" : "multiply_interleaved_kernel";
+        kernels->add_abs_kernel_name = "add_normalized_abs_interleaved_kernel";
+        kernels->multiply_kernel = clCreateKernel(program, kernels->multiply_kernel_name, &ret);
+        if (ret != CL_SUCCESS)
+            return ret;
+        kernels->add_abs_kernel = clCreateKernel(program, kernels->add_abs_kernel_name, &ret);
+        if (ret != CL_SUCCESS)
+            return ret;
+
+        ret |= clSetKernelArg(kernels->multiply_kernel, 0, sizeof(cl_mem), &images->buffers[0]);
+        ret |= clSetKernelArg(kernels->multiply_kernel, 3, sizeof(h_offset), &h_offset);
+        ret |= clSetKernelArg(kernels->multiply_kernel, 4 + result_arg_shift, sizeof(cl_mem), &result_part->buffers[0]);
+
+        ret |= clSetKernelArg(kernels->add_abs_kernel, 0, sizeof(cl_mem), &result_part->buffers[0]);
+        ret |= clSetKernelArg(kernels->add_abs_kernel, 1, sizeof(scaling), &scaling);
+        ret |= clSetKernelArg(kernels->add_abs_kernel, 2, sizeof(cl_mem), &result_CL);
+    }
+    else
+    {
+        kernels->global_size = N;
+        kernels->multiply_kernel_name = precision == PRECISION_HALF ? "multiply_half_kernel" : "multiply_kernel";
+        kernels->add_abs_kernel_name = "add_normalized_abs_part_kernel";
+        kernels->multiply_kernel = clCreateKernel(program, kernels->multiply_kernel_name, &ret);
+        if (ret != CL_SUCCESS)
+            return ret;
+        kernels->add_abs_kernel = clCreateKernel(program, kernels->add_abs_kernel_name, &ret);
+        if (ret != CL_SUCCESS)
+            return ret;
+
+        ret |= clSetKernelArg(kernels->multiply_kernel, 0, sizeof(cl_mem), &images->buffers[0]);
+        ret |= clSetKernelArg(kernels->multiply_kernel, 1, sizeof(cl_mem), &images->buffers[1]);
+        ret |= clSetKernelArg(kernels->multiply_kernel, 5, sizeof(h_offset), &h_offset);
+        ret |= clSetKernelArg(kernels->multiply_kernel, 6 + result_arg_shift, sizeof(cl_mem), &result_part->buffers[0]);
+        ret |= clSetKernelArg(kernels->multiply_kernel, 7 + result_arg_shift, sizeof(cl_mem), &result_part->buffers[1]);
+
+        ret |= clSetKernelArg(kernels->add_abs_kernel, 0, sizeof(cl_mem), &result_part->buffers[0]);
+        ret |= clSetKernelArg(kernels->add_abs_kernel, 1, sizeof(cl_mem), &result_part->buffers[1]);
+        ret |= clSetKernelArg(kernels->add_abs_kernel, 2, sizeof(scaling), &scaling);
+        ret |= clSetKernelArg(kernels->add_abs_kernel, 3, sizeof(cl_mem), &result_CL);
+    }
+
+    if (ret != CL_SUCCESS)
+        printf("InitPair_kernels: Problems w/ setting KernelArgs\n");
+    return ret;
+}
+
+// Встроенное ПФ: multiply + обратное ПФ + abs пары двумя kernel'ами с прореживанием по fft->output_*.
+// Только для float спектров, иначе ( и при clFFT ) пара остаётся как есть
+cl_int fuse_pair_kernels(struct Pair_kernels *kernels, cl_program program, struct FFT_OpenCL_data *fft,
+                         struct Cl_Buffer_pair *images, struct Cl_Buffer_pair *result_part, float scaling, cl_mem result_CL)
+{
+    cl_int ret = CL_SUCCESS;
+    if (fft->lines_kernel == 0 || kernels->precision != PRECISION_FLOAT)
+        return CL_SUCCESS;
+
+    int interleaved = kernels->layout == LAYOUT_INTERLEAVED;
+    cl_mem images_imag = interleaved ? images->buffers[0] : images->buffers[1];
+    cl_mem result_part_imag = interleaved ? result_part->buffers[0] : result_part->buffers[1];
+    int complex_pitch = interleaved ? 2 : 1;
+    int imag_offset = interleaved ? 1 : 0;
+    cl_ulong h_offset = 0;
+
+    cl_kernel multiply_fft_kernel = clCreateKernel(program, "multiply_fft_cols_kernel", &ret);
+    if (ret != CL_SUCCESS)
+        return ret;
+    cl_kernel fft_abs_kernel = clCreateKernel(program, "fft_abs_rows_kernel", &ret);
+    if (ret != CL_SUCCESS)
+    {
+        clReleaseKernel(multiply_fft_kernel);
+        return ret;
+    }
+
+    ret |= clSetKernelArg(multiply_fft_kernel, 0, sizeof(cl_mem), &images->buffers[0]);
+    ret |= clSetKernelArg(multiply_fft_kernel, 1, sizeof(cl_mem), &images_imag);
+    ret |= clSetKernelArg(multiply_fft_kernel, 5, sizeof(h_offset), &h_offset);
+    ret |= clSetKernelArg(multiply_fft_kernel, 6, sizeof(cl_mem), &result_part->buffers[0]);
+    ret |= clSetKernelArg(multiply_fft_kernel, 7, sizeof(cl_mem), &result_part_imag);
+    ret |= clSetKernelArg(multiply_fft_kernel, 8, sizeof(complex_pitch), &complex_pitch);
+    ret |= clSetKernelArg(multiply_fft_kernel, 9, sizeof(imag_offset), &imag_offset);
+    ret |= clSetKernelArg(multiply_fft_kernel, 10, sizeof(fft->sizex), &fft->sizex);
+    ret |= clSetKernelArg(multiply_fft_kernel, 11, sizeof(fft->sizey), &fft->sizey);
+    ret |= clSetKernelArg(multiply_fft_kernel, 12, sizeof(fft->output_y0), &fft->output_y0);
+    ret |= clSetKernelArg(multiply_fft_kernel, 13, sizeof(fft->output_height), &fft->output_height);
+    ret |= clSetKernelArg(multiply_fft_kernel, 14, fft->sizey * sizeof(cl_float2), NULL);
+
+    ret |= clSetKernelArg(fft_abs_kernel, 0, sizeof(cl_mem), &result_part->buffers[0]);
+    ret |= clSetKernelArg(fft_abs_kernel, 1, sizeof(cl_mem), &result_part_imag);
+    ret |= clSetKernelArg(fft_abs_kernel, 2, sizeof(complex_pitch), &complex_pitch);
+    ret |= clSetKernelArg(fft_abs_kernel, 3, sizeof(imag_offset), &imag_offset);
+    ret |= clSetKernelArg(fft_abs_kernel, 4, sizeof(fft->sizex), &fft->sizex);
+    ret |= clSetKernelArg(fft_abs_kernel, 5, sizeof(fft->output_y0), &fft->output_y0);
+    ret |= clSetKernelArg(fft_abs_kernel, 6, sizeof(fft->output_x0), &fft->output_x0);
+    ret |= clSetKernelArg(fft_abs_kernel, 7, sizeof(fft->output_width), &fft->output_width);
+    ret |= clSetKernelArg(fft_abs_kernel, 8, sizeof(fft->backward_scale), &fft->backward_scale);
+    ret |= clSetKernelArg(fft_abs_kernel, 9, sizeof(scaling), &scaling);
+    ret |= clSetKernelArg(fft_abs_kernel, 10, sizeof(cl_mem), &result_CL);
+    ret |= clSetKernelArg(fft_abs_kernel, 11, fft->sizex * sizeof(cl_float2), NULL);
+    if (ret != CL_SUCCESS)
+    {
+        printf("fuse_pair_kernels: Problems w/ setting KernelArgs\n");
+        clReleaseKernel(fft_abs_kernel);
+        clReleaseKernel(multiply_fft_kernel);
+        return ret;
+    }
+
+    clReleaseKernel(kernels->multiply_kernel);
+    clReleaseKernel(kernels->add_abs_kernel);
+    kernels->multiply_kernel = multiply_fft_kernel;
+    kernels->add_abs_kernel = fft_abs_kernel;
+    kernels->multiply_kernel_name = "multiply_fft_cols_kernel";
+    kernels->add_abs_kernel_name = "fft_abs_rows_kernel";
+    kernels->fused = 1;
+    kernels->cols_local_size = fft->col_local_size;
+    kernels->cols_global_size = fft->sizex * fft->col_local_size;
+    kernels->rows_local_size = fft->row_local_size;
+    kernels->rows_global_size = fft->output_height * fft->row_local_size;
+    return CL_SUCCESS;
+}
+
+// multiply пары по компактным h ( compact_h_rash ), только для float спектров и без слияния с ПФ
+cl_int sparse_pair_kernels(struct Pair_kernels *kernels, cl_program program, struct Cl_Buffer_pair *images,
+                           struct Cl_Buffer_pair *result_part, int sizex, int sizey)
+{
+    cl_int ret = CL_SUCCESS;
+    if (kernels->fused || kernels->precision != PRECISION_FLOAT)
+        return CL_INVALID_OPERATION;
+
+    int interleaved = kernels->layout == LAYOUT_INTERLEAVED;
+    cl_mem images_imag = interleaved ? images->buffers[0] : images->buffers[1];
+    cl_mem result_part_imag = interleaved ? result_part->buffers[0] : result_part->buffers[1];
+    int complex_pitch = interleaved ? 2 : 1;
+    int imag_offset = interleaved ? 1 : 0;
+
+    cl_kernel sparse_kernel = clCreateKernel(program, "multiply_sparse_kernel", &ret);
+    if (ret != CL_SUCCESS)
+        return ret;
+    ret |= clSetKernelArg(sparse_kernel, 0, sizeof(cl_mem), &images->buffers[0]);
+    ret |= clSetKernelArg(sparse_kernel, 1, sizeof(cl_mem), &images_imag);
+    ret |= clSetKernelArg(sparse_kernel, 5, sizeof(complex_pitch), &complex_pitch);
+    ret |= clSetKernelArg(sparse_kernel, 6, sizeof(imag_offset), &imag_offset);
+    ret |= clSetKernelArg(sparse_kernel, 7, sizeof(cl_mem), &result_part->buffers[0]);
+    ret |= clSetKernelArg(sparse_kernel, 8, sizeof(cl_mem), &result_part_imag);
+    if (ret != CL_SUCCESS)
+    {
+        printf("sparse_pair_kernels: Problems w/ setting KernelArgs\n");
+        clReleaseKernel(sparse_kernel);
+        return ret;
+    }
+
+    clReleaseKernel(kernels->multiply_kernel);
+    kernels->multiply_kernel = sparse_kernel;
+    kernels->multiply_kernel_name = "multiply_sparse_kernel";
+    kernels->sparse = 1;
+    kernels->sparse_global_size[0] = sizex;
+    kernels->sparse_global_size[1] = sizey;
+    return CL_SUCCESS;
+}
+
+void DeInitPair_kernels(struct Pair_kernels *kernels)
+{
+    if (kernels->multiply_kernel)
+        clReleaseKernel(kernels->multiply_kernel);
+    if (kernels->add_abs_kernel)
+        clReleaseKernel(kernels->add_abs_kernel);
+    DeInitCommand_recorder(&kernels->replay);
+    memset(kernels, 0, sizeof(*kernels));
+}
+
+// Таблица h ( generate_h_rash с H_table ) привязывается к multiply один раз; не для sparse
+cl_int bind_h_table(struct Pair_kernels *kernels, struct H_table *table)
+{
+    cl_int ret = CL_SUCCESS;
+    if (kernels->sparse)
+        return CL_INVALID_OPERATION;
+    int interleaved = kernels->layout == LAYOUT_INTERLEAVED;
+    cl_mem h_imag = interleaved ? table->table.buffers[0] : table->table.buffers[1];
+    if (kernels->fused || !interleaved)
+    {
+        ret |= clSetKernelArg(kernels->multiply_kernel, 3, sizeof(cl_mem), &table->table.buffers[0]);
+        ret |= clSetKernelArg(kernels->multiply_kernel, 4, sizeof(cl_mem), &h_imag);
+    }
+    else
+        ret |= clSetKernelArg(kernels->multiply_kernel, 2, sizeof(cl_mem), &table->table.buffers[0]);
+    if (ret == CL_SUCCESS)
+    {
+        kernels->h_table_bound = 1;
+        kernels->h_stride = table->stride;
+    }
+    return ret;
+}
+
+// image_offset - начало картинки в all_pics_buffer ( в комплексных числах ), k - номер h ( |n-m| ), h - его спектр
+// ( при kernels->sparse - компактный: buffers[0] значения, buffers[1] границы строк; при привязанной таблице
+// не нужен ), input_scale - произведение масштабов срезов картинки и h ( используется только в PRECISION_HALF )
+cl_int set_multiply_inputs(struct Pair_kernels *kernels, cl_ulong image_offset, int k, struct Cl_Buffer_pair *h,
+                           float input_scale)
+{
+    cl_int ret = CL_SUCCESS;
+    cl_ulong h_offset = kernels->h_table_bound ? k * kernels->h_stride : 0;
+    int bind_h = !kernels->h_table_bound;
+
+    if (kernels->sparse)
+    {
+        ret |= clSetKernelArg(kernels->multiply_kernel, 2, sizeof(image_offset), &image_offset);
+        ret |= clSetKernelArg(kernels->multiply_kernel, 3, sizeof(cl_mem), &h->buffers[0]);
+        ret |= clSetKernelArg(kernels->multiply_kernel, 4, sizeof(cl_mem), &h->buffers[1]);
+    }
+    else if (kernels->fused)
+    {
+        ret |= clSetKernelArg(kernels->multiply_kernel, 2, sizeof(image_offset), &image_offset);
+        if (bind_h)
+        {
+            cl_mem h_imag = kernels->layout == LAYOUT_INTERLEAVED ? h->buffers[0] : h->buffers[1];
+            ret |= clSetKernelArg(kernels->multiply_kernel, 3, sizeof(cl_mem), &h->buffers[0]);
+            ret |= clSetKernelArg(kernels->multiply_kernel, 4, sizeof(cl_mem), &h_imag);
+        }
+        ret |= clSetKernelArg(kernels->multiply_kernel, 5, sizeof(h_offset), &h_offset);
+    }
+    else if (kernels->layout == LAYOUT_INTERLEAVED)
+    {
+        ret |= clSetKernelArg(kernels->multiply_kernel, 1, sizeof(image_offset), &image_offset);
+        if (bind_h)
+            ret |= clSetKernelArg(kernels->multiply_kernel, 2, sizeof(cl_mem), &h->buffers[0]);
+        ret |= clSetKernelArg(kernels->multiply_kernel, 3, sizeof(h_offset), &h_offset);
+        if (kernels->precision == PRECISION_HALF)
+            ret |= clSetKernelArg(kernels->multiply_kernel, 4, sizeof(input_scale), &input_scale);
+    }
+    else
+    {
+        ret |= clSetKernelArg(kernels->multiply_kernel, 2, sizeof(image_offset), &image_offset);
+        if (bind_h)
+        {
+            ret |= clSetKernelArg(kernels->multiply_kernel, 3, sizeof(cl_mem), &h->buffers[0]);
+            ret |= clSetKernelArg(kernels->multiply_kernel, 4, sizeof(cl_mem), &h->buffers[1]);
+        }
+        ret |= clSetKernelArg(kernels->multiply_kernel, 5, sizeof(h_offset), &h_offset);
+        if (kernels->precision == PRECISION_HALF)
+            ret |= clSetKernelArg(kernels->multiply_kernel, 6, sizeof(input_scale), &input_scale);
+    }
+    return ret;
+}
+
+cl_int enqueue_multiply(struct Pair_kernels *kernels, cl_command_queue queue)
+{
+    if (kernels->fused)
+        return enqueue_kernel(queue, kernels->multiply_kernel, 1, &kernels->cols_global_size, &kernels->cols_local_size);
+    if (kernels->sparse)
+        return enqueue_kernel(queue, kernels->multiply_kernel, 2, kernels->sparse_global_size,
+                              tuned_local_size(kernels->multiply_kernel, kernels->multiply_kernel_name, 2,
+                                               kernels->sparse_global_size));
+    return enqueue_kernel(queue, kernels->multiply_kernel, 1, &kernels->global_size,
+                          tuned_local_size(kernels->multiply_kernel, kernels->multiply_kernel_name, 1, &kernels->global_size));
+}
+
+cl_int enqueue_add_abs(struct Pair_kernels *kernels, cl_command_queue queue)
+{
+    if (kernels->fused)
+        return enqueue_kernel(queue, kernels->add_abs_kernel, 1, &kernels->rows_global_size, &kernels->rows_local_size);
+    return enqueue_kernel(queue, kernels->add_abs_kernel, 1, &kernels->global_size,
+                          tuned_local_size(kernels->add_abs_kernel, kernels->add_abs_kernel_name, 1, &kernels->global_size));
+}
+
+// Пара ( multiply, обратное встроенное ПФ, abs ) записывается один раз; на пару меняются только смещения
+// картинки и h в таблице. Нужны привязанная таблица h, float спектры и встроенное ПФ ( или слитая пара )
+cl_int record_pair(struct Pair_kernels *kernels, cl_command_queue queue, struct Cl_Buffer_pair *result_part,
+                   struct FFT_OpenCL_data *fft)
+{
+    if (!kernels->h_table_bound || kernels->sparse || kernels->precision != PRECISION_FLOAT ||
+        (!kernels->fused && !fft->lines_kernel))
+        return CL_INVALID_OPERATION;
+
+    cl_int err = set_multiply_inputs(kernels, 0, 0, NULL, 1.0f);
+    if (err == CL_SUCCESS)
+        err = begin_recording(&kernels->replay, queue);
+    if (err != CL_SUCCESS)
+        return err;
+    err = enqueue_multiply(kernels, queue);
+    if (err == CL_SUCCESS && !kernels->fused)
+        err = builtin_fft_2d(result_part, CLFFT_BACKWARD, queue, fft);
+    if (err == CL_SUCCESS)
+        err = enqueue_add_abs(kernels, queue);
+    cl_int err1 = end_recording(&kernels->replay);
+    if (err == CL_SUCCESS)
+        err = err1;
+    if (err != CL_SUCCESS)
+        DeInitCommand_recorder(&kernels->replay);
+    return err;
+}
+
+// Повтор записанной пары для картинки со смещением image_offset и h номер k в таблице
+cl_int replay_pair(struct Pair_kernels *kernels, cl_ulong image_offset, int k)
+{
+    cl_ulong h_offset = k * kernels->h_stride;
+    // номера аргументов смещений у multiply ( см. set_multiply_inputs )
+    int interleaved = !kernels->fused && kernels->layout == LAYOUT_INTERLEAVED;
+    struct Recorded_arg args[2] = {
+        {interleaved ? 1 : 2, sizeof(image_offset), &image_offset},
+        {interleaved ? 3 : 5, sizeof(h_offset), &h_offset},
+    };
+    return replay_recording(&kernels->replay, 0, 2, args);
+}
+
+// Среднее время ( сек ) одного запуска h_init_kernel и multiply + abs для данной программы
+// на уже заполненных буферах. Результаты в result_part_CL и result_CL портятся.
+float benchmark_kernel_program(cl_program program, cl_command_queue queue, enum Data_layout layout, enum Spectrum_precision precision,
+                               int h_sizex, int h_sizey, size_t N, float scaling, struct Cl_Buffer_pair *all_pics_buffer,
+                               struct Cl_Buffer_pair *h_rash, struct Cl_Buffer_pair *result_part_CL, cl_mem result_CL, cl_mem h_scratch)
+{
+    const int repeats = 10;
+    cl_int ret = CL_SUCCESS;
+
+    struct Pair_kernels pair_kernels;
+    ret = InitPair_kernels(program, layout, precision, N, all_pics_buffer, result_part_CL, scaling, result_CL, &pair_kernels);
+    ret |= set_multiply_inputs(&pair_kernels, 0, 0, h_rash, 1.0f);
+
+    // h_init пишет re и im подряд в h_scratch ( нужно 2 * half_N чисел )
+    cl_kernel h_init_kernel = clCreateKernel(program, "h_init_kernel", &ret);
+    size_t half_N = (size_t)h_sizex * h_sizey;
+    cl_buffer_region imag_region = {half_N * sizeof(cl_float), half_N * sizeof(cl_float)};
+    cl_mem h_scratch_imag = clCreateSubBuffer(h_scratch, CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &imag_region, &ret);
+
+    float delta_z = M_PI;
+    ret |= clSetKernelArg(h_init_kernel, 0, sizeof(delta_z), &delta_z);
+    ret |= clSetKernelArg(h_init_kernel, 1, sizeof(cl_mem), &h_scratch);
+    ret |= clSetKernelArg(h_init_kernel, 2, sizeof(cl_mem), &h_scratch_imag);
+    if (ret != CL_SUCCESS)
+        printf("benchmark_kernel_program: problems w/ setting KernelArgs\n");
+
+    size_t h_global_size[] = {h_sizex, h_sizey};
+
+    // первый проход - прогрев ( ленивые компиляции и выделения в драйвере )
+    double time_start = 0;
+    for (int r = 0; r <= repeats; r++)
+    {
+        if (r == 1)
+        {
+            clFinish(queue);
+            time_start = get_wall_time();
+        }
+        clEnqueueNDRangeKernel(queue, h_init_kernel, 2, NULL, h_global_size, NULL, 0, NULL, NULL);
+        enqueue_multiply(&pair_kernels, queue);
+        enqueue_add_abs(&pair_kernels, queue);
+    }
+    clFinish(queue);
+    float average_time = (float)((get_wall_time() - time_start) / repeats);
+
+    clReleaseMemObject(h_scratch_imag);
+    clReleaseKernel(h_init_kernel);
+    DeInitPair_kernels(&pair_kernels);
+    return average_time;
+}
+
+// Среднее время ( сек ) одной пары multiply + обратное ПФ + abs в данной раскладке ( на нулевых данных )
+// Буферы выделяются как для float спектров, поэтому годятся и для half варианта multiply
+float benchmark_data_layout(cl_context ctx, cl_command_queue queue, cl_program program, int sizex, int sizey, float scaling,
+                            enum Data_layout layout, enum Spectrum_precision precision)
+{
+    const int repeats = 5;
+    size_t N = (size_t)sizex * sizey;
+    float average_time = -1;
+    cl_int err;
+
+    struct Cl_Buffer_pair images, h, result_part;
+    struct FFT_OpenCL_data fft;
+    struct Pair_kernels pair_kernels;
+
+    err = InitCl_Buffer_complex(ctx, queue, CL_MEM_READ_WRITE, N, layout, &images);
+    err |= InitCl_Buffer_complex(ctx, queue, CL_MEM_READ_WRITE, N, layout, &h);
+    err |= InitCl_Buffer_complex(ctx, queue, CL_MEM_READ_WRITE, N, layout, &result_part);
+    cl_mem result_CL = clCreateBuffer(ctx, CL_MEM_READ_WRITE, N * sizeof(cl_float), NULL, &err);
+    err |= InitFFT_OpenCL_data(sizex, sizey, ctx, queue, 1, CLFFT_BACKWARD, layout, &fft);
+    err |= InitPair_kernels(program, layout, precision, N, &images, &result_part, scaling, result_CL, &pair_kernels);
+    err |= fuse_pair_kernels(&pair_kernels, program, &fft, &images, &result_part, scaling, result_CL);
+    err |= set_multiply_inputs(&pair_kernels, 0, 0, &h, 1.0f);
+
+    if (err == CL_SUCCESS)
+    {
+        double time_start = 0;
+        for (int r = 0; r <= repeats; r++)
+        {
+            if (r == 1)
+            {
+                clFinish(queue);
+                time_start = get_wall_time();
+            }
+            enqueue_multiply(&pair_kernels, queue);
+            if (!pair_kernels.fused)
+                FFT_2D_OpenCL(&result_part, CLFFT_BACKWARD, queue, CL_FALSE, &fft);
+            enqueue_add_abs(&pair_kernels, queue);
+        }
+        clFinish(queue);
+        average_time = (float)((get_wall_time() - time_start) / repeats);
+    }
+    else
+        printf("benchmark_data_layout: could not set up %s layout\n", data_layout_name(layout));
+
+    DeInitPair_kernels(&pair_kernels);
+    DeInItFFT_OpenCL_data(&fft);
+    if (result_CL)
+        clReleaseMemObject(result_CL);
+    DeInItCl_Buffer_pair(&images);
+    DeInItCl_Buffer_pair(&h);
+    DeInItCl_Buffer_pair(&result_part);
+    return average_time;
+}
+
+
+/// СРАВНЕНИЕ clFFT И ВСТРОЕННОГО ПФ
+// Для картинок 512..4096 с удвоенными размерами ПФ ( три четверти входа - нули, из результата
+// нужна центральная четверть ) замеряется пара прямое + обратное ПФ обоими движками,
+// и сравнивается вырезанная часть результата.
+void benchmark_fft_engines(cl_context ctx, cl_device_id device, cl_command_queue queue, cl_program program,
+                           enum Data_layout layout)
+{
+    const int repeats = 5;
+    const int image_sizes[] = {512, 1024, 2048, 4096};
+    cl_ulong max_alloc_size = 0;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc_size), &max_alloc_size, NULL);
+
+    cl_program previous_program = builtin_fft_program;
+    if (previous_program)
+        clRetainProgram(previous_program);
+
+    show_status_string("FFT engines, %s layout: forward + inverse FFT, pic size | clFFT | builtin pruned | speedup | max rel. diff",
+                       data_layout_name(layout));
+
+    for (int s = 0; s < sizeof(image_sizes) / sizeof(image_sizes[0]); s++)
+    {
+        struct Conv_geometry geometry;
+        init_double_padding_geometry(image_sizes[s], image_sizes[s], &geometry);
+        size_t N = (size_t)geometry.sizex * geometry.sizey;
+        const int floats_per_pixel = layout == LAYOUT_INTERLEAVED ? 2 : 1;
+        if (N * floats_per_pixel * sizeof(cl_float) > max_alloc_size)
+        {
+            show_status_string("%5d: does not fit into one buffer, skipped", image_sizes[s]);
+            continue;
+        }
+
+        float *input = (float *) calloc(N * floats_per_pixel, sizeof(float));
+        float *outputs[2] = {(float *) malloc(N * floats_per_pixel * sizeof(float)),
+                             (float *) malloc(N * floats_per_pixel * sizeof(float))};
+        for (int y = 0; y < geometry.image_height; y++)
+            for (int x = 0; x < geometry.image_width; x++)
+                input[((size_t)y * geometry.sizex + x) * floats_per_pixel] = rand() % 256;
+
+        double times[2] = {-1, -1};
+        for (int engine = 0; engine < 2; engine++)
+        {
+            set_builtin_fft_program(engine == FFT_ENGINE_BUILTIN ? program : 0);
+
+            struct Cl_Buffer_pair buffer;
+            struct FFT_OpenCL_data fft;
+            memset(&fft, 0, sizeof(fft));
+            cl_int err = InitCl_Buffer_complex(ctx, queue, CL_MEM_READ_WRITE, N, layout, &buffer);
+            if (err == CL_SUCCESS)
+                err = InitFFT_OpenCL_data(geometry.sizex, geometry.sizey, ctx, queue, 1, CLFFT_BACKWARD, layout, &fft);
+            if (err == CL_SUCCESS && engine == FFT_ENGINE_BUILTIN && fft.lines_kernel == 0)
+                err = CL_INVALID_KERNEL;
+            prune_fft_input(&fft, geometry.image_width, geometry.image_height);
+            prune_fft_output(&fft, geometry.crop_x, geometry.crop_y, geometry.image_width, geometry.image_height);
+
+            double elapsed = 0;
+            for (int r = 0; r <= repeats && err == CL_SUCCESS; r++)
+            {
+                err = clEnqueueWriteBuffer(queue, buffer.buffers[0], CL_TRUE, 0, N * floats_per_pixel * sizeof(cl_float),
+                                           input, 0, NULL, NULL);
+                if (err == CL_SUCCESS && layout == LAYOUT_PLANAR)
+                    err = clEnqueueFillBuffer(queue, buffer.buffers[1], &zero, sizeof(zero), 0, N * sizeof(cl_float), 0, NULL, NULL);
+                clFinish(queue);
+
+                double time_start = get_wall_time();
+                if (err == CL_SUCCESS)
+                    err = FFT_2D_OpenCL(&buffer, CLFFT_FORWARD, queue, CL_FALSE, &fft);
+                if (err == CL_SUCCESS)
+                    err = FFT_2D_OpenCL(&buffer, CLFFT_BACKWARD, queue, CL_TRUE, &fft);
+                // первый прогон - прогрев
+                if (r > 0)
+                    elapsed += get_wall_time() - time_start;
+            }
+            if (err == CL_SUCCESS)
+                err = clEnqueueReadBuffer(queue, buffer.buffers[0], CL_TRUE, 0, N * floats_per_pixel * sizeof(cl_float),
+                                          outputs[engine], 0, NULL, NULL);
+            if (err == CL_SUCCESS)
+                times[engine] = elapsed / repeats;
+
+            DeInItFFT_OpenCL_data(&fft);
+            DeInItCl_Buffer_pair(&buffer);
+        }
+
+        // действительная часть вырезанной картинки
+        double max_diff = 0;
+        double max_value = 0;
+        for (int y = 0; y < geometry.image_height && times[0] > 0 && times[1] > 0; y++)
+            for (int x = 0; x < geometry.image_width; x++)
+            {
+                size_t index = ((size_t)(y + geometry.crop_y) * geometry.sizex + x + geometry.crop_x) * floats_per_pixel;
+                double diff = fabs(outputs[0][index] - outputs[1][index]);
+                if (diff > max_diff)
+                    max_diff = diff;
+                if (fabs(outputs[0][index]) > max_value)
+                    max_value = fabs(outputs[0][index]);
+            }
+
+        if (times[1] > 0)
+            show_status_string("%5d: %9.3f ms | %9.3f ms | %5.2fx | %g", image_sizes[s], times[0] * 1e3, times[1] * 1e3,
+                               times[0] / times[1], max_value > 0 ? max_diff / max_value : max_diff);
+        else
+            show_status_string("%5d: %9.3f ms | not supported on this device", image_sizes[s], times[0] * 1e3);
+
+        free(outputs[1]);
+        free(outputs[0]);
+        free(input);
+    }
+
+    set_builtin_fft_program(previous_program);
+    if (previous_program)
+        clReleaseProgram(previous_program);
+}
+
+
+/// ПОДБОР РАЗМЕРА РАБОЧЕЙ ГРУППЫ
+// Каждый kernel гоняется на черновых буферах с кандидатами local size ( плюс NULL ),
+// победитель сохраняется в tuning_db. Kernel'ы, уже записанные в базе, не трогаем.
+
+float time_kernel_launches(cl_command_queue queue, cl_kernel kernel, cl_uint work_dim, const size_t *global_size,
+                           const size_t *local_size)
+{
+    const int repeats = 5;
+
+    // прогрев и проверка, что такой local size вообще допустим
+    if (clEnqueueNDRangeKernel(queue, kernel, work_dim, NULL, global_size, local_size, 0, NULL, NULL) != CL_SUCCESS)
+        return -1;
+    if (clFinish(queue) != CL_SUCCESS)
+        return -1;
+
+    double time_start = get_wall_time();
+    for (int r = 0; r < repeats; r++)
+        clEnqueueNDRangeKernel(queue, kernel, work_dim, NULL, global_size, local_size, 0, NULL, NULL);
+    clFinish(queue);
+    return (float)((get_wall_time() - time_start) / repeats);
+}
+
+void tune_kernel(cl_command_queue queue, cl_device_id device, cl_kernel kernel, const char *kernel_name,
+                 cl_uint work_dim, const size_t *global_size)
+{
+    if (tuning_db.count == MAX_TUNING_ENTRIES || find_tuning_entry(kernel, kernel_name, work_dim, global_size) != NULL)
+        return;
+
+    static const size_t candidates_1d[][2] = {{32, 1}, {64, 1}, {128, 1}, {256, 1}, {512, 1}, {1024, 1}};
+    static const size_t candidates_2d[][2] = {{8, 8}, {16, 4}, {16, 8}, {16, 16}, {32, 4}, {32, 8}, {64, 1}, {64, 4}, {4, 64}, {1, 64}};
+
+    size_t max_work_group_size = 0;
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_work_group_size), &max_work_group_size, NULL);
+
+    struct Tuning_entry *entry = &tuning_db.entries[tuning_db.count];
+    memset(entry, 0, sizeof(*entry));
+    strncpy(entry->device_name, tuning_db.device_name, sizeof(entry->device_name) - 1);
+    strncpy(entry->kernel_name, kernel_name, sizeof(entry->kernel_name) - 1);
+    tuning_build_key(kernel, entry->build, sizeof(entry->build));
+    entry->global_size[0] = global_size[0];
+    entry->global_size[1] = work_dim > 1 ? global_size[1] : 1;
+
+    entry->default_time = time_kernel_launches(queue, kernel, work_dim, global_size, NULL);
+    entry->tuned_time = entry->default_time;
+
+    int amount_of_candidates = work_dim > 1 ? sizeof(candidates_2d)/sizeof(candidates_2d[0]) : sizeof(candidates_1d)/sizeof(candidates_1d[0]);
+    for (int c = 0; c < amount_of_candidates; c++)
+    {
+        const size_t *local_size = work_dim > 1 ? candidates_2d[c] : candidates_1d[c];
+        if (local_size[0] * local_size[1] > max_work_group_size ||
+            global_size[0] % local_size[0] != 0 || (work_dim > 1 && global_size[1] % local_size[1] != 0))
+            continue;
+
+        float time = time_kernel_launches(queue, kernel, work_dim, global_size, local_size);
+        if (time > 0 && (entry->tuned_time < 0 || time < entry->tuned_time))
+        {
+            entry->tuned_time = time;
+            entry->local_size[0] = local_size[0];
+            entry->local_size[1] = local_size[1];
+        }
+    }
+
+    tuning_db.count++;
+}
+
+void autotune_pipeline_kernels(cl_context ctx, cl_command_queue queue, cl_device_id device, cl_program program,
+                               enum Data_layout layout, enum Spectrum_precision precision,
+                               const struct Conv_geometry *geometry, float scaling)
+{
+    cl_int ret = CL_SUCCESS;
+    int sizex = geometry->sizex;
+    int sizey = geometry->sizey;
+    int h_sizex = geometry->image_width;
+    int h_sizey = geometry->image_height;
+    size_t N = (size_t)sizex * sizey;
+    size_t h_N = (size_t)h_sizex * h_sizey;
+    size_t h_global_size[] = {h_sizex, h_sizey};
+    size_t rows = h_sizey, cols = h_sizex;
+    float delta_z = M_PI;
+
+    struct Cl_Buffer_pair h_scratch, images, h, result_part;
+    InitCl_Buffer_pair(ctx, queue, CL_MEM_READ_WRITE, h_N, &h_scratch);
+    InitCl_Buffer_complex(ctx, queue, CL_MEM_READ_WRITE, N, layout, &images);
+    InitCl_Buffer_complex(ctx, queue, CL_MEM_READ_WRITE, N, layout, &h);
+    InitCl_Buffer_complex(ctx, queue, CL_MEM_READ_WRITE, N, layout, &result_part);
+    cl_mem result_CL = clCreateBuffer(ctx, CL_MEM_READ_WRITE, N * sizeof(cl_float), NULL, &ret);
+    clEnqueueFillBuffer(queue, result_CL, &zero, sizeof(zero), 0, N * sizeof(float), 0, NULL, NULL);
+
+    cl_kernel h_init_kernel = clCreateKernel(program, "h_init_kernel", &ret);
+    clSetKernelArg(h_init_kernel, 0, sizeof(delta_z), &delta_z);
+    clSetKernelArg(h_init_kernel, 1, sizeof(cl_mem), &h_scratch.buffers[0]);
+    clSetKernelArg(h_init_kernel, 2, sizeof(cl_mem), &h_scratch.buffers[1]);
+    tune_kernel(queue, device, h_init_kernel, "h_init_kernel", 2, h_global_size);
+    clReleaseKernel(h_init_kernel);
+
+    // на черновике нули, так что повторные запуски h_squared_abs_kernel безвредны
+    cl_kernel h_squared_abs_kernel = clCreateKernel(program, "h_squared_abs_kernel", &ret);
+    clEnqueueFillBuffer(queue, h_scratch.buffers[0], &zero, sizeof(zero), 0, h_N * sizeof(float), 0, NULL, NULL);
+    clSetKernelArg(h_squared_abs_kernel, 0, sizeof(cl_mem), &h_scratch.buffers[0]);
+    clSetKernelArg(h_squared_abs_kernel, 1, sizeof(cl_mem), &h_scratch.buffers[1]);
+    tune_kernel(queue, device, h_squared_abs_kernel, "h_squared_abs_kernel", 1, &h_N);
+    clReleaseKernel(h_squared_abs_kernel);
+
+    cl_kernel fft_shift_row_kernel = clCreateKernel(program, "fft_shift_row_kernel", &ret);
+    clSetKernelArg(fft_shift_row_kernel, 0, sizeof(cl_mem), &h_scratch.buffers[0]);
+    clSetKernelArg(fft_shift_row_kernel, 1, sizeof(h_sizex), &h_sizex);
+    tune_kernel(queue, device, fft_shift_row_kernel, "fft_shift_row_kernel", 1, &rows);
+    clReleaseKernel(fft_shift_row_kernel);
+
+    cl_kernel fft_shift_col_kernel = clCreateKernel(program, "fft_shift_col_kernel", &ret);
+    clSetKernelArg(fft_shift_col_kernel, 0, sizeof(cl_mem), &h_scratch.buffers[0]);
+    clSetKernelArg(fft_shift_col_kernel, 1, sizeof(h_sizey), &h_sizey);
+    tune_kernel(queue, device, fft_shift_col_kernel, "fft_shift_col_kernel", 1, &cols);
+    clReleaseKernel(fft_shift_col_kernel);
+
+    if (layout == LAYOUT_INTERLEAVED)
+    {
+        cl_kernel pad_kernel = clCreateKernel(program, "pad_real_to_interleaved_kernel", &ret);
+        clSetKernelArg(pad_kernel, 0, sizeof(cl_mem), &h_scratch.buffers[0]);
+        size_t pad_global_size[] = {geometry->psf_width, geometry->psf_height};
+        clSetKernelArg(pad_kernel, 1, sizeof(h_sizex), &h_sizex);
+        clSetKernelArg(pad_kernel, 2, sizeof(geometry->psf_x0), &geometry->psf_x0);
+        clSetKernelArg(pad_kernel, 3, sizeof(geometry->psf_y0), &geometry->psf_y0);
+        clSetKernelArg(pad_kernel, 4, sizeof(cl_mem), &h.buffers[0]);
+        clSetKernelArg(pad_kernel, 5, sizeof(sizex), &sizex);
+        tune_kernel(queue, device, pad_kernel, "pad_real_to_interleaved_kernel", 2, pad_global_size);
+        clReleaseKernel(pad_kernel);
+    }
+
+    if (precision == PRECISION_HALF)
+    {
+        // перевод среза в half: float буфер images -> result_part ( тот вдвое больше нужного )
+        cl_kernel to_half_kernel = clCreateKernel(program, "float_to_half_kernel", &ret);
+        size_t slice_values = layout == LAYOUT_INTERLEAVED ? 2 * N : N;
+        float inv_scale = 1.0f;
+        clSetKernelArg(to_half_kernel, 0, sizeof(cl_mem), &images.buffers[0]);
+        clSetKernelArg(to_half_kernel, 1, sizeof(inv_scale), &inv_scale);
+        clSetKernelArg(to_half_kernel, 2, sizeof(cl_mem), &result_part.buffers[0]);
+        tune_kernel(queue, device, to_half_kernel, "float_to_half_kernel", 1, &slice_values);
+        clReleaseKernel(to_half_kernel);
+    }
+
+    struct Pair_kernels pair_kernels;
+    // черновые буферы размером под float, half вариант multiply читает их половину
+    if (InitPair_kernels(program, layout, precision, N, &images, &result_part, scaling, result_CL, &pair_kernels) == CL_SUCCESS &&
+        set_multiply_inputs(&pair_kernels, 0, 0, &h, 1.0f) == CL_SUCCESS)
+    {
+        tune_kernel(queue, device, pair_kernels.multiply_kernel, pair_kernels.multiply_kernel_name, 1, &pair_kernels.global_size);
+        tune_kernel(queue, device, pair_kernels.add_abs_kernel, pair_kernels.add_abs_kernel_name, 1, &pair_kernels.global_size);
+    }
+    DeInitPair_kernels(&pair_kernels);
+
+    clReleaseMemObject(result_CL);
+    DeInItCl_Buffer_pair(&h_scratch);
+    DeInItCl_Buffer_pair(&images);
+    DeInItCl_Buffer_pair(&h);
+    DeInItCl_Buffer_pair(&result_part);
+}
+
+void show_tuning_report(void)
+{
+    show_status_string("Work-group sizes (%s):", tuning_db.device_name);
+    for (int i = 0; i < tuning_db.count; i++)
+    {
+        struct Tuning_entry *entry = &tuning_db.entries[i];
+        if (strcmp(entry->device_name, tuning_db.device_name) != 0)
+            continue;
+        if (entry->local_size[0] == 0)
+            show_status_string("  %-40s %-24s %zux%zu: default %f, tuned: default is best",
+                               entry->kernel_name, entry->build, entry->global_size[0], entry->global_size[1], entry->default_time);
+        else
+            show_status_string("  %-40s %-24s %zux%zu: default %f, tuned %zux%zu %f",
+                               entry->kernel_name, entry->build, entry->global_size[0], entry->global_size[1], entry->default_time,
+                               entry->local_size[0], entry->local_size[1], entry->tuned_time);
+    }
+}
+
+
+
+/// СПЕКТРЫ В ПОЛОВИННОЙ ТОЧНОСТИ
+// Максимум модуля среза переводится в HALF_SPECTRUM_PEAK: остаётся запас до предела half ( 65504 )
+// и как можно больше места снизу, до денормалов
+
+#define HALF_SPECTRUM_PEAK 32768.0f
+
+// count срезов по N комплексных чисел подряд переводятся из float в half: буферы spectra
+// заменяются half буферами, в scales[s] - на что умножать half значения среза s
+cl_int convert_spectra_to_half(cl_context ctx, cl_command_queue queue, cl_program program, enum Data_layout layout,
+                               size_t N, int count, struct Cl_Buffer_pair *spectra, float *scales)
+{
+    cl_int err = CL_SUCCESS;
+    int amount_of_planes = layout == LAYOUT_INTERLEAVED ? 1 : 2;
+    // сколько float чисел среза лежит в одном буфере
+    size_t slice_values = layout == LAYOUT_INTERLEAVED ? 2 * N : N;
+
+    struct Cl_Buffer_pair half_spectra;
+    memset(&half_spectra, 0, sizeof(half_spectra));
+
+    cl_kernel float_to_half_kernel = clCreateKernel(program, "float_to_half_kernel", &err);
+    if (err != CL_SUCCESS)
+    {
+        printf("convert_spectra_to_half: Error with clCreateKernel\n");
+        return err;
+    }
+
+    for (int i = 0; i < amount_of_planes && err == CL_SUCCESS; i++)
+        half_spectra.buffers[i] = create_buffer(ctx, CL_MEM_READ_WRITE, count * slice_values * sizeof(cl_half), &err);
+
+    float *slice = (float *) malloc(slice_values * sizeof(float));
+
+    for (int s = 0; s < count && err == CL_SUCCESS; s++)
+    {
+        // один масштаб на обе части среза
+        float peak = 0;
+        for (int i = 0; i < amount_of_planes && err == CL_SUCCESS; i++)
+        {
+            err = clEnqueueReadBuffer(queue, spectra->buffers[i], CL_TRUE, s * slice_values * sizeof(float),
+                                      slice_values * sizeof(float), slice, 0, NULL, NULL);
+            for (size_t j = 0; j < slice_values; j++)
+                if (fabsf(slice[j]) > peak)
+                    peak = fabsf(slice[j]);
+        }
+        scales[s] = peak > 0 ? peak / HALF_SPECTRUM_PEAK : 1.0f;
+        float inv_scale = 1.0f / scales[s];
+
+        size_t slice_start = s * slice_values;
+        for (int i = 0; i < amount_of_planes && err == CL_SUCCESS; i++)
+        {
+            err = clSetKernelArg(float_to_half_kernel, 0, sizeof(cl_mem), &spectra->buffers[i]);
+            err |= clSetKernelArg(float_to_half_kernel, 1, sizeof(inv_scale), &inv_scale);
+            err |= clSetKernelArg(float_to_half_kernel, 2, sizeof(cl_mem), &half_spectra.buffers[i]);
+            if (err == CL_SUCCESS)
+                err = clEnqueueNDRangeKernel(queue, float_to_half_kernel, 1, &slice_start, &slice_values,
+                                             tuned_local_size(float_to_half_kernel, "float_to_half_kernel", 1,
+                                                              &slice_values), 0, NULL, NULL);
+        }
+    }
+    if (err == CL_SUCCESS)
+        err = clFinish(queue);
+
+    free(slice);
+    clReleaseKernel(float_to_half_kernel);
+
+    if (err != CL_SUCCESS)
+    {
+        printf("convert_spectra_to_half: Error %d\n", err);
+        DeInItCl_Buffer_pair(&half_spectra);
+        return err;
+    }
+
+    DeInItCl_Buffer_pair(spectra);
+    *spectra = half_spectra;
+    return CL_SUCCESS;
+}
+
+
+/// PSF ( |h|^2 размером исходной картинки )
+// Для каждого k: h_init_kernel -> прямое ПФ -> fftshift -> |h|^2. Результат остаётся
+// в psf->h_CL_k.buffers[0] ( центр в (width/2, height/2) ), мнимая часть нулевая.
+
+struct Psf_generator {
+    int width;
+    int height;
+    struct FFT_OpenCL_data fft_orig_size;
+    struct Cl_Buffer_pair h_CL_k;
+    cl_kernel h_init_kernel;
+    cl_kernel h_squared_abs_kernel;
+    cl_kernel fft_shift_row_kernel;
+    cl_kernel fft_shift_col_kernel;
+};
+
+cl_int InitPsf_generator(cl_context ctx, cl_command_queue queue, cl_program program, int width, int height,
+                         struct Psf_generator *psf)
+{
+    cl_int err;
+    cl_int ret;
+    memset(psf, 0, sizeof(*psf));
+    psf->width = width;
+    psf->height = height;
+
+    err = InitFFT_OpenCL_data(width, height, ctx, queue, 1, CLFFT_FORWARD, LAYOUT_PLANAR, &psf->fft_orig_size);
+    if (err != CL_SUCCESS)
+        return err;
+
+    /// Создаем пару буферов для h размером исходной картинки
+    err = InitCl_Buffer_pair(ctx, queue, CL_MEM_READ_WRITE, (size_t)width * height, &psf->h_CL_k);
+    if (err != CL_SUCCESS)
+        return err;
+
+    // Создаем kernel для инициализации h и передаем туда аргументы ( delta_z и два буфера для вещественной и мнимой части )
+    psf->h_init_kernel = clCreateKernel(program, "h_init_kernel", &err);
+    psf->h_squared_abs_kernel = clCreateKernel(program, "h_squared_abs_kernel", &ret);
+    err |= ret;
+    psf->fft_shift_row_kernel = clCreateKernel(program, "fft_shift_row_kernel", &ret);
+    err |= ret;
+    psf->fft_shift_col_kernel = clCreateKernel(program, "fft_shift_col_kernel", &ret);
+    err |= ret;
+    if (err != CL_SUCCESS)
+    {
+        printf("InitPsf_generator: Error with clCreateKernel\n");
+        return err;
+    }
+
+    ret = clSetKernelArg(psf->h_init_kernel, 1, sizeof(cl_mem), &psf->h_CL_k.buffers[0]);
+    if (ret != CL_SUCCESS)
+        printf("Problems w/ setting KernelArgs for h[0] h_init_kernel\n");
+    ret = clSetKernelArg(psf->h_init_kernel, 2, sizeof(cl_mem), &psf->h_CL_k.buffers[1]);
+    if (ret != CL_SUCCESS)
+        printf("Problems w/ setting KernelArgs for h[1] h_init_kernel\n");
+
+
+    ret = clSetKernelArg(psf->h_squared_abs_kernel, 0, sizeof(cl_mem), &psf->h_CL_k.buffers[0]);
+    if (ret != CL_SUCCESS)
+        printf("Problems w/ setting KernelArgs for h[0] h_squared_abs_kernel\n");
+    ret = clSetKernelArg(psf->h_squared_abs_kernel, 1, sizeof(cl_mem), &psf->h_CL_k.buffers[1]);
+    if (ret != CL_SUCCESS)
+        printf("Problems w/ setting KernelArgs for h[1] h_squared_abs_kernel\n");
+
+    return CL_SUCCESS;
+}
+
+void DeInitPsf_generator(struct Psf_generator *psf)
+{
+    if (psf->h_init_kernel)
+        clReleaseKernel(psf->h_init_kernel);
+    if (psf->h_squared_abs_kernel)
+        clReleaseKernel(psf->h_squared_abs_kernel);
+    if (psf->fft_shift_row_kernel)
+        clReleaseKernel(psf->fft_shift_row_kernel);
+    if (psf->fft_shift_col_kernel)
+        clReleaseKernel(psf->fft_shift_col_kernel);
+    DeInItFFT_OpenCL_data(&psf->fft_orig_size);
+    DeInItCl_Buffer_pair(&psf->h_CL_k);
+    memset(psf, 0, sizeof(*psf));
+}
+
+cl_int make_psf(struct Psf_generator *psf, cl_command_queue queue, int k)
+{
+    cl_int ret;
+    int width = psf->width;
+    int height = psf->height;
+
+    float delta_z = k * M_PI;
+
+    ret = clSetKernelArg(psf->h_init_kernel, 0, sizeof(delta_z), &delta_z);
+    if (ret != CL_SUCCESS)
+        printf("Problems w/ setting KernelArgs for delta_z h_init_kernel\n");
+
+
+    size_t global_group_size[] = {width, height};
+    /// Кладем в очередь команды для вызова kernel, который создает матрицу h размерами исходной картинки
+
+    ret = clEnqueueNDRangeKernel(queue, psf->h_init_kernel, 2, NULL, global_group_size,
+                                 tuned_local_size(psf->h_init_kernel, "h_init_kernel", 2, global_group_size), 0, NULL, NULL);
+    if (ret != CL_SUCCESS)
+        printf("Problems w/ clEnqueueNDRangeKernel h_init_kernel");
+    ret = clFinish(queue);
+    if (ret != CL_SUCCESS)
+        printf("Problems w/ clFinish");
+
+
+
+    show_status_string("Making FFT for h_original_size");
+    /// Прямое ПФ для h
+    if (FFT_2D_OpenCL(&psf->h_CL_k, CLFFT_FORWARD, queue, CL_TRUE, &psf->fft_orig_size) == 0)
+        ;
+    else
+        printf("FFT for h func NOT passed !\n");
+
+    /// FFTShift для h
+
+    for (int i = 0; i < 2; i++)
+    {
+        ret = clSetKernelArg(psf->fft_shift_row_kernel, 0, sizeof(cl_mem), &psf->h_CL_k.buffers[i]);
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ setting KernelArgs for h[%d] fft_shift_row_kernel\n", i);
+        ret = clSetKernelArg(psf->fft_shift_row_kernel, 1, sizeof(width), &width);
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ setting KernelArgs for h[%d] fft_shift_row_kernel\n", i);
+
+        size_t sizey_t = height;
+        ret = clEnqueueNDRangeKernel(queue, psf->fft_shift_row_kernel, 1, NULL, &sizey_t,
+                                     tuned_local_size(psf->fft_shift_row_kernel, "fft_shift_row_kernel", 1, &sizey_t), 0, NULL, NULL);
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ clEnqueueNDRangeKernel fft_shift_row_kernel");
+        ret = clFinish(queue);
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ clFinish");
+
+        ret = clSetKernelArg(psf->fft_shift_col_kernel, 0, sizeof(cl_mem), &psf->h_CL_k.buffers[i]);
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ setting KernelArgs for h[%d] fft_shift_col_kernel\n", i);
+        ret = clSetKernelArg(psf->fft_shift_col_kernel, 1, sizeof(height), &height);
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ setting KernelArgs for h[%d] fft_shift_col_kernel\n", i);
+
+
+        size_t sizex_t = width;
+        ret = clEnqueueNDRangeKernel(queue, psf->fft_shift_col_kernel, 1, NULL, &sizex_t,
+                                     tuned_local_size(psf->fft_shift_col_kernel, "fft_shift_col_kernel", 1, &sizex_t), 0, NULL, NULL);
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ clEnqueueNDRangeKernel fft_shift_col_kernel");
+        ret = clFinish(queue);
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ clFinish");
+
+    }
+
+    /// Модуль для h^2
+
+    size_t h_N = (size_t)width * height;
+    ret = clEnqueueNDRangeKernel(queue, psf->h_squared_abs_kernel, 1, NULL, &h_N,
+                                 tuned_local_size(psf->h_squared_abs_kernel, "h_squared_abs_kernel", 1, &h_N), 0, NULL, NULL);
+    if (ret != CL_SUCCESS)
+        printf("Problems w/ clEnqueueNDRangeKernel h_squared_abs_kernel");
+    ret = clFinish(queue);
+    if (ret != CL_SUCCESS)
+        printf("Problems w/ clFinish");
+
+    return ret;
+}
+
+/// ОПОРА PSF
+// Для каждого h по строкам и столбцам |h|^2 находится наименьший центрированный прямоугольник,
+// вне которого лежит не больше psf_tail энергии ( половина допуска на каждое направление ).
+// Все h умножаются на одни и те же спектры картинок, поэтому берётся объединение опор.
+
+// Наименьший радиус r, при котором вне [center - r, center + r] сумма sums[] не больше limit
+int psf_support_radius(const double *sums, int length, int center, double limit)
+{
+    double outside = 0;
+    for (int i = 0; i < length; i++)
+        outside += sums[i];
+
+    int radius = 0;
+    outside -= sums[center];
+    while (outside > limit && radius < length)
+    {
+        radius++;
+        if (center - radius >= 0)
+            outside -= sums[center - radius];
+        if (center + radius < length)
+            outside -= sums[center + radius];
+    }
+    return radius;
+}
+
+// radii_x, radii_y ( могут быть NULL ) - радиусы опоры каждой PSF_k отдельно
+cl_int measure_psf_support(cl_context ctx, cl_command_queue queue, cl_program program, int amount_of_h, float psf_tail,
+                           struct Conv_geometry *geometry, int *radii_x, int *radii_y)
+{
+    int width = geometry->image_width;
+    int height = geometry->image_height;
+    int radius_x = 0;
+    int radius_y = 0;
+
+    struct Psf_generator psf;
+    cl_int err = InitPsf_generator(ctx, queue, program, width, height, &psf);
+    float *intensity = (float *) malloc((size_t)width * height * sizeof(float));
+    double *column_sums = (double *) malloc(width * sizeof(double));
+    double *row_sums = (double *) malloc(height * sizeof(double));
+
+    for (int k = 0; k < amount_of_h && err == CL_SUCCESS; k++)
+    {
+        err = make_psf(&psf, queue, k);
+        if (err == CL_SUCCESS)
+            err = clEnqueueReadBuffer(queue, psf.h_CL_k.buffers[0], CL_TRUE, 0, (size_t)width * height * sizeof(float),
+                                      intensity, 0, NULL, NULL);
+        if (err != CL_SUCCESS)
+            break;
+
+        double total = 0;
+        memset(column_sums, 0, width * sizeof(double));
+        memset(row_sums, 0, height * sizeof(double));
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+            {
+                double value = intensity[(size_t)y * width + x];
+                column_sums[x] += value;
+                row_sums[y] += value;
+                total += value;
+            }
+
+        int k_radius_x = psf_support_radius(column_sums, width, width / 2, total * psf_tail / 2);
+        int k_radius_y = psf_support_radius(row_sums, height, height / 2, total * psf_tail / 2);
+        show_status_string("PSF support for h[%d]: %dx%d", k, 2 * k_radius_x + 1, 2 * k_radius_y + 1);
+        if (radii_x != NULL)
+            radii_x[k] = k_radius_x;
+        if (radii_y != NULL)
+            radii_y[k] = k_radius_y;
+
+        if (k_radius_x > radius_x)
+            radius_x = k_radius_x;
+        if (k_radius_y > radius_y)
+            radius_y = k_radius_y;
+    }
+
+    free(row_sums);
+    free(column_sums);
+    free(intensity);
+    DeInitPsf_generator(&psf);
+
+    if (err != CL_SUCCESS)
+    {
+        printf("measure_psf_support: Error %d\n", err);
+        return err;
+    }
+
+    int x1 = width / 2 + radius_x + 1;
+    int y1 = height / 2 + radius_y + 1;
+    geometry->psf_x0 = width / 2 - radius_x > 0 ? width / 2 - radius_x : 0;
+    geometry->psf_y0 = height / 2 - radius_y > 0 ? height / 2 - radius_y : 0;
+    geometry->psf_width = (x1 < width ? x1 : width) - geometry->psf_x0;
+    geometry->psf_height = (y1 < height ? y1 : height) - geometry->psf_y0;
+    return CL_SUCCESS;
+}
+
+
+/// ГЕНЕРАЦИЯ h
+// Для каждого k: PSF ( make_psf ), перенос её опоры в левый верхний угол расширенной матрицы
+// и прямое ПФ уже от неё. H_generator держит всё нужное для этого, чтобы h_k можно было
+// получать и по одному ( кеш h ), и все сразу ( generate_h_rash ).
+struct H_generator {
+    struct Psf_generator psf;
+    struct FFT_OpenCL_data fft;
+    cl_kernel pad_real_to_interleaved_kernel;
+    enum Data_layout layout;
+    struct Conv_geometry geometry;
+    // время генерации PSF с переносом и время ПФ
+    clock_t gen_clocks;
+    clock_t fft_clocks;
+};
+
+void DeInitH_generator(struct H_generator *gen)
+{
+    if (gen->pad_real_to_interleaved_kernel)
+        clReleaseKernel(gen->pad_real_to_interleaved_kernel);
+    DeInItFFT_OpenCL_data(&gen->fft);
+    DeInitPsf_generator(&gen->psf);
+    memset(gen, 0, sizeof(*gen));
+}
+
+cl_int InitH_generator(cl_context ctx, cl_command_queue queue, cl_program program, enum Data_layout layout,
+                       const struct Conv_geometry *geometry, struct H_generator *gen)
+{
+    cl_int err;
+    memset(gen, 0, sizeof(*gen));
+    clock_t start = clock();
+    gen->layout = layout;
+    gen->geometry = *geometry;
+
+    err = InitPsf_generator(ctx, queue, program, geometry->image_width, geometry->image_height, &gen->psf);
+    if (err == CL_SUCCESS)
+        err = InitFFT_OpenCL_data(geometry->sizex, geometry->sizey, ctx, queue, 1, CLFFT_BACKWARD, layout, &gen->fft);
+    prune_fft_input(&gen->fft, geometry->psf_width, geometry->psf_height);
+    if (err == CL_SUCCESS)
+        gen->pad_real_to_interleaved_kernel = clCreateKernel(program, "pad_real_to_interleaved_kernel", &err);
+    gen->gen_clocks += clock() - start;
+    if (err != CL_SUCCESS)
+    {
+        printf("InitH_generator: Error %d\n", err);
+        DeInitH_generator(gen);
+    }
+    return err;
+}
+
+// Спектр h_k в h ( float, N комплексных чисел в раскладке генератора ). Вне опоры PSF h должен быть нулевым:
+// clear - обнулить его здесь ( буфер с прошлым h ), иначе он уже обнулён
+cl_int generate_h(struct H_generator *gen, cl_command_queue queue, int k, struct Cl_Buffer_pair *h, int clear)
+{
+    cl_int err = CL_SUCCESS;
+    cl_int ret;
+    const struct Conv_geometry *geometry = &gen->geometry;
+    int sizex = geometry->sizex;
+    int h_sizex = geometry->image_width;
+    size_t N = (size_t)sizex * geometry->sizey;
+    int amount_of_planes = gen->layout == LAYOUT_INTERLEAVED ? 1 : 2;
+    size_t plane_bytes = gen->layout == LAYOUT_INTERLEAVED ? 2 * N * sizeof(cl_float) : N * sizeof(cl_float);
+
+    clock_t h_gen_start = clock();
+    for (int i = 0; i < amount_of_planes && clear && err == CL_SUCCESS; i++)
+        err = clEnqueueFillBuffer(queue, h->buffers[i], &zero, sizeof(zero), 0, plane_bytes, 0, NULL, NULL);
+    if (err == CL_SUCCESS)
+        err = make_psf(&gen->psf, queue, k);
+
+    // Расширяем матрицу h ( теперь она становится h_rash ): переносим только опору PSF
+    if (err == CL_SUCCESS && gen->layout == LAYOUT_INTERLEAVED)
+    {
+        cl_kernel pad_real_to_interleaved_kernel = gen->pad_real_to_interleaved_kernel;
+        // мнимая часть |h|^2 нулевая, переносим только действительную
+        ret = clSetKernelArg(pad_real_to_interleaved_kernel, 0, sizeof(cl_mem), &gen->psf.h_CL_k.buffers[0]);
+        ret |= clSetKernelArg(pad_real_to_interleaved_kernel, 1, sizeof(h_sizex), &h_sizex);
+        ret |= clSetKernelArg(pad_real_to_interleaved_kernel, 2, sizeof(geometry->psf_x0), &geometry->psf_x0);
+        ret |= clSetKernelArg(pad_real_to_interleaved_kernel, 3, sizeof(geometry->psf_y0), &geometry->psf_y0);
+        ret |= clSetKernelArg(pad_real_to_interleaved_kernel, 4, sizeof(cl_mem), &h->buffers[0]);
+        ret |= clSetKernelArg(pad_real_to_interleaved_kernel, 5, sizeof(sizex), &sizex);
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ setting KernelArgs for pad_real_to_interleaved_kernel\n");
+
+        size_t pad_global_size[] = {geometry->psf_width, geometry->psf_height};
+        ret = clEnqueueNDRangeKernel(queue, pad_real_to_interleaved_kernel, 2, NULL, pad_global_size,
+                                     tuned_local_size(pad_real_to_interleaved_kernel, "pad_real_to_interleaved_kernel", 2,
+                                                      pad_global_size), 0, NULL, NULL);
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ clEnqueueNDRangeKernel pad_real_to_interleaved_kernel");
+    }
+    else for (int i = 0; i < 2 && err == CL_SUCCESS; i++)
+        for (int j = 0; j < geometry->psf_height; j++)
+        {
+            size_t src_offset = (size_t)(geometry->psf_y0 + j) * h_sizex + geometry->psf_x0;
+            err = clEnqueueCopyBuffer(queue, gen->psf.h_CL_k.buffers[i], h->buffers[i],
+                                      src_offset * sizeof(cl_float), (size_t)j * sizex * sizeof(cl_float),
+                                      geometry->psf_width * sizeof(cl_float), 0, NULL, NULL);
+            if (err != CL_SUCCESS)
+            {
+                printf("Error with clEnqueueCopyBuffer %d\n", j);
+                break;
+            }
+
+        }
+    if (err != CL_SUCCESS)
+        return err;
+
+    ret = clFinish(queue);
+    if (ret != CL_SUCCESS)
+        printf("Problems w/ clFinish after copy");
+
+    clock_t h_fft_start = clock();
+    gen->gen_clocks += h_fft_start - h_gen_start;
+
+    // Прямое ПФ для расширенной матрицы h
+    if (FFT_2D_OpenCL(h, CLFFT_FORWARD, queue, CL_TRUE, &gen->fft) == 0)
+        ;
+    else
+        printf("FFT for h_rash func NOT passed !\n");
+
+    gen->fft_clocks += clock() - h_fft_start;
+    return CL_SUCCESS;
+}
+
+// Все h_k сразу.
+// h_rash_CL[k] создаются здесь ( старые буферы, если есть, освобождаются, поэтому массив должен быть
+// обнулён или заполнен ранее ). В PRECISION_HALF каждый h_rash_CL[k] сразу после ПФ переводится в half
+// с масштабом h_scales[k], так что во float одновременно живёт только одна расширенная матрица.
+// Если table не NULL ( только PRECISION_FLOAT ), h_rash_CL[k] - окна уже обнулённой таблицы h, а не отдельные буферы.
+cl_int generate_h_rash(cl_context ctx, cl_command_queue queue, cl_program program, enum Data_layout layout,
+                       enum Spectrum_precision precision, const struct Conv_geometry *geometry, int amount_of_h,
+                       struct Cl_Buffer_pair *h_rash_CL, float *h_scales, struct H_table *table)
+{
+    cl_int err;
+    size_t N = (size_t)geometry->sizex * geometry->sizey;
+
+    struct H_generator gen;
+    err = InitH_generator(ctx, queue, program, layout, geometry, &gen);
+
+    for (int k = 0; k < amount_of_h && err == CL_SUCCESS; k++)
+    {
+        DeInItCl_Buffer_pair(&h_rash_CL[k]);
+        if (table != NULL)
+            err = h_table_view(table, k, &h_rash_CL[k]);
+        else
+            err = InitCl_Buffer_complex(ctx, queue, CL_MEM_READ_WRITE, N, layout, &h_rash_CL[k]);
+        if (err != CL_SUCCESS)
+        {
+            printf("Error with h_rash_CL[%d] buffers\n", k);
+            break;
+        }
+
+        err = generate_h(&gen, queue, k, &h_rash_CL[k], 0);
+
+        if (err == CL_SUCCESS && precision == PRECISION_HALF)
+        {
+            clock_t convert_start = clock();
+            err = convert_spectra_to_half(ctx, queue, program, layout, N, 1, &h_rash_CL[k], &h_scales[k]);
+            gen.fft_clocks += clock() - convert_start;
+        }
+    }
+
+    float h_gen_time = (float)gen.gen_clocks/CLOCKS_PER_SEC;
+    float h_fft_time = (float)gen.fft_clocks/CLOCKS_PER_SEC;
+    DeInitH_generator(&gen);
+
+    if (err != CL_SUCCESS)
+        return err;
+
+    show_status_string("");
+    show_status_string("Time for generating h: %f",  h_gen_time);
+    show_status_string("Time for h fft: %f",  h_fft_time);
+    show_status_string("Total time for generating and fft'ing h: %f", h_gen_time + h_fft_time);
+    show_status_string("");
+
+    return CL_SUCCESS;
+}
+
+/// КЕШ h ( --h-cache-mb M )
+// h_k генерируется при первой паре с |n - m| = k и живёт в одном из слотов своей таблицы h ( столько слотов,
+// сколько помещается в бюджет ). Если слотов не хватает, вытесняется h, к которому дольше всех не обращались,
+// и при следующем обращении он генерируется заново: PSF + ПФ на устройстве дешевле, чем держать все amount_of_h
+// спектров или гонять их через хост.
+struct H_cache {
+    struct H_generator gen;
+    struct H_table table;
+    // окна таблицы по слотам
+    struct Cl_Buffer_pair *slots;
+    int amount_of_slots;
+    // какой h в слоте ( -1 - пусто ) и в каком слоте h_k ( -1 - нет )
+    int *slot_h;
+    int *h_slot;
+    unsigned long *last_use;
+    // h_k уже генерировался ( повторная генерация - после вытеснения )
+    int *generated;
+    int amount_of_h;
+    unsigned long uses;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long regenerations;
+    clock_t generation_clocks;
+};
+
+void DeInitH_cache(struct H_cache *cache)
+{
+    for (int s = 0; cache->slots != NULL && s < cache->amount_of_slots; s++)
+        DeInItCl_Buffer_pair(&cache->slots[s]);
+    free(cache->slots);
+    free(cache->slot_h);
+    free(cache->h_slot);
+    free(cache->last_use);
+    free(cache->generated);
+    DeInitH_table(&cache->table);
+    DeInitH_generator(&cache->gen);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// Слоты берутся из арены: budget байт, но не меньше одного слота и не больше amount_of_h
+cl_int InitH_cache(cl_context ctx, cl_command_queue queue, cl_program program, struct Device_arena *arena,
+                   enum Data_layout layout, const struct Conv_geometry *geometry, int amount_of_h, size_t budget,
+                   struct H_cache *cache)
+{
+    cl_int err;
+    size_t N = (size_t)geometry->sizex * geometry->sizey;
+    memset(cache, 0, sizeof(*cache));
+
+    // как в InitH_table: каждая плоскость слота выровнена отдельно
+    size_t complex_bytes = layout == LAYOUT_INTERLEAVED ? 2 * sizeof(cl_float) : sizeof(cl_float);
+    int amount_of_planes = layout == LAYOUT_INTERLEAVED ? 1 : 2;
+    size_t slot_bytes = amount_of_planes * arena_align(arena, N * complex_bytes);
+    int amount_of_slots = budget / slot_bytes;
+    amount_of_slots = amount_of_slots < 1 ? 1 : amount_of_slots > amount_of_h ? amount_of_h : amount_of_slots;
+
+    err = InitH_generator(ctx, queue, program, layout, geometry, &cache->gen);
+    if (err == CL_SUCCESS)
+        err = InitH_table(arena, N, amount_of_slots, layout, &cache->table);
+    if (err == CL_SUCCESS)
+        err = arena_zero_fill(arena, queue);
+
+    cache->amount_of_h = amount_of_h;
+    cache->amount_of_slots = amount_of_slots;
+    cache->slots = (struct Cl_Buffer_pair *) calloc(amount_of_slots, sizeof(struct Cl_Buffer_pair));
+    cache->slot_h = (int *) malloc(amount_of_slots * sizeof(int));
+    cache->last_use = (unsigned long *) calloc(amount_of_slots, sizeof(unsigned long));
+    cache->h_slot = (int *) malloc(amount_of_h * sizeof(int));
+    cache->generated = (int *) calloc(amount_of_h, sizeof(int));
+    for (int s = 0; s < amount_of_slots && err == CL_SUCCESS; s++)
+    {
+        cache->slot_h[s] = -1;
+        err = h_table_view(&cache->table, s, &cache->slots[s]);
+    }
+    for (int k = 0; k < amount_of_h; k++)
+        cache->h_slot[k] = -1;
+
+    if (err != CL_SUCCESS)
+    {
+        printf("InitH_cache: Error %d\n", err);
+        DeInitH_cache(cache);
+        return err;
+    }
+    show_status_string("h cache: %d of %d h spectra resident ( %.1f MB )", amount_of_slots, amount_of_h,
+                       amount_of_slots * slot_bytes / 1048576.0);
+    return CL_SUCCESS;
+}
+
+// Слот с h_k ( *slot ); при промахе h_k генерируется в пустой или давно не использованный слот
+cl_int h_cache_get(struct H_cache *cache, cl_command_queue queue, int k, int *slot)
+{
+    cache->uses++;
+    if (cache->h_slot[k] >= 0)
+    {
+        cache->hits++;
+        *slot = cache->h_slot[k];
+        cache->last_use[*slot] = cache->uses;
+        return CL_SUCCESS;
+    }
+
+    int s = 0;
+    for (int i = 1; i < cache->amount_of_slots && cache->slot_h[s] >= 0; i++)
+        if (cache->slot_h[i] < 0 || cache->last_use[i] < cache->last_use[s])
+            s = i;
+    // слот из-под вытесненного h надо обнулять, свежий слот обнулён вместе с таблицей
+    int used_slot = cache->slot_h[s] >= 0;
+    if (used_slot)
+        cache->h_slot[cache->slot_h[s]] = -1;
+
+    clock_t start = clock();
+    cl_int err = generate_h(&cache->gen, queue, k, &cache->slots[s], used_slot);
+    cache->generation_clocks += clock() - start;
+    if (err != CL_SUCCESS)
+    {
+        cache->slot_h[s] = -1;
+        return err;
+    }
+
+    cache->misses++;
+    if (cache->generated[k])
+        cache->regenerations++;
+    cache->generated[k] = 1;
+    cache->slot_h[s] = k;
+    cache->h_slot[k] = s;
+    cache->last_use[s] = cache->uses;
+    *slot = s;
+    return CL_SUCCESS;
+}
+
+void report_h_cache(const struct H_cache *cache)
+{
+    show_status_string("h cache: %lu hits, %lu misses ( %lu regenerations after eviction ), hit rate %.1f%%",
+                       cache->hits, cache->misses, cache->regenerations,
+                       cache->uses > 0 ? 100.0 * cache->hits / cache->uses : 0.0);
+    show_status_string("h cache: generation time %f", (float)cache->generation_clocks / CLOCKS_PER_SEC);
+}
+
+/// ОДИН СЛОЙ РЕЗУЛЬТАТА
+// result_CL = сумма по n нормированных |IFFT( картинка_n * h_|n-m| )|
+
+/// ГИБРИДНАЯ СВЁРТКА ( --hybrid )
+// Пары с компактной PSF ( ближние к фокусу слои ) считаются прямой свёрткой картинки с опорой PSF_k
+// ( direct_conv_kernel ), остальные - через ПФ. Порог - наибольший радиус опоры, при котором прямая
+// свёртка быстрее пары multiply + обратное ПФ + abs, берётся из замера на этом устройстве.
+// С --separable PSF_k раскладывается SVD в сумму rank разделимых ядер ( rank - наименьший, при котором
+// относительная ошибка по норме Фробениуса не больше допуска ), и пара считается rank парами одномерных свёрток,
+// если это дешевле замеренного порога и двумерной прямой свёртки.
+
+// как в rash_kernel.cl
+#define DIRECT_CONV_TILE 16
+#define MAX_DIRECT_CONV_RADIUS 32
+#define MAX_SEPARABLE_RANK 8
+#define MAX_SEPARABLE_RADIUS 64
+
+struct Direct_convolution {
+    cl_kernel kernel;
+    // все картинки подряд, W x H float каждая
+    cl_mem pics;
+    // опора PSF_k ( (2 * radius_x[k] + 1) x (2 * radius_y[k] + 1) ), 0 - пары с h_k считаются через ПФ
+    cl_mem *psf_boxes;
+    int *radius_x;
+    int *radius_y;
+    int amount_of_h;
+    int image_width;
+    int image_height;
+    // разделимая свёртка: rank[k] ядер, row_taps[k] - rank x (2 * radius_x[k] + 1), col_taps[k] - rank x (2 * radius_y[k] + 1);
+    // rank[k] == 0 - пара с h_k не разделимая
+    int *rank;
+    cl_mem *row_taps;
+    cl_mem *col_taps;
+    // строки, свёрнутые с row_taps: max rank картинок W x H
+    cl_mem separable_tmp;
+    cl_kernel rows_kernel;
+    cl_kernel cols_kernel;
+};
+
+size_t direct_conv_local_mem(int radius_x, int radius_y)
+{
+    return (size_t)(DIRECT_CONV_TILE + 2 * radius_x) * (DIRECT_CONV_TILE + 2 * radius_y) * sizeof(cl_float);
+}
+
+cl_int enqueue_direct_conv(cl_command_queue queue, cl_kernel kernel, cl_mem pics, cl_ulong image_offset, int image_width,
+                           int image_height, cl_mem psf_box, int radius_x, int radius_y)
+{
+    cl_int ret = CL_SUCCESS;
+    ret |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &pics);
+    ret |= clSetKernelArg(kernel, 1, sizeof(image_offset), &image_offset);
+    ret |= clSetKernelArg(kernel, 2, sizeof(image_width), &image_width);
+    ret |= clSetKernelArg(kernel, 3, sizeof(image_height), &image_height);
+    ret |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &psf_box);
+    ret |= clSetKernelArg(kernel, 5, sizeof(radius_x), &radius_x);
+    ret |= clSetKernelArg(kernel, 6, sizeof(radius_y), &radius_y);
+    ret |= clSetKernelArg(kernel, 12, direct_conv_local_mem(radius_x, radius_y), NULL);
+    if (ret != CL_SUCCESS)
+    {
+        printf("Problems w/ setting KernelArgs for direct_conv_kernel\n");
+        return ret;
+    }
+
+    size_t global_size[] = {(image_width + DIRECT_CONV_TILE - 1) / DIRECT_CONV_TILE * DIRECT_CONV_TILE,
+                            (image_height + DIRECT_CONV_TILE - 1) / DIRECT_CONV_TILE * DIRECT_CONV_TILE};
+    size_t local_size[] = {DIRECT_CONV_TILE, DIRECT_CONV_TILE};
+    return clEnqueueNDRangeKernel(queue, kernel, 2, NULL, global_size, local_size, 0, NULL, NULL);
+}
+
+// Наибольший радиус квадратной опоры, при котором прямая свёртка картинки быстрее pair_time ( сек );
+// -1 - прямая свёртка не выгодна или не помещается на устройство
+int benchmark_direct_crossover(cl_context ctx, cl_device_id device, cl_command_queue queue, cl_program program,
+                               int image_width, int image_height, float pair_time)
+{
+    const int repeats = 5;
+    const int radii[] = {1, 2, 3, 4, 6, 8, 12, 16, 24, 32};
+    size_t image_size = (size_t)image_width * image_height;
+    int crossover = -1;
+    cl_int err;
+
+    cl_ulong local_mem_size = 0;
+    size_t max_work_group_size = 0;
+    cl_kernel kernel = clCreateKernel(program, "direct_conv_kernel", &err);
+    if (err != CL_SUCCESS)
+        return -1;
+    clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(local_mem_size), &local_mem_size, NULL);
+    clGetKernelWorkGroupInfo(kernel, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(max_work_group_size), &max_work_group_size, NULL);
+
+    size_t max_box = (2 * MAX_DIRECT_CONV_RADIUS + 1) * (2 * MAX_DIRECT_CONV_RADIUS + 1);
+    cl_mem image = clCreateBuffer(ctx, CL_MEM_READ_WRITE, image_size * sizeof(cl_float), NULL, &err);
+    cl_mem psf_box = 0, result = 0;
+    if (err == CL_SUCCESS)
+        psf_box = clCreateBuffer(ctx, CL_MEM_READ_WRITE, max_box * sizeof(cl_float), NULL, &err);
+    if (err == CL_SUCCESS)
+        result = clCreateBuffer(ctx, CL_MEM_READ_WRITE, image_size * sizeof(cl_float), NULL, &err);
+    if (err == CL_SUCCESS)
+        err = clEnqueueFillBuffer(queue, image, &zero, sizeof(zero), 0, image_size * sizeof(cl_float), 0, NULL, NULL);
+    if (err == CL_SUCCESS)
+        err = clEnqueueFillBuffer(queue, psf_box, &zero, sizeof(zero), 0, max_box * sizeof(cl_float), 0, NULL, NULL);
+    if (err == CL_SUCCESS)
+        err = clEnqueueFillBuffer(queue, result, &zero, sizeof(zero), 0, image_size * sizeof(cl_float), 0, NULL, NULL);
+
+    float weight = 1.0f;
+    int zero_offset = 0;
+    if (err == CL_SUCCESS)
+    {
+        err |= clSetKernelArg(kernel, 7, sizeof(weight), &weight);
+        err |= clSetKernelArg(kernel, 8, sizeof(cl_mem), &result);
+        err |= clSetKernelArg(kernel, 9, sizeof(image_width), &image_width);
+        err |= clSetKernelArg(kernel, 10, sizeof(zero_offset), &zero_offset);
+        err |= clSetKernelArg(kernel, 11, sizeof(zero_offset), &zero_offset);
+    }
+
+    for (int r = 0; r < sizeof(radii) / sizeof(radii[0]) && err == CL_SUCCESS; r++)
+    {
+        if (max_work_group_size < DIRECT_CONV_TILE * DIRECT_CONV_TILE ||
+            direct_conv_local_mem(radii[r], radii[r]) > local_mem_size)
+            break;
+
+        double time_start = 0;
+        for (int i = 0; i <= repeats && err == CL_SUCCESS; i++)
+        {
+            if (i == 1)
+            {
+                clFinish(queue);
+                time_start = get_wall_time();
+            }
+            err = enqueue_direct_conv(queue, kernel, image, 0, image_width, image_height, psf_box, radii[r], radii[r]);
+        }
+        clFinish(queue);
+        float direct_time = (float)((get_wall_time() - time_start) / repeats);
+        show_status_string("Direct convolution, support %dx%d: %f ( FFT pair: %f )", 2 * radii[r] + 1, 2 * radii[r] + 1,
+                           direct_time, pair_time);
+        if (err != CL_SUCCESS || direct_time >= pair_time)
+            break;
+        crossover = radii[r];
+    }
+
+    if (result)
+        clReleaseMemObject(result);
+    if (psf_box)
+        clReleaseMemObject(psf_box);
+    if (image)
+        clReleaseMemObject(image);
+    clReleaseKernel(kernel);
+    return crossover;
+}
+
+// Вклад пары через rank разделимых ядер: строки в tmp, затем столбцы с добавлением в результат.
+// Аргументы weight и result у cols_kernel задаются заранее
+cl_int enqueue_separable_conv(cl_command_queue queue, cl_kernel rows_kernel, cl_kernel cols_kernel, cl_mem pics,
+                              cl_ulong image_offset, int image_width, int image_height, cl_mem tmp,
+                              cl_mem row_taps, cl_mem col_taps, int radius_x, int radius_y, int rank)
+{
+    cl_int ret = CL_SUCCESS;
+    ret |= clSetKernelArg(rows_kernel, 0, sizeof(cl_mem), &pics);
+    ret |= clSetKernelArg(rows_kernel, 1, sizeof(image_offset), &image_offset);
+    ret |= clSetKernelArg(rows_kernel, 2, sizeof(image_width), &image_width);
+    ret |= clSetKernelArg(rows_kernel, 3, sizeof(image_height), &image_height);
+    ret |= clSetKernelArg(rows_kernel, 4, sizeof(cl_mem), &row_taps);
+    ret |= clSetKernelArg(rows_kernel, 5, sizeof(radius_x), &radius_x);
+    ret |= clSetKernelArg(rows_kernel, 6, sizeof(rank), &rank);
+    ret |= clSetKernelArg(rows_kernel, 7, sizeof(cl_mem), &tmp);
+
+    ret |= clSetKernelArg(cols_kernel, 0, sizeof(cl_mem), &tmp);
+    ret |= clSetKernelArg(cols_kernel, 1, sizeof(image_width), &image_width);
+    ret |= clSetKernelArg(cols_kernel, 2, sizeof(image_height), &image_height);
+    ret |= clSetKernelArg(cols_kernel, 3, sizeof(cl_mem), &col_taps);
+    ret |= clSetKernelArg(cols_kernel, 4, sizeof(radius_y), &radius_y);
+    ret |= clSetKernelArg(cols_kernel, 5, sizeof(rank), &rank);
+    if (ret != CL_SUCCESS)
+    {
+        printf("Problems w/ setting KernelArgs for separable convolution\n");
+        return ret;
+    }
+
+    size_t global_size[] = {image_width, image_height};
+    ret = clEnqueueNDRangeKernel(queue, rows_kernel, 2, NULL, global_size,
+                                 tuned_local_size(rows_kernel, "separable_rows_kernel", 2, global_size), 0, NULL, NULL);
+    if (ret == CL_SUCCESS)
+        ret = clEnqueueNDRangeKernel(queue, cols_kernel, 2, NULL, global_size,
+                                     tuned_local_size(cols_kernel, "separable_cols_add_kernel", 2, global_size), 0, NULL, NULL);
+    return ret;
+}
+
+// Наибольшее число отсчётов на пиксель ( rank * (ширина + высота) разделимых ядер ), при котором разделимая
+// свёртка картинки быстрее pair_time ( сек ); замер на ядрах ранга 1. 0 - не выгодна никогда
+int benchmark_separable_crossover(cl_context ctx, cl_command_queue queue, cl_program program,
+                                  int image_width, int image_height, float pair_time)
+{
+    const int repeats = 5;
+    const int radii[] = {2, 4, 8, 16, 32, 64};
+    size_t image_size = (size_t)image_width * image_height;
+    size_t max_taps = 2 * MAX_SEPARABLE_RADIUS + 1;
+    int crossover = 0;
+    cl_int err = CL_SUCCESS;
+
+    cl_kernel rows_kernel = clCreateKernel(program, "separable_rows_kernel", &err);
+    cl_kernel cols_kernel = 0;
+    if (err == CL_SUCCESS)
+        cols_kernel = clCreateKernel(program, "separable_cols_add_kernel", &err);
+    cl_mem image = 0, tmp = 0, taps = 0, result = 0;
+    if (err == CL_SUCCESS)
+        image = clCreateBuffer(ctx, CL_MEM_READ_WRITE, image_size * sizeof(cl_float), NULL, &err);
+    if (err == CL_SUCCESS)
+        tmp = clCreateBuffer(ctx, CL_MEM_READ_WRITE, image_size * sizeof(cl_float), NULL, &err);
+    if (err == CL_SUCCESS)
+        result = clCreateBuffer(ctx, CL_MEM_READ_WRITE, image_size * sizeof(cl_float), NULL, &err);
+    if (err == CL_SUCCESS)
+        taps = clCreateBuffer(ctx, CL_MEM_READ_WRITE, max_taps * sizeof(cl_float), NULL, &err);
+    if (err == CL_SUCCESS)
+        err = clEnqueueFillBuffer(queue, image, &zero, sizeof(zero), 0, image_size * sizeof(cl_float), 0, NULL, NULL);
+    if (err == CL_SUCCESS)
+        err = clEnqueueFillBuffer(queue, result, &zero, sizeof(zero), 0, image_size * sizeof(cl_float), 0, NULL, NULL);
+    if (err == CL_SUCCESS)
+        err = clEnqueueFillBuffer(queue, taps, &zero, sizeof(zero), 0, max_taps * sizeof(cl_float), 0, NULL, NULL);
+
+    float weight = 1.0f;
+    int zero_offset = 0;
+    if (err == CL_SUCCESS)
+    {
+        err |= clSetKernelArg(cols_kernel, 6, sizeof(weight), &weight);
+        err |= clSetKernelArg(cols_kernel, 7, sizeof(cl_mem), &result);
+        err |= clSetKernelArg(cols_kernel, 8, sizeof(image_width), &image_width);
+        err |= clSetKernelArg(cols_kernel, 9, sizeof(zero_offset), &zero_offset);
+        err |= clSetKernelArg(cols_kernel, 10, sizeof(zero_offset), &zero_offset);
+    }
+
+    for (int r = 0; r < sizeof(radii) / sizeof(radii[0]) && err == CL_SUCCESS; r++)
+    {
+        if (radii[r] > (image_width - 1) / 2 || radii[r] > (image_height - 1) / 2)
+            break;
+
+        double time_start = 0;
+        for (int i = 0; i <= repeats && err == CL_SUCCESS; i++)
+        {
+            if (i == 1)
+            {
+                clFinish(queue);
+                time_start = get_wall_time();
+            }
+            err = enqueue_separable_conv(queue, rows_kernel, cols_kernel, image, 0, image_width, image_height, tmp,
+                                         taps, taps, radii[r], radii[r], 1);
+        }
+        clFinish(queue);
+        float separable_time = (float)((get_wall_time() - time_start) / repeats);
+        show_status_string("Separable convolution, rank 1, support %dx%d: %f ( FFT pair: %f )", 2 * radii[r] + 1,
+                           2 * radii[r] + 1, separable_time, pair_time);
+        if (err != CL_SUCCESS || separable_time >= pair_time)
+            break;
+        crossover = 2 * (2 * radii[r] + 1);
+    }
+
+    if (taps)
+        clReleaseMemObject(taps);
+    if (result)
+        clReleaseMemObject(result);
+    if (tmp)
+        clReleaseMemObject(tmp);
+    if (image)
+        clReleaseMemObject(image);
+    if (cols_kernel)
+        clReleaseKernel(cols_kernel);
+    if (rows_kernel)
+        clReleaseKernel(rows_kernel);
+    return crossover;
+}
+
+// Собственные числа и векторы симметричной матрицы a ( n x n, портится ) вращениями Якоби:
+// eigenvalues[i] и столбец i матрицы vectors
+void jacobi_eigen(double *a, int n, double *eigenvalues, double *vectors)
+{
+    for (int i = 0; i < n; i++)
+        for (int j = 0; j < n; j++)
+            vectors[i * n + j] = i == j;
+
+    for (int sweep = 0; sweep < 64; sweep++)
+    {
+        double off = 0, diagonal = 0;
+        for (int p = 0; p < n; p++)
+        {
+            diagonal += a[p * n + p] * a[p * n + p];
+            for (int q = p + 1; q < n; q++)
+                off += a[p * n + q] * a[p * n + q];
+        }
+        if (off <= 1e-24 * diagonal)
+            break;
+
+        for (int p = 0; p < n; p++)
+            for (int q = p + 1; q < n; q++)
+            {
+                if (a[p * n + q] == 0)
+                    continue;
+                double theta = (a[q * n + q] - a[p * n + p]) / (2 * a[p * n + q]);
+                double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1));
+                double c = 1 / sqrt(t * t + 1);
+                double s = t * c;
+                for (int k = 0; k < n; k++)
+                {
+                    double akp = a[k * n + p], akq = a[k * n + q];
+                    a[k * n + p] = c * akp - s * akq;
+                    a[k * n + q] = s * akp + c * akq;
+                }
+                for (int k = 0; k < n; k++)
+                {
+                    double apk = a[p * n + k], aqk = a[q * n + k];
+                    a[p * n + k] = c * apk - s * aqk;
+                    a[q * n + k] = s * apk + c * aqk;
+                }
+                for (int k = 0; k < n; k++)
+                {
+                    double vkp = vectors[k * n + p], vkq = vectors[k * n + q];
+                    vectors[k * n + p] = c * vkp - s * vkq;
+                    vectors[k * n + q] = s * vkp + c * vkq;
+                }
+            }
+    }
+    for (int i = 0; i < n; i++)
+        eigenvalues[i] = a[i * n + i];
+}
+
+// Разложение опоры PSF box ( height x width ) в сумму разделимых ядер через SVD ( собственные векторы box^T box ):
+// row_taps[r] = v_r, col_taps[r] = box v_r = sigma_r u_r. Возвращает наименьший rank <= max_rank с относительной
+// ошибкой по норме Фробениуса не больше tolerance, 0 - такого нет
+int separable_psf_taps(const float *box, int width, int height, float tolerance, int max_rank, float *row_taps, float *col_taps)
+{
+    double *gram = (double *) calloc((size_t)width * width, sizeof(double));
+    double *eigenvalues = (double *) malloc(width * sizeof(double));
+    double *vectors = (double *) malloc((size_t)width * width * sizeof(double));
+    int *order = (int *) malloc(width * sizeof(int));
+
+    for (int i = 0; i < width; i++)
+        for (int j = i; j < width; j++)
+        {
+            double sum = 0;
+            for (int b = 0; b < height; b++)
+                sum += (double)box[b * width + i] * box[b * width + j];
+            gram[i * width + j] = gram[j * width + i] = sum;
+        }
+    jacobi_eigen(gram, width, eigenvalues, vectors);
+
+    // по убыванию собственных чисел ( квадратов сингулярных )
+    double total = 0;
+    for (int i = 0; i < width; i++)
+    {
+        order[i] = i;
+        total += eigenvalues[i] > 0 ? eigenvalues[i] : 0;
+    }
+    for (int i = 1; i < width; i++)
+        for (int j = i; j > 0 && eigenvalues[order[j]] > eigenvalues[order[j - 1]]; j--)
+        {
+            int swap = order[j];
+            order[j] = order[j - 1];
+            order[j - 1] = swap;
+        }
+
+    int rank = 0;
+    double rest = total;
+    while (rank < max_rank && rank < width && rest > (double)tolerance * tolerance * total)
+    {
+        double value = eigenvalues[order[rank]];
+        rest -= value > 0 ? value : 0;
+        rank++;
+    }
+    if (rest > (double)tolerance * tolerance * total)
+        rank = 0;
+
+    for (int r = 0; r < rank; r++)
+    {
+        int v = order[r];
+        for (int a = 0; a < width; a++)
+            row_taps[r * width + a] = (float)vectors[a * width + v];
+        for (int b = 0; b < height; b++)
+        {
+            double sum = 0;
+            for (int a = 0; a < width; a++)
+                sum += box[b * width + a] * vectors[a * width + v];
+            col_taps[r * height + b] = (float)sum;
+        }
+    }
+
+    free(order);
+    free(vectors);
+    free(eigenvalues);
+    free(gram);
+    return rank;
+}
+
+void DeInitDirect_convolution(struct Direct_convolution *direct)
+{
+    for (int k = 0; direct->psf_boxes != NULL && k < direct->amount_of_h; k++)
+    {
+        if (direct->psf_boxes[k])
+            clReleaseMemObject(direct->psf_boxes[k]);
+        if (direct->row_taps[k])
+            clReleaseMemObject(direct->row_taps[k]);
+        if (direct->col_taps[k])
+            clReleaseMemObject(direct->col_taps[k]);
+    }
+    free(direct->psf_boxes);
+    free(direct->rank);
+    free(direct->row_taps);
+    free(direct->col_taps);
+    if (direct->separable_tmp)
+        clReleaseMemObject(direct->separable_tmp);
+    if (direct->rows_kernel)
+        clReleaseKernel(direct->rows_kernel);
+    if (direct->cols_kernel)
+        clReleaseKernel(direct->cols_kernel);
+    free(direct->radius_x);
+    free(direct->radius_y);
+    if (direct->pics)
+        clReleaseMemObject(direct->pics);
+    if (direct->kernel)
+        clReleaseKernel(direct->kernel);
+    memset(direct, 0, sizeof(*direct));
+}
+
+// Радиусы опор PSF_k, выбор пар для прямой свёртки ( площадь опоры не больше, чем у порога crossover_radius )
+// или разделимой ( rank при допуске separable_tolerance, rank * (ширина + высота) не больше separable_taps ),
+// опоры PSF или разделимые ядра и картинки в пространстве на устройстве. weight - множитель, с которым прямая свёртка
+// совпадает с результатом пары через ПФ ( scaling * sqrt(N), см. result_scaling ).
+// crossover_radius < 0 или separable_taps <= 0 выключают соответствующий способ.
+// Если ни одна пара не подходит, direct остаётся пустым.
+cl_int InitDirect_convolution(cl_context ctx, cl_command_queue queue, cl_program program, const struct Conv_geometry *geometry,
+                              int amount_of_h, int crossover_radius, int separable_taps, float separable_tolerance,
+                              float weight, cl_mem result_CL, struct Direct_convolution *direct)
+{
+    cl_int err = CL_SUCCESS;
+    int width = geometry->image_width;
+    int height = geometry->image_height;
+    memset(direct, 0, sizeof(*direct));
+    if (crossover_radius < 0 && separable_taps <= 0)
+        return CL_SUCCESS;
+
+    direct->amount_of_h = amount_of_h;
+    direct->image_width = width;
+    direct->image_height = height;
+    direct->psf_boxes = (cl_mem *) calloc(amount_of_h, sizeof(cl_mem));
+    direct->radius_x = (int *) calloc(amount_of_h, sizeof(int));
+    direct->radius_y = (int *) calloc(amount_of_h, sizeof(int));
+    direct->rank = (int *) calloc(amount_of_h, sizeof(int));
+    direct->row_taps = (cl_mem *) calloc(amount_of_h, sizeof(cl_mem));
+    direct->col_taps = (cl_mem *) calloc(amount_of_h, sizeof(cl_mem));
+
+    // опоры по отдельности ( геометрия для ПФ не меняется )
+    struct Conv_geometry scratch_geometry = *geometry;
+    err = measure_psf_support(ctx, queue, program, amount_of_h, options.psf_tail, &scratch_geometry,
+                              direct->radius_x, direct->radius_y);
+
+    int amount_of_direct = 0;
+    int max_rank = 0;
+    int crossover_area = crossover_radius < 0 ? 0 : (2 * crossover_radius + 1) * (2 * crossover_radius + 1);
+    struct Psf_generator psf;
+    memset(&psf, 0, sizeof(psf));
+    if (err == CL_SUCCESS)
+        err = InitPsf_generator(ctx, queue, program, width, height, &psf);
+
+    float *box = (float *) malloc((size_t)(2 * MAX_SEPARABLE_RADIUS + 1) * (2 * MAX_SEPARABLE_RADIUS + 1) * sizeof(float));
+    float *row_taps = (float *) malloc((size_t)MAX_SEPARABLE_RANK * (2 * MAX_SEPARABLE_RADIUS + 1) * sizeof(float));
+    float *col_taps = (float *) malloc((size_t)MAX_SEPARABLE_RANK * (2 * MAX_SEPARABLE_RADIUS + 1) * sizeof(float));
+    for (int k = 0; k < amount_of_h && err == CL_SUCCESS; k++)
+    {
+        // опора целиком внутри картинки PSF
+        int rx = direct->radius_x[k];
+        int ry = direct->radius_y[k];
+        if (rx > (width - 1) / 2 || ry > (height - 1) / 2)
+            continue;
+        size_t box_width = 2 * rx + 1;
+        size_t box_height = 2 * ry + 1;
+        int direct_area = rx <= MAX_DIRECT_CONV_RADIUS && ry <= MAX_DIRECT_CONV_RADIUS &&
+                          (int)(box_width * box_height) <= crossover_area ? (int)(box_width * box_height) : 0;
+        int separable = separable_taps > 0 && rx <= MAX_SEPARABLE_RADIUS && ry <= MAX_SEPARABLE_RADIUS;
+        if (direct_area == 0 && !separable)
+            continue;
+
+        err = make_psf(&psf, queue, k);
+        size_t src_origin[] = {(width / 2 - rx) * sizeof(cl_float), height / 2 - ry, 0};
+        size_t dst_origin[] = {0, 0, 0};
+        size_t region[] = {box_width * sizeof(cl_float), box_height, 1};
+
+        // ранг разделимого приближения и его цена на пиксель
+        int rank = 0;
+        if (err == CL_SUCCESS && separable)
+        {
+            err = clEnqueueReadBufferRect(queue, psf.h_CL_k.buffers[0], CL_TRUE, src_origin, dst_origin, region,
+                                          width * sizeof(cl_float), 0, box_width * sizeof(cl_float), 0, box, 0, NULL, NULL);
+            if (err == CL_SUCCESS)
+                rank = separable_psf_taps(box, box_width, box_height, separable_tolerance, MAX_SEPARABLE_RANK, row_taps, col_taps);
+            if (rank > 0 && rank * (int)(box_width + box_height) > separable_taps)
+                rank = 0;
+            if (rank > 0 && direct_area > 0 && direct_area <= rank * (int)(box_width + box_height))
+                rank = 0;
+        }
+        if (err != CL_SUCCESS || (direct_area == 0 && rank == 0))
+            continue;
+
+        if (rank > 0)
+        {
+            direct->rank[k] = rank;
+            direct->row_taps[k] = clCreateBuffer(ctx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, rank * box_width * sizeof(cl_float),
+                                                 row_taps, &err);
+            if (err == CL_SUCCESS)
+                direct->col_taps[k] = clCreateBuffer(ctx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                                     rank * box_height * sizeof(cl_float), col_taps, &err);
+            if (rank > max_rank)
+                max_rank = rank;
+            show_status_string("h[%d]: separable convolution, rank %d, %dx%d support", k, rank, (int)box_width, (int)box_height);
+        }
+        else
+        {
+            direct->psf_boxes[k] = clCreateBuffer(ctx, CL_MEM_READ_ONLY, box_width * box_height * sizeof(cl_float), NULL, &err);
+            if (err == CL_SUCCESS)
+                err = clEnqueueCopyBufferRect(queue, psf.h_CL_k.buffers[0], direct->psf_boxes[k], src_origin, dst_origin, region,
+                                              width * sizeof(cl_float), 0, box_width * sizeof(cl_float), 0, 0, NULL, NULL);
+            if (err == CL_SUCCESS)
+                err = clFinish(queue);
+            show_status_string("h[%d]: direct convolution with %dx%d support", k, (int)box_width, (int)box_height);
+        }
+        amount_of_direct++;
+    }
+    free(col_taps);
+    free(row_taps);
+    free(box);
+    DeInitPsf_generator(&psf);
+
+    if (err == CL_SUCCESS && amount_of_direct == 0)
+    {
+        show_status_string("Hybrid convolution: every PSF is wider than the crossover, all pairs use FFT");
+        DeInitDirect_convolution(direct);
+        return CL_SUCCESS;
+    }
+
+    /// Картинки в пространстве ( для ПФ они уже превращены в спектры )
+    size_t image_size = (size_t)width * height;
+    float *pic = (float *) malloc(image_size * sizeof(float));
+    if (err == CL_SUCCESS)
+        direct->pics = clCreateBuffer(ctx, CL_MEM_READ_ONLY, image_size * amount_of_h * sizeof(cl_float), NULL, &err);
+    for (int n = 0; n < amount_of_h && err == CL_SUCCESS; n++)
+    {
+        char filename[64] = {'\0'};
+        make_pic_filename(filename, width, height, n);
+        struct Image image = read_png_file(filename);
+        if (image.row_pointers == NULL || image.width != width || image.height != height)
+            err = CL_INVALID_VALUE;
+        for (int l = 0; l < image.height && image.row_pointers != NULL; l++)
+        {
+            for (int p = 0; p < image.width && err == CL_SUCCESS; p++)
+                pic[(size_t)l * width + p] = image.row_pointers[l][p];
+            free(image.row_pointers[l]);
+        }
+        free(image.row_pointers);
+        if (err == CL_SUCCESS)
+            err = clEnqueueWriteBuffer(queue, direct->pics, CL_TRUE, image_size * n * sizeof(cl_float),
+                                       image_size * sizeof(cl_float), pic, 0, NULL, NULL);
+    }
+    free(pic);
+
+    int result_pitch = geometry->sizex;
+    if (err == CL_SUCCESS)
+        direct->kernel = clCreateKernel(program, "direct_conv_kernel", &err);
+    if (err == CL_SUCCESS)
+    {
+        err |= clSetKernelArg(direct->kernel, 7, sizeof(weight), &weight);
+        err |= clSetKernelArg(direct->kernel, 8, sizeof(cl_mem), &result_CL);
+        err |= clSetKernelArg(direct->kernel, 9, sizeof(result_pitch), &result_pitch);
+        err |= clSetKernelArg(direct->kernel, 10, sizeof(geometry->crop_x), &geometry->crop_x);
+        err |= clSetKernelArg(direct->kernel, 11, sizeof(geometry->crop_y), &geometry->crop_y);
+    }
+
+    /// Разделимые ядра: черновик строк и kernel'ы
+    if (err == CL_SUCCESS && max_rank > 0)
+    {
+        direct->separable_tmp = clCreateBuffer(ctx, CL_MEM_READ_WRITE, image_size * max_rank * sizeof(cl_float), NULL, &err);
+        if (err == CL_SUCCESS)
+            direct->rows_kernel = clCreateKernel(program, "separable_rows_kernel", &err);
+        if (err == CL_SUCCESS)
+            direct->cols_kernel = clCreateKernel(program, "separable_cols_add_kernel", &err);
+        if (err == CL_SUCCESS)
+        {
+            err |= clSetKernelArg(direct->cols_kernel, 6, sizeof(weight), &weight);
+            err |= clSetKernelArg(direct->cols_kernel, 7, sizeof(cl_mem), &result_CL);
+            err |= clSetKernelArg(direct->cols_kernel, 8, sizeof(result_pitch), &result_pitch);
+            err |= clSetKernelArg(direct->cols_kernel, 9, sizeof(geometry->crop_x), &geometry->crop_x);
+            err |= clSetKernelArg(direct->cols_kernel, 10, sizeof(geometry->crop_y), &geometry->crop_y);
+        }
+    }
+
+    if (err != CL_SUCCESS)
+    {
+        printf("InitDirect_convolution: Error %d\n", err);
+        DeInitDirect_convolution(direct);
+    }
+    return err;
+}
+
+// Пара ( картинка n, h_k ) считается прямой или разделимой свёрткой
+int uses_direct_conv(const struct Direct_convolution *direct, int k)
+{
+    return direct != NULL && direct->psf_boxes != NULL && (direct->psf_boxes[k] != 0 || direct->rank[k] > 0);
+}
+
+// Вклад пары ( картинка n, h_k ) прямой или разделимой свёрткой
+cl_int enqueue_direct_pair(const struct Direct_convolution *direct, cl_command_queue queue, int n, int k)
+{
+    cl_ulong image_offset = (cl_ulong)direct->image_width * direct->image_height * n;
+    if (direct->rank[k] > 0)
+        return enqueue_separable_conv(queue, direct->rows_kernel, direct->cols_kernel, direct->pics, image_offset,
+                                      direct->image_width, direct->image_height, direct->separable_tmp,
+                                      direct->row_taps[k], direct->col_taps[k], direct->radius_x[k], direct->radius_y[k],
+                                      direct->rank[k]);
+    return enqueue_direct_conv(queue, direct->kernel, direct->pics, image_offset, direct->image_width, direct->image_height,
+                               direct->psf_boxes[k], direct->radius_x[k], direct->radius_y[k]);
+}
+
+/// ДАЛЬНИЕ СЛОИ В ПОНИЖЕННОМ РАЗРЕШЕНИИ ( --reduce-far-layers F )
+// Спектр h_k сильно расфокусированного слоя сосредоточен на низких частотах. Для каждого h_k ищется
+// полоса |u| <= band_x, |v| <= band_y, вне которой лежит не больше доли F энергии |H_k|^2 ( по F/2 на ось ),
+// и если уменьшенное ПФ ( полоса с двукратным запасом для интерполяции ) хотя бы вчетверо меньше полного,
+// пары с h_k считаются на нём: multiply_reduced_kernel -> обратное ПФ уменьшенного размера ->
+// add_upsampled_abs_kernel ( бикубическая интерполяция модуля обратно на сетку ПФ ).
+
+struct Reduced_layers {
+    cl_kernel multiply_kernel;
+    cl_kernel upsample_kernel;
+    int amount_of_h;
+    // уменьшенный размер ПФ для h_k, 0 - пары с h_k считаются в полном разрешении
+    int *reduced_sizex;
+    int *reduced_sizey;
+    int *band_x;
+    int *band_y;
+    struct FFT_OpenCL_data *fft;
+    // уменьшенный результат пары ( по самому большому из уменьшенных размеров )
+    struct Cl_Buffer_pair result_part;
+    // спектры картинок ( не владеет )
+    struct Cl_Buffer_pair *images;
+    enum Data_layout layout;
+    int sizex;
+    int sizey;
+    int image_width;
+    int image_height;
+    int crop_x;
+    int crop_y;
+    float scaling;
+};
+
+// Наименьшая полоса |f| <= band, вне которой энергия не больше limit; energy[f] - энергия частоты f
+// ( f = 0..length-1, частоты больше length/2 - отрицательные )
+int spectrum_band(const double *energy, int length, double limit)
+{
+    double outside = 0;
+    for (int f = 1; f < length; f++)
+        outside += energy[f];
+
+    int band = 0;
+    while (outside > limit && band < length / 2)
+    {
+        band++;
+        outside -= energy[band];
+        if (length - band != band)
+            outside -= energy[length - band];
+    }
+    return band;
+}
+
+void DeInitReduced_layers(struct Reduced_layers *reduced)
+{
+    for (int k = 0; reduced->fft != NULL && k < reduced->amount_of_h; k++)
+        DeInItFFT_OpenCL_data(&reduced->fft[k]);
+    free(reduced->fft);
+    free(reduced->reduced_sizex);
+    free(reduced->reduced_sizey);
+    free(reduced->band_x);
+    free(reduced->band_y);
+    DeInItCl_Buffer_pair(&reduced->result_part);
+    if (reduced->multiply_kernel)
+        clReleaseKernel(reduced->multiply_kernel);
+    if (reduced->upsample_kernel)
+        clReleaseKernel(reduced->upsample_kernel);
+    memset(reduced, 0, sizeof(*reduced));
+}
+
+// Полосы h_k ( по float спектрам h_rash_CL ) и уменьшенные ПФ; если ни одно h_k не подходит, reduced остаётся пустым
+cl_int InitReduced_layers(cl_context ctx, cl_command_queue queue, cl_program program, enum Data_layout layout,
+                          const struct Conv_geometry *geometry, int amount_of_h, struct Cl_Buffer_pair *images,
+                          struct Cl_Buffer_pair *h_rash_CL, float energy_budget, float scaling, struct Reduced_layers *reduced)
+{
+    cl_int err = CL_SUCCESS;
+    int sizex = geometry->sizex;
+    int sizey = geometry->sizey;
+    size_t N = (size_t)sizex * sizey;
+    const int floats_per_pixel = layout == LAYOUT_INTERLEAVED ? 2 : 1;
+
+    memset(reduced, 0, sizeof(*reduced));
+    reduced->amount_of_h = amount_of_h;
+    reduced->layout = layout;
+    reduced->sizex = sizex;
+    reduced->sizey = sizey;
+    reduced->image_width = geometry->image_width;
+    reduced->image_height = geometry->image_height;
+    reduced->crop_x = geometry->crop_x;
+    reduced->crop_y = geometry->crop_y;
+    reduced->scaling = scaling;
+    reduced->images = images;
+    reduced->reduced_sizex = (int *) calloc(amount_of_h, sizeof(int));
+    reduced->reduced_sizey = (int *) calloc(amount_of_h, sizeof(int));
+    reduced->band_x = (int *) calloc(amount_of_h, sizeof(int));
+    reduced->band_y = (int *) calloc(amount_of_h, sizeof(int));
+    reduced->fft = (struct FFT_OpenCL_data *) calloc(amount_of_h, sizeof(struct FFT_OpenCL_data));
+
+    float *spectrum = (float *) malloc(N * 2 * sizeof(float));
+    double *energy_x = (double *) malloc(sizex * sizeof(double));
+    double *energy_y = (double *) malloc(sizey * sizeof(double));
+    size_t max_reduced_N = 0;
+
+    for (int k = 0; k < amount_of_h && err == CL_SUCCESS; k++)
+    {
+        // re и im подряд ( planar ) или пары ( interleaved ) - для энергии всё равно
+        err = clEnqueueReadBuffer(queue, h_rash_CL[k].buffers[0], CL_TRUE, 0, N * floats_per_pixel * sizeof(float),
+                                  spectrum, 0, NULL, NULL);
+        if (err == CL_SUCCESS && layout == LAYOUT_PLANAR)
+            err = clEnqueueReadBuffer(queue, h_rash_CL[k].buffers[1], CL_TRUE, 0, N * sizeof(float), spectrum + N, 0, NULL, NULL);
+        if (err != CL_SUCCESS)
+            break;
+
+        double total = 0;
+        memset(energy_x, 0, sizex * sizeof(double));
+        memset(energy_y, 0, sizey * sizeof(double));
+        for (int v = 0; v < sizey; v++)
+            for (int u = 0; u < sizex; u++)
+            {
+                size_t e = (size_t)v * sizex + u;
+                double re = layout == LAYOUT_PLANAR ? spectrum[e] : spectrum[2 * e];
+                double im = layout == LAYOUT_PLANAR ? spectrum[N + e] : spectrum[2 * e + 1];
+                double value = re * re + im * im;
+                energy_x[u] += value;
+                energy_y[v] += value;
+                total += value;
+            }
+
+        reduced->band_x[k] = spectrum_band(energy_x, sizex, total * energy_budget / 2);
+        reduced->band_y[k] = spectrum_band(energy_y, sizey, total * energy_budget / 2);
+        // двукратный запас по частоте дискретизации, чтобы интерполяция модуля была гладкой
+        int reduced_sizex = next_fft_size(2 * (2 * reduced->band_x[k] + 1));
+        int reduced_sizey = next_fft_size(2 * (2 * reduced->band_y[k] + 1));
+        if ((size_t)reduced_sizex * reduced_sizey * 4 > N || reduced_sizex > sizex || reduced_sizey > sizey)
+        {
+            show_status_string("h[%d]: band %dx%d, full resolution %dx%d", k, 2 * reduced->band_x[k] + 1,
+                               2 * reduced->band_y[k] + 1, sizex, sizey);
+            continue;
+        }
+
+        err = InitFFT_OpenCL_data(reduced_sizex, reduced_sizey, ctx, queue, 1, CLFFT_BACKWARD, layout, &reduced->fft[k]);
+        if (err != CL_SUCCESS)
+            break;
+        reduced->reduced_sizex[k] = reduced_sizex;
+        reduced->reduced_sizey[k] = reduced_sizey;
+        if ((size_t)reduced_sizex * reduced_sizey > max_reduced_N)
+            max_reduced_N = (size_t)reduced_sizex * reduced_sizey;
+        show_status_string("h[%d]: band %dx%d, reduced resolution %dx%d ( %.1f%% of the points )", k, 2 * reduced->band_x[k] + 1,
+                           2 * reduced->band_y[k] + 1, reduced_sizex, reduced_sizey, 100.0 * reduced_sizex * reduced_sizey / N);
+    }
+    free(energy_y);
+    free(energy_x);
+    free(spectrum);
+
+    if (err == CL_SUCCESS && max_reduced_N == 0)
+    {
+        show_status_string("Reduced resolution: every h is too wide-band, all pairs use full resolution");
+        DeInitReduced_layers(reduced);
+        return CL_SUCCESS;
+    }
+
+    if (err == CL_SUCCESS)
+        err = InitCl_Buffer_complex(ctx, queue, CL_MEM_READ_WRITE, max_reduced_N, layout, &reduced->result_part);
+    if (err == CL_SUCCESS)
+        reduced->multiply_kernel = clCreateKernel(program, "multiply_reduced_kernel", &err);
+    if (err == CL_SUCCESS)
+        reduced->upsample_kernel = clCreateKernel(program, "add_upsampled_abs_kernel", &err);
+    if (err != CL_SUCCESS)
+    {
+        printf("InitReduced_layers: Error %d\n", err);
+        DeInitReduced_layers(reduced);
+    }
+    return err;
+}
+
+int uses_reduced_resolution(const struct Reduced_layers *reduced, int k)
+{
+    return reduced != NULL && reduced->reduced_sizex != NULL && reduced->reduced_sizex[k] != 0;
+}
+
+// Вклад пары ( картинка с началом image_offset в спектрах картинок, h_k ) в result_CL в пониженном разрешении
+cl_int enqueue_reduced_pair(struct Reduced_layers *reduced, cl_command_queue queue, cl_ulong image_offset,
+                            struct Cl_Buffer_pair *h, int k, cl_mem result_CL)
+{
+    struct Cl_Buffer_pair *images = reduced->images;
+    cl_int ret = CL_SUCCESS;
+    int interleaved = reduced->layout == LAYOUT_INTERLEAVED;
+    int complex_pitch = interleaved ? 2 : 1;
+    int imag_offset = interleaved ? 1 : 0;
+    cl_mem images_imag = interleaved ? images->buffers[0] : images->buffers[1];
+    cl_mem h_imag = interleaved ? h->buffers[0] : h->buffers[1];
+    cl_mem reduced_imag = interleaved ? reduced->result_part.buffers[0] : reduced->result_part.buffers[1];
+    int reduced_sizex = reduced->reduced_sizex[k];
+    int reduced_sizey = reduced->reduced_sizey[k];
+    // обратное ПФ размера N' нормировано на 1/sqrt(N'), а полное - на 1/sqrt(N)
+    float scaling = reduced->scaling * sqrtf((float)reduced_sizex * reduced_sizey / ((float)reduced->sizex * reduced->sizey));
+
+    cl_kernel multiply = reduced->multiply_kernel;
+    ret |= clSetKernelArg(multiply, 0, sizeof(cl_mem), &images->buffers[0]);
+    ret |= clSetKernelArg(multiply, 1, sizeof(cl_mem), &images_imag);
+    ret |= clSetKernelArg(multiply, 2, sizeof(image_offset), &image_offset);
+    ret |= clSetKernelArg(multiply, 3, sizeof(cl_mem), &h->buffers[0]);
+    ret |= clSetKernelArg(multiply, 4, sizeof(cl_mem), &h_imag);
+    ret |= clSetKernelArg(multiply, 5, sizeof(complex_pitch), &complex_pitch);
+    ret |= clSetKernelArg(multiply, 6, sizeof(imag_offset), &imag_offset);
+    ret |= clSetKernelArg(multiply, 7, sizeof(reduced->sizex), &reduced->sizex);
+    ret |= clSetKernelArg(multiply, 8, sizeof(reduced->sizey), &reduced->sizey);
+    ret |= clSetKernelArg(multiply, 9, sizeof(reduced->band_x[k]), &reduced->band_x[k]);
+    ret |= clSetKernelArg(multiply, 10, sizeof(reduced->band_y[k]), &reduced->band_y[k]);
+    ret |= clSetKernelArg(multiply, 11, sizeof(cl_mem), &reduced->result_part.buffers[0]);
+    ret |= clSetKernelArg(multiply, 12, sizeof(cl_mem), &reduced_imag);
+
+    cl_kernel upsample = reduced->upsample_kernel;
+    ret |= clSetKernelArg(upsample, 0, sizeof(cl_mem), &reduced->result_part.buffers[0]);
+    ret |= clSetKernelArg(upsample, 1, sizeof(cl_mem), &reduced_imag);
+    ret |= clSetKernelArg(upsample, 2, sizeof(complex_pitch), &complex_pitch);
+    ret |= clSetKernelArg(upsample, 3, sizeof(imag_offset), &imag_offset);
+    ret |= clSetKernelArg(upsample, 4, sizeof(reduced_sizex), &reduced_sizex);
+    ret |= clSetKernelArg(upsample, 5, sizeof(reduced_sizey), &reduced_sizey);
+    ret |= clSetKernelArg(upsample, 6, sizeof(reduced->sizex), &reduced->sizex);
+    ret |= clSetKernelArg(upsample, 7, sizeof(reduced->sizey), &reduced->sizey);
+    ret |= clSetKernelArg(upsample, 8, sizeof(reduced->crop_x), &reduced->crop_x);
+    ret |= clSetKernelArg(upsample, 9, sizeof(reduced->crop_y), &reduced->crop_y);
+    ret |= clSetKernelArg(upsample, 10, sizeof(scaling), &scaling);
+    ret |= clSetKernelArg(upsample, 11, sizeof(cl_mem), &result_CL);
+    if (ret != CL_SUCCESS)
+    {
+        printf("Problems w/ setting KernelArgs for reduced resolution pair\n");
+        return ret;
+    }
+
+    size_t reduced_global_size[] = {reduced_sizex, reduced_sizey};
+    ret = clEnqueueNDRangeKernel(queue, multiply, 2, NULL, reduced_global_size,
+                                 tuned_local_size(multiply, "multiply_reduced_kernel", 2, reduced_global_size), 0, NULL, NULL);
+    if (ret == CL_SUCCESS)
+        ret = FFT_2D_OpenCL(&reduced->result_part, CLFFT_BACKWARD, queue, CL_FALSE, &reduced->fft[k]);
+    size_t image_global_size[] = {reduced->image_width, reduced->image_height};
+    if (ret == CL_SUCCESS)
+        ret = clEnqueueNDRangeKernel(queue, upsample, 2, NULL, image_global_size,
+                                     tuned_local_size(upsample, "add_upsampled_abs_kernel", 2, image_global_size), 0, NULL, NULL);
+    return ret;
+}
+
+/// КОМПАКТНОЕ ХРАНЕНИЕ h ( --compact-otf )
+// Вне полосы пропускания зрачка спектр h почти нулевой. Для каждой строки хранится отрезок частот ( со знаком ),
+// где |h| > threshold * max|h|, значения отрезков подряд ( float2 ), плюс таблица строк ( cl_int4: начало, конец,
+// смещение значений ) - формат multiply_sparse_kernel. Компактный h_rash_CL[k] - buffers[0] значения, buffers[1] таблица.
+
+// Компактная копия float спектра h ( interleaved или planar ); *stored - сколько частот сохранено
+cl_int compact_h_spectrum(cl_context ctx, cl_command_queue queue, enum Data_layout layout, int sizex, int sizey,
+                          float threshold, struct Cl_Buffer_pair *h, struct Cl_Buffer_pair *compact, size_t *stored)
+{
+    cl_int err = CL_SUCCESS;
+    size_t N = (size_t)sizex * sizey;
+    const int floats_per_pixel = layout == LAYOUT_INTERLEAVED ? 2 : 1;
+    memset(compact, 0, sizeof(*compact));
+
+    float *spectrum = (float *) malloc(N * 2 * sizeof(float));
+    err = clEnqueueReadBuffer(queue, h->buffers[0], CL_TRUE, 0, N * floats_per_pixel * sizeof(float), spectrum, 0, NULL, NULL);
+    if (err == CL_SUCCESS && layout == LAYOUT_PLANAR)
+        err = clEnqueueReadBuffer(queue, h->buffers[1], CL_TRUE, 0, N * sizeof(float), spectrum + N, 0, NULL, NULL);
+    if (err != CL_SUCCESS)
+    {
+        free(spectrum);
+        return err;
+    }
+
+    // сравниваем квадраты модулей
+    float max_abs2 = 0;
+    for (size_t e = 0; e < N; e++)
+    {
+        float re = layout == LAYOUT_PLANAR ? spectrum[e] : spectrum[2 * e];
+        float im = layout == LAYOUT_PLANAR ? spectrum[N + e] : spectrum[2 * e + 1];
+        if (re * re + im * im > max_abs2)
+            max_abs2 = re * re + im * im;
+    }
+    float limit = max_abs2 * threshold * threshold;
+
+    cl_int *rows = (cl_int *) malloc((size_t)sizey * 4 * sizeof(cl_int));
+    float *values = (float *) malloc(N * 2 * sizeof(float));
+    size_t count = 0;
+    for (int j = 0; j < sizey; j++)
+    {
+        // частоты со знаком: столбец i соответствует u = i при i <= sizex/2, иначе i - sizex
+        int lo = sizex;
+        int hi = -sizex;
+        for (int i = 0; i < sizex; i++)
+        {
+            size_t e = (size_t)j * sizex + i;
+            float re = layout == LAYOUT_PLANAR ? spectrum[e] : spectrum[2 * e];
+            float im = layout == LAYOUT_PLANAR ? spectrum[N + e] : spectrum[2 * e + 1];
+            int u = i <= sizex / 2 ? i : i - sizex;
+            if (re * re + im * im > limit)
+            {
+                lo = u < lo ? u : lo;
+                hi = u > hi ? u : hi;
+            }
+        }
+        rows[4 * j] = lo;
+        rows[4 * j + 1] = hi;
+        rows[4 * j + 2] = (cl_int)count;
+        rows[4 * j + 3] = 0;
+        for (int u = lo; u <= hi; u++, count++)
+        {
+            size_t e = (size_t)j * sizex + (u < 0 ? u + sizex : u);
+            values[2 * count] = layout == LAYOUT_PLANAR ? spectrum[e] : spectrum[2 * e];
+            values[2 * count + 1] = layout == LAYOUT_PLANAR ? spectrum[N + e] : spectrum[2 * e + 1];
+        }
+    }
+    free(spectrum);
+
+    // буфер нулевого размера создать нельзя
+    size_t values_count = count > 0 ? count : 1;
+    compact->buffers[0] = clCreateBuffer(ctx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, values_count * 2 * sizeof(float),
+                                         values, &err);
+    if (err == CL_SUCCESS)
+        compact->buffers[1] = clCreateBuffer(ctx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, (size_t)sizey * 4 * sizeof(cl_int),
+                                             rows, &err);
+    free(values);
+    free(rows);
+    if (err != CL_SUCCESS)
+    {
+        printf("compact_h_spectrum: Error %d\n", err);
+        DeInItCl_Buffer_pair(compact);
+        return err;
+    }
+    *stored = count;
+    return CL_SUCCESS;
+}
+
+// Заменяет h_rash_CL[k] компактными копиями; h пар в пониженном разрешении ( reduced ) остаются полными.
+// Либо заменяются все, либо ни один
+cl_int compact_h_rash(cl_context ctx, cl_command_queue queue, enum Data_layout layout, const struct Conv_geometry *geometry,
+                      int amount_of_h, struct Cl_Buffer_pair *h_rash_CL, const struct Reduced_layers *reduced, float threshold)
+{
+    cl_int err = CL_SUCCESS;
+    size_t N = (size_t)geometry->sizex * geometry->sizey;
+    struct Cl_Buffer_pair compact[amount_of_h];
+    memset(compact, 0, sizeof(compact));
+    size_t full_bytes = 0;
+    size_t compact_bytes = 0;
+
+    for (int k = 0; k < amount_of_h && err == CL_SUCCESS; k++)
+    {
+        if (uses_reduced_resolution(reduced, k))
+            continue;
+        size_t stored = 0;
+        err = compact_h_spectrum(ctx, queue, layout, geometry->sizex, geometry->sizey, threshold, &h_rash_CL[k], &compact[k], &stored);
+        if (err != CL_SUCCESS)
+            break;
+        full_bytes += N * 2 * sizeof(float);
+        compact_bytes += stored * 2 * sizeof(float) + (size_t)geometry->sizey * 4 * sizeof(cl_int);
+        show_status_string("h[%d]: %zu of %zu frequencies stored ( %.1f%% )", k, stored, N, 100.0 * stored / N);
+    }
+
+    if (err != CL_SUCCESS)
+    {
+        for (int k = 0; k < amount_of_h; k++)
+            DeInItCl_Buffer_pair(&compact[k]);
+        return err;
+    }
+
+    for (int k = 0; k < amount_of_h; k++)
+        if (compact[k].buffers[0] != 0)
+        {
+            DeInItCl_Buffer_pair(&h_rash_CL[k]);
+            h_rash_CL[k] = compact[k];
+        }
+    show_status_string("Compact h: %.1f MB instead of %.1f MB", compact_bytes / 1048576.0, full_bytes / 1048576.0);
+    return CL_SUCCESS;
+}
+
+struct Layer_timing {
+    clock_t multiply_plus_add_time;
+    float time_multiply_full;
+    // время хоста на постановку пар в очередь ( аргументы и enqueue, без ожидания ) и число таких пар
+    clock_t enqueue_time;
+    int enqueued_pairs;
+};
+
+cl_int compute_result_layer(cl_command_queue queue, struct Pair_kernels *pair_kernels, struct FFT_OpenCL_data *fft_rash_size,
+                            struct Cl_Buffer_pair *result_part_CL, cl_mem result_CL, struct Cl_Buffer_pair *h_rash_CL,
+                            const struct Direct_convolution *direct, struct Reduced_layers *reduced, struct H_cache *h_cache,
+                            int m, int amount_of_pics, size_t N, struct Layer_timing *timing)
+{
+    cl_int err;
+    cl_int ret;
+
+    clock_t time1 = clock();
+
+    err = clEnqueueFillBuffer(queue, result_CL, &zero, sizeof(zero), 0, N * sizeof(float), 0, NULL, NULL);
+    if (err != CL_SUCCESS)
+    {
+        printf("Init result_CL clEnqueueFillBuffer ERROR\n");
+        return err;
+    }
+    ret = clFinish(queue);
+    if (ret != CL_SUCCESS)
+        printf("Problems w/ clFinish after copy");
+
+    clock_t time1_e = clock();
+    timing->multiply_plus_add_time += time1_e - time1;
+
+    for (int n = 0; n < amount_of_pics; n++)
+    {
+        clock_t time2 = clock();
+        cl_ulong offset = N * n;
+        int h_rash_CL_index = abs(n-m);
+
+        if (uses_direct_conv(direct, h_rash_CL_index))
+        {
+            ret = enqueue_direct_pair(direct, queue, n, h_rash_CL_index);
+            if (ret != CL_SUCCESS)
+                printf("Problems w/ direct convolution pair: %d\n", ret);
+            ret = clFinish(queue);
+            if (ret != CL_SUCCESS)
+                printf("Problems w/ clFinish");
+            timing->multiply_plus_add_time += clock() - time2;
+            printf("### index_result:%d index_input:%d ( direct )\n", m, n);
+            continue;
+        }
+
+        if (uses_reduced_resolution(reduced, h_rash_CL_index))
+        {
+            ret = enqueue_reduced_pair(reduced, queue, offset, &h_rash_CL[h_rash_CL_index], h_rash_CL_index, result_CL);
+            if (ret != CL_SUCCESS)
+                printf("Problems w/ reduced resolution pair: %d\n", ret);
+            ret = clFinish(queue);
+            if (ret != CL_SUCCESS)
+                printf("Problems w/ clFinish");
+            timing->multiply_plus_add_time += clock() - time2;
+            printf("### index_result:%d index_input:%d ( %dx%d )\n", m, n, reduced->reduced_sizex[h_rash_CL_index],
+                   reduced->reduced_sizey[h_rash_CL_index]);
+            continue;
+        }
+        float input_scale = 1.0f;
+        if (pair_kernels->image_scales != NULL)
+            input_scale *= pair_kernels->image_scales[n];
+        if (pair_kernels->h_scales != NULL)
+            input_scale *= pair_kernels->h_scales[h_rash_CL_index];
+        // с кешем h_k берётся ( или генерируется ) в слоте кеша, и смещение в таблице - по слоту
+        int h_index = h_rash_CL_index;
+        struct Cl_Buffer_pair *h = &h_rash_CL[h_rash_CL_index];
+        if (h_cache != NULL)
+        {
+            ret = h_cache_get(h_cache, queue, h_rash_CL_index, &h_index);
+            if (ret != CL_SUCCESS)
+            {
+                printf("Problems w/ generating h[%d] in the cache: %d\n", h_rash_CL_index, ret);
+                return ret;
+            }
+            h = &h_cache->slots[h_index];
         }
 
-    }
-    err = clFinish(queue);
-    if (err != CL_SUCCESS) {
-        printf("InitCl_Buffer_pair: Error with clFinish\n");
-        return err;
-    }
-    return  err;
-}
+        /// Записанная пара: обновить смещения и повторить запись
+        if (pair_kernels->replay.ready)
+        {
+            clock_t replay_start = clock();
+            ret = replay_pair(pair_kernels, offset, h_index);
+            timing->enqueue_time += clock() - replay_start;
+            timing->enqueued_pairs++;
+            if (ret != CL_SUCCESS)
+                printf("Problems w/ replaying the recorded pair: %d\n", ret);
+            ret = clFinish(queue);
+            if (ret != CL_SUCCESS)
+                printf("Problems w/ clFinish");
+            timing->multiply_plus_add_time += clock() - time2;
+            printf("### index_result:%d index_input:%d ( replay )\n", m, n);
+            continue;
+        }
 
-void DeInItCl_Buffer_pair(struct Cl_Buffer_pair *pair)
-{
-    // Release OpenCL memory objects
-    clReleaseMemObject(pair->buffers[0]);
-    clReleaseMemObject(pair->buffers[1]);
-    memset(pair, 0, sizeof(*pair)); // побайтовое обнуление всей структуры pair
-}
+        clock_t enqueue_start = clock();
+        ret = set_multiply_inputs(pair_kernels, offset, h_index, h, input_scale);
+        if(ret != CL_SUCCESS)
+            printf("Problems w/ setting KernelArgs for offset and h_rash_CL multiply\n");
+        clock_t time2_e = clock();
+        timing->multiply_plus_add_time += time2_e - time2;
 
-struct FFT_OpenCL_data {
-    int sizex;
-    int sizey;
+        clock_t  multiply_start_time = clock();
 
-    // Temporary buffer
-    cl_mem tmpBuffer;
+        ret = enqueue_multiply(pair_kernels, queue);
+        clock_t enqueue_time = clock() - enqueue_start;
 
-    // FFT library realted declarations
-    clfftPlanHandle planHandle;
-};
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ clEnqueueNDRangeKernel multiply: %d\n", ret);
+        ret = clFinish(queue);
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ clFinish");
 
-cl_int InitFFT_OpenCL_data(int sizex, int sizey, cl_context ctx, cl_command_queue queue, int amount_of_buffers_to_transform, clfftDirection direction_normalize, struct FFT_OpenCL_data *data) {
-    cl_int err = CL_SUCCESS;
-    memset(data, 0, sizeof(*data)); // побайтовое обнуление всей структуры data
-    data->sizex = sizex;
-    data->sizey = sizey;
-    int N = sizex * sizey;
-    size_t clLengths[2] = {sizex, sizey};
-    size_t tmpBufferSize = 0; // Size of temp buffer
+        clock_t  multiply_end_time = clock();
+        timing->multiply_plus_add_time += multiply_end_time - multiply_start_time;
 
-    // Create a default plan for a complex FFT
-    err = clfftCreateDefaultPlan(&data->planHandle, ctx, CLFFT_2D, clLengths);
-    if (err != CL_SUCCESS)
-        return err;
+        show_status_string("Time for multiplying 1 layer: %f", (float)(multiply_end_time-multiply_start_time)/CLOCKS_PER_SEC);
+        timing->time_multiply_full += (float)(multiply_end_time-multiply_start_time)/CLOCKS_PER_SEC;
+        
+        timing->multiply_plus_add_time += multiply_end_time-multiply_start_time;
+        printf("### index_result:%d index_input:%d\n", m, n);
 
-    // Set plan parameters
-    err = clfftSetPlanPrecision(data->planHandle, CLFFT_SINGLE);
-    if (err != CL_SUCCESS)
-        return err;
 
-    err = clfftSetLayout(data->planHandle, CLFFT_COMPLEX_PLANAR, CLFFT_COMPLEX_PLANAR);
-    if (err != CL_SUCCESS)
-        return err;
+        clock_t time3 = clock();
+        /// Обратное ПФ для результата ( слитое с парой - внутри multiply и abs )
+        // без ожидания после ПФ: abs в той же очереди, clFinish после него
+        if (pair_kernels->fused || FFT_2D_OpenCL(result_part_CL, CLFFT_BACKWARD, queue, CL_FALSE, fft_rash_size) == 0)
+            ;
+            //            printf("IFFT for result passed !\n");
+        else
+            printf("IFFT for result NOT passed !\n");
 
-    err = clfftSetResultLocation(data->planHandle, CLFFT_INPLACE);
-    if (err != CL_SUCCESS)
-        return err;
 
+        ret = enqueue_add_abs(pair_kernels, queue);
+        timing->enqueue_time += enqueue_time + clock() - time3;
+        timing->enqueued_pairs++;
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ clEnqueueNDRangeKernel abs");
+        ret = clFinish(queue);
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ clFinish");
+        
+        clock_t time3_e = clock();
+
+        timing->multiply_plus_add_time += time3_e - time3;
+    }
+    return CL_SUCCESS;
+}
 
-    err = clfftSetPlanBatchSize(data->planHandle, amount_of_buffers_to_transform);
-    if (err != CL_SUCCESS)
-        return err;
+/// БЛОК СЛОЁВ РЕЗУЛЬТАТА ( --batch-outputs B )
+// На маленьких картинках одна пара ( multiply на N work-item'ов + обратное ПФ ) не загружает устройство, поэтому
+// B выходных слоёв считаются вместе: для каждой картинки n один запуск multiply_batch_kernel пишет B произведений
+// ( h_|n-m| из таблицы h ), одно обратное ПФ с batch = B их преобразует, и один add_abs на B * N элементов
+// прибавляет их к B сегментам results. Слой m потом копируется в result_CL и дальше идёт как обычно.
+
+struct Output_batch {
+    int size;
+    enum Data_layout layout;
+    size_t N;
+    // work-item'ов на слой: N для planar, N/2 для interleaved
+    size_t layer_global_size;
+    cl_kernel multiply_kernel;
+    cl_kernel add_abs_kernel;
+    const char *multiply_kernel_name;
+    const char *add_abs_kernel_name;
+    struct Cl_Buffer_pair products;
+    cl_mem results;
+    struct FFT_OpenCL_data fft;
+    // слои в results: first_m .. first_m + amount - 1
+    int first_m;
+    int amount;
+};
 
-    err = clfftSetPlanDistance(data->planHandle, N, N);
-    if (err != CL_SUCCESS)
-        return err;
+// B: чтобы work-item'ов блока хватало на 4 полные рабочие группы на вычислительный блок, но произведения и
+// аккумуляторы ( 12 байт на точку слоя ) занимали не больше четверти памяти устройства; requested > 0 - не больше него
+int choose_output_batch(cl_device_id device, size_t N, enum Data_layout layout, int amount_of_pics, int requested)
+{
+    cl_uint compute_units = 1;
+    size_t max_work_group_size = 1;
+    cl_ulong global_mem = 0, max_alloc = 0;
+    clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(compute_units), &compute_units, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_work_group_size), &max_work_group_size, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_GLOBAL_MEM_SIZE, sizeof(global_mem), &global_mem, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_MAX_MEM_ALLOC_SIZE, sizeof(max_alloc), &max_alloc, NULL);
+
+    size_t layer_global_size = layout == LAYOUT_INTERLEAVED ? N / 2 : N;
+    size_t wanted = (size_t)compute_units * max_work_group_size * 4;
+    int by_occupancy = (int)((wanted + layer_global_size - 1) / layer_global_size);
+    cl_ulong by_alloc = max_alloc / (N * 2 * sizeof(cl_float));
+    cl_ulong by_memory = global_mem / 4 / (N * 3 * sizeof(cl_float));
+
+    int batch = requested > 0 ? requested : by_occupancy;
+    if ((cl_ulong)batch > by_alloc)
+        batch = (int)by_alloc;
+    if ((cl_ulong)batch > by_memory)
+        batch = (int)by_memory;
+    if (batch > amount_of_pics)
+        batch = amount_of_pics;
+    return batch < 1 ? 1 : batch;
+}
 
-    err = clfftSetPlanScale(data->planHandle, direction_normalize, 1.0f / sqrtf(N));
+void DeInitOutput_batch(struct Output_batch *batch)
+{
+    if (batch->multiply_kernel)
+        clReleaseKernel(batch->multiply_kernel);
+    if (batch->add_abs_kernel)
+        clReleaseKernel(batch->add_abs_kernel);
+    DeInItCl_Buffer_pair(&batch->products);
+    if (batch->results)
+        clReleaseMemObject(batch->results);
+    DeInItFFT_OpenCL_data(&batch->fft);
+    memset(batch, 0, sizeof(*batch));
+}
+
+cl_int InitOutput_batch(cl_context ctx, cl_command_queue queue, cl_program program, enum Data_layout layout,
+                        const struct Conv_geometry *geometry, int size, struct Cl_Buffer_pair *images,
+                        struct H_table *table, float scaling, struct Output_batch *batch)
+{
+    cl_int err = CL_SUCCESS;
+    memset(batch, 0, sizeof(*batch));
+    size_t N = (size_t)geometry->sizex * geometry->sizey;
+    batch->size = size;
+    batch->layout = layout;
+    batch->N = N;
+    int interleaved = layout == LAYOUT_INTERLEAVED;
+    batch->layer_global_size = interleaved ? N / 2 : N;
+    batch->multiply_kernel_name = interleaved ? "multiply_batch_interleaved_kernel" : "multiply_batch_kernel";
+    batch->add_abs_kernel_name = interleaved ? "add_normalized_abs_interleaved_kernel" : "add_normalized_abs_part_kernel";
+
+    err = InitCl_Buffer_complex(ctx, queue, CL_MEM_READ_WRITE, N * size, layout, &batch->products);
+    if (err == CL_SUCCESS)
+        batch->results = create_buffer(ctx, CL_MEM_READ_WRITE, N * size * sizeof(cl_float), &err);
+    if (err == CL_SUCCESS)
+        err = InitFFT_OpenCL_data(geometry->sizex, geometry->sizey, ctx, queue, size, CLFFT_BACKWARD, layout, &batch->fft);
+    if (err == CL_SUCCESS)
+        prune_fft_output(&batch->fft, geometry->crop_x, geometry->crop_y, geometry->image_width, geometry->image_height);
+    if (err == CL_SUCCESS)
+        batch->multiply_kernel = clCreateKernel(program, batch->multiply_kernel_name, &err);
+    if (err == CL_SUCCESS)
+        batch->add_abs_kernel = clCreateKernel(program, batch->add_abs_kernel_name, &err);
     if (err != CL_SUCCESS)
+    {
+        printf("InitOutput_batch: Error %d\n", err);
+        DeInitOutput_batch(batch);
         return err;
+    }
 
-    // Bake the plan
-    err = clfftBakePlan(data->planHandle, 1, &queue, NULL, NULL);
+    cl_ulong h_stride = table->stride;
+    if (interleaved)
+    {
+        err |= clSetKernelArg(batch->multiply_kernel, 0, sizeof(cl_mem), &images->buffers[0]);
+        err |= clSetKernelArg(batch->multiply_kernel, 2, sizeof(cl_mem), &table->table.buffers[0]);
+        err |= clSetKernelArg(batch->multiply_kernel, 3, sizeof(h_stride), &h_stride);
+        err |= clSetKernelArg(batch->multiply_kernel, 5, sizeof(cl_mem), &batch->products.buffers[0]);
+
+        err |= clSetKernelArg(batch->add_abs_kernel, 0, sizeof(cl_mem), &batch->products.buffers[0]);
+        err |= clSetKernelArg(batch->add_abs_kernel, 1, sizeof(scaling), &scaling);
+        err |= clSetKernelArg(batch->add_abs_kernel, 2, sizeof(cl_mem), &batch->results);
+    }
+    else
+    {
+        err |= clSetKernelArg(batch->multiply_kernel, 0, sizeof(cl_mem), &images->buffers[0]);
+        err |= clSetKernelArg(batch->multiply_kernel, 1, sizeof(cl_mem), &images->buffers[1]);
+        err |= clSetKernelArg(batch->multiply_kernel, 3, sizeof(cl_mem), &table->table.buffers[0]);
+        err |= clSetKernelArg(batch->multiply_kernel, 4, sizeof(cl_mem), &table->table.buffers[1]);
+        err |= clSetKernelArg(batch->multiply_kernel, 5, sizeof(h_stride), &h_stride);
+        err |= clSetKernelArg(batch->multiply_kernel, 7, sizeof(cl_mem), &batch->products.buffers[0]);
+        err |= clSetKernelArg(batch->multiply_kernel, 8, sizeof(cl_mem), &batch->products.buffers[1]);
+
+        err |= clSetKernelArg(batch->add_abs_kernel, 0, sizeof(cl_mem), &batch->products.buffers[0]);
+        err |= clSetKernelArg(batch->add_abs_kernel, 1, sizeof(cl_mem), &batch->products.buffers[1]);
+        err |= clSetKernelArg(batch->add_abs_kernel, 2, sizeof(scaling), &scaling);
+        err |= clSetKernelArg(batch->add_abs_kernel, 3, sizeof(cl_mem), &batch->results);
+    }
     if (err != CL_SUCCESS)
-        return err;
+    {
+        printf("InitOutput_batch: Error with clSetKernelArg\n");
+        DeInitOutput_batch(batch);
+    }
+    return err;
+}
 
-    // Create temporary buffer
-    err = clfftGetTmpBufSize(data->planHandle, &tmpBufferSize);
+// Слои first_m .. first_m + batch->size - 1 ( не дальше amount_of_pics ) в batch->results
+cl_int compute_result_block(cl_command_queue queue, struct Output_batch *batch, int first_m, int amount_of_pics,
+                            struct Layer_timing *timing)
+{
+    cl_int err = CL_SUCCESS;
+    int amount = amount_of_pics - first_m < batch->size ? amount_of_pics - first_m : batch->size;
+    size_t N = batch->N;
+    clock_t block_start = clock();
+
+    err = clEnqueueFillBuffer(queue, batch->results, &zero, sizeof(zero), 0, N * amount * sizeof(float), 0, NULL, NULL);
+    size_t multiply_global[2] = {batch->layer_global_size, (size_t)amount};
+    size_t add_global = batch->layer_global_size * amount;
+    int interleaved = batch->layout == LAYOUT_INTERLEAVED;
+    for (int n = 0; n < amount_of_pics && err == CL_SUCCESS; n++)
+    {
+        clock_t enqueue_start = clock();
+        cl_ulong image_offset = N * n;
+        cl_int first_k = n - first_m;
+        err |= clSetKernelArg(batch->multiply_kernel, interleaved ? 1 : 2, sizeof(image_offset), &image_offset);
+        err |= clSetKernelArg(batch->multiply_kernel, interleaved ? 4 : 6, sizeof(first_k), &first_k);
+        if (err == CL_SUCCESS)
+            err = enqueue_kernel(queue, batch->multiply_kernel, 2, multiply_global,
+                                 tuned_local_size(batch->multiply_kernel, batch->multiply_kernel_name, 2, multiply_global));
+        // ПФ всех batch->size сегментов ( в последнем неполном блоке лишние не используются )
+        if (err == CL_SUCCESS)
+            err = FFT_2D_OpenCL(&batch->products, CLFFT_BACKWARD, queue, CL_FALSE, &batch->fft);
+        if (err == CL_SUCCESS)
+            err = enqueue_kernel(queue, batch->add_abs_kernel, 1, &add_global,
+                                 tuned_local_size(batch->add_abs_kernel, batch->add_abs_kernel_name, 1, &add_global));
+        timing->enqueue_time += clock() - enqueue_start;
+        timing->enqueued_pairs += amount;
+        printf("### index_result:%d..%d index_input:%d\n", first_m, first_m + amount - 1, n);
+    }
+    if (err == CL_SUCCESS)
+        err = clFinish(queue);
+    timing->multiply_plus_add_time += clock() - block_start;
     if (err != CL_SUCCESS)
+    {
+        printf("compute_result_block: Error %d\n", err);
         return err;
+    }
+    batch->first_m = first_m;
+    batch->amount = amount;
+    return CL_SUCCESS;
+}
 
-    if (tmpBufferSize > 0)
-    {
-        data->tmpBuffer = clCreateBuffer(ctx, CL_MEM_READ_WRITE, tmpBufferSize, NULL, &err);
-        if (err != CL_SUCCESS) {
-            printf("Error with tmpBuffer clCreateBuffer\n");
-            return err;
+// Слой m из блока ( после compute_result_block ) в result_CL
+cl_int copy_batch_layer(cl_command_queue queue, const struct Output_batch *batch, int m, cl_mem result_CL)
+{
+    if (m < batch->first_m || m >= batch->first_m + batch->amount)
+        return CL_INVALID_VALUE;
+    const size_t bytes = batch->N * sizeof(float);
+    return clEnqueueCopyBuffer(queue, batch->results, result_CL, (m - batch->first_m) * bytes, 0, bytes, 0, NULL, NULL);
+}
+
+// Из расширенного результата ( ширина geometry->sizex ) вырезаем картинку, она начинается с (crop_x, crop_y)
+void crop_result_to_image(const float *result, const struct Conv_geometry *geometry, struct Image *image_result)
+{
+    int row_length = geometry->sizex;
+//#pragma omp parallel for
+    for (int k = 0; k < image_result->height; k++)
+        for(int l = 0; l < image_result->width; l++)
+        {
+            float res = result[(k+geometry->crop_y)*row_length+(l+geometry->crop_x)];
+            image_result->row_pointers[k][l] = (png_byte)res;
         }
-    }
+}
 
-    return err;
+// Слой m основного расчёта: обрезка ( STAGE_CROP ) в свою картинку и копия для сравнения с эталоном
+// ( run_output ), затем кодирование в result/imageMM.png ( STAGE_ENCODE ) - задачами пула
+struct Layer_output_job {
+    const struct Conv_geometry *geometry;
+    // данные слоя на хосте: готовы к началу обрезки
+    const float *layer;
+    unsigned char *run_output;
+    int m;
+    struct Image image;
+};
+
+struct Layer_output_job *new_layer_output_job(const struct Conv_geometry *geometry, const float *layer,
+                                              unsigned char *run_output, int m)
+{
+    struct Layer_output_job *job = (struct Layer_output_job *) calloc(1, sizeof(struct Layer_output_job));
+    job->geometry = geometry;
+    job->layer = layer;
+    job->run_output = run_output;
+    job->m = m;
+    job->image.width = geometry->image_width;
+    job->image.height = geometry->image_height;
+    job->image.row_pointers = malloc(job->image.height * sizeof(job->image.row_pointers[0]));
+    for (int i = 0; i < job->image.height; i++)
+        job->image.row_pointers[i] = malloc(job->image.width * sizeof(job->image.row_pointers[0][0]));
+    return job;
 }
 
-void DeInItFFT_OpenCL_data(struct FFT_OpenCL_data *data)
+void free_layer_output_job(struct Layer_output_job *job)
 {
-    // Release OpenCL memory objects
-    clReleaseMemObject(data->tmpBuffer);
-    clfftDestroyPlan(&data->planHandle);
-    memset(data, 0, sizeof(*data)); // побайтовое обнуление всей структуры data
+    for (int i = 0; i < job->image.height; i++)
+        free(job->image.row_pointers[i]);
+    free(job->image.row_pointers);
+    free(job);
 }
 
-///////// OpenCL FFT 2D function ///////////
-int FFT_2D_OpenCL(struct Cl_Buffer_pair *input_output, clfftDirection direction, cl_command_queue queue, cl_int finishFlag,
-                  struct FFT_OpenCL_data *data){
-    cl_int err;
-    // заполнение буферов на GPU нулями
-    err = clfftEnqueueTransform(data->planHandle, direction, 1, &queue, 0, NULL, NULL,
-                                input_output->buffers, input_output->buffers, data->tmpBuffer);
+void crop_layer_job(void *arg)
+{
+    struct Layer_output_job *job = (struct Layer_output_job *)arg;
+    crop_result_to_image(job->layer, job->geometry, &job->image);
+    if (job->run_output != NULL)
+        for (int k = 0; k < job->image.height; k++)
+            memcpy(job->run_output + ((size_t)job->m * job->image.height + k) * job->image.width,
+                   job->image.row_pointers[k], job->image.width);
+}
 
-    // Wait for calculations to be finished
-    if (finishFlag == CL_TRUE)
-        err = clFinish(queue);
+// Пишет png и освобождает задание
+void encode_layer_job(void *arg)
+{
+    struct Layer_output_job *job = (struct Layer_output_job *)arg;
+    char filename_png[64] = {'\0'};
+    sprintf(filename_png, "result/image%02d.png",  job->m+1);
+    show_status_string("Writing data to file");
 
-    return err;
+    write_png_file(job->image, filename_png);
+    free_layer_output_job(job);
 }
 
-struct Image{
-    int width;
-    int height;
+/// ПРОВЕРКА ТОЧНОСТИ
+// Путь расчёта для render_layers: какие необязательные механизмы включены ( нули - базовый расчёт )
+struct Render_path {
+    const char *name;
+    // встроенное ПФ ( и слитая с ним пара ) вместо clFFT
+    int builtin_fft;
+    // h в одной таблице арены, multiply по смещению
+    int h_table;
+    // пара записывается в command buffer и повторяется
+    int command_buffers;
+    // h генерируются по требованию в кеш на столько слотов ( 0 - все заранее )
+    int h_cache_slots;
+    // пары с опорой PSF до direct_radius - прямой свёрткой, с разделимым приближением не дороже
+    // separable_taps на пиксель - разделимой ( 0 - нет )
+    int direct_radius;
+    int separable_taps;
+    // пары с узкополосным h в пониженном разрешении: доля энергии спектра h вне полосы ( 0 - нет )
+    float reduce_far_layers;
+    // h хранится только там, где |h| > compact_otf * max|h| ( 0 - полностью )
+    float compact_otf;
+    // слоёв в блоке ( 0 - по одному )
+    int batch_outputs;
+    // передачи через кольцо промежуточных буферов ( иначе напрямую ) и буферы без копирования
+    int staging_ring;
+    int zero_copy;
+    // обрезка слоёв - задачами своего пула стадий
+    int stage_pool;
+    // потайловая свёртка ( run_tiled_convolution ) вместо render_layers
+    int tiled;
+    // допустимое отклонение от базового расчёта, уровней серого
+    int tolerance;
+};
 
-    png_bytep* row_pointers;
+// Глобальное состояние, которое путь меняет на время расчёта: движок ПФ, кольцо передач и zero-copy
+struct Render_path_state {
+    cl_program engine_program;
+    struct Staging_ring staging;
+    int zero_copy_buffers;
 };
 
-struct Image read_png_file(char* file_name)
+// Ставит движок ПФ и передачи пути, прежние запоминает в state. CL_INVALID_OPERATION - zero-copy
+// на устройстве без общей с хостом памяти
+cl_int enter_render_path(cl_context ctx, cl_device_id device, cl_command_queue queue, cl_program program,
+                         const struct Render_path *path, struct Render_path_state *state)
 {
-    png_byte color_type;
-    png_byte bit_depth;
+    state->engine_program = builtin_fft_program;
+    if (state->engine_program)
+        clRetainProgram(state->engine_program);
+    state->staging = staging;
+    state->zero_copy_buffers = zero_copy_buffers;
+
+    set_builtin_fft_program(path->builtin_fft ? program : 0);
+    zero_copy_buffers = path->zero_copy;
+    memset(&staging, 0, sizeof(staging));
+    if (path->staging_ring)
+        InitStaging_ring(ctx, queue, 0, &staging);
+    return path->zero_copy && !device_has_host_memory(device) ? CL_INVALID_OPERATION : CL_SUCCESS;
+}
 
-    png_structp png_ptr;
-    png_infop info_ptr;
-    int number_of_passes;
+void leave_render_path(struct Render_path_state *state)
+{
+    DeInitStaging_ring(&staging);
+    staging = state->staging;
+    zero_copy_buffers = state->zero_copy_buffers;
+    set_builtin_fft_program(state->engine_program);
+    if (state->engine_program)
+        clReleaseProgram(state->engine_program);
+}
 
-    struct Image image;
-    memset(&image, 0, sizeof(image));
+// Весь расчёт ( спектры картинок, h и все слои ) заново с заданной сборкой и точностью спектров,
+// 8-битные слои подряд пишутся в output ( amount_of_pics * half_N байт ). Буферы свои, поэтому
+// вызывается после освобождения буферов основного расчёта. path == NULL - как настроен основной
+// расчёт ( движок ПФ ), иначе движок и механизмы пути; CL_INVALID_OPERATION - путь не поддерживается
+cl_int render_layers(cl_context ctx, cl_device_id device, cl_command_queue queue, const struct Kernel_config *config,
+                     enum Data_layout layout, enum Spectrum_precision precision, const struct Conv_geometry *geometry,
+                     int amount_of_pics, const struct Render_path *path, unsigned char *output)
+{
+    cl_int err = CL_SUCCESS;
+    int sizex = geometry->sizex;
+    int sizey = geometry->sizey;
+    size_t N = (size_t)sizex * sizey;
+    int width = geometry->image_width;
+    int height = geometry->image_height;
+    size_t layer_size = (size_t)width * height;
+
+    cl_program program = get_program_variant(ctx, device, config);
+    if (program == 0)
+        return CL_BUILD_PROGRAM_FAILURE;
 
-    png_byte header[8];    // 8 is the maximum size that can be checked
+    // движок ПФ и передачи пути; прежние восстанавливаются в конце
+    struct Render_path_state state;
+    if (path != NULL)
+        err = enter_render_path(ctx, device, queue, program, path, &state);
 
-    /* open file and test for it being a png */
-    FILE *fp = fopen(file_name, "rb");
-    if (!fp)
+    struct Cl_Buffer_pair all_pics_buffer;
+    memset(&all_pics_buffer, 0, sizeof(all_pics_buffer));
+    if (err == CL_SUCCESS)
+        all_pics_buffer = read_and_fft_pics(ctx, queue, amount_of_pics, geometry, layout, NULL);
+    if (all_pics_buffer.buffers[0] == 0)
     {
-        printf("[read_png_file] File %s could not be opened for reading\n", file_name);
-        return image;
+        if (path != NULL)
+            leave_render_path(&state);
+        clReleaseProgram(program);
+        return err != CL_SUCCESS ? err : CL_INVALID_MEM_OBJECT;
     }
 
-    fread(header, 1, 8, fp);
-    if (png_sig_cmp(header, 0, 8))
+    float *image_scales = (float *) calloc(amount_of_pics, sizeof(float));
+    float *h_scales = (float *) calloc(amount_of_pics, sizeof(float));
+    struct Cl_Buffer_pair *h_rash_CL = (struct Cl_Buffer_pair *) calloc(amount_of_pics, sizeof(struct Cl_Buffer_pair));
+    float *result = (float *) calloc(N, sizeof(float));
+    struct Image image;
+    image.width = width;
+    image.height = height;
+    image.row_pointers = malloc(height * sizeof(image.row_pointers[0]));
+
+    struct Cl_Buffer_pair result_part_CL;
+    memset(&result_part_CL, 0, sizeof(result_part_CL));
+    struct Pair_kernels pair_kernels;
+    memset(&pair_kernels, 0, sizeof(pair_kernels));
+    struct FFT_OpenCL_data fft_rash_size;
+    memset(&fft_rash_size, 0, sizeof(fft_rash_size));
+    cl_mem result_CL = 0;
+    struct Device_arena arena;
+    memset(&arena, 0, sizeof(arena));
+    struct H_table h_table;
+    memset(&h_table, 0, sizeof(h_table));
+    struct H_cache h_cache;
+    memset(&h_cache, 0, sizeof(h_cache));
+    struct Direct_convolution direct;
+    memset(&direct, 0, sizeof(direct));
+    struct Reduced_layers reduced;
+    memset(&reduced, 0, sizeof(reduced));
+    struct Output_batch output_batch;
+    memset(&output_batch, 0, sizeof(output_batch));
+    // слои для обрезки в пуле: каждый в своём буфере, пока его задача не выполнена
+    struct Stage_graph graph;
+    memset(&graph, 0, sizeof(graph));
+    float *layer_copies = NULL;
+    struct Layer_output_job **jobs = NULL;
+    int use_h_table = path != NULL && (path->h_table || path->batch_outputs);
+    int use_h_cache = path != NULL && path->h_cache_slots > 0;
+    int compact_otf = path != NULL && path->compact_otf > 0;
+
+    if (precision == PRECISION_HALF)
+        err = convert_spectra_to_half(ctx, queue, program, layout, N, amount_of_pics, &all_pics_buffer, image_scales);
+    if (err == CL_SUCCESS && (use_h_table || use_h_cache))
     {
-        printf("[read_png_file] File %s is not recognized as a PNG file\n", file_name);
-        return image;
+        // как в InitH_cache: плоскости слота выровнены отдельно
+        size_t complex_bytes = layout == LAYOUT_INTERLEAVED ? 2 * sizeof(cl_float) : sizeof(cl_float);
+        int amount_of_planes = layout == LAYOUT_INTERLEAVED ? 1 : 2;
+        err = InitDevice_arena(ctx, device, N * sizeof(cl_float), &arena);
+        if (err == CL_SUCCESS && use_h_cache)
+            err = InitH_cache(ctx, queue, program, &arena, layout, geometry, amount_of_pics,
+                              path->h_cache_slots * amount_of_planes * arena_align(&arena, N * complex_bytes), &h_cache);
+        else if (err == CL_SUCCESS)
+            err = InitH_table(&arena, N, amount_of_pics, layout, &h_table);
+        if (err == CL_SUCCESS)
+            err = arena_zero_fill(&arena, queue);
     }
-
-
-    /* initialize stuff */
-    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-
-    if (!png_ptr)
+    if (err == CL_SUCCESS && !use_h_cache)
+        err = generate_h_rash(ctx, queue, program, layout, precision, geometry, amount_of_pics, h_rash_CL, h_scales,
+                              use_h_table ? &h_table : NULL);
+    if (err == CL_SUCCESS)
+        err = InitFFT_OpenCL_data(sizex, sizey, ctx, queue, 1, CLFFT_BACKWARD, layout, &fft_rash_size);
+    prune_fft_output(&fft_rash_size, geometry->crop_x, geometry->crop_y, geometry->image_width, geometry->image_height);
+    if (err == CL_SUCCESS)
+        result_CL = create_buffer(ctx, CL_MEM_READ_WRITE, N * sizeof(cl_float), &err);
+    if (err == CL_SUCCESS)
+        err = InitCl_Buffer_complex(ctx, queue, CL_MEM_READ_WRITE, N, layout, &result_part_CL);
+    if (err == CL_SUCCESS)
+        err = InitPair_kernels(program, layout, precision, N, &all_pics_buffer, &result_part_CL, config->scaling, result_CL, &pair_kernels);
+    // компактные h читает только multiply_sparse_kernel, как в main
+    if (err == CL_SUCCESS && !compact_otf)
+        err = fuse_pair_kernels(&pair_kernels, program, &fft_rash_size, &all_pics_buffer, &result_part_CL, config->scaling, result_CL);
+    if (err == CL_SUCCESS && (use_h_table || use_h_cache))
+        err = bind_h_table(&pair_kernels, use_h_cache ? &h_cache.table : &h_table);
+    // запись пары: нужны расширение, таблица h и встроенное ПФ этого размера
+    if (err == CL_SUCCESS && path != NULL && path->command_buffers &&
+        (!InitCommand_buffers(device) || record_pair(&pair_kernels, queue, &result_part_CL, &fft_rash_size) != CL_SUCCESS))
+        err = CL_INVALID_OPERATION;
+    if (err == CL_SUCCESS && path != NULL && (path->direct_radius > 0 || path->separable_taps > 0))
     {
-        printf("[read_png_file] png_create_read_struct failed\n");
-        return  image;
+        err = InitDirect_convolution(ctx, queue, program, geometry, amount_of_pics,
+                                     path->direct_radius > 0 ? path->direct_radius : -1, path->separable_taps,
+                                     options.separable > 0 ? options.separable : 1e-3f, config->scaling * sqrtf(N),
+                                     result_CL, &direct);
+        // ни одна пара не подошла - сравнивать нечего
+        if (err == CL_SUCCESS && direct.amount_of_h == 0)
+            err = CL_INVALID_OPERATION;
+    }
+    if (err == CL_SUCCESS && path != NULL && path->reduce_far_layers > 0)
+    {
+        err = InitReduced_layers(ctx, queue, program, layout, geometry, amount_of_pics, &all_pics_buffer, h_rash_CL,
+                                 path->reduce_far_layers, config->scaling, &reduced);
+        if (err == CL_SUCCESS && reduced.amount_of_h == 0)
+            err = CL_INVALID_OPERATION;
+    }
+    if (err == CL_SUCCESS && compact_otf)
+        err = compact_h_rash(ctx, queue, layout, geometry, amount_of_pics, h_rash_CL, &reduced, path->compact_otf);
+    if (err == CL_SUCCESS && compact_otf)
+        err = sparse_pair_kernels(&pair_kernels, program, &all_pics_buffer, &result_part_CL, sizex, sizey);
+    if (err == CL_SUCCESS && path != NULL && path->batch_outputs)
+    {
+        int batch_size = choose_output_batch(device, N, layout, amount_of_pics, path->batch_outputs);
+        if (batch_size < 2)
+            err = CL_INVALID_OPERATION;
+        else
+            err = InitOutput_batch(ctx, queue, program, layout, geometry, batch_size, &all_pics_buffer, &h_table,
+                                   config->scaling, &output_batch);
+    }
+    // --stage-threads 0: пула нет, как и в main
+    if (err == CL_SUCCESS && path != NULL && path->stage_pool && options.stage_threads == 0)
+        err = CL_INVALID_OPERATION;
+    if (err == CL_SUCCESS && path != NULL && path->stage_pool)
+    {
+        layer_copies = (float *) malloc((size_t)amount_of_pics * N * sizeof(float));
+        jobs = (struct Layer_output_job **) calloc(amount_of_pics, sizeof(jobs[0]));
+        if (layer_copies == NULL || jobs == NULL)
+            err = CL_OUT_OF_HOST_MEMORY;
+        else if (InitStage_graph(&graph, options.stage_threads, amount_of_pics) == 0)
+            err = CL_INVALID_OPERATION;
     }
 
+    if (err == CL_SUCCESS && precision == PRECISION_HALF)
+    {
+        pair_kernels.image_scales = image_scales;
+        pair_kernels.h_scales = h_scales;
+    }
 
-    info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
+    struct Layer_timing timing;
+    memset(&timing, 0, sizeof(timing));
+    for (int m = 0; m < amount_of_pics && err == CL_SUCCESS; m++)
     {
-        printf("[read_png_file] png_create_info_struct failed\n");
-        return image;
+        if (output_batch.size > 1)
+        {
+            if (m % output_batch.size == 0)
+                err = compute_result_block(queue, &output_batch, m, amount_of_pics, &timing);
+            if (err == CL_SUCCESS)
+                err = copy_batch_layer(queue, &output_batch, m, result_CL);
+        }
+        else
+            err = compute_result_layer(queue, &pair_kernels, &fft_rash_size, &result_part_CL, result_CL, h_rash_CL,
+                                       &direct, &reduced, use_h_cache ? &h_cache : NULL, m, amount_of_pics, N, &timing);
+        const float *layer = result;
+        if (err == CL_SUCCESS)
+            layer = read_result_layer(queue, result_CL, N, result, &err);
+        if (err != CL_SUCCESS)
+            break;
+
+        if (jobs != NULL)
+        {
+            // обрезка идёт в пуле, пока устройство считает следующие слои
+            float *copy = layer_copies + (size_t)m * N;
+            memcpy(copy, layer, N * sizeof(float));
+            jobs[m] = new_layer_output_job(geometry, copy, output, m);
+            stage_add(&graph, STAGE_CROP, crop_layer_job, jobs[m], 0, NULL, 0);
+        }
+        else
+        {
+            for (int k = 0; k < height; k++)
+                image.row_pointers[k] = output + m * layer_size + (size_t)k * width;
+            crop_result_to_image(layer, geometry, &image);
+        }
+        err = release_result_layer(queue, result_CL, layer);
     }
 
+    if (err != CL_SUCCESS && err != CL_INVALID_OPERATION)
+        printf("render_layers: Error %d\n", err);
 
-    if (setjmp(png_jmpbuf(png_ptr)))
+    if (graph.amount_of_workers > 0)
     {
-        printf("[read_png_file] Error during init_io\n");
-        return image;
+        stage_wait_all(&graph);
+        DeInitStage_graph(&graph);
     }
+    for (int m = 0; jobs != NULL && m < amount_of_pics; m++)
+        if (jobs[m] != NULL)
+            free_layer_output_job(jobs[m]);
+    free(jobs);
+    free(layer_copies);
+    DeInitOutput_batch(&output_batch);
+    DeInitReduced_layers(&reduced);
+    DeInitDirect_convolution(&direct);
+    DeInitPair_kernels(&pair_kernels);
+    DeInItCl_Buffer_pair(&result_part_CL);
+    if (result_CL)
+        clReleaseMemObject(result_CL);
+    DeInItFFT_OpenCL_data(&fft_rash_size);
+    for (int k = 0; k < amount_of_pics; k++)
+        DeInItCl_Buffer_pair(&h_rash_CL[k]);
+    DeInitH_cache(&h_cache);
+    DeInitH_table(&h_table);
+    DeInitDevice_arena(&arena);
+    DeInItCl_Buffer_pair(&all_pics_buffer);
+    if (path != NULL)
+        leave_render_path(&state);
+    clReleaseProgram(program);
 
+    free(image.row_pointers);
+    free(result);
+    free(h_rash_CL);
+    free(h_scales);
+    free(image_scales);
+    return err;
+}
 
-    png_init_io(png_ptr, fp);
-    png_set_sig_bytes(png_ptr, 8);
+// Попиксельное отклонение 8-битного результата от эталона, возвращает максимум ( в уровнях серого )
+int report_output_deviation(const char *name, const char *reference_name, const unsigned char *output,
+                            const unsigned char *reference, size_t size)
+{
+    int max_deviation = 0;
+    double squared_deviation_sum = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        int deviation = abs((int)output[i] - (int)reference[i]);
+        if (deviation > max_deviation)
+            max_deviation = deviation;
+        squared_deviation_sum += (double)deviation * deviation;
+    }
+    float rms_deviation = (float)sqrt(squared_deviation_sum / size);
 
-    png_read_info(png_ptr, info_ptr);
+    show_status_string("%s vs %s: max deviation %d grey levels, RMS %f", name, reference_name, max_deviation, rms_deviation);
+    return max_deviation;
+}
 
-    image.width = png_get_image_width(png_ptr, info_ptr);
-    image.height = png_get_image_height(png_ptr, info_ptr);
-    color_type = png_get_color_type(png_ptr, info_ptr);
-    bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+// Сравнение быстрой и точной сборки kernel'ов
+void validate_fast_math(cl_context ctx, cl_device_id device, cl_command_queue queue, const struct Kernel_config *config,
+                        enum Data_layout layout, enum Spectrum_precision precision, const struct Conv_geometry *geometry,
+                        int amount_of_pics)
+{
+    size_t output_size = (size_t)geometry->image_width * geometry->image_height * amount_of_pics;
+    const char *variant_names[2] = {"precise", "fast-math"};
+    unsigned char *outputs[2];
+    int rendered = 1;
 
-    number_of_passes = png_set_interlace_handling(png_ptr);
-//    png_read_update_info(png_ptr, info_ptr);
+    for (int variant = 0; variant < 2; variant++)
+    {
+        outputs[variant] = (unsigned char *) calloc(output_size, 1);
 
+        struct Kernel_config variant_config = *config;
+        variant_config.fast_math = variant;
+        cl_int err = render_layers(ctx, device, queue, &variant_config, layout, precision, geometry, amount_of_pics,
+                                   NULL, outputs[variant]);
+        // не собранный вариант не сравниваем: его нулевой результат выглядел бы как огромная ошибка
+        if (err != CL_SUCCESS)
+        {
+            printf("validate_fast_math: %s build failed ( error %d ), comparison skipped\n", variant_names[variant], err);
+            rendered = 0;
+        }
+    }
 
-    /* read file */
-    if (setjmp(png_jmpbuf(png_ptr)))
+    if (rendered)
     {
-        printf("[read_png_file] Error during read_image\n");
-        return  image;
+        int max_deviation = report_output_deviation("Fast math", "precise", outputs[1], outputs[0], output_size);
+        if (max_deviation <= 1)
+            show_status_string("Fast math is within one grey level, --fast-math is safe for this job");
+        else
+            show_status_string("Fast math exceeds one grey level, keep the precise build");
     }
 
-    if ((color_type & PNG_COLOR_MASK_COLOR)!= PNG_COLOR_TYPE_GRAY )
-        png_set_rgb_to_gray(png_ptr, 1, 0, 0);
-    png_read_update_info(png_ptr, info_ptr);
-
-    image.row_pointers = (png_bytep*) malloc(sizeof(png_bytep) * image.height);
-    for (int y = 0; y < image.height; y++)
-        image.row_pointers[y] = (png_byte*) malloc(png_get_rowbytes(png_ptr,info_ptr));
-
-    png_read_image(png_ptr, image.row_pointers);
-
-    fclose(fp);
-    return image;
+    free(outputs[0]);
+    free(outputs[1]);
 }
 
-void write_png_file(struct Image image, const char* file_name)
-{
-    png_byte color_type = PNG_COLOR_TYPE_GRAY;
-    png_byte bit_depth = 8;
-
-    png_structp png_ptr;
-    png_infop info_ptr;
 
+/// ЭТАЛОННЫЙ РАСЧЁТ В DOUBLE НА CPU
+// Тот же конвейер, что и на устройстве ( h_init -> ПФ -> fftshift -> |h|^2 -> расширение -> ПФ,
+// свёртки с картинками и модуль с насыщением ), но в double complex и без OpenCL.
+// Медленно, нужен только для проверки точности.
 
-    /* create file */
-    FILE *fp = fopen(file_name, "wb");
-    if (!fp)
+// Одномерное ПФ без нормировки, рекурсивно по наименьшему простому делителю n ( любая длина ).
+// twiddles[x] = exp(sign * 2*pi*i * x / n_top) для самой длинной длины n_top = n * twiddle_step
+void reference_dft(const double complex *in, size_t stride, double complex *out, size_t n,
+                   const double complex *twiddles, size_t twiddle_step)
+{
+    if (n == 1)
     {
-        printf("[write_png_file] File %s could not be opened for writing", file_name);
+        out[0] = in[0];
         return;
     }
 
-    /* initialize stuff */
-    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    size_t p = 2;
+    while (n % p != 0)
+        p++;
+    size_t m = n / p;
+    size_t n_top = n * twiddle_step;
 
-    if (!png_ptr)
+    for (size_t r = 0; r < p; r++)
+        reference_dft(in + r * stride, stride * p, out + r * m, m, twiddles, twiddle_step * p);
+
+    // X[k + m*s] = sum_r W_n^(r*k) * W_p^(r*s) * Y_r[k], все p значений для данного k на тех же местах
+    double complex y[p];
+    for (size_t k = 0; k < m; k++)
     {
-        printf("[write_png_file] png_create_write_struct failed");
-        return;
+        for (size_t r = 0; r < p; r++)
+            y[r] = out[r * m + k] * twiddles[(r * k * twiddle_step) % n_top];
+        for (size_t s = 0; s < p; s++)
+        {
+            double complex sum = 0;
+            for (size_t r = 0; r < p; r++)
+                sum += y[r] * twiddles[(r * s * m * twiddle_step) % n_top];
+            out[s * m + k] = sum;
+        }
     }
+}
 
+void reference_twiddles(double complex *twiddles, size_t n, int sign)
+{
+    for (size_t x = 0; x < n; x++)
+        twiddles[x] = cexp(sign * 2.0 * M_PI * I * (double)x / n);
+}
 
-    info_ptr = png_create_info_struct(png_ptr);
-    if (!info_ptr)
+// 2D ПФ без нормировки: rows строк по cols чисел; sign = -1 прямое, +1 обратное
+void reference_fft_2d(double complex *data, size_t rows, size_t cols, int sign)
+{
+    size_t longest = rows > cols ? rows : cols;
+    double complex *line_in = (double complex *) malloc(longest * sizeof(double complex));
+    double complex *line_out = (double complex *) malloc(longest * sizeof(double complex));
+    double complex *twiddles = (double complex *) malloc(longest * sizeof(double complex));
+
+    reference_twiddles(twiddles, cols, sign);
+    for (size_t r = 0; r < rows; r++)
     {
-        printf("[write_png_file] png_create_info_struct failed");
-        return;
+        reference_dft(data + r * cols, 1, line_out, cols, twiddles, 1);
+        memcpy(data + r * cols, line_out, cols * sizeof(double complex));
+    }
+
+    reference_twiddles(twiddles, rows, sign);
+    for (size_t c = 0; c < cols; c++)
+    {
+        for (size_t r = 0; r < rows; r++)
+            line_in[r] = data[r * cols + c];
+        reference_dft(line_in, 1, line_out, rows, twiddles, 1);
+        for (size_t r = 0; r < rows; r++)
+            data[r * cols + c] = line_out[r];
     }
 
+    free(twiddles);
+    free(line_out);
+    free(line_in);
+}
 
-    if (setjmp(png_jmpbuf(png_ptr)))
+// Циклический сдвиг на n/2 вправо, как fft_shift_line в rash_kernel.cl ( и для нечётного n )
+void reference_fft_shift_line(double complex *line, size_t n, size_t stride)
+{
+    size_t shift = n / 2;
+    size_t cycles = n;
+    for (size_t b = shift; b != 0; )
     {
-        printf("[write_png_file] Error during init_io");
-        return;
+        size_t t = cycles % b;
+        cycles = b;
+        b = t;
+    }
+    for (size_t start = 0; start < cycles; start++)
+    {
+        double complex tmp = line[start * stride];
+        size_t j = start;
+        for (;;)
+        {
+            size_t from = j >= shift ? j - shift : j + n - shift;
+            if (from == start)
+                break;
+            line[j * stride] = line[from * stride];
+            j = from;
+        }
+        line[j * stride] = tmp;
     }
+}
 
+// Как fft_shift_row_kernel + fft_shift_col_kernel: сдвигаем строки, затем столбцы
+void reference_fft_shift(double complex *data, size_t rows, size_t cols)
+{
+    for (size_t r = 0; r < rows; r++)
+        reference_fft_shift_line(data + r * cols, cols, 1);
+    for (size_t c = 0; c < cols; c++)
+        reference_fft_shift_line(data + c, rows, cols);
+}
 
-    png_init_io(png_ptr, fp);
+/// Задачи эталонного расчёта
+// Сначала по задаче на спектр каждой картинки и на каждую h_rash, затем задачи ( слой m, блок картинок c ):
+// блок - подряд идущие картинки, сумма |ОПФ( картинка_n * h_|n-m| )| по ним добавляется в слой под его
+// мьютексом. Блоков столько, сколько потоков, и все задачи блока c лежат у потока c, которому достались
+// и спектры этих картинок, а перехват выравнивает остаток, когда слоёв не кратно потокам. Насыщение
+// до 255 делается в конце: слагаемые неотрицательны, так что это то же, что насыщение после каждого сложения.
+
+struct Reference_job {
+    int image_width;
+    int image_height;
+    int amount_of_pics;
+    int sizex;
+    int sizey;
+    size_t N;
+    double scaling;
+    int amount_of_blocks;
+    int pics_per_block;
+    double complex *pics;
+    double complex *h_rash;
+    double *layers;
+    pthread_mutex_t *layer_locks;
+    // буферы потоков: result_part ( N ) и частичная сумма ( N )
+    double complex **result_parts;
+    double **partial;
+    // -1 - ошибка чтения картинки
+    int status;
+};
 
+// Задачи 0..amount-1 - спектры картинок, amount..2*amount-1 - h_rash.
+// Свой срез задача обнуляет сама ( буферы выделены без обнуления )
+void reference_spectrum_task(void *arg, int task, int worker)
+{
+    struct Reference_job *job = (struct Reference_job *)arg;
+    int half_sizex = job->image_width;
+    int half_sizey = job->image_height;
+    size_t N = job->N;
+    size_t half_N = (size_t)half_sizex * half_sizey;
 
-    /* write header */
-    if (setjmp(png_jmpbuf(png_ptr)))
+    if (task < job->amount_of_pics)
     {
-        printf("[write_png_file] Error during writing header");
+        int n = task;
+        double complex *pic = job->pics + n * N;
+        memset(pic, 0, N * sizeof(double complex));
+
+        char filename[64] = {'\0'};
+        make_pic_filename(filename, job->image_width, job->image_height, n);
+        struct Image image = read_png_file(filename);
+        if (image.row_pointers == NULL || image.width != half_sizex || image.height != half_sizey)
+        {
+            printf("render_reference_fp64: could not read %s\n", filename);
+            job->status = -1;
+        }
+        else
+        {
+            for (int l = 0; l < image.height; l++)
+                for (int p = 0; p < image.width; p++)
+                    pic[(size_t)l * job->sizex + p] = image.row_pointers[l][p];
+            reference_fft_2d(pic, job->sizey, job->sizex, -1);
+        }
+
+        if (image.row_pointers != NULL)
+        {
+            for (int l = 0; l < image.height; l++)
+                free(image.row_pointers[l]);
+            free(image.row_pointers);
+        }
         return;
     }
 
+    /// h_rash: i - столбец, j - строка, как в h_init_kernel
+    int k = task - job->amount_of_pics;
+    double complex *h_k = job->h_rash + k * N;
+    memset(h_k, 0, N * sizeof(double complex));
+    double complex *h = job->result_parts[worker];
+    double delta_z = k * M_PI;
+    for (int i = 0; i < half_sizex; i++)
+        for (int j = 0; j < half_sizey; j++)
+        {
+            double x = (M_PI / half_sizex) * (i - half_sizex / 2);
+            double y = (M_PI / half_sizey) * (j - half_sizey / 2);
+            double r2 = x * x + y * y;
+            double pupil = r2 < (double)options.pupil_radius * options.pupil_radius ? 1.0 : 0.0;
+            double phase = options.pupil_phase_coef * r2 + options.defocus_coef * fabs(delta_z) * M_PI * r2;
+            h[(size_t)j * half_sizex + i] = pupil * cexp(I * phase);
+        }
 
-    png_set_IHDR(png_ptr, info_ptr, image.width, image.height,
-                 bit_depth, color_type, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+    reference_fft_2d(h, half_sizey, half_sizex, -1);
+    reference_fft_shift(h, half_sizey, half_sizex);
 
-    png_write_info(png_ptr, info_ptr);
+    double h_scale = 1.0 / half_N;
+    for (int l = 0; l < half_sizey; l++)
+        for (int p = 0; p < half_sizex; p++)
+        {
+            double complex value = h[(size_t)l * half_sizex + p];
+            h_k[(size_t)l * job->sizex + p] = (creal(value) * creal(value) + cimag(value) * cimag(value)) * h_scale;
+        }
 
+    reference_fft_2d(h_k, job->sizey, job->sizex, -1);
+}
 
-    /* write bytes */
-    if (setjmp(png_jmpbuf(png_ptr)))
+// Задача m * amount_of_blocks + c: слой m, картинки блока c
+void reference_layer_task(void *arg, int task, int worker)
+{
+    struct Reference_job *job = (struct Reference_job *)arg;
+    int m = task / job->amount_of_blocks;
+    int block = task % job->amount_of_blocks;
+    int first = block * job->pics_per_block;
+    int last = first + job->pics_per_block < job->amount_of_pics ? first + job->pics_per_block : job->amount_of_pics;
+    size_t N = job->N;
+    double complex *result_part = job->result_parts[worker];
+    double *partial = job->partial[worker];
+    double factor = job->scaling / sqrt((double)N);
+
+    memset(partial, 0, N * sizeof(double));
+    for (int n = first; n < last; n++)
     {
-        printf("[write_png_file] Error during writing bytes");
-        return;
+        const double complex *h_k = job->h_rash + abs(n - m) * N;
+        for (size_t i = 0; i < N; i++)
+            result_part[i] = job->pics[n * N + i] * h_k[i];
+
+        reference_fft_2d(result_part, job->sizey, job->sizex, +1);
+
+        for (size_t i = 0; i < N; i++)
+            partial[i] += cabs(result_part[i]) * factor;
     }
 
+    double *layer = job->layers + m * N;
+    pthread_mutex_lock(&job->layer_locks[m]);
+    for (size_t i = 0; i < N; i++)
+        layer[i] += partial[i];
+    pthread_mutex_unlock(&job->layer_locks[m]);
+}
 
-    png_write_image(png_ptr, image.row_pointers);
+// Эталонные 8-битные слои в output ( как у render_layers ), 0 - успех. Всегда вся h и удвоенные
+// размеры, так что сравнение показывает и ошибку от обрезки PSF по опоре.
+// threads - потоков пула ( <= 0 - по числу процессоров ); wall_time, если не NULL, - время расчёта
+int render_reference_fp64(int image_width, int image_height, int amount_of_pics, int threads, unsigned char *output,
+                          double *wall_time)
+{
+    struct Conv_geometry geometry;
+    init_double_padding_geometry(image_width, image_height, &geometry);
+    struct Reference_job job;
+    memset(&job, 0, sizeof(job));
+    job.image_width = image_width;
+    job.image_height = image_height;
+    job.amount_of_pics = amount_of_pics;
+    job.sizex = geometry.sizex;
+    job.sizey = geometry.sizey;
+    job.N = (size_t)job.sizex * job.sizey;
+    size_t N = job.N;
+    size_t half_N = (size_t)image_width * image_height;
+    job.scaling = 2.0 / (sqrt((double)N) * half_N * amount_of_pics);
+
+    double reference_start = get_wall_time();
+
+    threads = cpu_pool_size(threads);
+    job.amount_of_blocks = threads < amount_of_pics ? threads : amount_of_pics;
+    job.pics_per_block = (amount_of_pics + job.amount_of_blocks - 1) / job.amount_of_blocks;
+    // pics_per_block округлено вверх, блоков может оказаться меньше
+    job.amount_of_blocks = (amount_of_pics + job.pics_per_block - 1) / job.pics_per_block;
+    int amount_of_tasks = amount_of_pics * (job.amount_of_blocks > 2 ? job.amount_of_blocks : 2);
+
+    struct Cpu_pool pool;
+    int workers = InitCpu_pool(&pool, threads, amount_of_tasks);
+
+    // без обнуления: срезы обнуляют задачи спектров
+    job.pics = (double complex *) malloc(N * amount_of_pics * sizeof(double complex));
+    job.h_rash = (double complex *) malloc(N * amount_of_pics * sizeof(double complex));
+    job.layers = (double *) calloc(N * amount_of_pics, sizeof(double));
+    job.layer_locks = (pthread_mutex_t *) malloc(amount_of_pics * sizeof(pthread_mutex_t));
+    job.result_parts = (double complex **) calloc(workers, sizeof(double complex *));
+    job.partial = (double **) calloc(workers, sizeof(double *));
+    int *home = (int *) malloc(amount_of_tasks * sizeof(int));
+    int status = workers > 0 && job.pics && job.h_rash && job.layers && job.layer_locks && job.result_parts &&
+                 job.partial && home ? 0 : -1;
+    for (int w = 0; w < workers && status == 0; w++)
+    {
+        job.result_parts[w] = (double complex *) malloc(N * sizeof(double complex));
+        job.partial[w] = (double *) malloc(N * sizeof(double));
+        if (job.result_parts[w] == NULL || job.partial[w] == NULL)
+            status = -1;
+    }
+    if (status != 0)
+        printf("render_reference_fp64: not enough host memory\n");
 
+    /// Спектры картинок ( у потока своего блока ) и h_rash ( по кругу )
+    if (status == 0)
+    {
+        for (int n = 0; n < amount_of_pics; n++)
+        {
+            home[n] = n / job.pics_per_block;
+            home[amount_of_pics + n] = n;
+        }
+        status = cpu_pool_run(&pool, 2 * amount_of_pics, home, reference_spectrum_task, &job);
+        if (status == 0)
+            status = job.status;
+    }
 
-    /* end write */
-    if (setjmp(png_jmpbuf(png_ptr)))
+    /// Слои результата
+    if (status == 0)
     {
-        printf("[write_png_file] Error during end of write");
-        return;
+        for (int m = 0; m < amount_of_pics; m++)
+        {
+            pthread_mutex_init(&job.layer_locks[m], NULL);
+            for (int c = 0; c < job.amount_of_blocks; c++)
+                home[m * job.amount_of_blocks + c] = c;
+        }
+        status = cpu_pool_run(&pool, amount_of_pics * job.amount_of_blocks, home, reference_layer_task, &job);
+        for (int m = 0; m < amount_of_pics; m++)
+            pthread_mutex_destroy(&job.layer_locks[m]);
+
+        int half_sizex = image_width;
+        int half_sizey = image_height;
+        for (int m = 0; m < amount_of_pics && status == 0; m++)
+        {
+            const double *result = job.layers + m * N;
+            for (int k = 0; k < half_sizey; k++)
+                for (int l = 0; l < half_sizex; l++)
+                    output[m * half_N + (size_t)k * half_sizex + l] =
+                        (unsigned char)fmin(result[(size_t)(k + half_sizey / 2) * job.sizex + (l + half_sizex / 2)], 255.0);
+        }
     }
 
-    png_write_end(png_ptr, NULL);
+    double reference_time = get_wall_time() - reference_start;
+    if (wall_time != NULL)
+        *wall_time = reference_time;
+    if (status == 0)
+    {
+        show_status_string("Float64 reference on the host: %f", (float)reference_time);
+        report_cpu_pool(&pool, "Float64 reference pool");
+    }
 
-    fclose(fp);
+    for (int w = 0; w < workers && job.result_parts && job.partial; w++)
+    {
+        free(job.result_parts[w]);
+        free(job.partial[w]);
+    }
+    DeInitCpu_pool(&pool);
+    free(home);
+    free(job.partial);
+    free(job.result_parts);
+    free(job.layer_locks);
+    free(job.layers);
+    free(job.h_rash);
+    free(job.pics);
+    return status;
 }
 
-struct Cl_Buffer_pair read_and_fft_pics(cl_context ctx, cl_command_queue queue, int amount_of_pics, int sizex) {
-    cl_int err;
-    struct Cl_Buffer_pair all_pics_buffer;
-    struct FFT_OpenCL_data fft_rash_size;
-    size_t N = sizex*sizex;
-    float *Array;
-
-    clock_t creation_of_helpers_time_start = clock();
-    Array  = (float *) calloc(N, sizeof(float));
-    InitCl_Buffer_pair(ctx, queue, CL_MEM_READ_WRITE, N*amount_of_pics, &all_pics_buffer);
-    InitFFT_OpenCL_data(sizex, sizex, ctx, queue, amount_of_pics, CLFFT_BACKWARD, &fft_rash_size);
-    clock_t creation_of_helpers_time_end = clock();
-    show_status_string("Time for initiating buffer(helpers) for pics: %f", (float)(creation_of_helpers_time_end-creation_of_helpers_time_start)/CLOCKS_PER_SEC);
+// Ускорение эталонного расчёта от 1 потока до всех процессоров ( --cpu-scaling )
+void measure_cpu_scaling(int image_width, int image_height, int amount_of_pics)
+{
+    int cores = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores > MAX_CPU_WORKERS)
+        cores = MAX_CPU_WORKERS;
+    unsigned char *output = (unsigned char *) calloc((size_t)image_width * image_height * amount_of_pics, 1);
+    double single_time = 0;
+    double times[MAX_CPU_WORKERS + 1];
+    int counts[MAX_CPU_WORKERS + 1];
+    int amount = 0;
+    for (int threads = 1; threads <= cores; threads = threads < cores && threads * 2 > cores ? cores : threads * 2)
+    {
+        double time = 0;
+        if (render_reference_fp64(image_width, image_height, amount_of_pics, threads, output, &time) != 0)
+            break;
+        if (threads == 1)
+            single_time = time;
+        times[amount] = time;
+        counts[amount++] = threads;
+        if (threads == cores)
+            break;
+    }
 
-    clock_t  sumtime = 0;
+    if (amount > 0)
+        show_status_string("CPU scaling of the float64 reference ( %d pics, %d cores ):", amount_of_pics, cores);
+    for (int i = 0; i < amount; i++)
+        show_status_string("  %3d threads: %9.3f s, speedup %6.2f, efficiency %5.1f%%", counts[i], times[i],
+                           single_time / times[i], 100.0 * single_time / times[i] / counts[i]);
+    free(output);
+}
 
-    const size_t pic_size_in_bytes = N * sizeof(cl_float);
+// Сравнение результата основного расчёта ( run_output ) с эталоном в double; для half спектров
+// дополнительно считается float вариант, чтобы отделить потери от half
+void validate_precision(cl_context ctx, cl_device_id device, cl_command_queue queue, const struct Kernel_config *config,
+                        enum Data_layout layout, enum Spectrum_precision precision, const struct Conv_geometry *geometry,
+                        int amount_of_pics, const unsigned char *run_output)
+{
+    size_t output_size = (size_t)geometry->image_width * geometry->image_height * amount_of_pics;
+    unsigned char *reference = (unsigned char *) calloc(output_size, 1);
 
-    for (int i = 0; i < amount_of_pics; i++)
+    if (render_reference_fp64(geometry->image_width, geometry->image_height, amount_of_pics, options.cpu_threads,
+                              reference, NULL) == 0)
     {
-        clock_t start_time_load_pic = clock();
-        char filename[64] = {'\0'};
-        sprintf(filename, "%dx%d/image%02d.png", fft_rash_size.sizex/2, fft_rash_size.sizey/2, i+1);
-        printf("### filename: %s\n", filename);
-
-        struct Image image;
-        image = read_png_file(filename);
+        char run_name[64];
+        snprintf(run_name, sizeof(run_name), "%s spectra", spectrum_precision_name(precision));
+        report_output_deviation(run_name, "float64 reference", run_output, reference, output_size);
 
-        if (image.row_pointers == NULL || image.width*2 != fft_rash_size.sizex || image.height*2 != fft_rash_size.sizey)
+        if (precision == PRECISION_HALF)
         {
-            DeInItCl_Buffer_pair(&all_pics_buffer);
-            if (image.row_pointers != NULL)
+            unsigned char *float_output = (unsigned char *) calloc(output_size, 1);
+            if (render_layers(ctx, device, queue, config, layout, PRECISION_FLOAT, geometry, amount_of_pics, NULL, float_output) == CL_SUCCESS)
             {
-                for(int l = 0; l < image.width; l++)
-                    free(image.row_pointers[l]);
-                free(image.row_pointers);
+                report_output_deviation("float spectra", "float64 reference", float_output, reference, output_size);
+                report_output_deviation("half spectra", "float spectra", run_output, float_output, output_size);
             }
-            free(Array);
-            return all_pics_buffer;
+            free(float_output);
         }
+    }
+    free(reference);
+}
 
-        for (int l = 0; l < image.height; l++)
+/// ПОТАЙЛОВАЯ СВЁРТКА ( OVERLAP-SAVE )
+// Для очень больших картинок: ПФ делается не для всей расширенной картинки, а для тайлов
+// размера P x P. h пересчитывается под тайл: зрачок на том же диапазоне координат дискретизируется
+// P точками вместо размера картинки ( h_sizex = h_sizey = P ), так что PSF тайла совпадает с PSF
+// полного расчёта только с точностью до этой передискретизации и наложения хвостов с периодом P.
+// Опора K измеряется на сетке тайла и переносится в угол h_rash размера P.
+// Циклическая свёртка тайла верна в строках/столбцах [K - 1, P), так что тайл даёт
+// P - K + 1 пикселей результата по каждому направлению; входной тайл сдвинут на K - 1 - c
+// ( c - центр PSF в опоре ) и дополнен нулями за краем картинки.
+// Память устройства: 2 * L спектров размера P^2 и пара буферов результата - от размера картинки не зависит.
+// Картинки и результаты ( 8 бит ) целиком лежат в памяти хоста.
+
+#define MAX_TILE_FFT_SIZE 8192
+
+// Размер тайла и опора PSF на его сетке. tile_fft_size == 0 - подобрать по опоре ( P ~ 4K )
+cl_int choose_tile_geometry(cl_context ctx, cl_device_id device, cl_command_queue queue, const struct Kernel_config *base_config,
+                            int amount_of_pics, int tile_fft_size, struct Conv_geometry *tile_geometry)
+{
+    int automatic = tile_fft_size == 0;
+    int size = automatic ? 256 : next_fft_size(tile_fft_size);
+
+    while (1)
+    {
+        // тайл: картинка P x P без расширения, h на той же сетке
+        memset(tile_geometry, 0, sizeof(*tile_geometry));
+        tile_geometry->image_width = size;
+        tile_geometry->image_height = size;
+        tile_geometry->sizex = size;
+        tile_geometry->sizey = size;
+
+        struct Kernel_config config = *base_config;
+        config.h_sizex = size;
+        config.h_sizey = size;
+        config.scaling = result_scaling(tile_geometry, amount_of_pics);
+        cl_program program = get_program_variant(ctx, device, &config);
+        if (program == 0)
+            return CL_BUILD_PROGRAM_FAILURE;
+        cl_int err = measure_psf_support(ctx, queue, program, amount_of_pics, options.psf_tail, tile_geometry, NULL, NULL);
+        clReleaseProgram(program);
+        if (err != CL_SUCCESS)
+            return err;
+
+        int support = tile_geometry->psf_width > tile_geometry->psf_height ? tile_geometry->psf_width : tile_geometry->psf_height;
+        int wanted = automatic ? next_fft_size(4 * support) : 2 * support;
+        if (wanted <= size)
+            break;
+        if (size >= MAX_TILE_FFT_SIZE)
         {
-            for (int p = 0; p < image.width; p++)
-                Array[l*fft_rash_size.sizey+p] = image.row_pointers[l][p];
+            printf("choose_tile_geometry: PSF support %d does not fit into %dx%d tiles\n", support, size, size);
+            return CL_INVALID_BUFFER_SIZE;
         }
+        if (!automatic)
+            show_status_string("Tile FFT size %d is too small for PSF support %d, growing it", size, support);
+        size = wanted < MAX_TILE_FFT_SIZE ? wanted : MAX_TILE_FFT_SIZE;
+    }
 
-        cl_event write_future = 0;
-        err = clEnqueueWriteBuffer(queue, all_pics_buffer.buffers[0], CL_FALSE, pic_size_in_bytes*i,
-                                   pic_size_in_bytes, Array, 0, NULL, &write_future);
+    // положение картинки внутри тайла результата - начало верной части
+    tile_geometry->crop_x = tile_geometry->psf_width - 1;
+    tile_geometry->crop_y = tile_geometry->psf_height - 1;
+    return CL_SUCCESS;
+}
 
+// Кладёт в all_pics_buffer входные тайлы всех картинок: прямоугольник P x P с левым верхним углом
+// (x0, y0) ( может выходить за картинку - там нули )
+cl_int upload_tile(cl_command_queue queue, struct Image *images, int amount_of_pics, int x0, int y0, int tile_size,
+                   enum Data_layout layout, float *tile, struct Cl_Buffer_pair *all_pics_buffer)
+{
+    const int floats_per_pixel = layout == LAYOUT_INTERLEAVED ? 2 : 1;
+    const size_t tile_size_in_bytes = (size_t)tile_size * tile_size * floats_per_pixel * sizeof(cl_float);
+    cl_int err = CL_SUCCESS;
 
-        for(int l = 0; l < image.width; l++)
-            free(image.row_pointers[l]);
-        free(image.row_pointers);
-        if (err != CL_SUCCESS)
+    float *host_tile = tile;
+    for (int n = 0; n < amount_of_pics && err == CL_SUCCESS; n++)
+    {
+        // zero-copy: тайл собирается прямо в буфере; через кольцо: заполнение следующего тайла идёт,
+        // пока копируется предыдущий
+        int slot = -1;
+        tile = host_tile;
+        if (zero_copy_buffers)
         {
-            printf("Error with pics[%d].buffers[0] clEnqueueWriteBuffer\n", i);
-            clReleaseEvent(write_future);
-            DeInItCl_Buffer_pair(&all_pics_buffer);
-            free(Array);
-            return all_pics_buffer;
+            tile = (float *)clEnqueueMapBuffer(queue, all_pics_buffer->buffers[0], CL_TRUE, CL_MAP_WRITE_INVALIDATE_REGION,
+                                               tile_size_in_bytes * n, tile_size_in_bytes, 0, NULL, NULL, &err);
+            if (err != CL_SUCCESS)
+                break;
         }
-        err = clWaitForEvents(1, &write_future);
-        cl_int err1 = clReleaseEvent(write_future);
-        if (err != CL_SUCCESS || err1 != CL_SUCCESS)
+        else if ((slot = staging_acquire(&staging, tile_size_in_bytes)) >= 0)
+            tile = (float *)staging.host[slot];
+        memset(tile, 0, tile_size_in_bytes);
+        for (int l = 0; l < tile_size; l++)
         {
-            printf("ERROR with events\n");
-            DeInItCl_Buffer_pair(&all_pics_buffer);
-            free(Array);
-            return all_pics_buffer;
+            int y = y0 + l;
+            if (y < 0 || y >= images[n].height)
+                continue;
+            for (int p = 0; p < tile_size; p++)
+            {
+                int x = x0 + p;
+                if (x >= 0 && x < images[n].width)
+                    tile[((size_t)l * tile_size + p) * floats_per_pixel] = images[n].row_pointers[y][x];
+            }
         }
+        if (zero_copy_buffers)
+            err = clEnqueueUnmapMemObject(queue, all_pics_buffer->buffers[0], tile, 0, NULL, NULL);
+        else if (slot < 0)
+            err = clEnqueueWriteBuffer(queue, all_pics_buffer->buffers[0], CL_TRUE, tile_size_in_bytes * n,
+                                       tile_size_in_bytes, tile, 0, NULL, NULL);
+        else
+            err = staging_upload(&staging, slot, all_pics_buffer->buffers[0], tile_size_in_bytes * n, tile_size_in_bytes);
+    }
+    if (err == CL_SUCCESS)
+        err = staging_hand_off(&staging, queue);
+    return err;
+}
 
-        clock_t tmpTime = clock() - start_time_load_pic;
-        sumtime += tmpTime;
-        printf("### %d loaded pic: %f seconds", i+1, (float)tmpTime/CLOCKS_PER_SEC);
-        printf("\n");
+// output != NULL - 8-битные слои подряд в output вместо png
+cl_int run_tiled_convolution(cl_context ctx, cl_device_id device, cl_command_queue queue, const struct Kernel_config *base_config,
+                             enum Data_layout layout, int image_width, int image_height, int amount_of_pics, int tile_fft_size,
+                             unsigned char *output)
+{
+    cl_int err = CL_SUCCESS;
+    cl_int ret;
+
+    struct Conv_geometry tile_geometry;
+    err = choose_tile_geometry(ctx, device, queue, base_config, amount_of_pics, tile_fft_size, &tile_geometry);
+    if (err != CL_SUCCESS)
+        return err;
+
+    int tile_size = tile_geometry.sizex;
+    size_t N = (size_t)tile_size * tile_size;
+    int step_x = tile_size - tile_geometry.psf_width + 1;
+    int step_y = tile_size - tile_geometry.psf_height + 1;
+    // сдвиг входного тайла относительно выходного: K - 1 - c
+    int shift_x = tile_geometry.crop_x - (tile_size / 2 - tile_geometry.psf_x0);
+    int shift_y = tile_geometry.crop_y - (tile_size / 2 - tile_geometry.psf_y0);
+    int tiles_x = (image_width + step_x - 1) / step_x;
+    int tiles_y = (image_height + step_y - 1) / step_y;
+
+    show_status_string("Tiled convolution: %dx%d tiles of %dx%d ( FFT %dx%d, PSF support %dx%d )", tiles_x, tiles_y,
+                       step_x, step_y, tile_size, tile_size, tile_geometry.psf_width, tile_geometry.psf_height);
+
+    struct Kernel_config config = *base_config;
+    config.h_sizex = tile_size;
+    config.h_sizey = tile_size;
+    config.scaling = result_scaling(&tile_geometry, amount_of_pics);
+    if (options.fft_engine == FFT_ENGINE_BUILTIN)
+    {
+        config.fft_sizex = tile_size;
+        config.fft_sizey = tile_size;
+    }
+    cl_program program = get_program_variant(ctx, device, &config);
+    if (program == 0)
+        return CL_BUILD_PROGRAM_FAILURE;
+    if (options.fft_engine == FFT_ENGINE_BUILTIN)
+        set_builtin_fft_program(program);
+
+    /// Картинки и результаты целиком на хосте
+    struct Image images[amount_of_pics];
+    struct Image outputs[amount_of_pics];
+    memset(images, 0, sizeof(images));
+    memset(outputs, 0, sizeof(outputs));
+    for (int n = 0; n < amount_of_pics && err == CL_SUCCESS; n++)
+    {
+        char filename[64] = {'\0'};
+        make_pic_filename(filename, image_width, image_height, n);
+        images[n] = read_png_file(filename);
+        if (images[n].row_pointers == NULL || images[n].width != image_width || images[n].height != image_height)
+        {
+            printf("run_tiled_convolution: could not read %s\n", filename);
+            err = CL_INVALID_VALUE;
+        }
+
+        outputs[n].width = image_width;
+        outputs[n].height = image_height;
+        outputs[n].row_pointers = malloc(image_height * sizeof(outputs[n].row_pointers[0]));
+        for (int l = 0; l < image_height; l++)
+            outputs[n].row_pointers[l] = calloc(image_width, sizeof(outputs[n].row_pointers[0][0]));
     }
 
-    /// Прямое ПФ для КАРТИНК
+    /// Буферы одного тайла
+    struct Cl_Buffer_pair all_pics_buffer, result_part_CL;
+    struct Cl_Buffer_pair h_rash_CL[amount_of_pics];
+    struct FFT_OpenCL_data fft_pics, fft_tile;
+    struct Pair_kernels pair_kernels;
+    memset(&all_pics_buffer, 0, sizeof(all_pics_buffer));
+    memset(&result_part_CL, 0, sizeof(result_part_CL));
+    memset(h_rash_CL, 0, sizeof(h_rash_CL));
+    memset(&fft_pics, 0, sizeof(fft_pics));
+    memset(&fft_tile, 0, sizeof(fft_tile));
+    memset(&pair_kernels, 0, sizeof(pair_kernels));
+    cl_mem result_CL = 0;
+    // zero-copy: тайлы собираются прямо в буферах, промежуточный тайл на хосте не нужен
+    float *tile = zero_copy_buffers ? NULL : (float *) malloc(N * 2 * sizeof(float));
+    float *result = (float *) malloc(N * sizeof(float));
+
+    if (err == CL_SUCCESS)
+        err = generate_h_rash(ctx, queue, program, layout, PRECISION_FLOAT, &tile_geometry, amount_of_pics, h_rash_CL, NULL, NULL);
+    if (err == CL_SUCCESS)
+        err = InitCl_Buffer_complex(ctx, queue, CL_MEM_READ_WRITE, N * amount_of_pics, layout, &all_pics_buffer);
+    if (err == CL_SUCCESS)
+        err = InitCl_Buffer_complex(ctx, queue, CL_MEM_READ_WRITE, N, layout, &result_part_CL);
+    if (err == CL_SUCCESS)
+        result_CL = create_buffer(ctx, CL_MEM_READ_WRITE, N * sizeof(cl_float), &err);
+    if (err == CL_SUCCESS)
+        err = InitFFT_OpenCL_data(tile_size, tile_size, ctx, queue, amount_of_pics, CLFFT_BACKWARD, layout, &fft_pics);
+    if (err == CL_SUCCESS)
+        err = InitFFT_OpenCL_data(tile_size, tile_size, ctx, queue, 1, CLFFT_BACKWARD, layout, &fft_tile);
+    prune_fft_output(&fft_tile, tile_geometry.crop_x, tile_geometry.crop_y, step_x, step_y);
+    if (err == CL_SUCCESS)
+        err = InitPair_kernels(program, layout, PRECISION_FLOAT, N, &all_pics_buffer, &result_part_CL, config.scaling,
+                               result_CL, &pair_kernels);
+    if (err == CL_SUCCESS)
+        err = fuse_pair_kernels(&pair_kernels, program, &fft_tile, &all_pics_buffer, &result_part_CL, config.scaling, result_CL);
+
+    struct Layer_timing timing;
+    memset(&timing, 0, sizeof(timing));
+    clock_t tiles_start = clock();
+
+    for (int ty = 0; ty < tiles_y && err == CL_SUCCESS; ty++)
+        for (int tx = 0; tx < tiles_x && err == CL_SUCCESS; tx++)
+        {
+            int out_x = tx * step_x;
+            int out_y = ty * step_y;
 
-    clock_t fft_start = clock();
-    if (FFT_2D_OpenCL(&all_pics_buffer, CLFFT_FORWARD, queue, CL_TRUE , &fft_rash_size) == 0)
+            /// Спектры входных тайлов всех картинок
+            err = upload_tile(queue, images, amount_of_pics, out_x - shift_x, out_y - shift_y, tile_size, layout, tile, &all_pics_buffer);
+            if (err == CL_SUCCESS && FFT_2D_OpenCL(&all_pics_buffer, CLFFT_FORWARD, queue, CL_TRUE, &fft_pics) != 0)
+            {
+                printf("FFT for tile NOT passed !\n");
+                err = CL_INVALID_OPERATION;
+            }
+
+            /// Слои результата тайла, сшиваем верные части
+            for (int m = 0; m < amount_of_pics && err == CL_SUCCESS; m++)
+            {
+                err = compute_result_layer(queue, &pair_kernels, &fft_tile, &result_part_CL, result_CL, h_rash_CL,
+                                           NULL, NULL, NULL, m, amount_of_pics, N, &timing);
+                const float *layer = result;
+                if (err == CL_SUCCESS)
+                    layer = read_result_layer(queue, result_CL, N, result, &err);
+                if (err != CL_SUCCESS)
+                    break;
+
+                for (int k = 0; k < step_y && out_y + k < image_height; k++)
+                    for (int l = 0; l < step_x && out_x + l < image_width; l++)
+                        outputs[m].row_pointers[out_y + k][out_x + l] =
+                            (png_byte)layer[(size_t)(k + tile_geometry.crop_y) * tile_size + (l + tile_geometry.crop_x)];
+                err = release_result_layer(queue, result_CL, layer);
+            }
+        }
+
+    if (err == CL_SUCCESS)
     {
+        show_status_string("Time for all tiles: %f", (float)(clock() - tiles_start)/CLOCKS_PER_SEC);
+        show_status_string("Full time of calculations(multiply+add): %g seconds", (float)timing.multiply_plus_add_time/CLOCKS_PER_SEC);
 
-        clock_t fft_end = clock();
-        printf("### all pics fft: %f seconds\n", (float)(fft_end - fft_start)/CLOCKS_PER_SEC);
+        for (int m = 0; m < amount_of_pics; m++)
+        {
+            if (output != NULL)
+            {
+                for (int l = 0; l < image_height; l++)
+                    memcpy(output + ((size_t)m * image_height + l) * image_width, outputs[m].row_pointers[l], image_width);
+                continue;
+            }
+            char filename_png[64] = {'\0'};
+            sprintf(filename_png, "result/image%02d.png",  m+1);
+            show_status_string("Writing data to file");
+            write_png_file(outputs[m], filename_png);
+        }
     }
     else
+        printf("run_tiled_convolution: Error %d\n", err);
+
+    DeInitPair_kernels(&pair_kernels);
+    DeInItFFT_OpenCL_data(&fft_tile);
+    DeInItFFT_OpenCL_data(&fft_pics);
+    if (result_CL)
     {
-        printf("Problems w/ FFT\n");
-        DeInItCl_Buffer_pair(&all_pics_buffer);
+        ret = clReleaseMemObject(result_CL);
+        if (ret != CL_SUCCESS)
+            printf("Problems w/ releasing result_CL\n");
     }
+    DeInItCl_Buffer_pair(&result_part_CL);
+    DeInItCl_Buffer_pair(&all_pics_buffer);
+    for (int k = 0; k < amount_of_pics; k++)
+        DeInItCl_Buffer_pair(&h_rash_CL[k]);
+    clReleaseProgram(program);
 
-    printf("\n");
-    DeInItFFT_OpenCL_data(&fft_rash_size);
-    free(Array);
-    return all_pics_buffer;
+    for (int n = 0; n < amount_of_pics; n++)
+    {
+        for (int l = 0; l < image_height; l++)
+        {
+            if (images[n].row_pointers != NULL)
+                free(images[n].row_pointers[l]);
+            free(outputs[n].row_pointers[l]);
+        }
+        free(images[n].row_pointers);
+        free(outputs[n].row_pointers);
+    }
+    free(result);
+    free(tile);
+    return err;
 }
 
-cl_program init_kernel_program(cl_context ctx, cl_device_id device)
+/// ПРОВЕРКА ПУТЕЙ РАСЧЁТА ( --validate-paths )
+// Каждый необязательный путь считается заново на тех же картинках и геометрии и сравнивается с базовым
+// расчётом ( clFFT, без необязательных механизмов, передачи напрямую ). Точные пути ( передачи, таблица
+// и кеш h, повтор пары, блоки слоёв, пул стадий ) расходятся не больше чем на округление, приближённые
+// ( прямая и разделимая свёртка, пониженное разрешение, компактные h, тайлы ) - на своё отсечение PSF.
+// Пул эталонного расчёта проверяется отдельно: при любом числе потоков результат тот же, что у одного.
+
+// Отклонение float64 эталона от float расчёта на устройстве, уровней серого
+#define REFERENCE_PATH_TOLERANCE 2
+
+// Отклонение пути от базового расчёта; 1 - больше допустимого
+int path_failed(const char *name, const char *reference_name, const unsigned char *output,
+                const unsigned char *reference, size_t size, int tolerance)
 {
-    // Execute the OpenCL kernel on the list
-    cl_int ret;
-    FILE *rash_kernel;
-    char *source_str;
+    int max_deviation = report_output_deviation(name, reference_name, output, reference, size);
+    if (max_deviation <= tolerance)
+        return 0;
+    show_status_string("Path %s: FAILED, more than %d grey levels", name, tolerance);
+    return 1;
+}
 
-    /// Открываем файл с kernel на чтение
-    rash_kernel = fopen("rash_kernel.cl", "r");
-    if (!rash_kernel)
+// Путь, который устройство или картинки не поддерживают, пропускается. Возвращает число расхождений
+int validate_paths(cl_context ctx, cl_device_id device, cl_command_queue queue, const struct Kernel_config *config,
+                   enum Data_layout layout, const struct Conv_geometry *geometry, int amount_of_pics)
+{
+    static const struct Render_path baseline = {.name = "clFFT baseline"};
+    // радиус и число отсчётов прямой свёртки больше опоры PSF маленьких картинок: прямой путь получают все пары
+    static const struct Render_path paths[] = {
+        {.name = "built-in FFT, fused pair", .builtin_fft = 1, .tolerance = 1},
+        {.name = "h table in the arena", .h_table = 1, .tolerance = 1},
+        {.name = "fused pair replayed from a command buffer", .builtin_fft = 1, .h_table = 1, .command_buffers = 1,
+         .tolerance = 1},
+        {.name = "LRU h cache with 2 slots", .h_cache_slots = 2, .tolerance = 1},
+        {.name = "direct convolution", .direct_radius = 16, .tolerance = 2},
+        {.name = "separable convolution", .separable_taps = 256, .tolerance = 2},
+        {.name = "reduced far layers", .reduce_far_layers = 1e-4f, .tolerance = 2},
+        {.name = "compact OTF", .compact_otf = 1e-5f, .tolerance = 1},
+        {.name = "output batching", .batch_outputs = 4, .tolerance = 1},
+        {.name = "staging ring", .staging_ring = 1},
+        {.name = "zero-copy buffers", .zero_copy = 1},
+        {.name = "layers cropped in the stage pool", .stage_pool = 1},
+        {.name = "tiled overlap-save", .tiled = 1, .tolerance = 2},
+    };
+    int width = geometry->image_width;
+    int height = geometry->image_height;
+    size_t output_size = (size_t)width * height * amount_of_pics;
+    unsigned char *reference = (unsigned char *) calloc(output_size, 1);
+    unsigned char *output = (unsigned char *) calloc(output_size, 1);
+    int failures = 0;
+
+    cl_int err = render_layers(ctx, device, queue, config, layout, PRECISION_FLOAT, geometry, amount_of_pics,
+                               &baseline, reference);
+    if (err != CL_SUCCESS)
     {
-        fprintf(stderr, "Failed to load kernel.\n");
-        return 0;
+        printf("validate_paths: baseline failed ( error %d )\n", err);
+        free(output);
+        free(reference);
+        return 1;
     }
-    source_str = (char*)malloc(MAX_SOURCE_SIZE);
-    fread( source_str, 1, MAX_SOURCE_SIZE, rash_kernel);
-    fclose(rash_kernel);
-
-    // Create program
-    cl_program program = clCreateProgramWithSource(ctx, 1, (const char **)&source_str, NULL, &ret);
 
-    // Build the program
-    ret = clBuildProgram(program, 1, &device, NULL, NULL, NULL);
+    for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); i++)
+    {
+        memset(output, 0, output_size);
+        if (paths[i].tiled)
+        {
+            // сборка как у --tiled в main: размеры тайла run_tiled_convolution ставит сам
+            struct Kernel_config tile_config;
+            memset(&tile_config, 0, sizeof(tile_config));
+            tile_config.specialized = config->specialized;
+            tile_config.fast_math = config->fast_math;
+            struct Render_path_state state;
+            err = enter_render_path(ctx, device, queue, 0, &paths[i], &state);
+            if (err == CL_SUCCESS)
+                err = run_tiled_convolution(ctx, device, queue, &tile_config, layout, width, height, amount_of_pics,
+                                            options.tile_fft_size, output);
+            leave_render_path(&state);
+        }
+        else
+            err = render_layers(ctx, device, queue, config, layout, PRECISION_FLOAT, geometry, amount_of_pics,
+                                &paths[i], output);
+        if (err == CL_INVALID_OPERATION)
+        {
+            show_status_string("Path %s: not supported here, skipped", paths[i].name);
+            continue;
+        }
+        if (err != CL_SUCCESS)
+        {
+            printf("validate_paths: %s failed ( error %d )\n", paths[i].name, err);
+            failures++;
+            continue;
+        }
+        failures += path_failed(paths[i].name, baseline.name, output, reference, output_size, paths[i].tolerance);
+    }
 
-    /// в случае ошибок выводим log
-    if(ret != CL_SUCCESS)
+    /// Пул эталонного расчёта: один поток и весь пул
+    unsigned char *serial = (unsigned char *) calloc(output_size, 1);
+    memset(output, 0, output_size);
+    if (render_reference_fp64(width, height, amount_of_pics, 1, serial, NULL) != 0 ||
+        render_reference_fp64(width, height, amount_of_pics, options.cpu_threads, output, NULL) != 0)
     {
-        printf("Problems w/ building program\n");
-        size_t source_size_log;
-        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0 , NULL, &source_size_log);
-        char *log= malloc(sizeof(char) * source_size_log);
-        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, source_size_log, log, &source_size_log);
-        printf("%s\n", log);
-        free(log);
-        clReleaseProgram(program);
-        return 0;
+        printf("validate_paths: float64 reference failed\n");
+        failures++;
     }
-    free(source_str);
-    source_str = NULL;
+    else
+    {
+        failures += path_failed("float64 reference in the work-stealing pool", "one thread", output, serial, output_size, 0);
+        failures += path_failed("float64 reference in the work-stealing pool", baseline.name, output, reference, output_size,
+                                REFERENCE_PATH_TOLERANCE);
+    }
+    free(serial);
 
-    return program;
+    show_status_string("Path validation: %d failed", failures);
+    free(output);
+    free(reference);
+    return failures;
 }
 
-
-
 //// СКОЛЬКО ПАМЯТИ ТРАТИТСЯ ////
 // x^2 - размер одой картинки в пикселях ( оригинальный )
 // тк мы работаем с раширенными матрицами => (2x)^2 - размер одной картинки в пикселях ( расширенный )
@@ -507,8 +7439,13 @@ cl_program init_kernel_program(cl_context ctx, cl_device_id device)
 
 // тогда минимальный объем памяти для N картинок на GPU - (2x)^2 * sizeof(float) * 2 * (2*N + 1) + x^2* sizeof(float)*2  + (2x)^2 * sizeof(float) ( предпоследнее слагаемое - h оригинального размера, последнее - результат )
 // x^2 * sizeof(float) * (16N + 14)
+// при PRECISION_HALF спектры картинок и h_rash вдвое меньше, но спектры картинок сначала считаются во float
+
+int main(int argc, char **argv) {
 
-int main(void) {
+    int options_status = parse_run_options(argc, argv, &options);
+    if (options_status != 0)
+        return options_status > 0 ? 0 : 1;
 
     cl_int err;
     cl_int ret;
@@ -564,11 +7501,20 @@ int main(void) {
         printf("Program requires OpenCL 1.2 and higher\n");
         exit(1);
     }
-
-    ptr = 0;
-    printf("Choose image size (like 512, 1024 etc): ");
-    scanf("%d", &ptr);
-    printf("\n");
+
+    // квадратная ( 512 ) или прямоугольная ( 640x480 ) картинка
+    int image_width = 0;
+    int image_height = 0;
+
+    while (image_width < 1 || image_height < 1)
+    {
+        char size_answer[64] = {'\0'};
+        printf("Choose image size (like 512, 1024 or 640x480): ");
+        scanf("%63s", size_answer);
+        if (sscanf(size_answer, "%dx%d", &image_width, &image_height) == 1)
+            image_height = image_width;
+        printf("\n");
+    }
     
     int amount_of_pics = 0;
 
@@ -586,14 +7532,14 @@ int main(void) {
     strftime (buff, 100, "%Y-%m-%d | %H-%M-%S", localtime(&now));
 
     char str_name_of_log_file[128];
-    sprintf(str_name_of_log_file, "log_file | %d | %d | %s.txt", ptr, amount_of_pics, buff);
+    sprintf(str_name_of_log_file, "log_file | %dx%d | %d | %s.txt", image_width, image_height, amount_of_pics, buff);
     last_run_log_file = fopen(str_name_of_log_file, "wb");
 
     fprintf(last_run_log_file, "Amount of devices: %u\n", number_of_devices);
     err = clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(name), name, NULL);
     fprintf(last_run_log_file, "You chose this device: [%s]\n", name);
     fprintf(last_run_log_file, "Your OpenCL version: %s\n", version);
-    fprintf(last_run_log_file, "You chose image size: %dx%d\n", ptr, ptr);
+    fprintf(last_run_log_file, "You chose image size: %dx%d\n", image_width, image_height);
     fprintf(last_run_log_file, "You chose this amount of pics: %d\n", amount_of_pics);
 
     cl_ulong device_memsize_in_bytes = 0;
@@ -601,8 +7547,15 @@ int main(void) {
 
     show_status_string("GPU mem space: %"PRIu64" MB", device_memsize_in_bytes/((cl_ulong)1024*(cl_ulong)1024));
 
-    cl_ulong min_memsize_in_bytes_required = (cl_ulong)(ptr*ptr) * sizeof(float) * (32 * amount_of_pics + 22);
-    if (min_memsize_in_bytes_required >= device_memsize_in_bytes)
+    enum Spectrum_precision precision = options.spectrum_precision;
+    if (options.tiled && precision == PRECISION_HALF)
+    {
+        show_status_string("Tiled convolution keeps spectra in float");
+        precision = PRECISION_FLOAT;
+    }
+    int floats_per_pic_required = precision == PRECISION_HALF ? 24 : 32;
+    cl_ulong min_memsize_in_bytes_required = (cl_ulong)image_width * image_height * sizeof(float) * (floats_per_pic_required * amount_of_pics + 22);
+    if (!options.tiled && min_memsize_in_bytes_required >= device_memsize_in_bytes)
     {
         printf("### Not enough GPU memory\n");
         printf("### Min required GPU mem space: %"PRIu64" MB\n", min_memsize_in_bytes_required/((cl_ulong)1024*(cl_ulong)1024));
@@ -614,35 +7567,184 @@ int main(void) {
     ctx = clCreateContext(NULL, 1, &device, NULL, NULL, &err);
 
 // Create a command queue
-    queue = clCreateCommandQueue(ctx, device, 0, &err);
+    // память устройства - память хоста: буферы поверх неё, копировать и держать вторые копии не нужно
+    zero_copy_buffers = !options.no_zero_copy && device_has_host_memory(device);
+    if (zero_copy_buffers)
+        show_status_string("Device shares memory with the host: zero-copy buffers");
+
+    // Очередь расчёта и отдельная очередь передач ( без zero-copy ): загрузки и чтения идут параллельно с
+    // kernel'ами, порядок между очередями - по событиям. Профилирование - для статистики передач и перекрытия
+    int use_transfer_queue = !options.single_queue && !zero_copy_buffers;
+    queue = clCreateCommandQueue(ctx, device, options.no_pinned_staging && !use_transfer_queue ? 0 : CL_QUEUE_PROFILING_ENABLE, &err);
+    cl_command_queue transfer_queue = 0;
+    if (use_transfer_queue)
+    {
+        transfer_queue = clCreateCommandQueue(ctx, device, CL_QUEUE_PROFILING_ENABLE, &err);
+        if (err != CL_SUCCESS)
+        {
+            printf("Transfer queue not created ( %d ), transfers go through the compute queue\n", err);
+            transfer_queue = 0;
+        }
+    }
+    if (!options.no_pinned_staging && !zero_copy_buffers)
+        InitStaging_ring(ctx, transfer_queue ? transfer_queue : queue, options.staging_huge_pages, &staging);
 
     show_status_string("Initializing FFT library...");
     // Setup clFFT
     clfftSetupData fftSetup;
     err = clfftInitSetupData(&fftSetup);
+    if (options.fft_kernel_dump_dir != NULL)
+        fftSetup.debugFlags |= CLFFT_DUMP_PROGRAMS;
+    clock_t fft_setup_start = clock();
     err = clfftSetup(&fftSetup);
+    show_status_string("FFT library setup: %f", (float)(clock() - fft_setup_start)/CLOCKS_PER_SEC);
+
+    /// Потайловая свёртка: свой расчёт целиком, дальше основной путь не нужен
+    if (options.tiled)
+    {
+        struct Kernel_config tile_config;
+        memset(&tile_config, 0, sizeof(tile_config));
+        tile_config.specialized = !options.generic_kernels;
+        tile_config.fast_math = options.fast_math;
+        enum Data_layout tile_layout = options.layout_auto ? LAYOUT_PLANAR : options.layout;
+
+        err = run_tiled_convolution(ctx, device, queue, &tile_config, tile_layout, image_width, image_height,
+                                    amount_of_pics, options.tile_fft_size, NULL);
+        show_status_string("Full time of program: %f", (float)(clock() - time_start_program)/CLOCKS_PER_SEC);
+
+        release_program_variants();
+        release_fft_plans();
+        clfftTeardown(); // Release clFFT library
+        report_staging(&staging);
+        DeInitStaging_ring(&staging);
+        if (transfer_queue)
+            clReleaseCommandQueue(transfer_queue);
+        clReleaseCommandQueue(queue); // Release OpenCL working objects
+        clReleaseContext(ctx);
+        fclose(last_run_log_file);
+        return err == CL_SUCCESS ? 0 : 1;
+    }
 
 
-    int sizex = ptr*2;
-    int sizey = ptr*2;
-    int half_sizex = sizex / 2;
-    int half_sizey = sizey / 2;
+    // пока опора PSF не измерена - исходная геометрия ( удвоенные размеры )
+    struct Conv_geometry geometry;
+    init_double_padding_geometry(image_width, image_height, &geometry);
 
-    // Total size of FFT( по сути размер расширенных матриц )
-    size_t N = sizex * sizey;
-    // исходный размер картинки ( используется только для h )
-    size_t half_N = half_sizex * half_sizey;
+    /// Пул стадий: картинки декодируются уже сейчас, пока собираются программы и планы ПФ
+    /// ( задач: по 2 на картинку, по 3 на слой и несколько общих ). С кэшем спектров - только если
+    /// кэш не подошёл: ключ зависит от размеров ПФ, которые известны после измерения PSF
+    struct Pic_decoding pic_decoding;
+    memset(&pic_decoding, 0, sizeof(pic_decoding));
+    if (options.stage_threads != 0 && InitStage_graph(&stages, options.stage_threads, 5 * amount_of_pics + 16) > 0)
+    {
+        show_status_string("Pipeline stages run on %d pool threads", stages.amount_of_workers);
+        if (options.spectra_cache_dir == NULL)
+            start_pic_decoding(&stages, amount_of_pics, image_width, image_height, &pic_decoding);
+    }
+
+    struct Kernel_config kernel_config;
+    memset(&kernel_config, 0, sizeof(kernel_config));
+    kernel_config.h_sizex = image_width;
+    kernel_config.h_sizey = image_height;
+    kernel_config.scaling = result_scaling(&geometry, amount_of_pics);
+    kernel_config.specialized = !options.generic_kernels;
+    kernel_config.fast_math = options.fast_math;
+    if (options.fft_engine == FFT_ENGINE_BUILTIN)
+    {
+        kernel_config.fft_sizex = geometry.sizex;
+        kernel_config.fft_sizey = geometry.sizey;
+    }
+
+    cl_program program = get_program_variant(ctx, device, &kernel_config);
+
+    /// Размеры ПФ по опоре PSF
+    if (program != 0 && !options.double_padding)
+    {
+        clock_t support_start = clock();
+        err = measure_psf_support(ctx, queue, program, amount_of_pics, options.psf_tail, &geometry, NULL, NULL);
+        if (err == CL_SUCCESS)
+        {
+            fit_geometry_to_psf_support(&geometry);
+            // нормировка зависит от размера ПФ, а в специализированной сборке она константа
+            kernel_config.scaling = result_scaling(&geometry, amount_of_pics);
+            if (options.fft_engine == FFT_ENGINE_BUILTIN)
+            {
+                kernel_config.fft_sizex = geometry.sizex;
+                kernel_config.fft_sizey = geometry.sizey;
+            }
+            clReleaseProgram(program);
+            program = get_program_variant(ctx, device, &kernel_config);
+        }
+        else
+            init_double_padding_geometry(image_width, image_height, &geometry);
+        show_status_string("PSF support measurement: %f", (float)(clock() - support_start)/CLOCKS_PER_SEC);
+    }
 
-    cl_program program = init_kernel_program(ctx, device);
     if (program == 0)
     {
+        release_program_variants();
+        release_fft_plans();
         clfftTeardown(); // Release clFFT library
+        report_staging(&staging);
+        DeInitStaging_ring(&staging);
+        if (transfer_queue)
+            clReleaseCommandQueue(transfer_queue);
         clReleaseCommandQueue(queue); // Release OpenCL working objects
         clReleaseContext(ctx);
         fclose(last_run_log_file);
+        stage_wait_all(&stages);
+        DeInitStage_graph(&stages);
         exit(1);
     }
 
+    int sizex = geometry.sizex;
+    int sizey = geometry.sizey;
+
+    // Total size of FFT( по сути размер расширенных матриц )
+    size_t N = (size_t)sizex * sizey;
+
+    show_status_string("FFT size: %dx%d ( PSF support %dx%d, image at %d,%d ), %.1f%% of the points of 2x padding",
+                       sizex, sizey, geometry.psf_width, geometry.psf_height, geometry.crop_x, geometry.crop_y,
+                       100.0 * N / (4.0 * image_width * image_height));
+
+    /// Движок ПФ
+    if (options.benchmark_fft)
+        benchmark_fft_engines(ctx, device, queue, program, options.layout_auto ? LAYOUT_PLANAR : options.layout);
+    if (options.fft_engine == FFT_ENGINE_BUILTIN)
+        set_builtin_fft_program(program);
+    show_status_string("FFT engine: %s", fft_engine_name(options.fft_engine));
+
+    /// Выбор раскладки комплексных данных
+    enum Data_layout layout = options.layout;
+    if (options.layout_auto)
+    {
+        float planar_time = benchmark_data_layout(ctx, queue, program, sizex, sizey, kernel_config.scaling, LAYOUT_PLANAR, precision);
+        float interleaved_time = benchmark_data_layout(ctx, queue, program, sizex, sizey, kernel_config.scaling, LAYOUT_INTERLEAVED, precision);
+        show_status_string("Time for 1 pair (multiply+IFFT+abs), planar layout: %f", planar_time);
+        show_status_string("Time for 1 pair (multiply+IFFT+abs), interleaved layout: %f", interleaved_time);
+
+        layout = LAYOUT_PLANAR;
+        if (interleaved_time > 0 && (planar_time < 0 || interleaved_time < planar_time))
+            layout = LAYOUT_INTERLEAVED;
+    }
+    show_status_string("Data layout: %s", data_layout_name(layout));
+    show_status_string("Spectrum precision: %s", spectrum_precision_name(precision));
+
+    /// Подбор размеров рабочих групп ( только для того, чего ещё нет в базе )
+    if (options.tune_file != NULL)
+    {
+        clock_t tuning_start = clock();
+        load_tuning_db(options.tune_file, device);
+        int amount_of_known_entries = tuning_db.count;
+        autotune_pipeline_kernels(ctx, queue, device, program, layout, precision, &geometry, kernel_config.scaling);
+        if (tuning_db.count != amount_of_known_entries)
+        {
+            save_tuning_db(options.tune_file);
+            show_status_string("Autotuning: %f", (float)(clock() - tuning_start)/CLOCKS_PER_SEC);
+        }
+        show_tuning_report();
+    }
+
 ///=================================================================
 
 /// НАЧАЛО РАБОТЫ С КАРТИНКОЙ
@@ -650,209 +7752,146 @@ int main(void) {
 
     show_status_string("Reading and FFT-ing input pics...");
     clock_t start = clock();
-    all_pics_buffer = read_and_fft_pics(ctx, queue, amount_of_pics, sizex);
+    all_pics_buffer = read_and_fft_pics(ctx, queue, amount_of_pics, &geometry, layout,
+                                        stages.amount_of_workers > 0 ? &pic_decoding : NULL);
+    if (pic_decoding.jobs != NULL)
+        DeInitPic_decoding(&stages, &pic_decoding);
     printf("### Reading and fft'ing pics ends in: %f seconds\n", (float)(clock()-start)/CLOCKS_PER_SEC);
     if (all_pics_buffer.buffers[0] == 0)
     {
+       release_fft_plans();
        clfftTeardown(); // Release clFFT library
+       report_staging(&staging);
+       DeInitStaging_ring(&staging);
+       if (transfer_queue)
+           clReleaseCommandQueue(transfer_queue);
        clReleaseCommandQueue(queue); // Release OpenCL working objects
        clReleaseProgram(program);
        clReleaseContext(ctx);
        fclose(last_run_log_file);
+       stage_wait_all(&stages);
+       DeInitStage_graph(&stages);
        exit(1);
     }
 
+    // масштабы срезов для PRECISION_HALF
+    float image_scales[amount_of_pics];
+    float h_scales[amount_of_pics];
+
+    if (precision == PRECISION_HALF)
+    {
+        clock_t convert_start = clock();
+        err = convert_spectra_to_half(ctx, queue, program, layout, N, amount_of_pics, &all_pics_buffer, image_scales);
+        if (err != CL_SUCCESS)
+        {
+            DeInItCl_Buffer_pair(&all_pics_buffer);
+            release_fft_plans();
+            clfftTeardown(); // Release clFFT library
+            report_staging(&staging);
+            DeInitStaging_ring(&staging);
+            if (transfer_queue)
+                clReleaseCommandQueue(transfer_queue);
+            clReleaseCommandQueue(queue); // Release OpenCL working objects
+            clReleaseProgram(program);
+            clReleaseContext(ctx);
+            fclose(last_run_log_file);
+            stage_wait_all(&stages);
+            DeInitStage_graph(&stages);
+            exit(1);
+        }
+        show_status_string("Converting spectra of pics to half: %f", (float)(clock() - convert_start)/CLOCKS_PER_SEC);
+    }
+
 /// КОНЕЦ РАБОТЫ С КАРТИНКОЙ
 
 
 /// НАЧАЛО РАБОТЫ С h
 
-    clock_t start_h_CL_time = clock();
-    struct FFT_OpenCL_data fft_orig_size;
-    err = InitFFT_OpenCL_data(half_sizex, half_sizey, ctx, queue, 1, CLFFT_FORWARD, &fft_orig_size);
-
     // кол-во картинок равно 3 => amount_of_pics = 3;
     int amount_of_h = amount_of_pics;
 
-    /// Создаем пару буферов для h размером исходной картинки и h расширенной
-    struct Cl_Buffer_pair h_rash_CL[amount_of_h];
-    struct Cl_Buffer_pair h_CL_k;
-
-    show_status_string("Init buffer for h_original_size and h_extended_size");
-
-    for (int i = 0; i < amount_of_h; i++)
+    /// Арена: таблица h, result_part_CL и result_CL ( общий блок на 3N float + запас на выравнивание )
+    struct Device_arena arena;
+    InitDevice_arena(ctx, device, 3 * (N * sizeof(cl_float) + 4096), &arena);
+
+    /// Таблица h: multiply меняет на пару только смещение. half спектры и --compact-otf заменяют h_rash_CL[k]
+    /// своими буферами, поэтому там h остаются отдельными
+    struct H_table h_table;
+    memset(&h_table, 0, sizeof(h_table));
+    int use_h_table = precision == PRECISION_FLOAT && options.compact_otf <= 0;
+
+    /// Кеш h: h генерируются по требованию в ограниченное число слотов. Пониженному разрешению и
+    /// --compact-otf нужны все h сразу, half спектры не кешируются
+    struct H_cache h_cache;
+    memset(&h_cache, 0, sizeof(h_cache));
+    int use_h_cache = options.h_cache_mb > 0;
+    if (use_h_cache && (precision != PRECISION_FLOAT || options.compact_otf > 0 || options.reduce_far_layers > 0))
     {
-        InitCl_Buffer_pair(ctx, queue, CL_MEM_READ_WRITE, N, &h_rash_CL[i]);
+        show_status_string("h cache needs float spectra and no --compact-otf or --reduce-far-layers, all h are generated up front");
+        use_h_cache = 0;
     }
-    InitCl_Buffer_pair(ctx, queue, CL_MEM_READ_WRITE, half_N, &h_CL_k);
-
-    // Создаем kernel для инициализации h и передаем туда аргументы ( delta_z и два буфера для вещественной и мнимой части )
-    cl_kernel h_init_kernel = clCreateKernel(program, "h_init_kernel", &ret);
-    cl_kernel h_squared_abs_kernel = clCreateKernel(program, "h_squared_abs_kernel", &ret);
-    cl_kernel fft_shift_row_kernel = clCreateKernel(program, "fft_shift_row_kernel", &ret);
-    cl_kernel fft_shift_col_kernel = clCreateKernel(program, "fft_shift_col_kernel", &ret);
-
-
-    ret = clSetKernelArg(h_init_kernel, 1, sizeof(cl_mem), &h_CL_k.buffers[0]);
-    if (ret != CL_SUCCESS)
-        printf("Problems w/ setting KernelArgs for h[0] h_init_kernel\n");
-    ret = clSetKernelArg(h_init_kernel, 2, sizeof(cl_mem), &h_CL_k.buffers[1]);
-    if (ret != CL_SUCCESS)
-        printf("Problems w/ setting KernelArgs for h[1] h_init_kernel\n");
-
-
-    ret = clSetKernelArg(h_squared_abs_kernel, 0, sizeof(cl_mem), &h_CL_k.buffers[0]);
-    if (ret != CL_SUCCESS)
-        printf("Problems w/ setting KernelArgs for h[0] h_squared_abs_kernel\n");
-    ret = clSetKernelArg(h_squared_abs_kernel, 1, sizeof(cl_mem), &h_CL_k.buffers[1]);
-    if (ret != CL_SUCCESS)
-        printf("Problems w/ setting KernelArgs for h[1] h_squared_abs_kernel\n");
-
-
-    for (int k = 0; k < amount_of_h; k++)
+    if (use_h_cache)
     {
-
-        float delta_z = k * M_PI;
-
-        ret = clSetKernelArg(h_init_kernel, 0, sizeof(delta_z), &delta_z);
-        if (ret != CL_SUCCESS)
-            printf("Problems w/ setting KernelArgs for delta_z h_init_kernel\n");
-
-
-        size_t global_group_size[] = {half_sizex, half_sizey};
-        /// Кладем в очередь команды для вызова kernel, который создает матрицу h размерами исходной картинки
-
-        ret = clEnqueueNDRangeKernel(queue, h_init_kernel, 2, NULL, global_group_size, NULL, 0, NULL, NULL);
-        if (ret != CL_SUCCESS)
-            printf("Problems w/ clEnqueueNDRangeKernel h_init_kernel");
-        ret = clFinish(queue);
-        if (ret != CL_SUCCESS)
-            printf("Problems w/ clFinish");
-
-
-
-        show_status_string("Making FFT for h_original_size");
-        /// Прямое ПФ для h
-        if (FFT_2D_OpenCL(&h_CL_k, CLFFT_FORWARD, queue, CL_TRUE ,&fft_orig_size) == 0)
-            ;
-        else
-            printf("FFT for h func NOT passed !\n");
-
-        /// FFTShift для h
-
-        for (int i = 0; i < 2; i++)
+        err = InitH_cache(ctx, queue, program, &arena, layout, &geometry, amount_of_h,
+                          (size_t)(options.h_cache_mb * 1048576.0f), &h_cache);
+        if (err != CL_SUCCESS)
+            show_status_string("h cache is off, all h are generated up front");
+        use_h_cache = err == CL_SUCCESS;
+        if (use_h_cache)
+            use_h_table = 0;
+    }
+    if (use_h_table)
+    {
+        err = InitH_table(&arena, N, amount_of_h, layout, &h_table);
+        if (err == CL_SUCCESS)
+            err = arena_zero_fill(&arena, queue);
+        if (err != CL_SUCCESS)
         {
-            ret = clSetKernelArg(fft_shift_row_kernel, 0, sizeof(cl_mem), &h_CL_k.buffers[i]);
-            if (ret != CL_SUCCESS)
-                printf("Problems w/ setting KernelArgs for h[%d] fft_shift_row_kernel\n", i);
-            ret = clSetKernelArg(fft_shift_row_kernel, 1, sizeof(half_sizex), &half_sizex);
-            if (ret != CL_SUCCESS)
-                printf("Problems w/ setting KernelArgs for h[%d] fft_shift_row_kernel\n", i);
-
-            size_t sizey_t = half_sizey;
-            ret = clEnqueueNDRangeKernel(queue, fft_shift_row_kernel, 1, NULL, &sizey_t, NULL, 0, NULL, NULL);
-            if (ret != CL_SUCCESS)
-                printf("Problems w/ clEnqueueNDRangeKernel fft_shift_row_kernel");
-            ret = clFinish(queue);
-            if (ret != CL_SUCCESS)
-                printf("Problems w/ clFinish");
-
-            ret = clSetKernelArg(fft_shift_col_kernel, 0, sizeof(cl_mem), &h_CL_k.buffers[i]);
-            if (ret != CL_SUCCESS)
-                printf("Problems w/ setting KernelArgs for h[%d] fft_shift_col_kernel\n", i);
-            ret = clSetKernelArg(fft_shift_col_kernel, 1, sizeof(half_sizey), &half_sizey);
-            if (ret != CL_SUCCESS)
-                printf("Problems w/ setting KernelArgs for h[%d] fft_shift_col_kernel\n", i);
-
-
-            size_t sizex_t = half_sizex;
-            ret = clEnqueueNDRangeKernel(queue, fft_shift_col_kernel, 1, NULL, &sizex_t, NULL, 0, NULL, NULL);
-            if (ret != CL_SUCCESS)
-                printf("Problems w/ clEnqueueNDRangeKernel fft_shift_col_kernel");
-            ret = clFinish(queue);
-            if (ret != CL_SUCCESS)
-                printf("Problems w/ clFinish");
-
+            show_status_string("No room for the h table, h spectra are separate buffers");
+            DeInitH_table(&h_table);
+            use_h_table = 0;
         }
-
-        /// Модуль для h^2
-
-        size_t half_N_local = half_N;
-        ret = clEnqueueNDRangeKernel(queue, h_squared_abs_kernel, 1, NULL, &half_N_local, NULL, 0, NULL, NULL);
-        if (ret != CL_SUCCESS)
-            printf("Problems w/ clEnqueueNDRangeKernel h_squared_abs_kernel");
-        ret = clFinish(queue);
-        if (ret != CL_SUCCESS)
-            printf("Problems w/ clFinish");
-
-        // Расширяем матрицу h ( теперь она становится h_rash )
-        for (int i = 0; i < 2; i++)
-            for (int j = 0; j < half_sizey; j++)
-            {
-                err = clEnqueueCopyBuffer(queue, h_CL_k.buffers[i], h_rash_CL[k].buffers[i],
-                                          j * half_sizex * sizeof(cl_float),  j * sizex * sizeof(cl_float),
-                                          half_sizex * sizeof(cl_float), 0, NULL, NULL);
-                if (err != CL_SUCCESS)
-                {
-                    printf("Error with clEnqueueCopyBuffer %d\n", j);
-                    for (int l = 0; l < amount_of_h; l++)
-                        DeInItCl_Buffer_pair(&h_rash_CL[l]);
-                    DeInItCl_Buffer_pair(&all_pics_buffer);
-                    fclose(last_run_log_file);
-                    DeInItFFT_OpenCL_data(&fft_orig_size);
-                    clReleaseProgram(program);
-                    clfftTeardown(); // Release clFFT library
-                    clReleaseCommandQueue(queue); // Release OpenCL working objects
-                    clReleaseContext(ctx);
-                    return err;
-                }
-
-            }
-
-        ret = clFinish(queue);
-        if (ret != CL_SUCCESS)
-            printf("Problems w/ clFinish after copy");
     }
 
+    /// Буферы для h расширенной создаются в generate_h_rash
+    struct Cl_Buffer_pair h_rash_CL[amount_of_h];
+    memset(h_rash_CL, 0, sizeof(h_rash_CL));
 
-    clReleaseKernel(h_init_kernel);
-    clReleaseKernel(h_squared_abs_kernel);
-    clReleaseKernel(fft_shift_col_kernel);
-    clReleaseKernel(fft_shift_row_kernel);
-
-    DeInItFFT_OpenCL_data(&fft_orig_size);
-    DeInItCl_Buffer_pair(&h_CL_k);
-
-    clock_t end_h_CL_time = clock();
-
-    clock_t start_h_CL_fft_time = clock();
-    struct FFT_OpenCL_data fft_rash_size;
-    err = InitFFT_OpenCL_data(sizex, sizey, ctx, queue, 1, CLFFT_BACKWARD, &fft_rash_size);
-
-    for (int k = 0; k < amount_of_h; k++)
+    double h_generation_start = get_wall_time();
+    if (!use_h_cache)
+        err = generate_h_rash(ctx, queue, program, layout, precision, &geometry, amount_of_h, h_rash_CL, h_scales,
+                              use_h_table ? &h_table : NULL);
+    stage_record(&stages, STAGE_H_GENERATION, h_generation_start, 0, NULL);
+    if (err != CL_SUCCESS)
     {
-        // Прямое ПФ для расширенной матрицы h
-        if (FFT_2D_OpenCL(&h_rash_CL[k], CLFFT_FORWARD, queue, CL_FALSE, &fft_rash_size) == 0)
-            ;
-        else
-            printf("FFT for h_rash func NOT passed !\n");
+        for (int l = 0; l < amount_of_h; l++)
+            DeInItCl_Buffer_pair(&h_rash_CL[l]);
+        DeInitH_cache(&h_cache);
+        DeInitH_table(&h_table);
+        DeInitDevice_arena(&arena);
+        DeInItCl_Buffer_pair(&all_pics_buffer);
+        fclose(last_run_log_file);
+        clReleaseProgram(program);
+        release_program_variants();
+        release_fft_plans();
+        clfftTeardown(); // Release clFFT library
+        report_staging(&staging);
+        DeInitStaging_ring(&staging);
+        if (transfer_queue)
+            clReleaseCommandQueue(transfer_queue);
+        clReleaseCommandQueue(queue); // Release OpenCL working objects
+        clReleaseContext(ctx);
+        stage_wait_all(&stages);
+        DeInitStage_graph(&stages);
+        return err;
     }
-    ret = clFinish(queue);
-    if (ret != CL_SUCCESS)
-        printf("Problems w/ clFinish after 2nd FFT for h_rash");
-
-    clock_t end_h_CL_fft_time = clock();
 
+    struct FFT_OpenCL_data fft_rash_size;
+    err = InitFFT_OpenCL_data(sizex, sizey, ctx, queue, 1, CLFFT_BACKWARD, layout, &fft_rash_size);
+    // из результата нужна только картинка
+    prune_fft_output(&fft_rash_size, geometry.crop_x, geometry.crop_y, image_width, image_height);
 
 /// РАБОТА С h ЗАКОНЧЕНА
-    float h_gen_time = (float)(end_h_CL_time - start_h_CL_time)/CLOCKS_PER_SEC;
-    float h_fft_time = (float)(end_h_CL_fft_time - start_h_CL_fft_time)/CLOCKS_PER_SEC;
-
-    show_status_string("");
-    show_status_string("Time for generating h: %f",  h_gen_time);
-    show_status_string("Time for h fft: %f",  h_fft_time);
-    show_status_string("Total time for generating and fft'ing h: %f", h_gen_time + h_fft_time);
-    show_status_string("");
 
 /// Умножение картинки и элементов матрицы h_rash
 
@@ -860,169 +7899,277 @@ int main(void) {
 
     clock_t time0 = clock();
 
-    cl_kernel multiply_kernel = clCreateKernel(program, "multiply_kernel", &ret);
-    cl_kernel add_normalized_abs_part_kernel = clCreateKernel(program, "add_normalized_abs_part_kernel", &ret);
-
-    /// Создаем два буфера, которые будут хранить результат произведения
+    /// Создаем два буфера, которые будут хранить результат произведения ( result_CL обнуляется на каждом слое )
     cl_mem result_CL;
-    result_CL = clCreateBuffer(ctx, CL_MEM_READ_WRITE, N * sizeof(cl_float), NULL, &err);
+    result_CL = arena_buffer(&arena, N * sizeof(cl_float), 0, &err);
     if (err != CL_SUCCESS) {
-        printf("Init result_CL clCreateBuffer ERROR\n");
+        printf("Init result_CL arena_buffer ERROR\n");
+        stage_wait_all(&stages);
+        DeInitStage_graph(&stages);
+        fclose(last_run_log_file);
         return err;
     }
 
     struct Cl_Buffer_pair result_part_CL;
-    InitCl_Buffer_pair(ctx, queue, CL_MEM_READ_WRITE, N, &result_part_CL);
-
-    ret = clSetKernelArg(multiply_kernel, 0, sizeof(cl_mem), &all_pics_buffer.buffers[0]);
-    if(ret != CL_SUCCESS)
-        printf("Problems w/ setting KernelArgs for all_pics_buffer.buffers[0 ]multiply\n");
-    ret = clSetKernelArg(multiply_kernel, 1, sizeof(cl_mem), &all_pics_buffer.buffers[1]);
-    if(ret != CL_SUCCESS)
-        printf("Problems w/ setting KernelArgs for all_pics_buffer.buffers[1] multiply\n");
-
-    ret = clSetKernelArg(multiply_kernel, 5, sizeof(cl_mem), &result_part_CL.buffers[0]);
-    if(ret != CL_SUCCESS)
-        printf("Problems w/ setting KernelArgs for result[0] multiply\n");
-    ret = clSetKernelArg(multiply_kernel, 6, sizeof(cl_mem), &result_part_CL.buffers[1]);
+    arena_buffer_complex(&arena, N, layout, 1, &result_part_CL);
+    arena_zero_fill(&arena, queue);
+
+    float scaling = kernel_config.scaling;
+    struct Pair_kernels pair_kernels;
+    ret = InitPair_kernels(program, layout, precision, N, &all_pics_buffer, &result_part_CL, scaling, result_CL, &pair_kernels);
+    // компактные h читает только multiply_sparse_kernel, поэтому при --compact-otf пара не сливается с ПФ
+    int compact_otf = options.compact_otf > 0 && precision == PRECISION_FLOAT;
+    if (ret == CL_SUCCESS && !compact_otf)
+        ret = fuse_pair_kernels(&pair_kernels, program, &fft_rash_size, &all_pics_buffer, &result_part_CL, scaling, result_CL);
     if(ret != CL_SUCCESS)
-        printf("Problems w/ setting KernelArgs for result[1] multiply\n");
+        printf("Problems w/ creating multiply and abs kernels\n");
+    else if (pair_kernels.fused)
+        show_status_string("Multiply and abs are fused into the built-in inverse FFT");
+    if (ret == CL_SUCCESS && use_h_table && bind_h_table(&pair_kernels, &h_table) != CL_SUCCESS)
+        printf("Problems w/ binding the h table, h is bound per pair\n");
+    if (ret == CL_SUCCESS && use_h_cache && bind_h_table(&pair_kernels, &h_cache.table) != CL_SUCCESS)
+        printf("Problems w/ binding the h cache table, h is bound per pair\n");
+    if (precision == PRECISION_HALF)
+    {
+        pair_kernels.image_scales = image_scales;
+        pair_kernels.h_scales = h_scales;
+    }
+    /// Пара записывается в command buffer и повторяется ( нужны расширение, таблица h и встроенное ПФ )
+    if (ret == CL_SUCCESS && !options.no_command_buffers && !compact_otf && InitCommand_buffers(device))
+    {
+        if (record_pair(&pair_kernels, queue, &result_part_CL, &fft_rash_size) == CL_SUCCESS)
+            show_status_string("Pairs are replayed from a recorded command buffer");
+        else
+            show_status_string("Pairs are not recorded ( need the h table and the built-in FFT ), enqueued directly");
+    }
 
+    /// Гибридная свёртка: пары с компактной PSF - прямой или разделимой свёрткой
+    struct Direct_convolution direct;
+    memset(&direct, 0, sizeof(direct));
+    if (options.hybrid || options.separable > 0)
+    {
+        float pair_time = benchmark_data_layout(ctx, queue, program, sizex, sizey, scaling, layout, precision);
+        int crossover_radius = -1;
+        int separable_taps = 0;
+        if (options.hybrid)
+        {
+            crossover_radius = benchmark_direct_crossover(ctx, device, queue, program, image_width, image_height, pair_time);
+            if (crossover_radius >= 0)
+                show_status_string("Direct convolution is faster up to %dx%d support", 2 * crossover_radius + 1, 2 * crossover_radius + 1);
+            else
+                show_status_string("Direct convolution is never faster than the FFT pair");
+        }
+        if (options.separable > 0)
+        {
+            separable_taps = benchmark_separable_crossover(ctx, queue, program, image_width, image_height, pair_time);
+            if (separable_taps > 0)
+                show_status_string("Separable convolution is faster up to %d taps per pixel", separable_taps);
+            else
+                show_status_string("Separable convolution is never faster than the FFT pair");
+        }
+        ret = InitDirect_convolution(ctx, queue, program, &geometry, amount_of_h, crossover_radius, separable_taps,
+                                     options.separable, scaling * sqrtf(N), result_CL, &direct);
+        if (ret != CL_SUCCESS)
+            show_status_string("Hybrid convolution is off, all pairs use FFT");
+    }
 
-    ret = clSetKernelArg(add_normalized_abs_part_kernel, 0, sizeof(cl_mem), &result_part_CL.buffers[0]);
-    if(ret != CL_SUCCESS)
-        printf("Problems w/ setting KernelArgs for result[0] abs\n");
-    ret = clSetKernelArg(add_normalized_abs_part_kernel, 1, sizeof(cl_mem), &result_part_CL.buffers[1]);
-    if(ret != CL_SUCCESS)
-        printf("Problems w/ setting KernelArgs for result[1] abs\n");
+    /// Пары с узкополосным h - в пониженном разрешении
+    struct Reduced_layers reduced;
+    memset(&reduced, 0, sizeof(reduced));
+    if (options.reduce_far_layers > 0 && precision == PRECISION_HALF)
+        show_status_string("Reduced resolution needs float spectra, all pairs use full resolution");
+    else if (options.reduce_far_layers > 0)
+    {
+        ret = InitReduced_layers(ctx, queue, program, layout, &geometry, amount_of_h, &all_pics_buffer, h_rash_CL,
+                                 options.reduce_far_layers, scaling, &reduced);
+        if (ret != CL_SUCCESS)
+            show_status_string("Reduced resolution is off, all pairs use full resolution");
+    }
 
-    float scaling = 1 / (powf(half_sizex, 3.0f)*amount_of_pics);
-    ret = clSetKernelArg(add_normalized_abs_part_kernel, 2, sizeof(scaling), &scaling);
-    if(ret != CL_SUCCESS)
-        printf("Problems w/ setting KernelArgs for scaling add_normalized_abs_part_kernel\n");
-    ret = clSetKernelArg(add_normalized_abs_part_kernel, 3, sizeof(cl_mem), &result_CL);
-    if(ret != CL_SUCCESS)
-        printf("Problems w/ setting KernelArgs for result[1] abs\n");
+    /// Компактное хранение h и multiply только по опоре спектра ( после InitReduced_layers - ему нужны полные h )
+    if (options.compact_otf > 0 && !compact_otf)
+        show_status_string("Compact h needs float spectra, h is stored in full");
+    else if (compact_otf)
+    {
+        ret = compact_h_rash(ctx, queue, layout, &geometry, amount_of_h, h_rash_CL, &reduced, options.compact_otf);
+        if (ret == CL_SUCCESS)
+            ret = sparse_pair_kernels(&pair_kernels, program, &all_pics_buffer, &result_part_CL, sizex, sizey);
+        if (ret != CL_SUCCESS)
+        {
+            printf("Problems w/ compact h: %d\n", ret);
+            stage_wait_all(&stages);
+            DeInitStage_graph(&stages);
+            fclose(last_run_log_file);
+            return ret;
+        }
+    }
     
+    /// Блоки выходных слоёв: нужны таблица h ( без кеша ) и только пары через ПФ
+    struct Output_batch output_batch;
+    memset(&output_batch, 0, sizeof(output_batch));
+    if (options.batch_outputs != 0)
+    {
+        int batch_size = choose_output_batch(device, N, layout, amount_of_pics, options.batch_outputs);
+        if (!pair_kernels.h_table_bound || use_h_cache || options.hybrid || options.separable > 0 ||
+            options.reduce_far_layers > 0)
+            show_status_string("Output batching needs the h table and FFT-only pairs, layers go one by one");
+        else if (batch_size < 2)
+            show_status_string("One output layer already fills the device, layers go one by one");
+        else if (InitOutput_batch(ctx, queue, program, layout, &geometry, batch_size, &all_pics_buffer, &h_table,
+                                  scaling, &output_batch) == CL_SUCCESS)
+            show_status_string("Output layers are computed in blocks of %d", batch_size);
+    }
+
     clock_t time0_e = clock();
     multiply_plus_add_time += time0_e - time0;
 
     float *result;
-    struct Image image_result;
-
-    image_result.width = half_sizex;
-    image_result.height = half_sizey;
-    image_result.row_pointers = malloc(image_result.height* sizeof(image_result.row_pointers[0]));
-
-
-    for(int i = 0; i < image_result.height; i++)
-        image_result.row_pointers[i] = malloc(image_result.width* sizeof(image_result.row_pointers[0][0]));
-
     result = (float *) calloc(N, sizeof(float));
 
+    // 8-битные слои основного расчёта, нужны для сравнения с эталоном
+    unsigned char *run_output = NULL;
+    if (options.validate_precision)
+        run_output = (unsigned char *) calloc((size_t)image_width * image_height * amount_of_pics, 1);
+
     float time_multiply_full = 0;
-    for (int m = 0; m < amount_of_pics; m++)
+    struct Layer_timing layer_timing;
+    layer_timing.multiply_plus_add_time = multiply_plus_add_time;
+    layer_timing.time_multiply_full = 0;
+    layer_timing.enqueue_time = 0;
+    layer_timing.enqueued_pairs = 0;
+    // с очередью передач слой m читается, пока считается слой m + 1 ( и пишется в png после него )
+    struct Layer_readback readback;
+    memset(&readback, 0, sizeof(readback));
+    int overlap_readback = transfer_queue != 0 &&
+                           InitLayer_readback(ctx, transfer_queue, N, result, &readback) == CL_SUCCESS;
+    // обрезка слоя - после события чтения, кодирование и запись png - после обрезки, в пуле
+    int crop_task = -1;
+    int layer_task = -1;
+    for (int m = 0; m <= amount_of_pics; m++)
     {
-
-        clock_t time1 = clock();
-
-        err = clEnqueueFillBuffer(queue, result_CL, &zero, sizeof(zero), 0, N * sizeof(float), 0, NULL, NULL);
-        if (err != CL_SUCCESS)
+        if (m < amount_of_pics)
         {
-            printf("Init result_CL clEnqueueFillBuffer ERROR\n");
-            return err;
-        }
-        ret = clFinish(queue);
-        if (ret != CL_SUCCESS)
-            printf("Problems w/ clFinish after copy");
+            double layer_start = get_wall_time();
+            if (overlap_readback)
+                layer_compute_mark(&readback, queue, 0);
+            if (output_batch.size > 1)
+            {
+                // блок считается на первом своём слое, остальные слои только копируются из него
+                if (m % output_batch.size == 0)
+                    err = compute_result_block(queue, &output_batch, m, amount_of_pics, &layer_timing);
+                if (err == CL_SUCCESS)
+                    err = copy_batch_layer(queue, &output_batch, m, result_CL);
+            }
+            else
+                err = compute_result_layer(queue, &pair_kernels, &fft_rash_size, &result_part_CL, result_CL, h_rash_CL,
+                                           &direct, &reduced, use_h_cache ? &h_cache : NULL, m, amount_of_pics, N, &layer_timing);
+            if (err != CL_SUCCESS)
+            {
+                // Задачи пула ещё пишут PNG: дождаться их до выхода
+                stage_wait_all(&stages);
+                DeInitStage_graph(&stages);
+                fclose(last_run_log_file);
+                return err;
+            }
+            if (overlap_readback)
+                layer_compute_mark(&readback, queue, 1);
+            layer_task = stage_record(&stages, STAGE_LAYER, layer_start, 0, NULL);
+            multiply_plus_add_time = layer_timing.multiply_plus_add_time;
+            time_multiply_full = layer_timing.time_multiply_full;
 
-        clock_t time1_e = clock();
-        multiply_plus_add_time += time1_e - time1;
+            show_status_string("Time for multiplying all layers: %f", time_multiply_full);
+        }
 
-        for (int n = 0; n < amount_of_pics; n++)
+        if (!overlap_readback)
         {
-            clock_t time2 = clock();
-            cl_ulong offset = N * n;
-            ret = clSetKernelArg(multiply_kernel, 2, sizeof(offset), &offset);
-            if(ret != CL_SUCCESS)
-                printf("Problems w/ setting KernelArgs for offset multiply\n");
-
-            int h_rash_CL_index = abs(n-m);
-            ret = clSetKernelArg(multiply_kernel, 3, sizeof(cl_mem), &h_rash_CL[h_rash_CL_index].buffers[0]);
-            if(ret != CL_SUCCESS)
-                printf("Problems w/ setting KernelArgs for h_rash_CL[0] multiply\n");
-            ret = clSetKernelArg(multiply_kernel, 4, sizeof(cl_mem), &h_rash_CL[h_rash_CL_index].buffers[1]);
-            if(ret != CL_SUCCESS)
-                printf("Problems w/ setting KernelArgs for h_rash_CL[1] multiply\n");
-            clock_t time2_e = clock();
-            multiply_plus_add_time += time2_e - time2;
-
-            clock_t  multiply_start_time = clock();
-
-            ret = clEnqueueNDRangeKernel(queue, multiply_kernel, 1, NULL, &N, NULL, 0, NULL, NULL);
-
-            if (ret != CL_SUCCESS)
-                printf("Problems w/ clEnqueueNDRangeKernel multiply: %d\n", ret);
-            ret = clFinish(queue);
+            if (m == amount_of_pics)
+                break;
+            double crop_start = get_wall_time();
+            const float *layer = read_result_layer(queue, result_CL, N, result, &ret);
             if (ret != CL_SUCCESS)
-                printf("Problems w/ clFinish");
-
-            clock_t  multiply_end_time = clock();
-            multiply_plus_add_time += multiply_end_time - multiply_start_time;
-
-            show_status_string("Time for multiplying 1 layer: %f", (float)(multiply_end_time-multiply_start_time)/CLOCKS_PER_SEC);
-            time_multiply_full += (float)(multiply_end_time-multiply_start_time)/CLOCKS_PER_SEC;
-            
-            multiply_plus_add_time += multiply_end_time-multiply_start_time;
-            printf("### index_result:%d index_input:%d\n", m, n);
-
-
-            clock_t time3 = clock();
-            /// Обратное ПФ для результата
-            if (FFT_2D_OpenCL(&result_part_CL, CLFFT_BACKWARD, queue, CL_TRUE, &fft_rash_size) == 0)
-                ;
-                //            printf("IFFT for result passed !\n");
-            else
-                printf("IFFT for result NOT passed !\n");
-
+                printf("Problems w/ clEnqueueReadBuffer");
+            struct Layer_output_job *job = new_layer_output_job(&geometry, layer, run_output, m);
+            crop_layer_job(job);
+            release_result_layer(queue, result_CL, layer);
+            crop_task = stage_record(&stages, STAGE_CROP, crop_start, 0, NULL);
+            stage_add(&stages, STAGE_ENCODE, encode_layer_job, job, 1, &crop_task, 0);
+            continue;
+        }
 
-            ret = clEnqueueNDRangeKernel(queue, add_normalized_abs_part_kernel, 1, NULL, &N, NULL, 0, NULL, NULL);
-            if (ret != CL_SUCCESS)
-                printf("Problems w/ clEnqueueNDRangeKernel abs");
-            ret = clFinish(queue);
+        if (m > 0)
+        {
+            ret = account_layer_readback(&readback);
             if (ret != CL_SUCCESS)
-                printf("Problems w/ clFinish");
-            
-            clock_t time3_e = clock();
-
-            multiply_plus_add_time += time3_e - time3;
+                printf("Problems w/ reading back layer %d: %d\n", m - 1, ret);
+            // слой m - 1 обрезан: его буфер на хосте и событие чтения свободны
+            stage_wait(&stages, crop_task);
         }
-
-        show_status_string("Time for multiplying all layers: %f", time_multiply_full);
-
-        ret = clEnqueueReadBuffer(queue, result_CL, CL_TRUE, 0,
-                                  N * sizeof(float), result, 0, NULL, NULL);
-        if (ret != CL_SUCCESS)
-            printf("Problems w/ clEnqueueReadBuffer");
-
-
-//#pragma omp parallel for
-        for (int k = 0; k < image_result.height; k++)
-            for(int l = 0; l < image_result.width; l++)
+        if (m < amount_of_pics)
+        {
+            ret = start_layer_readback(&readback, queue, result_CL);
+            if (ret != CL_SUCCESS)
             {
-                float res = result[(k+image_result.height/2)*fft_rash_size.sizex+(l+image_result.width/2)];
-                image_result.row_pointers[k][l] = (png_byte)res;
+                printf("Problems w/ starting readback of layer %d: %d\n", m, ret);
+                continue;
             }
-
-        char filename_png[64] = {'\0'};
-        sprintf(filename_png, "result/image%02d.png",  m+1);
-        show_status_string("Writing data to file");
-
-        write_png_file(image_result, filename_png);
+            struct Layer_output_job *job = new_layer_output_job(&geometry, layer_readback_data(&readback), run_output, m);
+            crop_task = stage_add(&stages, STAGE_CROP, crop_layer_job, job, 1, &layer_task, readback.done);
+            stage_add(&stages, STAGE_ENCODE, encode_layer_job, job, 1, &crop_task, 0);
+        }
+    }
+    stage_wait_all(&stages);
+    report_stage_graph(&stages);
+    report_layer_readback(&readback);
+    DeInitOutput_batch(&output_batch);
+    if (layer_timing.enqueued_pairs > 0)
+        show_status_string("Host enqueue time: %f s for %d pairs, %.1f us per pair ( %s )",
+                           (float)layer_timing.enqueue_time/CLOCKS_PER_SEC, layer_timing.enqueued_pairs,
+                           1e6 * layer_timing.enqueue_time / CLOCKS_PER_SEC / layer_timing.enqueued_pairs,
+                           pair_kernels.replay.ready ? "command buffer replay" : "direct enqueue");
+    DeInitLayer_readback(&readback);
+
+    /// Сравнение обычной и специализированной сборки kernel'ов
+    if (options.jit_compare && pair_kernels.sparse)
+        show_status_string("Build comparison needs full h spectra, skipped with --compact-otf");
+    else if (options.jit_compare)
+    {
+        struct Kernel_config generic_config = kernel_config;
+        struct Kernel_config specialized_config = kernel_config;
+        generic_config.specialized = 0;
+        specialized_config.specialized = 1;
+
+        cl_program generic_program = get_program_variant(ctx, device, &generic_config);
+        cl_program specialized_program = get_program_variant(ctx, device, &specialized_config);
+        // черновик для h_init_kernel: re и im h размером картинки ( h_rash_CL при обрезанной опоре может быть меньше )
+        cl_mem h_scratch = clCreateBuffer(ctx, CL_MEM_READ_WRITE, 2 * (size_t)image_width * image_height * sizeof(cl_float), NULL, &err);
+        // с кешем h_0 берётся из его слота
+        struct Cl_Buffer_pair *h_0 = &h_rash_CL[0];
+        int h_0_slot = 0;
+        if (use_h_cache && err == CL_SUCCESS)
+        {
+            err = h_cache_get(&h_cache, queue, 0, &h_0_slot);
+            h_0 = &h_cache.slots[h_0_slot];
+        }
+        if (generic_program != 0 && specialized_program != 0 && err == CL_SUCCESS)
+        {
+            float generic_time = benchmark_kernel_program(generic_program, queue, layout, precision, image_width, image_height, N, scaling,
+                                                          &all_pics_buffer, h_0, &result_part_CL, result_CL, h_scratch);
+            float specialized_time = benchmark_kernel_program(specialized_program, queue, layout, precision, image_width, image_height, N, scaling,
+                                                              &all_pics_buffer, h_0, &result_part_CL, result_CL, h_scratch);
+            show_status_string("Kernel time (h_init+multiply+abs), generic build: %f", generic_time);
+            show_status_string("Kernel time (h_init+multiply+abs), specialized build: %f", specialized_time);
+        }
+        if (h_scratch)
+            clReleaseMemObject(h_scratch);
+        if (generic_program)
+            clReleaseProgram(generic_program);
+        if (specialized_program)
+            clReleaseProgram(specialized_program);
     }
 
-    clReleaseKernel(multiply_kernel);
-    clReleaseKernel(add_normalized_abs_part_kernel);
+    DeInitReduced_layers(&reduced);
+    DeInitDirect_convolution(&direct);
+    DeInitPair_kernels(&pair_kernels);
     clReleaseMemObject(result_CL);
     DeInItCl_Buffer_pair(&result_part_CL);
 
@@ -1033,9 +8180,6 @@ int main(void) {
     
     printf("### Cleaning...\n");
 
-    for (int i = 0; i < image_result.height; i++)
-        free(image_result.row_pointers[i]);
-    free(image_result.row_pointers);
     free(result);
 
     /// Удаляем ненужные нам буфферы
@@ -1045,14 +8189,39 @@ int main(void) {
     {
         DeInItCl_Buffer_pair(&h_rash_CL[i]);
     }
+    if (use_h_cache)
+        report_h_cache(&h_cache);
+    DeInitH_cache(&h_cache);
+    DeInitH_table(&h_table);
+    DeInitDevice_arena(&arena);
+
+    /// Проверки точности: считают всё заново на своих буферах, поэтому после освобождения основных
+    if (options.validate_fast_math)
+        validate_fast_math(ctx, device, queue, &kernel_config, layout, precision, &geometry, amount_of_pics);
+    if (options.validate_paths)
+        validate_paths(ctx, device, queue, &kernel_config, layout, &geometry, amount_of_pics);
+    if (run_output != NULL)
+    {
+        validate_precision(ctx, device, queue, &kernel_config, layout, precision, &geometry, amount_of_pics, run_output);
+        free(run_output);
+    }
+    if (options.cpu_scaling)
+        measure_cpu_scaling(image_width, image_height, amount_of_pics);
 
     // fputc('\n', list_of_runs_log_file);
     fclose(last_run_log_file);
     DeInItFFT_OpenCL_data(&fft_rash_size);
     clReleaseProgram(program);
+    release_program_variants();
+    release_fft_plans();
     clfftTeardown(); // Release clFFT library
+    report_staging(&staging);
+    DeInitStaging_ring(&staging);
+    if (transfer_queue)
+        clReleaseCommandQueue(transfer_queue);
     clReleaseCommandQueue(queue); // Release OpenCL working objects
     clReleaseContext(ctx);
+    DeInitStage_graph(&stages);
 
 
     clock_t time_end_program = clock();
@@ -1064,7 +8233,7 @@ int main(void) {
     if (ftell(list_of_runs_log_file) == 0)
         fprintf(list_of_runs_log_file, "|%-20s |%-19s |%-22s |%-15s |%-15s |%-15s\n\n", "Date", "time(multiply+add)", "full time of program" ,"Size", "Amount of pics", "Device");
  
-    fprintf(list_of_runs_log_file, "|%-20s |%-19f |%-22f |%-15d |%-15d |%-15s\n" , buff, tmp_time_of_calc, (float)(time_end_program-time_start_program)/CLOCKS_PER_SEC, half_sizex, amount_of_pics, name);
+    fprintf(list_of_runs_log_file, "|%-20s |%-19f |%-22f |%-15d |%-15d |%-15s\n" , buff, tmp_time_of_calc, (float)(time_end_program-time_start_program)/CLOCKS_PER_SEC, image_width, amount_of_pics, name);
 
     fclose(list_of_runs_log_file);
     return 0;
@@ -1,5 +1,45 @@
 #define M_PI 3.1415927f
 
+// Все константы ниже можно переопределить опциями сборки ( -D ... ), см. make_build_options()
+//
+// Оптика
+#ifndef DEFOCUS_COEF
+#define DEFOCUS_COEF 0.375f
+#endif
+#ifndef PUPIL_RADIUS
+#define PUPIL_RADIUS (M_PI*0.5f)
+#endif
+#ifndef PUPIL_PHASE_COEF
+#define PUPIL_PHASE_COEF (M_PI*0.5f)
+#endif
+
+// Быстрая математика ( USE_NATIVE_MATH, собирается вместе с -cl-fast-relaxed-math ):
+// native_* вместо точных sqrt/sincos и x*x вместо pown
+#ifdef USE_NATIVE_MATH
+#define MATH_SQRT(x) native_sqrt(x)
+#define MATH_HYPOT(x, y) native_sqrt((x)*(x) + (y)*(y))
+#define MATH_SINCOS(x, cos_ptr) (*(cos_ptr) = native_cos(x), native_sin(x))
+#define POW2(x) ((x)*(x))
+#else
+#define MATH_SQRT(x) sqrt(x)
+#define MATH_HYPOT(x, y) sqrt((x)*(x) + (y)*(y))
+#define MATH_SINCOS(x, cos_ptr) sincos(x, cos_ptr)
+#define POW2(x) pown(x, 2)
+#endif
+
+// Специализированная сборка: размеры известны на этапе компиляции
+// H_SIZEX, H_SIZEY   - размер h ( исходной картинки )
+// H_SIZEX_LOG2       - задан, если H_SIZEX степень двойки
+// ABS_SCALING        - нормировка в add_normalized_abs_part_kernel
+// FFT_SIZEX, FFT_SIZEY - размер ПФ для встроенных kernel'ов пары ( multiply_fft_cols_kernel, fft_abs_rows_kernel )
+
+// h хранится по строкам длины sizex ( быстрое измерение clFFT ), i - столбец, j - строка
+#ifdef H_SIZEX_LOG2
+#define H_INDEX(i, j) (((j) << H_SIZEX_LOG2) | (i))
+#else
+#define H_INDEX(i, j) ((j) * sizex + (i))
+#endif
+
 __kernel void add_normalized_abs_part_kernel(__global float *result_part_real, __global float *result_part_imag, 
                                              const float scaling, __global float *result)
 {
@@ -9,32 +49,641 @@ __kernel void add_normalized_abs_part_kernel(__global float *result_part_real, _
     float res_real = result_part_real[i];
     float res_imag = result_part_imag[i];
     
+#ifdef ABS_SCALING
+    const float abs_scaling = ABS_SCALING;
+#else
+    const float abs_scaling = scaling;
+#endif
     
     // Do the operation
     // result[i] += sqrt(res_real*res_real + res_imag*res_imag)*scaling;
-    result[i] = min(sqrt(res_real*res_real + res_imag*res_imag)*scaling + result[i], 255.0f);
+    result[i] = min(MATH_HYPOT(res_real, res_imag)*abs_scaling + result[i], 255.0f);
 }
 
+// h_start_offset - начало h в таблице h ( в комплексных числах, как image_start_offset ), 0 - отдельный буфер h
 __kernel void multiply_kernel(__global const float *images_real, __global const float *images_imag, 
                                 const ulong image_start_offset,
-                              __global const float *h_real, __global const float *h_imag,
+                              __global const float *h_real, __global const float *h_imag, const ulong h_start_offset,
                               __global float *result_real, __global float *result_imag)
 {
     int i = get_global_id(0);
     ulong pixel_offset = i + image_start_offset; 
     float im_real =  images_real[pixel_offset];
     float im_imag =  images_imag[pixel_offset];
-    float h_r = h_real[i];
-    float h_i = h_imag[i];
+    float h_r = h_real[i + h_start_offset];
+    float h_i = h_imag[i + h_start_offset];
 
     result_real[i] = im_real * h_r - im_imag * h_i;
     result_imag[i] = im_real * h_i + im_imag * h_r;
 }
 
 
+// Варианты для CLFFT_COMPLEX_INTERLEAVED: (re, im) лежат подряд, и каждый work-item
+// обрабатывает сразу два комплексных числа одним float4 ( глобальный размер N/2 )
+
+__kernel void multiply_interleaved_kernel(__global const float4 *images, const ulong image_start_offset,
+                                          __global const float4 *h, const ulong h_start_offset, __global float4 *result)
+{
+    int i = get_global_id(0);
+    // image_start_offset и h_start_offset задаются в комплексных числах, как в multiply_kernel
+    float4 im = images[i + image_start_offset/2];
+    float4 h_v = h[i + h_start_offset/2];
+
+    result[i] = (float4)(im.x * h_v.x - im.y * h_v.y,
+                         im.x * h_v.y + im.y * h_v.x,
+                         im.z * h_v.z - im.w * h_v.w,
+                         im.z * h_v.w + im.w * h_v.z);
+}
+
+// Блок из get_global_size(1) выходных слоёв m0 + b для одной картинки n: h_k с k = |first_k - b|
+// ( first_k = n - m0 ) берётся из таблицы h со смещением k * h_stride, произведение b пишется в
+// сегмент b результата ( сегмент - get_global_size(0) элементов )
+__kernel void multiply_batch_kernel(__global const float *images_real, __global const float *images_imag,
+                                    const ulong image_start_offset,
+                                    __global const float *h_real, __global const float *h_imag, const ulong h_stride,
+                                    const int first_k, __global float *result_real, __global float *result_imag)
+{
+    size_t i = get_global_id(0);
+    size_t b = get_global_id(1);
+    ulong pixel_offset = i + image_start_offset;
+    ulong h_offset = i + abs(first_k - (int)b) * h_stride;
+    float im_real = images_real[pixel_offset];
+    float im_imag = images_imag[pixel_offset];
+    float h_r = h_real[h_offset];
+    float h_i = h_imag[h_offset];
+
+    size_t out = b * get_global_size(0) + i;
+    result_real[out] = im_real * h_r - im_imag * h_i;
+    result_imag[out] = im_real * h_i + im_imag * h_r;
+}
+
+__kernel void multiply_batch_interleaved_kernel(__global const float4 *images, const ulong image_start_offset,
+                                                __global const float4 *h, const ulong h_stride, const int first_k,
+                                                __global float4 *result)
+{
+    size_t i = get_global_id(0);
+    size_t b = get_global_id(1);
+    // смещения в комплексных числах, как в multiply_interleaved_kernel
+    float4 im = images[i + image_start_offset/2];
+    float4 h_v = h[i + abs(first_k - (int)b) * h_stride/2];
+
+    result[b * get_global_size(0) + i] = (float4)(im.x * h_v.x - im.y * h_v.y,
+                                                  im.x * h_v.y + im.y * h_v.x,
+                                                  im.z * h_v.z - im.w * h_v.w,
+                                                  im.z * h_v.w + im.w * h_v.z);
+}
+
+__kernel void add_normalized_abs_interleaved_kernel(__global const float4 *result_part, const float scaling,
+                                                    __global float *result)
+{
+    int i = get_global_id(0);
+
+    float4 res = result_part[i];
+
+#ifdef ABS_SCALING
+    const float abs_scaling = ABS_SCALING;
+#else
+    const float abs_scaling = scaling;
+#endif
+
+    float2 magnitude = (float2)(MATH_HYPOT(res.x, res.y), MATH_HYPOT(res.z, res.w));
+    vstore2(min(magnitude*abs_scaling + vload2(i, result), 255.0f), i, result);
+}
+
+// Спектры в половинной точности ( PRECISION_HALF ): срез хранится как half, делённый на свой
+// масштаб, и переводится во float при чтении. vload_half/vstore_half есть в OpenCL 1.2 и без cl_khr_fp16
+
+// Запускается с global offset = началу среза, так что src и dst адресуются одним индексом
+__kernel void float_to_half_kernel(__global const float *src, const float inv_scale, __global half *dst)
+{
+    size_t i = get_global_id(0);
+
+    vstore_half_rte(src[i] * inv_scale, i, dst);
+}
+
+__kernel void multiply_half_kernel(__global const half *images_real, __global const half *images_imag,
+                                   const ulong image_start_offset,
+                                   __global const half *h_real, __global const half *h_imag, const ulong h_start_offset,
+                                   const float input_scale, __global float *result_real, __global float *result_imag)
+{
+    int i = get_global_id(0);
+    ulong pixel_offset = i + image_start_offset;
+    float im_real = vload_half(pixel_offset, images_real);
+    float im_imag = vload_half(pixel_offset, images_imag);
+    float h_r = vload_half(i + h_start_offset, h_real);
+    float h_i = vload_half(i + h_start_offset, h_imag);
+
+    // input_scale - произведение масштабов среза картинки и h
+    result_real[i] = (im_real * h_r - im_imag * h_i) * input_scale;
+    result_imag[i] = (im_real * h_i + im_imag * h_r) * input_scale;
+}
+
+__kernel void multiply_half_interleaved_kernel(__global const half *images, const ulong image_start_offset,
+                                               __global const half *h, const ulong h_start_offset,
+                                               const float input_scale, __global float4 *result)
+{
+    int i = get_global_id(0);
+    float4 im = vload_half4(i + image_start_offset/2, images);
+    float4 h_v = vload_half4(i + h_start_offset/2, h);
+
+    result[i] = (float4)(im.x * h_v.x - im.y * h_v.y,
+                         im.x * h_v.y + im.y * h_v.x,
+                         im.z * h_v.z - im.w * h_v.w,
+                         im.z * h_v.w + im.w * h_v.z) * input_scale;
+}
+
+// Перенос прямоугольника действительной матрицы src ( шириной src_width, начиная с (src_x0, src_y0),
+// размер прямоугольника - глобальный размер ) в левый верхний угол комплексной interleaved матрицы dst
+// шириной dst_width; мнимая часть обнуляется
+__kernel void pad_real_to_interleaved_kernel(__global const float *src, const int src_width,
+                                             const int src_x0, const int src_y0,
+                                             __global float2 *dst, const int dst_width)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+
+    dst[y * dst_width + x] = (float2)(src[(y + src_y0) * src_width + x + src_x0], 0.0f);
+}
+
+
+/// ПРЯМАЯ СВЁРТКА ( --hybrid )
+// Вклад пары с компактной PSF: result += weight * (картинка * PSF_k) прямо в пространстве.
+// PSF действительная и неотрицательная, поэтому модуль свёртки - она сама.
+// Картинка image_start_offset..+W*H ( float ), опора PSF (2*radius_x+1) x (2*radius_y+1) с центром посередине.
+// Рабочая группа DIRECT_CONV_TILE x DIRECT_CONV_TILE кладёт в local свой кусок картинки с полями radius
+// ( за краем картинки нули ), результат пишется в result с шагом result_pitch начиная с (result_x0, result_y0).
+
+#define DIRECT_CONV_TILE 16
+
+__kernel void direct_conv_kernel(__global const float *images, const ulong image_start_offset,
+                                 const int image_width, const int image_height,
+                                 __global const float *psf, const int radius_x, const int radius_y, const float weight,
+                                 __global float *result, const int result_pitch, const int result_x0, const int result_y0,
+                                 __local float *tile)
+{
+    int lx = get_local_id(0);
+    int ly = get_local_id(1);
+    int x0 = get_group_id(0) * DIRECT_CONV_TILE;
+    int y0 = get_group_id(1) * DIRECT_CONV_TILE;
+    int tile_width = DIRECT_CONV_TILE + 2 * radius_x;
+    int tile_height = DIRECT_CONV_TILE + 2 * radius_y;
+    __global const float *image = images + image_start_offset;
+
+    for (int ty = ly; ty < tile_height; ty += DIRECT_CONV_TILE)
+        for (int tx = lx; tx < tile_width; tx += DIRECT_CONV_TILE)
+        {
+            int x = x0 - radius_x + tx;
+            int y = y0 - radius_y + ty;
+            tile[ty * tile_width + tx] = (x >= 0 && x < image_width && y >= 0 && y < image_height) ? image[y * image_width + x] : 0.0f;
+        }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    int x = x0 + lx;
+    int y = y0 + ly;
+    if (x >= image_width || y >= image_height)
+        return;
+
+    // out(x, y) = sum psf(b, a) * image(y + radius_y - b, x + radius_x - a)
+    int psf_width = 2 * radius_x + 1;
+    float sum = 0.0f;
+    for (int b = 0; b <= 2 * radius_y; b++)
+        for (int a = 0; a < psf_width; a++)
+            sum += psf[b * psf_width + a] * tile[(ly + 2 * radius_y - b) * tile_width + lx + 2 * radius_x - a];
+
+    int i = (result_y0 + y) * result_pitch + result_x0 + x;
+    result[i] = min(sum * weight + result[i], 255.0f);
+}
+
+/// РАЗДЕЛИМАЯ СВЁРТКА ( --separable )
+// PSF_k приближена суммой rank разделимых ядер: psf(b, a) = sum_r col_taps[r][b] * row_taps[r][a].
+// Сначала каждая строка картинки сворачивается с row_taps[r] в tmp[r] ( rank картинок W x H подряд ),
+// затем столбцы tmp[r] - с col_taps[r], всё суммируется и добавляется в result как в direct_conv_kernel.
+// Приближение может дать малые отрицательные значения, поэтому берётся модуль, как у пары через ПФ.
+
+__kernel void separable_rows_kernel(__global const float *images, const ulong image_start_offset,
+                                    const int image_width, const int image_height,
+                                    __global const float *row_taps, const int radius_x, const int rank,
+                                    __global float *tmp)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int taps_width = 2 * radius_x + 1;
+    __global const float *image_row = images + image_start_offset + (ulong)y * image_width;
+
+    for (int r = 0; r < rank; r++)
+    {
+        float sum = 0.0f;
+        for (int a = 0; a < taps_width; a++)
+        {
+            int xx = x + radius_x - a;
+            if (xx >= 0 && xx < image_width)
+                sum += row_taps[r * taps_width + a] * image_row[xx];
+        }
+        tmp[((ulong)r * image_height + y) * image_width + x] = sum;
+    }
+}
+
+__kernel void separable_cols_add_kernel(__global const float *tmp, const int image_width, const int image_height,
+                                        __global const float *col_taps, const int radius_y, const int rank,
+                                        const float weight, __global float *result, const int result_pitch,
+                                        const int result_x0, const int result_y0)
+{
+    int x = get_global_id(0);
+    int y = get_global_id(1);
+    int taps_height = 2 * radius_y + 1;
+
+    float sum = 0.0f;
+    for (int r = 0; r < rank; r++)
+        for (int b = 0; b < taps_height; b++)
+        {
+            int yy = y + radius_y - b;
+            if (yy >= 0 && yy < image_height)
+                sum += col_taps[r * taps_height + b] * tmp[((ulong)r * image_height + yy) * image_width + x];
+        }
+
+    int i = (result_y0 + y) * result_pitch + result_x0 + x;
+    result[i] = min(fabs(sum) * weight + result[i], 255.0f);
+}
+
+/// ВСТРОЕННОЕ ПФ ( --fft-engine builtin )
+// Stockham со смешанным основанием ( 8, 4, 2, 3, 5, 7 ) по строкам и столбцам, линия целиком лежит в local памяти.
+// Одна рабочая группа - одна линия длины n: элементы line_start + t * element_pitch, где
+// line_start = (first_line + get_group_id(0)) * line_pitch + get_group_id(1) * batch_pitch.
+// Комплексное число с индексом e: re[e * complex_pitch], im[e * complex_pitch + imag_offset] -
+// planar ( real, imag, 1, 0 ) или interleaved ( buffer, buffer, 2, 1 ).
+// Прореживание: читаются только первые in_count элементов линии ( остальные считаются нулями ),
+// пишутся только элементы [out_start, out_start + out_count).
+// Каждый work-item держит в регистрах все свои бабочки этапа, поэтому local_size >= n / 16.
+
+#define FFT_MAX_PER_ITEM 32
+
+float2 complex_mul(float2 a, float2 b)
+{
+    return (float2)(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x);
+}
+
+// exp(i * angle)
+float2 complex_exp(float angle)
+{
+    float cos_value = 0.0f;
+    float sin_value = MATH_SINCOS(angle, &cos_value);
+    return (float2)(cos_value, sin_value);
+}
+
+// a * (sign * i)
+float2 complex_mul_i(float2 a, float sign)
+{
+    return (float2)(-sign * a.y, sign * a.x);
+}
+
+// ДПФ длины 4 над u0..u3
+void dft4(float2 *u0, float2 *u1, float2 *u2, float2 *u3, float sign)
+{
+    float2 t0 = *u0 + *u2;
+    float2 t1 = *u0 - *u2;
+    float2 t2 = *u1 + *u3;
+    float2 t3 = complex_mul_i(*u1 - *u3, sign);
+    *u0 = t0 + t2;
+    *u1 = t1 + t3;
+    *u2 = t0 - t2;
+    *u3 = t1 - t3;
+}
+
+// ДПФ длины radix над u[0..radix), знак экспоненты sign
+void small_dft(float2 *u, int radix, float sign)
+{
+    if (radix == 2)
+    {
+        float2 t = u[1];
+        u[1] = u[0] - t;
+        u[0] = u[0] + t;
+    }
+    else if (radix == 4)
+        dft4(&u[0], &u[1], &u[2], &u[3], sign);
+    else if (radix == 8)
+    {
+        // два ДПФ длины 4 по чётным и нечётным, затем домножение нечётных на exp(sign*i*pi*k/4)
+        const float c = 0.70710678f;
+        dft4(&u[0], &u[2], &u[4], &u[6], sign);
+        dft4(&u[1], &u[3], &u[5], &u[7], sign);
+        float2 o1 = (float2)(c * (u[3].x - sign * u[3].y), c * (u[3].y + sign * u[3].x));
+        float2 o2 = complex_mul_i(u[5], sign);
+        float2 o3 = (float2)(-c * (u[7].x + sign * u[7].y), c * (sign * u[7].x - u[7].y));
+        float2 e0 = u[0], e1 = u[2], e2 = u[4], e3 = u[6];
+        u[0] = e0 + u[1];
+        u[4] = e0 - u[1];
+        u[1] = e1 + o1;
+        u[5] = e1 - o1;
+        u[2] = e2 + o2;
+        u[6] = e2 - o2;
+        u[3] = e3 + o3;
+        u[7] = e3 - o3;
+    }
+    else
+    {
+        float2 v[7];
+        for (int s = 0; s < radix; s++)
+        {
+            v[s] = u[0];
+            for (int q = 1; q < radix; q++)
+                v[s] += complex_mul(u[q], complex_exp(sign * 2.0f * M_PI * ((q * s) % radix) / radix));
+        }
+        for (int s = 0; s < radix; s++)
+            u[s] = v[s];
+    }
+}
+
+int fft_radix(int rest)
+{
+    if (rest % 8 == 0)
+        return 8;
+    if (rest % 4 == 0)
+        return 4;
+    if (rest % 2 == 0)
+        return 2;
+    if (rest % 3 == 0)
+        return 3;
+    if (rest % 5 == 0)
+        return 5;
+    return 7;
+}
+
+// Этапы Stockham над линией в local памяти: на этапе с основанием r и уже пройденной длиной p
+// бабочка i берёт x[i + q*n/r], домножает на exp(sign*2*pi*i*q*k/(p*r)), k = i mod p,
+// и кладёт результат в y[(i - k)*r + k + s*p]
+void fft_line_stages(__local float2 *line, const int n, const float sign)
+{
+    int lid = get_local_id(0);
+    int local_size = get_local_size(0);
+    float2 u[FFT_MAX_PER_ITEM];
+
+    for (int p = 1; p < n; )
+    {
+        int r = fft_radix(n / p);
+        int stride = n / r;
+        int count = 0;
+
+        for (int i = lid; i < stride; i += local_size, count += r)
+        {
+            int k = i % p;
+            for (int q = 0; q < r; q++)
+                u[count + q] = line[i + q * stride];
+            for (int q = 1; q < r; q++)
+                u[count + q] = complex_mul(u[count + q], complex_exp(sign * 2.0f * M_PI * (q * k) / (p * r)));
+            small_dft(u + count, r, sign);
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        count = 0;
+        for (int i = lid; i < stride; i += local_size, count += r)
+        {
+            int k = i % p;
+            int j = (i - k) * r + k;
+            for (int s = 0; s < r; s++)
+                line[j + s * p] = u[count + s];
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        p *= r;
+    }
+}
+
+__kernel void fft_lines_kernel(__global float *re, __global float *im, const int complex_pitch, const int imag_offset,
+                               const int n, const int first_line, const int line_pitch, const int element_pitch,
+                               const ulong batch_pitch, const int in_count, const int out_start, const int out_count,
+                               const float sign, const float scale, __local float2 *line)
+{
+    int lid = get_local_id(0);
+    int local_size = get_local_size(0);
+    ulong line_start = (ulong)(first_line + get_group_id(0)) * line_pitch + get_group_id(1) * batch_pitch;
+
+    for (int t = lid; t < n; t += local_size)
+    {
+        float2 value = (float2)(0.0f, 0.0f);
+        if (t < in_count)
+        {
+            ulong e = (line_start + (ulong)t * element_pitch) * complex_pitch;
+            value = (float2)(re[e], im[e + imag_offset]);
+        }
+        line[t] = value;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    fft_line_stages(line, n, sign);
+
+    for (int t = lid; t < out_count; t += local_size)
+    {
+        float2 value = line[out_start + t] * scale;
+        ulong e = (line_start + (ulong)(out_start + t) * element_pitch) * complex_pitch;
+        re[e] = value.x;
+        im[e + imag_offset] = value.y;
+    }
+}
+
+// Встроенное обратное ПФ пары в два прохода вместо multiply -> ПФ -> abs:
+// multiply_fft_cols_kernel - умножение спектров прямо при загрузке столбца + ПФ по столбцу,
+// сохраняются только строки [out_start, out_start + out_count);
+// fft_abs_rows_kernel - ПФ по этим строкам, модуль с накоплением в result только для столбцов
+// [out_start, out_start + out_count), result_part в память уже не пишется.
+// Раскладка комплексных чисел - как в fft_lines_kernel, одна рабочая группа на линию.
+
+__kernel void multiply_fft_cols_kernel(__global const float *images_re, __global const float *images_im,
+                                       const ulong image_start_offset,
+                                       __global const float *h_re, __global const float *h_im, const ulong h_start_offset,
+                                       __global float *result_re, __global float *result_im,
+                                       const int complex_pitch, const int imag_offset,
+                                       const int sizex_arg, const int sizey_arg,
+                                       const int out_start, const int out_count, __local float2 *line)
+{
+#ifdef FFT_SIZEX
+    const int sizex = FFT_SIZEX;
+    const int sizey = FFT_SIZEY;
+#else
+    const int sizex = sizex_arg;
+    const int sizey = sizey_arg;
+#endif
+    int lid = get_local_id(0);
+    int local_size = get_local_size(0);
+    int x = get_group_id(0);
+
+    for (int t = lid; t < sizey; t += local_size)
+    {
+        ulong e = (ulong)t * sizex + x;
+        ulong ie = (e + image_start_offset) * complex_pitch;
+        ulong he = (e + h_start_offset) * complex_pitch;
+        line[t] = complex_mul((float2)(images_re[ie], images_im[ie + imag_offset]),
+                              (float2)(h_re[he], h_im[he + imag_offset]));
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    fft_line_stages(line, sizey, 1.0f);
+
+    for (int t = lid; t < out_count; t += local_size)
+    {
+        ulong e = ((ulong)(out_start + t) * sizex + x) * complex_pitch;
+        float2 value = line[out_start + t];
+        result_re[e] = value.x;
+        result_im[e + imag_offset] = value.y;
+    }
+}
+
+__kernel void fft_abs_rows_kernel(__global const float *result_part_re, __global const float *result_part_im,
+                                  const int complex_pitch, const int imag_offset, const int sizex_arg,
+                                  const int first_row, const int out_start, const int out_count,
+                                  const float fft_scale, const float scaling, __global float *result,
+                                  __local float2 *line)
+{
+#ifdef FFT_SIZEX
+    const int sizex = FFT_SIZEX;
+#else
+    const int sizex = sizex_arg;
+#endif
+#ifdef ABS_SCALING
+    const float abs_scaling = ABS_SCALING;
+#else
+    const float abs_scaling = scaling;
+#endif
+    int lid = get_local_id(0);
+    int local_size = get_local_size(0);
+    ulong row_start = (ulong)(first_row + get_group_id(0)) * sizex;
+
+    for (int t = lid; t < sizex; t += local_size)
+    {
+        ulong e = (row_start + t) * complex_pitch;
+        line[t] = (float2)(result_part_re[e], result_part_im[e + imag_offset]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    fft_line_stages(line, sizex, 1.0f);
+
+    for (int t = lid; t < out_count; t += local_size)
+    {
+        float2 value = line[out_start + t];
+        ulong i = row_start + out_start + t;
+        result[i] = min(MATH_HYPOT(value.x, value.y) * fft_scale * abs_scaling + result[i], 255.0f);
+    }
+}
+
+
+/// ДАЛЬНИЕ СЛОИ В ПОНИЖЕННОМ РАЗРЕШЕНИИ ( --reduce-far-layers )
+// Для h_k с узкой полосой пара считается на вырезанном низкочастотном блоке спектра: частоты
+// |u| <= band_x, |v| <= band_y переносятся в спектр reduced_sizex x reduced_sizey ( отрицательные - в конец ),
+// остальное - нули. После обратного ПФ этого размера модуль интерполируется обратно на сетку ПФ.
+// Комплексные числа адресуются как в fft_lines_kernel ( complex_pitch, imag_offset ).
+
+__kernel void multiply_reduced_kernel(__global const float *images_re, __global const float *images_im,
+                                      const ulong image_start_offset,
+                                      __global const float *h_re, __global const float *h_im,
+                                      const int complex_pitch, const int imag_offset,
+                                      const int sizex, const int sizey, const int band_x, const int band_y,
+                                      __global float *reduced_re, __global float *reduced_im)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    int reduced_sizex = get_global_size(0);
+    int reduced_sizey = get_global_size(1);
+
+    // частота ( со знаком ) этого элемента уменьшенного спектра
+    int u = i <= reduced_sizex / 2 ? i : i - reduced_sizex;
+    int v = j <= reduced_sizey / 2 ? j : j - reduced_sizey;
+
+    float2 value = (float2)(0.0f, 0.0f);
+    if (abs(u) <= band_x && abs(v) <= band_y)
+    {
+        ulong e = (ulong)(v < 0 ? v + sizey : v) * sizex + (u < 0 ? u + sizex : u);
+        ulong ie = (e + image_start_offset) * complex_pitch;
+        ulong he = e * complex_pitch;
+        value = complex_mul((float2)(images_re[ie], images_im[ie + imag_offset]),
+                            (float2)(h_re[he], h_im[he + imag_offset]));
+    }
+
+    ulong index = ((ulong)j * reduced_sizex + i) * complex_pitch;
+    reduced_re[index] = value.x;
+    reduced_im[index + imag_offset] = value.y;
+}
+
+float reduced_abs(__global const float *reduced_re, __global const float *reduced_im, const int complex_pitch,
+                  const int imag_offset, int reduced_sizex, int reduced_sizey, int i, int j)
+{
+    // результат циклический
+    i = (i + reduced_sizex) % reduced_sizex;
+    j = (j + reduced_sizey) % reduced_sizey;
+    ulong e = ((ulong)j * reduced_sizex + i) * complex_pitch;
+    return MATH_HYPOT(reduced_re[e], reduced_im[e + imag_offset]);
+}
+
+// Веса Catmull-Rom для точек -1, 0, 1, 2 при дробной части t
+float4 catmull_rom_weights(float t)
+{
+    float t2 = t * t;
+    float t3 = t2 * t;
+    return (float4)(-t3 + 2.0f * t2 - t, 3.0f * t3 - 5.0f * t2 + 2.0f, -3.0f * t3 + 4.0f * t2 + t, t3 - t2) * 0.5f;
+}
+
+// Глобальный размер - картинка; её пиксель (x, y) лежит в (result_x0 + x, result_y0 + y) сетки ПФ sizex x sizey
+__kernel void add_upsampled_abs_kernel(__global const float *reduced_re, __global const float *reduced_im,
+                                       const int complex_pitch, const int imag_offset,
+                                       const int reduced_sizex, const int reduced_sizey, const int sizex, const int sizey,
+                                       const int result_x0, const int result_y0, const float scaling,
+                                       __global float *result)
+{
+    int x = get_global_id(0) + result_x0;
+    int y = get_global_id(1) + result_y0;
+
+    float fx = (float)x * reduced_sizex / sizex;
+    float fy = (float)y * reduced_sizey / sizey;
+    int i0 = (int)floor(fx);
+    int j0 = (int)floor(fy);
+    float4 wx = catmull_rom_weights(fx - i0);
+    float4 wy = catmull_rom_weights(fy - j0);
+    float wx_array[4] = {wx.x, wx.y, wx.z, wx.w};
+    float wy_array[4] = {wy.x, wy.y, wy.z, wy.w};
+
+    float value = 0.0f;
+    for (int b = 0; b < 4; b++)
+        for (int a = 0; a < 4; a++)
+            value += wy_array[b] * wx_array[a] * reduced_abs(reduced_re, reduced_im, complex_pitch, imag_offset,
+                                                             reduced_sizex, reduced_sizey, i0 - 1 + a, j0 - 1 + b);
+
+    int i = y * sizex + x;
+    result[i] = min(max(value, 0.0f) * scaling + result[i], 255.0f);
+}
+
+
+/// КОМПАКТНОЕ ХРАНЕНИЕ h ( --compact-otf )
+// Спектр h хранится только на своей опоре: для строки j ненулевые частоты u ( со знаком, отрицательные
+// соответствуют столбцам sizex + u ) лежат в [rows[j].x, rows[j].y], их значения подряд с h_values[rows[j].z].
+// Пустая строка - rows[j].x > rows[j].y. Вне опоры произведение - нуль, и ни h, ни картинка там не читаются.
+
+__kernel void multiply_sparse_kernel(__global const float *images_re, __global const float *images_im,
+                                     const ulong image_start_offset,
+                                     __global const float2 *h_values, __global const int4 *h_rows,
+                                     const int complex_pitch, const int imag_offset,
+                                     __global float *result_re, __global float *result_im)
+{
+    int i = get_global_id(0);
+    int j = get_global_id(1);
+    int sizex = get_global_size(0);
+
+    int4 row = h_rows[j];
+    int u = i <= sizex / 2 ? i : i - sizex;
+    ulong e = (ulong)j * sizex + i;
+
+    float2 value = (float2)(0.0f, 0.0f);
+    if (u >= row.x && u <= row.y)
+    {
+        ulong ie = (e + image_start_offset) * complex_pitch;
+        value = complex_mul((float2)(images_re[ie], images_im[ie + imag_offset]), h_values[row.z + u - row.x]);
+    }
+
+    ulong index = e * complex_pitch;
+    result_re[index] = value.x;
+    result_im[index + imag_offset] = value.y;
+}
+
+
 int M(float x, float y) 
 {
-    if ((pown(x, 2) + pown(y, 2)) < pown(M_PI*0.5f, 2))
+    if ((POW2(x) + POW2(y)) < POW2(PUPIL_RADIUS))
         return (1);
     else
         return (0);
@@ -49,11 +698,11 @@ float p_s(float x, float y, float delta_z)
     // float w = 2.34f * 10e-5;
 
     // return (-M_PI * lamba * (d_1*d_1)*delta_z * (pown(x, 2) + pown(y, 2)))/pown(d_0 + w, 2);
-    return (0.375 * fabs(delta_z) * M_PI * (pown(x, 2) + pown(y, 2)));
+    return (DEFOCUS_COEF * fabs(delta_z) * M_PI * (POW2(x) + POW2(y)));
 }
 
 float p(float x, float y) {
-    return (M_PI*0.5f * (pown(x, 2) + pown(y, 2)));
+    return (PUPIL_PHASE_COEF * (POW2(x) + POW2(y)));
 }
 
 
@@ -62,8 +711,13 @@ __kernel void h_init_kernel(const float delta_z, __global float *h_real,  __glob
     int i = get_global_id(0);
     int j = get_global_id(1);
     
+#ifdef H_SIZEX
+    const int sizex = H_SIZEX;
+    const int sizey = H_SIZEY;
+#else
     int sizex = get_global_size(0);
     int sizey = get_global_size(1);
+#endif
     
     // float d_1 = 57.4f * 1e-3;
     // float d_0 = 37.0f * 1e-3;
@@ -72,7 +726,7 @@ __kernel void h_init_kernel(const float delta_z, __global float *h_real,  __glob
     // float w = 2.34f * 1e-4;
     // float a = 4.0f * r_0/(lamba * d_1);
 
-    int index = i * sizey + j;
+    int index = H_INDEX(i, j);
     float x = 0, y = 0;
 
     x = (M_PI / sizex) * (i - sizex/2);
@@ -83,7 +737,7 @@ __kernel void h_init_kernel(const float delta_z, __global float *h_real,  __glob
     float p_s_result = p_s(x, y, delta_z);
     
     float cos_result = 0.0f;
-    float sin_result = sincos(p_result + p_s_result, &cos_result);
+    float sin_result = MATH_SINCOS(p_result + p_s_result, &cos_result);
     
     h_real[index] = m_result * cos_result;
     h_imag[index] = m_result * sin_result;
@@ -97,37 +751,63 @@ __kernel void h_squared_abs_kernel(__global float *h_real, __global float *h_ima
     h_imag[i] = 0.0f; 
 }
 
-__kernel void fft_shift_row_kernel(__global float *array, const int num_col)
+// Циклический сдвиг линии из n элементов ( шаг stride ) на n/2 вправо, как fftshift: нулевая частота
+// попадает в n/2. Для чётного n это обмен половин, для нечётного - настоящий поворот.
+// На месте, по циклам перестановки: их gcd(n, n/2), каждый длины n / gcd
+void fft_shift_line(__global float *line, const int n, const int stride)
 {
-    int i = get_global_id(0);
+    int shift = n/2;
+    int cycles = n;
+    for (int b = shift; b != 0; )
+    {
+        int t = cycles % b;
+        cycles = b;
+        b = t;
+    }
 
-    int half_num_col = num_col/2;
-    int row_start_index = i * num_col;
-    
-    for (int j = 0; j < half_num_col; j++)
+    for (int start = 0; start < cycles; start++)
     {
-        float tmp = array[row_start_index + j];
-        array[row_start_index + j] = array[row_start_index + half_num_col + j];
-        array[row_start_index + half_num_col + j] = tmp;
+        float tmp = line[start * stride];
+        int j = start;
+        for (;;)
+        {
+            int from = j >= shift ? j - shift : j - shift + n;
+            if (from == start)
+                break;
+            line[j * stride] = line[from * stride];
+            j = from;
+        }
+        line[j * stride] = tmp;
     }
-    
 }
 
-__kernel void fft_shift_col_kernel(__global float *array, const int num_row)
+__kernel void fft_shift_row_kernel(__global float *array, const int num_col_arg)
+{
+    int i = get_global_id(0);
+
+#ifdef H_SIZEX
+    const int num_col = H_SIZEX;
+#else
+    const int num_col = num_col_arg;
+#endif
+
+    fft_shift_line(array + i * num_col, num_col, 1);
+}
+
+__kernel void fft_shift_col_kernel(__global float *array, const int num_row_arg)
 {
     int j = get_global_id(0);
+
+#ifdef H_SIZEY
+    const int num_row = H_SIZEY;
+    const int num_col = H_SIZEX;
+#else
+    const int num_row = num_row_arg;
     int num_col = get_global_size(0);
+#endif
 
     // sizex = num_col
     // sizey = num_row
 
-    int half_num_row = num_row/2;
-
-    for (int i = 0; i < half_num_row; i++)
-    {
-        float tmp = array[i * num_col + j];
-        array[i * num_col + j] = array[(i + half_num_row) * num_col + j];
-        array[(i + half_num_row) * num_col + j] = tmp;
-    }
+    fft_shift_line(array + j, num_row, num_col);
 }
-